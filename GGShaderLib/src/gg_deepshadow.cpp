@@ -0,0 +1,306 @@
+/******************************************************************************
+ * Created:	17.10.26
+ * Module:	gg_deepshadow
+ *
+ * Exports:
+ *      gg_deepshadow(), gg_deepshadow_version()
+ *
+ * Requires:
+ *      mrClasses, LPGL (mrDeepShadow)
+ *
+ * History:
+ *      17.10.26: initial version
+ *
+ * Description:
+ *      Lens shader for a render from a light, which writes a deep
+ *      shadow map for gg_tiff's shadow lookups.  The first eye ray of
+ *      each pixel is followed through everything it hits.  Once all
+ *      the pixels of a tile of the map are in, the tile gets simplified
+ *      and written.
+ *
+ *      Hits are found with probe rays.  How much light each surface
+ *      lets through is what its material's shadow shader makes of
+ *      white light.  Materials without one block "opacity" of it.
+ *      Between hits, the ray is marched through the volume shader it
+ *      is in (the camera's, or that of the last object it went into),
+ *      in volumeSteps steps, so smoke and fog get a smooth falloff.
+ *      The image rendered is the visibility past the last hit.
+ *
+ *****************************************************************************/
+
+#ifndef MR_NO_TIFF
+
+#include <algorithm>
+
+#include "mrGenerics.h"
+#include "mrAtomic.h"
+#include "mrDeepShadow.h"
+
+using namespace mr;
+
+
+struct gg_deepshadow_t
+{
+     miTag     filename;
+     miInteger tileSize;
+     miScalar  tolerance;
+     miColor   opacity;
+     miInteger maxHits;
+     miInteger volumeSteps;
+};
+
+
+struct deepShadowCache
+{
+     CDeepShadowWriter* writer;
+     miLock             lock;        //<- Guards visibility
+     float*             visibility;  //<- Per pixel, -1 until traced
+     volatile miUint*   pixelsLeft;  //<- Per tile, not traced yet
+     int                xres, yres;
+     matrix             worldToNDC;
+     color              opacity;
+     color              transmit;    //<- 1 - opacity
+     int                maxHits;
+     int                volumeSteps;
+};
+
+
+
+EXTERN_C DLLEXPORT int gg_deepshadow_version(void) {return(1);}
+
+
+EXTERN_C DLLEXPORT void
+gg_deepshadow_init(
+		   miState* const        state,
+		   struct gg_deepshadow_t* p,
+		   miBoolean* req_inst
+		   )
+{
+   if ( !p ) {  // global shader init, request per instance init
+      *req_inst = miTRUE; return;
+   }
+
+   miTag fileNameTag = *mi_eval_tag( &p->filename );
+   const char* name = (char*) mi_db_access( fileNameTag );
+
+   deepShadowCache* cache = new deepShadowCache;
+   cache->xres = state->camera->x_resolution;
+   cache->yres = state->camera->y_resolution;
+
+   // World to camera, then camera to [0,1] over the map
+   miMatrix* m;
+   mi_query( miQ_TRANS_WORLD_TO_CAMERA, state, miNULLTAG, &m );
+   matrix P( state );
+   matrix toUnit( 0.5f, 0.0f, 0.0f, 0.0f,
+		  0.0f, 0.5f, 0.0f, 0.0f,
+		  0.0f, 0.0f, 1.0f, 0.0f,
+		  0.5f, 0.5f, 0.0f, 1.0f );
+   cache->worldToNDC  = *m;
+   cache->worldToNDC *= P;
+   cache->worldToNDC *= toUnit;
+
+   miInteger tileSize = mr_eval( p->tileSize );
+   miScalar tolerance = mr_eval( p->tolerance );
+   cache->opacity = mr_eval( p->opacity );
+   cache->transmit.r = 1.0f - cache->opacity.r;
+   cache->transmit.g = 1.0f - cache->opacity.g;
+   cache->transmit.b = 1.0f - cache->opacity.b;
+   cache->maxHits = mr_eval( p->maxHits );
+   cache->volumeSteps = mr_eval( p->volumeSteps );
+
+   cache->writer = new CDeepShadowWriter( name, cache->xres, cache->yres,
+					  &cache->worldToNDC,
+					  tileSize, tolerance );
+   mi_db_unpin( fileNameTag );
+
+   const CDeepShadowHeader& h = cache->writer->getHeader();
+   int numPixels = cache->xres * cache->yres;
+   cache->visibility = new float[ numPixels ];
+   for ( int i = 0; i < numPixels; ++i )
+      cache->visibility[i] = -1.0f;
+
+   cache->pixelsLeft = new miUint[ h.xTiles * h.yTiles ];
+   for ( int ty = 0; ty < h.yTiles; ++ty )
+      for ( int tx = 0; tx < h.xTiles; ++tx )
+      {
+	 int w = std::min( h.tileSize, cache->xres - tx * h.tileSize );
+	 int l = std::min( h.tileSize, cache->yres - ty * h.tileSize );
+	 cache->pixelsLeft[ ty * h.xTiles + tx ] = (miUint) (w * l);
+      }
+
+   mi_init_lock( &cache->lock );
+
+   void **user;
+   mi_query(miQ_FUNC_USERPTR, state, 0, &user);
+   *user = cache;
+}
+
+
+EXTERN_C DLLEXPORT void
+gg_deepshadow_exit(
+		   miState* const        state,
+		   struct gg_deepshadow_t* p
+		   )
+{
+   if ( !p ) return;
+
+   void **user;
+   mi_query(miQ_FUNC_USERPTR, state, 0, &user);
+   deepShadowCache* cache = static_cast< deepShadowCache* >( *user );
+   if ( !cache ) return;
+
+   // Tiles some pixels of were never rendered
+   if ( !cache->writer->close() )
+      mi_error("gg_deepshadow: could not finish the deep shadow map.");
+
+   delete cache->writer;
+   delete [] cache->visibility;
+   delete [] cache->pixelsLeft;
+   mi_delete_lock( &cache->lock );
+   delete cache;
+}
+
+
+//! Light let through by the surface hit, a material's shadow shader
+//! seeing white light
+static color surfaceTransmit( const deepShadowCache* cache,
+			      miState* const hit )
+{
+   miTag shadow = miNULLTAG;
+   if ( hit->material == miNULLTAG ||
+	!mi_query( miQ_MTL_SHADOW, NULL, hit->material, &shadow ) ||
+	shadow == miNULLTAG )
+      return cache->transmit;
+
+   miColor t = { 1.0f, 1.0f, 1.0f, 1.0f };
+   const miRay_type type = hit->type;
+   hit->type = miRAY_SHADOW;
+   if ( !mi_call_shader_x( &t, miSHADER_SHADOW, hit, shadow, NULL ) )
+      t.r = t.g = t.b = 0.0f;
+   hit->type = type;
+   return color( t.r, t.g, t.b );
+}
+
+
+//! Light let through by the volume shader from org to hit, added as a
+//! sample at the end of each of the volumeSteps steps
+static void volumeTransmit( deepShadowCache* cache, miState* const hit,
+			    const miTag volume, const int x, const int y,
+			    const point& org, color& t )
+{
+   const int steps = cache->volumeSteps;
+   if ( volume == miNULLTAG || steps <= 0 ) return;
+
+   miState vs = *hit;
+   vs.type = miRAY_SHADOW;
+   vs.dist = hit->dist / steps;
+
+   point a( org );
+   for ( int i = 1; i <= steps; ++i )
+   {
+      point b( hit->point );
+      if ( i < steps )
+      {
+	 b  = a;
+	 b += vector( hit->dir ) * vs.dist;
+      }
+
+      miColor f = { 1.0f, 1.0f, 1.0f, 1.0f };
+      vs.org   = a;
+      vs.point = b;
+      if ( !mi_call_shader_x( &f, miSHADER_VOLUME, &vs, volume, NULL ) )
+	 return;
+
+      point P( b );
+      mi_point_to_world( hit, &P, &P );
+      P *= cache->worldToNDC;
+      cache->writer->addSample( x, y, P.z,
+				color( 1.0f - f.r, 1.0f - f.g, 1.0f - f.b ) );
+      t *= color( f.r, f.g, f.b );
+      a = b;
+   }
+}
+
+
+EXTERN_C DLLEXPORT miBoolean
+gg_deepshadow(
+	      color* const result,
+	      miState* const state,
+	      struct gg_deepshadow_t* p
+	      )
+{
+   void **user;
+   mi_query(miQ_FUNC_USERPTR, state, 0, &user);
+   deepShadowCache* cache = static_cast< deepShadowCache* >( *user );
+   if ( !cache ) return mi_trace_eye( result, state, &state->org,
+				      &state->dir );
+
+   int x = (int) state->raster_x;
+   int y = (int) state->raster_y;
+   if ( x < 0 || y < 0 || x >= cache->xres || y >= cache->yres )
+   {
+      result->r = result->g = result->b = result->a = 1.0f;
+      return miTRUE;
+   }
+
+   float* v = cache->visibility + y * cache->xres + x;
+
+   // Only the first eye ray of a pixel goes into the map
+   mi_lock( cache->lock );
+   miBoolean first = ( *v < 0.0f );
+   if ( first ) *v = 1.0f;
+   float vis = *v;
+   mi_unlock( cache->lock );
+
+   if ( first )
+   {
+      vector dir( state->dir );
+      point  org( state->org );
+      color  t( 1.0f );
+      miTag  volume = state->volume;
+      for ( int i = 0; i < cache->maxHits; ++i )
+      {
+	 if ( !mi_trace_probe( state, &dir, &org ) ) break;
+	 miState* const hit = state->child;
+
+	 volumeTransmit( cache, hit, volume, x, y, org, t );
+
+	 color f = surfaceTransmit( cache, hit );
+	 point P( hit->point );
+	 mi_point_to_world( state, &P, &P );
+	 P *= cache->worldToNDC;
+	 cache->writer->addSample( x, y, P.z, color( 1.0f - f.r, 1.0f - f.g,
+						     1.0f - f.b ) );
+	 t *= f;
+	 if ( t.r <= 0.0f && t.g <= 0.0f && t.b <= 0.0f ) break;
+
+	 // Rays hitting the back of a surface leave its volume
+	 if ( hit->inv_normal )
+	    volume = state->volume;
+	 else if ( hit->material == miNULLTAG ||
+		   !mi_query( miQ_MTL_VOLUME, NULL, hit->material, &volume ) )
+	    volume = miNULLTAG;
+
+	 // Step past the hit, along the ray
+	 org  = hit->point;
+	 org += dir * ( 1e-4f * ( 1.0f + hit->dist ) );
+      }
+      vis = ( t.r + t.g + t.b ) * ( 1.0f / 3.0f );
+
+      mi_lock( cache->lock );
+      *v = vis;
+      mi_unlock( cache->lock );
+
+      const CDeepShadowHeader& h = cache->writer->getHeader();
+      int tile = cache->writer->tileOf( x, y );
+      if ( atomicAdd( &cache->pixelsLeft[tile], (miUint) -1 ) == 0 )
+	 cache->writer->tileDone( tile % h.xTiles, tile / h.xTiles );
+   }
+
+   result->r = result->g = result->b = vis;
+   result->a = 1.0f;
+   return miTRUE;
+}
+
+
+#endif // MR_NO_TIFF
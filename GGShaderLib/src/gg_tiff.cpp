@@ -19,18 +19,49 @@
 
 #ifndef MR_NO_TIFF
 
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
 #include "tiffio.h"
 #include "mrGenerics.h"
 #include "mrTiff.h"
 #include "mrRman.h"
 #include "mrRman_macros.h"
 
+using namespace mr;
+using namespace rsl;
+
 //! Constant for the texture cache (x 1024 bytes)
 const miUint kMEMORY_LIMIT = 16384;
 
+//! Options for the texture cache.  Set MR_TEXTURE_STATS to a .json or
+//! .csv file name to get the cache statistics written there at the end
+//! of the render.  Set MR_TEXTURE_STORAGE to "half" or "unorm16" to
+//! keep float textures in 16 bits (unorm16 clamps them to [0,1]).
+//! Set MR_TEXTURE_TRACE to a file name to get a CSV trace of the tile
+//! loads, evictions and lookups.  Set MR_TEXTURE_PREFETCH to a number
+//! of threads to page tiles in ahead of the lookups.
+static TextureCacheOptions cacheOptions()
+{
+   TextureCacheOptions opts;
+   opts.statsFile = getenv( "MR_TEXTURE_STATS" );
+   opts.traceFile = getenv( "MR_TEXTURE_TRACE" );
+   const char* prefetch = getenv( "MR_TEXTURE_PREFETCH" );
+   if ( prefetch != NULL )
+      opts.prefetchThreads = atoi( prefetch );
+
+   const char* storage = getenv( "MR_TEXTURE_STORAGE" );
+   if ( storage != NULL )
+   {
+      if ( strcmp( storage, "half" ) == 0 )
+	 opts.floatStorage = kTEXTURE_STORE_HALF;
+      else if ( strcmp( storage, "unorm16" ) == 0 )
+	 opts.floatStorage = kTEXTURE_STORE_UNORM16;
+   }
+   return opts;
+}
 
-using namespace mr;
-using namespace rsl;
 
 struct gg_tiff_t
 {
@@ -43,6 +74,7 @@ struct gg_tiff_t
      miScalar    twidth;
      miInteger  channel;
      miScalar      fill;
+     miBoolean      ewa;
 };
 
 struct gg_ctiff_t
@@ -56,6 +88,7 @@ struct gg_ctiff_t
      miScalar    twidth;
      miInteger  channel;
      miColor       fill;
+     miBoolean      ewa;
 };
 
 
@@ -64,15 +97,41 @@ struct tiffCache
      tiffCache() {}
      ~tiffCache()
      {
-	delete txt;
+	textureRelease( txt );
 	delete opts;
      }
 
      CTexture*         txt;
      TextureOptions*  opts;
+     miBoolean        udim;  //<- A UDIM set, see udimCoords
 };
 
 
+//! The float just below x
+static inline miScalar floatBelow( const miScalar x )
+{
+   union { miScalar f; miUint i; } b;
+   b.f = x;
+   if ( x > 0.0f )      --b.i;
+   else if ( x < 0.0f ) ++b.i;
+   else                 b.i = 0x80000001;  // -smallest denormal
+   return b.f;
+}
+
+//! Coordinates of a lookup in a UDIM set.  The square is the one
+//! (u,v) falls in, within it s and t are flipped like those of single
+//! textures, to match maya.
+static inline void udimCoords( miState* const state, miScalar s,
+			       miScalar t )
+{
+   const miScalar u0 = fastmath<float>::floor( state->tex_list[0].x );
+   const miScalar v0 = fastmath<float>::floor( state->tex_list[0].y );
+   // A flip of 0, or a sum that rounds up, must stay in the square
+   state->tex.x = std::min( u0 + s, floatBelow( u0 + 1.0f ) );
+   state->tex.y = std::min( v0 + t, floatBelow( v0 + 1.0f ) );
+}
+
+
 
 
 
@@ -88,7 +147,7 @@ gg_tiff_init(
 {
   if ( !p ) {  // global shader init, request per instance init
      
-     textureInit( kMEMORY_LIMIT * 1024 );
+     textureInit( kMEMORY_LIMIT * 1024, cacheOptions() );
      *req_inst = miTRUE; return;
   }
   
@@ -97,12 +156,14 @@ gg_tiff_init(
    const char* name = (char*) mi_db_access( fileNameTag );
    
    CTexture* txt = textureLoad( name );
+   miBoolean udim = ( strstr( name, "<UDIM>" ) != NULL );
    mi_db_unpin( fileNameTag );
    if ( !txt )  return;
    
    tiffCache* cache = new tiffCache;
 
    cache->txt = txt;
+   cache->udim = udim;
    
    miScalar swidth = mr_eval( p->swidth );
    miScalar twidth = mr_eval( p->twidth );
@@ -111,13 +172,14 @@ gg_tiff_init(
    miScalar tblur = mr_eval( p->tblur ) / 100.0f;
    miUint  channel = mr_eval( p->channel );
    miScalar fill   = mr_eval( p->fill );
+   miBoolean ewa   = mr_eval( p->ewa );
 
    mr::filter::types flt = (mr::filter::types) mr_eval( p->filter );
    mr::filter::function filter = mr::filter::fromEnumeration( flt );
    
    cache->opts = new TextureOptions( filter, swidth,
 				     twidth, sblur, tblur, samples,
-				     channel, fill );
+				     channel, fill, ewa );
    
    void **user;
    mi_query(miQ_FUNC_USERPTR, state, 0, &user);
@@ -132,9 +194,14 @@ gg_tiff_exit(
 {
   if ( !p )
   {
-     Stats->Print();
-     Stats->Init();
-     textureShutdown();
+     // Both shaders share the cache, the last one out reports
+     TextureStats stats;
+     textureStatistics( stats );
+     if ( textureShutdown() )
+     {
+	stats.Print();
+	Stats->Init();
+     }
      return;
   }
   
@@ -165,9 +232,14 @@ gg_tiff(
    // This is done to match maya
    state->tex.x = 1.0f - state->tex_list[0].y;
    state->tex.y = state->tex_list[0].x;
+   if ( cache->udim )
+      udimCoords( state, 1.0f - ( state->tex_list[0].y -
+				  fastmath<float>::floor(state->tex_list[0].y) ),
+		  state->tex_list[0].x -
+		  fastmath<float>::floor(state->tex_list[0].x) );
       
    miScalar val[3];
-   if ( cache->opts->numSamples == 1 )
+   if ( cache->opts->numSamples == 1 && !cache->opts->ewa )
       cache->txt->lookup( state, val, state->tex.x, state->tex.y,
 			  *cache->opts );
    else
@@ -216,7 +288,7 @@ gg_ctiff_init(
 	      )
 {
   if ( !p ) {  // global shader init, request per instance init
-     textureInit( 8192 * 1024 );
+     textureInit( 8192 * 1024, cacheOptions() );
 
     *req_inst = miTRUE; return;
   }
@@ -225,12 +297,14 @@ gg_ctiff_init(
    const char* name = (char*) mi_db_access( fileNameTag );
    
    CTexture* txt = textureLoad( name );
+   miBoolean udim = ( strstr( name, "<UDIM>" ) != NULL );
    mi_db_unpin( fileNameTag );
    if ( !txt )  return;
 
    tiffCache* cache = new tiffCache;
 
    cache->txt = txt;
+   cache->udim = udim;
    
    miScalar swidth = mr_eval( p->swidth );
    miScalar twidth = mr_eval( p->twidth );
@@ -239,13 +313,14 @@ gg_ctiff_init(
    miScalar tblur = mr_eval( p->tblur ) / 100.0f;
    miUint  channel = mr_eval( p->channel );
    miColor  fill   = mr_eval( p->fill );
+   miBoolean ewa   = mr_eval( p->ewa );
 
    mr::filter::types flt = (mr::filter::types) mr_eval( p->filter );
    mr::filter::function filter = mr::filter::fromEnumeration( flt );
    
    cache->opts = new TextureOptions( filter, swidth,
 				     twidth, sblur, tblur, samples,
-				     channel, fill );
+				     channel, fill, ewa );
    
    void **user;
    mi_query(miQ_FUNC_USERPTR, state, 0, &user);
@@ -260,9 +335,14 @@ gg_ctiff_exit(
 {
   if ( !p )
   {
-     Stats->Print();
-     Stats->Init();
-     textureShutdown();
+     // Both shaders share the cache, the last one out reports
+     TextureStats stats;
+     textureStatistics( stats );
+     if ( textureShutdown() )
+     {
+	stats.Print();
+	Stats->Init();
+     }
      return;
   }
   
@@ -293,11 +373,16 @@ gg_ctiff(
    // This is used to match maya
    state->tex.x = 1.0f - state->tex_list[0].x;
    state->tex.y = state->tex_list[0].y;
+   if ( cache->udim )
+      udimCoords( state, 1.0f - ( state->tex_list[0].x -
+				  fastmath<float>::floor(state->tex_list[0].x) ),
+		  state->tex_list[0].y -
+		  fastmath<float>::floor(state->tex_list[0].y) );
 
    
    miScalar val[4];
    
-   if ( cache->opts->numSamples == 1 )
+   if ( cache->opts->numSamples == 1 && !cache->opts->ewa )
       cache->txt->lookup( state, val, state->tex.x, state->tex.y,
 			  *cache->opts );
    else
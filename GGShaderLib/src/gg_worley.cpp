@@ -66,6 +66,38 @@ kFlatMix
 };
 
 
+//! FWorley::noise() with the distance measure of distanceType.  The
+//! measure is picked once here and inlined in the search.
+static void worley( const miUint D, const miVector& distScale,
+		    const point& Pt, const miUlong order, miScalar* const F,
+		    miVector* const delta = NULL, miUlong* const ID = NULL )
+{
+   switch( D )
+   {
+      case kManhattan:
+	 FWorley::noise( distances::kManhattan, distScale, Pt, order,
+			 F, delta, ID );
+	 break;
+      case kChessboard:
+	 FWorley::noise( distances::kChessboard, distScale, Pt, order,
+			 F, delta, ID );
+	 break;
+      case kEuclidianBiased:
+	 FWorley::noise( distances::kEuclidian, distScale, Pt, order,
+			 F, delta, ID );
+	 break;
+      case kSuperquadratic:
+	 FWorley::noise( distances::kSuperquadratic, distScale, Pt, order,
+			 F, delta, ID );
+	 break;
+      case kEuclidian:
+      default:
+	 FWorley::noise( Pt, order, F, delta, ID );
+	 break;
+   }
+}
+
+
 EXTERN_C DLLEXPORT int gg_worley_version(void) {return(1);}
 
 
@@ -90,174 +122,79 @@ gg_worley(
    Pt *= mr_eval( p->scale );
 
    miUint D = mr_eval( p->distanceType );
+   const miVector& distScale = mr_eval( p->distanceScale );
    
    miScalar F[3];
-   if (D == 0)
-   {
-      switch( type )
-      {
-	 case kFlat:
-	    FWorley::noise( Pt, 1, F );
-	    Ci = F[0];
-	    break;
-	 case kF1:
-	    {
-	       FWorley::noise( Pt, 1, F );
-	       miScalar c1 = mr_eval( p->c1 );
-	       Ci = F[0] * c1;
-	       break;
-	    }
-	 case kF2:
-	    {
-	       FWorley::noise( Pt, 2, F );
-	       miScalar c2 = mr_eval( p->c2 );
-	       Ci = F[1] * c2;
-	       break;
-	    }
-	 case kF2_F1:
-	    {
-	       miScalar c1 = mr_eval( p->c1 );
-	       miScalar c2 = mr_eval( p->c2 );
-	    
-	       FWorley::noise( Pt, 2, F );
-	       Ci = (F[1] * c2) - (F[0] * c1);
-	       break;
-	    }
-	 case kStep:
-	    {
-	       miScalar c1 = mr_eval( p->c1 );
-	       miScalar c2 = mr_eval( p->c2 );
-	       miScalar stepsize = mr_eval( p->stepsize );
-	    
-	       point pos[2];
-	       FWorley::noise( Pt, 2, F, pos );
-	       F[0] *= c1;
-	       F[1] *= c2;
-	       miScalar scale = ( distance(pos[0],pos[1]) /
-				  (distance(pos[0],Pt)+distance(pos[1],Pt)) );
-	       Ci = step(stepsize*scale, F[1]-F[0]);
-	       break;
-	    }
-	 case kCosine:
-	    {
-	       miScalar c1 = mr_eval( p->c1 );
-	    
-	       FWorley::noise( Pt, 1, F );
-	       F[0] = sqrt(F[0]);
-	       Ci = cos(F[0]*c1);
-	       break;
-	    }
-	 case kCrystal:
-	 default:
-	    {
-	       miScalar c1 = mr_eval( p->c1 );
-	       miScalar c2 = mr_eval( p->c2 );
-	       miScalar stepsize = mr_eval( p->stepsize );
-	    
-	       point pos[2];
-	       FWorley::noise( Pt, 2, F, pos );
-	       F[0] *= c1;
-	       F[1] *= c2;
-	       miScalar scale = ( distance(pos[0],pos[1]) /
-				  (distance(pos[0],Pt)+distance(pos[1],Pt)) );
-	       Ci = clamp(F[1]-F[0], 0.0f, (stepsize*scale)) / stepsize;
-	       break;
-	    }
-      }
-   }
-   else
+   switch( type )
    {
-      mr::distances::Type* DM;
-      switch( D )
-      {
-	 case kManhattan:
-	    DM = new mr::distances::Manhattan();
-	    break;
-	 case kChessboard:
-	    DM = new mr::distances::Chessboard();
-	    break;
-	 case kEuclidianBiased:
-	    DM = new mr::distances::Euclidian();
-	    break;
-	 case kSuperquadratic:
-	    DM = new mr::distances::Superquadratic();
+      case kFlat:
+	 worley( D, distScale, Pt, 1, F );
+	 Ci = F[0];
+	 break;
+      case kF1:
+	 {
+	    worley( D, distScale, Pt, 1, F );
+	    miScalar c1 = mr_eval( p->c1 );
+	    Ci = F[0] * c1;
 	    break;
-      }
-
-      const miVector& distScale = mr_eval( p->distanceScale );
-      
-      switch( type )
-      {
-	 case kFlat:
-	    FWorley::noise( *DM, distScale, Pt, 1, F );
-	    Ci = F[0];
+	 }
+      case kF2:
+	 {
+	    worley( D, distScale, Pt, 2, F );
+	    miScalar c2 = mr_eval( p->c2 );
+	    Ci = F[1] * c2;
 	    break;
-	 case kF1:
-	    {
-	       FWorley::noise( *DM, distScale, Pt, 1, F );
-	       miScalar c1 = mr_eval( p->c1 );
-	       Ci = F[0] * c1;
-	       break;
-	    }
-	 case kF2:
-	    {
-	       FWorley::noise( *DM, distScale, Pt, 2, F );
-	       miScalar c2 = mr_eval( p->c2 );
-	       Ci = F[1] * c2;
-	       break;
-	    }
-	 case kF2_F1:
-	    {
-	       miScalar c1 = mr_eval( p->c1 );
-	       miScalar c2 = mr_eval( p->c2 );
+	 }
+      case kF2_F1:
+	 {
+	    miScalar c1 = mr_eval( p->c1 );
+	    miScalar c2 = mr_eval( p->c2 );
 	    
-	       FWorley::noise( *DM, distScale, Pt, 2, F );
-	       Ci = (F[1] * c2) - (F[0] * c1);
-	       break;
-	    }
-	 case kStep:
-	    {
-	       miScalar c1 = mr_eval( p->c1 );
-	       miScalar c2 = mr_eval( p->c2 );
-	       miScalar stepsize = mr_eval( p->stepsize );
+	    worley( D, distScale, Pt, 2, F );
+	    Ci = (F[1] * c2) - (F[0] * c1);
+	    break;
+	 }
+      case kStep:
+	 {
+	    miScalar c1 = mr_eval( p->c1 );
+	    miScalar c2 = mr_eval( p->c2 );
+	    miScalar stepsize = mr_eval( p->stepsize );
 	    
-	       point pos[2];
-	       FWorley::noise( *DM, distScale, Pt, 2, F, pos );
-	       F[0] *= c1;
-	       F[1] *= c2;
-	       miScalar scale = ( distance(pos[0],pos[1]) /
-				  (distance(pos[0],Pt)+distance(pos[1],Pt)) );
-	       Ci = step(stepsize*scale, F[1]-F[0]);
-	       break;
-	    }
-	 case kCosine:
-	    {
-	       miScalar c1 = mr_eval( p->c1 );
+	    point pos[2];
+	    worley( D, distScale, Pt, 2, F, pos );
+	    F[0] *= c1;
+	    F[1] *= c2;
+	    miScalar scale = ( distance(pos[0],pos[1]) /
+			       (distance(pos[0],Pt)+distance(pos[1],Pt)) );
+	    Ci = step(stepsize*scale, F[1]-F[0]);
+	    break;
+	 }
+      case kCosine:
+	 {
+	    miScalar c1 = mr_eval( p->c1 );
 	    
-	       FWorley::noise( *DM, distScale, Pt, 1, F );
-	       F[0] = sqrt(F[0]);
-	       Ci = cos(F[0]*c1);
-	       break;
-	    }
-	 case kCrystal:
-	 default:
-	    {
-	       miScalar c1 = mr_eval( p->c1 );
-	       miScalar c2 = mr_eval( p->c2 );
-	       miScalar stepsize = mr_eval( p->stepsize );
+	    worley( D, distScale, Pt, 1, F );
+	    F[0] = sqrt(F[0]);
+	    Ci = cos(F[0]*c1);
+	    break;
+	 }
+      case kCrystal:
+      default:
+	 {
+	    miScalar c1 = mr_eval( p->c1 );
+	    miScalar c2 = mr_eval( p->c2 );
+	    miScalar stepsize = mr_eval( p->stepsize );
 	    
-	       point pos[2];
-	       FWorley::noise( *DM, distScale, Pt, 2, F, pos );
-	       F[0] *= c1;
-	       F[1] *= c2;
-	       miScalar scale = ( distance(pos[0],pos[1]) /
-				  (distance(pos[0],Pt)+distance(pos[1],Pt)) );
-	       Ci = clamp(F[1]-F[0], 0.0f, (stepsize*scale)) / stepsize;
-	       break;
-	    }
-      }
-      delete DM;
-   } // else
+	    point pos[2];
+	    worley( D, distScale, Pt, 2, F, pos );
+	    F[0] *= c1;
+	    F[1] *= c2;
+	    miScalar scale = ( distance(pos[0],pos[1]) /
+			       (distance(pos[0],Pt)+distance(pos[1],Pt)) );
+	    Ci = clamp(F[1]-F[0], 0.0f, (stepsize*scale)) / stepsize;
+	    break;
+	 }
+   }
 
    if ( mr_eval( p->clamp ) )
    {
@@ -309,41 +246,8 @@ gg_vworley(
    miScalar F[1];
    
    miUint D = mr_eval( p->distanceType );
-   
-   switch(D)
-   {
-      case kEuclidian:
-	 FWorley::noise( Pt, 1, F, NULL, ID );
-	 break;
-      case kManhattan:
-	 {
-	    const miVector& distScale = mr_eval( p->distanceScale );
-	    FWorley::noise( mr::distances::Manhattan(), distScale,
-			    Pt, 1, F, NULL, ID );
-	 break;
-	 }
-      case kChessboard:
-	 {
-	    const miVector& distScale = mr_eval( p->distanceScale );
-	    FWorley::noise( mr::distances::Chessboard(), distScale,
-			    Pt, 1, F, NULL, ID );
-	 break;
-	 }
-      case kEuclidianBiased:
-	 {
-	    const miVector& distScale = mr_eval( p->distanceScale );
-	    FWorley::noise( mr::distances::Euclidian(), distScale,
-			    Pt, 1, F, NULL, ID );
-	 break;
-	 }
-      case kSuperquadratic:
-	 {
-	    const miVector& distScale = mr_eval( p->distanceScale );
-	    FWorley::noise( mr::distances::Superquadratic(), distScale,
-			    Pt, 1, F, NULL, ID );
-	 break;
-	 }
-   }
+   const miVector& distScale = mr_eval( p->distanceScale );
+   worley( D, distScale, Pt, 1, F, NULL, ID );
    
    color cellcolor = vcellnoise( (miScalar) ID[0] );
    switch( type )
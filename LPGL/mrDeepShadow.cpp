@@ -0,0 +1,364 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Deep shadow map writer, producing the files CDeepShadow in mrTiff.cpp
+// reads.  As it is tied to that file format, it is distributed with it
+// under LPGL, not OpenBSD.
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef MR_NO_TIFF
+
+#include <algorithm>
+
+#ifndef mrDeepShadow_h
+#include "mrDeepShadow.h"
+#endif
+
+
+BEGIN_NAMESPACE( mr )
+
+//! Orders samples front to back
+struct CSampleDepthLess
+{
+     template< class S >
+     bool operator()( const S& a, const S& b ) const
+     {
+	return a.z < b.z;
+     }
+};
+
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CDeepShadowWriter
+// Method  :	CDeepShadowWriter
+// Description 	:	Ctor
+CDeepShadowWriter::CDeepShadowWriter(const char *fileName,int xres,int yres,
+				     const miMatrix worldToNDC,int tileSize,
+				     float tol) :
+tolerance( tol ),
+nextTile( 0 ),
+failed( miFALSE )
+{
+   int	i,numTiles;
+
+   header.tileShift = 0;
+   while ((1 << header.tileShift) < tileSize)	header.tileShift++;
+
+   header.xres  = xres;
+   header.yres  = yres;
+   header.tileSize = 1 << header.tileShift;
+   header.xTiles  = (xres + header.tileSize - 1) >> header.tileShift;
+   header.yTiles  = (yres + header.tileSize - 1) >> header.tileShift;
+   memcpy(header.toNDC,worldToNDC,sizeof(miMatrix));
+
+   numTiles  = header.xTiles*header.yTiles;
+   tiles  = new CTile[numTiles];
+   tileIndices = new int[numTiles];
+   for (i=0;i<numTiles;i++) {
+      mi_init_lock(&tiles[i].lock);
+      tiles[i].samples = NULL;
+      tiles[i].done  = miFALSE;
+      tiles[i].data  = NULL;
+      tiles[i].size  = 0;
+      tileIndices[i] = 0;
+   }
+   mi_init_lock(&fileLock);
+
+   // The tile indices get written again once we know them
+   offset = sizeof(MR_DEEP_SHADOW_MAGIC) + sizeof(CDeepShadowHeader) +
+	    numTiles*sizeof(int);
+
+   file = fopen(fileName,"wb");
+   if ((file == NULL) ||
+       (fwrite(MR_DEEP_SHADOW_MAGIC,sizeof(MR_DEEP_SHADOW_MAGIC),1,file) != 1) ||
+       (fwrite(&header,sizeof(CDeepShadowHeader),1,file) != 1) ||
+       (fwrite(tileIndices,sizeof(int),numTiles,file) != (size_t) numTiles))
+   {
+      mi_error("Could not write deep shadow map \"%s\".",fileName);
+      failed = miTRUE;
+   }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CDeepShadowWriter
+// Method  :	~CDeepShadowWriter
+// Description 	:	Dtor
+CDeepShadowWriter::~CDeepShadowWriter()
+{
+   int	i;
+
+   if (file != NULL)	close();
+
+   for (i=0;i<header.xTiles*header.yTiles;i++) {
+      delete [] tiles[i].samples;
+      delete [] tiles[i].data;
+      mi_delete_lock(&tiles[i].lock);
+   }
+   delete [] tiles;
+   delete [] tileIndices;
+
+   mi_delete_lock(&fileLock);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CDeepShadowWriter
+// Method  :	addSample
+// Description 	:	Add something blocking the light to a pixel
+// Comments  :	Samples added after their tile is done are dropped
+void	CDeepShadowWriter::addSample(int x,int y,float z,const color& opacity)
+{
+   const int	mask = header.tileSize - 1;
+   CTile	*tile;
+   CSample	s;
+
+   if ((x < 0) || (y < 0) || (x >= header.xres) || (y >= header.yres))
+      return;
+
+   s.z  = z;
+   s.opacity[0] = opacity.r;
+   s.opacity[1] = opacity.g;
+   s.opacity[2] = opacity.b;
+
+   tile = tiles + tileOf(x,y);
+
+   mi_lock(tile->lock);
+   if (tile->done == miFALSE) {
+      if (tile->samples == NULL)
+	 tile->samples = new std::vector<CSample>[header.tileSize*
+						   header.tileSize];
+      tile->samples[((y & mask) << header.tileShift) + (x & mask)].
+      push_back(s);
+   }
+   mi_unlock(tile->lock);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CDeepShadowWriter
+// Method  :	compressPixel
+// Description 	:	Turn the samples of a pixel into a visibility
+//			function and append it to the tile
+// Comments  :	The function steps down at each sample.  It is
+//		simplified greedily: from each vertex kept, the next
+//		vertex is pushed as far as a single line can stay within
+//		the tolerance of every vertex it skips, in all three
+//		channels (see Lokovic and Veach, "Deep Shadow Maps").
+void	CDeepShadowWriter::compressPixel(std::vector<CSample>& samples,
+					 std::vector<float>& out)
+{
+   std::vector<float>	v;		// z,r,g,b of each step
+   float	t[3] = { 1, 1, 1 };
+   float	at[3],lo[3],hi[3],nlo[3],nhi[3];
+   float	az,dz;
+   int  	nv,a,j,best,c;
+   miBoolean	ok;
+   size_t	i;
+
+   std::sort(samples.begin(),samples.end(),CSampleDepthLess());
+
+   for (i=0;i<samples.size();i++) {
+      v.push_back(samples[i].z);
+      v.push_back(t[0]); v.push_back(t[1]); v.push_back(t[2]);
+
+      for (c=0;c<3;c++) {
+	 float	o = samples[i].opacity[c];
+	 if (o < 0)	o = 0;
+	 if (o > 1)	o = 1;
+	 t[c] *= 1 - o;
+      }
+
+      v.push_back(samples[i].z);
+      v.push_back(t[0]); v.push_back(t[1]); v.push_back(t[2]);
+   }
+   nv = (int) v.size() / 4;
+
+   out.push_back(-kDEEP_INFINITY);
+   out.push_back(1); out.push_back(1); out.push_back(1);
+
+   at[0] = at[1] = at[2] = 1;
+   if (nv > 0) {
+      az = v[0];
+      out.push_back(az);
+      out.push_back(1); out.push_back(1); out.push_back(1);
+
+      for (a=0;a<nv-1;a=best) {
+	 lo[0] = lo[1] = lo[2] = -kDEEP_INFINITY;
+	 hi[0] = hi[1] = hi[2] =  kDEEP_INFINITY;
+
+	 for (best=-1,j=a+1;j<nv;j++) {
+	    const float	*cv = &v[4*j];
+
+	    ok = miTRUE;
+	    dz = cv[0] - az;
+	    for (c=0;c<3;c++) {
+	       if (dz <= 0) {
+		  // A step: the vertex must be right at the last one
+		  if (fabsf(cv[1+c] - at[c]) > tolerance)	ok = miFALSE;
+		  nlo[c] = lo[c];
+		  nhi[c] = hi[c];
+	       } else {
+		  nlo[c] = std::max(lo[c],(cv[1+c] - tolerance - at[c])/dz);
+		  nhi[c] = std::min(hi[c],(cv[1+c] + tolerance - at[c])/dz);
+		  if (nlo[c] > nhi[c])	ok = miFALSE;
+	       }
+	    }
+	    if (!ok)	break;
+
+	    for (c=0;c<3;c++) {
+	       lo[c] = nlo[c];
+	       hi[c] = nhi[c];
+	    }
+	    best = j;
+	 }
+
+	 if (best < 0) {
+	    // Can't skip anything, keep the next vertex as it is
+	    best = a+1;
+	    az = v[4*best];
+	    for (c=0;c<3;c++)	at[c] = v[4*best+1+c];
+	 } else {
+	    dz = v[4*best] - az;
+	    if (dz <= 0)	continue;
+
+	    for (c=0;c<3;c++) {
+	       float	s = (v[4*best+1+c] - at[c]) / dz;
+	       if (s < lo[c])	s = lo[c];
+	       if (s > hi[c])	s = hi[c];
+	       at[c] += s*dz;
+	    }
+	    az = v[4*best];
+	 }
+
+	 out.push_back(az);
+	 out.push_back(at[0]); out.push_back(at[1]); out.push_back(at[2]);
+      }
+   }
+
+   out.push_back(kDEEP_INFINITY);
+   out.push_back(at[0]); out.push_back(at[1]); out.push_back(at[2]);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CDeepShadowWriter
+// Method  :	tileDone
+// Description 	:	Simplify a tile and write it, with any tiles
+//			after it that were waiting for it
+// Comments  :	Threads finishing different tiles simplify them at
+//		the same time.  Only the writing is serialized.
+void	CDeepShadowWriter::tileDone(int tx,int ty)
+{
+   const int	n = header.tileSize*header.tileSize;
+   CTile	*tile;
+   std::vector<CSample>	*samples;
+   std::vector<CSample>	none;
+   std::vector<float>	out;
+   int  	i;
+
+   if ((tx < 0) || (ty < 0) || (tx >= header.xTiles) || (ty >= header.yTiles))
+      return;
+
+   tile = tiles + ty*header.xTiles + tx;
+
+   mi_lock(tile->lock);
+   if (tile->done) {
+      mi_unlock(tile->lock);
+      return;
+   }
+   tile->done  = miTRUE;
+   samples  = tile->samples;
+   tile->samples = NULL;
+   mi_unlock(tile->lock);
+
+   for (i=0;i<n;i++)
+      compressPixel(samples != NULL ? samples[i] : none,out);
+   delete [] samples;
+
+   mi_lock(fileLock);
+   tile->size = (int) out.size();
+   tile->data = new float[tile->size];
+   memcpy(tile->data,&out[0],tile->size*sizeof(float));
+   writeTiles();
+   mi_unlock(fileLock);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CDeepShadowWriter
+// Method  :	writeTiles
+// Description 	:	Write the tiles that are ready, in order
+// Comments  :	The file lock must be held
+void	CDeepShadowWriter::writeTiles()
+{
+   const int	numTiles = header.xTiles*header.yTiles;
+   CTile	*tile;
+
+   while ((nextTile < numTiles) && (tiles[nextTile].data != NULL)) {
+      tile = tiles + nextTile;
+
+      if ((failed == miFALSE) &&
+	  (fwrite(tile->data,sizeof(float),tile->size,file) !=
+	   (size_t) tile->size)) {
+	 mi_error("Could not write deep shadow map tile %d.",nextTile);
+	 failed = miTRUE;
+      }
+
+      offset += tile->size*sizeof(float);
+      tileIndices[nextTile] = (int) offset;
+
+      delete [] tile->data;
+      tile->data = NULL;
+      tile->size = 0;
+      nextTile++;
+   }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CDeepShadowWriter
+// Method  :	close
+// Description 	:	Finish all tiles and the file
+// Return Value :	miFALSE if anything couldn't be written
+miBoolean	CDeepShadowWriter::close()
+{
+   const int	numTiles = header.xTiles*header.yTiles;
+   int	tx,ty;
+
+   for (ty=0;ty<header.yTiles;ty++)
+      for (tx=0;tx<header.xTiles;tx++)
+	 tileDone(tx,ty);
+
+   mi_lock(fileLock);
+   if (file != NULL) {
+      if ((failed == miFALSE) &&
+	  ((fseek(file,sizeof(MR_DEEP_SHADOW_MAGIC) +
+		  sizeof(CDeepShadowHeader),SEEK_SET) != 0) ||
+	   (fwrite(tileIndices,sizeof(int),numTiles,file) !=
+	    (size_t) numTiles)))
+      {
+	 mi_error("Could not write deep shadow map tile indices.");
+	 failed = miTRUE;
+      }
+      if (fclose(file) != 0)	failed = miTRUE;
+      file = NULL;
+   }
+   mi_unlock(fileLock);
+
+   return (failed == miFALSE);
+}
+
+
+END_NAMESPACE( mr )
+
+#endif // MR_NO_TIFF
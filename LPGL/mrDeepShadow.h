@@ -0,0 +1,114 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Deep shadow map writer, producing the files CDeepShadow in mrTiff.cpp
+// reads.  As it is tied to that file format, it is distributed with it
+// under LPGL, not OpenBSD.
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+
+#ifndef mrDeepShadow_h
+#define mrDeepShadow_h
+
+#ifndef MR_NO_TIFF
+
+#include <vector>
+
+#ifndef mrTiff_h
+#include "mrTiff.h"
+#endif
+
+
+BEGIN_NAMESPACE( mr )
+
+
+//! Writes a deep shadow map, for environmentLoad to read back.
+//!
+//! Render threads of a light space pass add what they find along each
+//! pixel with addSample(), in any order, and call tileDone() once a
+//! tile has all of its samples.  The thread finishing a tile turns its
+//! pixels into visibility functions, simplifies them to within the
+//! tolerance and writes the tile.  Tiles finished ahead of the ones
+//! before them wait in memory until those are written.
+//!
+//! The gg_deepshadow lens shader drives one from a render done from
+//! the light.
+class CDeepShadowWriter
+{
+   public:
+     //! worldToNDC maps world space to light space, with x and y in
+     //! [0,1] over the map and z the depth.  tileSize must be a
+     //! power of 2.
+     CDeepShadowWriter(const char *fileName,int xres,int yres,
+		       const miMatrix worldToNDC,int tileSize = 32,
+		       float tolerance = 0.005f);
+     //! Finishes the file if close() wasn't called
+     ~CDeepShadowWriter();
+
+     //! Something blocking opacity of the light at depth z in pixel x,y
+     void	addSample(int x,int y,float z,const color& opacity);
+     //! All samples of the tile tx,ty were added
+     void	tileDone(int tx,int ty);
+     //! Finish the remaining tiles and the file
+     miBoolean	close();
+
+     //! The tile pixel x,y is in
+     int	tileOf(int x,int y) const
+     {
+	return (y >> header.tileShift)*header.xTiles +
+	       (x >> header.tileShift);
+     }
+
+     const CDeepShadowHeader&	getHeader() const { return header; }
+
+   private:
+     struct CSample
+     {
+	  float		z;
+	  float		opacity[3];
+     };
+
+     struct CTile
+     {
+	  miLock	lock;		//<- Guards samples and done
+	  std::vector<CSample>*	samples; //<- Per pixel, NULL until used
+	  miBoolean	done;
+	  float*	data;		//<- Simplified, waiting to be written
+	  int		size;		//<- Number of floats in data
+     };
+
+     void	compressPixel(std::vector<CSample>&,std::vector<float>&);
+     void	writeTiles();
+
+     FILE*		file;
+     CDeepShadowHeader	header;
+     float		tolerance;
+     CTile*		tiles;
+     int*		tileIndices;	//<- End offset of each tile
+     int		nextTile;	//<- The next tile to write
+     long		offset;		//<- Where it goes
+     miBoolean		failed;
+     miLock		fileLock;	//<- Guards everything above
+};
+
+
+END_NAMESPACE( mr )
+
+#endif // MR_NO_TIFF
+
+#endif // mrDeepShadow_h
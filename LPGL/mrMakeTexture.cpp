@@ -0,0 +1,697 @@
+////////////////////////////////////////////////////////////////////////
+//
+// mrMakeTexture: turns a TIFF image into the tiled, mipmapped
+// ("made") textures textureLoad() in mrTiff.cpp reads a tile at a
+// time.  As it is tied to that file format, it is distributed with it
+// under LPGL, not OpenBSD.
+//
+// It is a standalone program, it needs the mental ray headers for the
+// mrClasses types but does not link against mental ray:
+//
+//    g++ -O2 -I../mrClasses -I<mental ray>/include mrMakeTexture.cpp
+//        -ltiff -lpthread -o mrMakeTexture
+//
+// On Windows, it is the mrMakeTexture project of GGShaderLib.sln.
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "tiffio.h"
+
+#ifdef WIN32
+#  define NOMINMAX
+#  include <windows.h>	// for GetSystemInfo()
+#else
+#  include <unistd.h>	// for sysconf()
+#endif
+
+#ifndef mrTiff_h
+#include "mrTiff.h"
+#endif
+
+#ifndef mrThread_h
+#include "mrThread.h"
+#endif
+
+using namespace mr;
+
+
+//! The filters mrMakeTexture knows about.  width is the default
+//! filter width and radius how far the filter reaches for that width,
+//! both in texels of the coarser level.
+struct CMakeFilter
+{
+     const char*	name;
+     filter::types	type;
+     float		width;
+     float		radius;		//<- Multiplies width, if > 0
+     float		fixedRadius;	//<- Used if radius is 0
+};
+
+static const CMakeFilter kFilters[] = {
+{ "box",	filter::kBox,		1.0f, 0.5f, 0.0f },
+{ "triangle",	filter::kTriangle,	2.0f, 0.5f, 0.0f },
+{ "gaussian",	filter::kGaussian,	2.0f, 0.5f, 0.0f },
+{ "disk",	filter::kDisk,		1.0f, 0.5f, 0.0f },
+{ "bessel",	filter::kBessel,	2.0f, 0.5f, 0.0f },
+{ "sinc",	filter::kSinc,		3.0f, 1.0f, 0.0f },
+{ "catmullrom",	filter::kCatmullRom,	4.0f, 0.0f, 2.0f },
+{ "mitchell",	filter::kMitchell,	1.0f, 2.0f, 0.0f },
+{ "lanczos2",	filter::kLanczos2,	1.0f, 2.0f, 0.0f },
+{ "lanczos3",	filter::kLanczos3,	1.0f, 3.0f, 0.0f },
+{ NULL,		filter::kBox,		0.0f, 0.0f, 0.0f }
+};
+
+
+//! An image in memory, always as floats
+struct CMakeImage
+{
+     int	width,height,numSamples;
+     float*	data;
+};
+
+//! The taps of a 1D resampling, tapsPer for each output texel
+struct CMakeTaps
+{
+     int	tapsPer;
+     std::vector<int>	index;
+     std::vector<float>	weight;
+};
+
+//! A band of rows of a resampling pass, for one worker thread
+struct CMakeJob
+{
+     const CMakeImage*	src;
+     CMakeImage*	dst;
+     const CMakeTaps*	taps;
+     miBoolean		vertical;
+     int		row0,row1;
+};
+
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	usage
+// Description 	:	Print the command line options
+static void	usage()
+{
+   fprintf(stderr,
+	   "usage: mrMakeTexture [options] in.tif out.tif\n"
+	   "  -tile <n>          tile size, a power of 2 (default 64)\n"
+	   "  -filter <name>     box, triangle, gaussian, disk, bessel, sinc,\n"
+	   "                     catmullrom, mitchell, lanczos2, lanczos3\n"
+	   "                     (default gaussian)\n"
+	   "  -width <w>         filter width, in texels of the coarser level\n"
+	   "  -smode <mode>      periodic, clamp or black (default periodic)\n"
+	   "  -tmode <mode>      the same, in t\n"
+	   "  -mode <mode>       both of them\n"
+	   "  -half              store floats as 16 bit halves\n"
+	   "  -float             store 32 bit floats, even for 8 or 16 bit\n"
+	   "                     images (by default, samples are stored as\n"
+	   "                     in the input)\n"
+	   "  -compression <c>   none, lzw or deflate (default none, which\n"
+	   "                     lets the texture cache map the tiles)\n"
+	   "  -threads <n>       worker threads (default one per CPU)\n");
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	numberOfCPUs
+// Description 	:	The number of processors of the machine
+static int	numberOfCPUs()
+{
+#ifdef WIN32
+   SYSTEM_INFO	info;
+   GetSystemInfo(&info);
+   return (int) info.dwNumberOfProcessors;
+#else
+   long	n = sysconf(_SC_NPROCESSORS_ONLN);
+   return (n > 0) ? (int) n : 1;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	readSample
+// Description 	:	Turn one sample of the input into a float
+// Comments  :	Integer samples are mapped to [0,1]
+static inline float	readSample(const unsigned char *p,int bits,
+				   int format)
+{
+   if (bits == 8)
+      return p[0] * (1.0f / 255.0f);
+
+   if (bits == 16)
+   {
+      unsigned short	v;
+      memcpy(&v,p,sizeof(v));
+      if (format == SAMPLEFORMAT_IEEEFP)	return halfToFloat(v);
+      return v * (1.0f / 65535.0f);
+   }
+
+   float	f;
+   memcpy(&f,p,sizeof(f));
+   return f;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	readImage
+// Description 	:	Read the first directory of a TIFF file
+// Return Value :	miTRUE on success
+// Comments  :	Takes scanline and tiled files with 8 or 16 bit
+//		integer, 16 bit half or 32 bit float samples.  bits and
+//		format are those of the file's samples.
+static miBoolean	readImage(const char *name,CMakeImage& img,
+				  int& bits,uint16& format)
+{
+   TIFF	*in;
+   uint32	width,height,tileWidth,tileHeight;
+   uint16	numSamples,bitsPerSample,sampleFormat,planarConfig;
+   unsigned char	*buf;
+   int	pixelSize,x,y,i,j,k;
+   miBoolean	ok = miTRUE;
+
+   in = TIFFOpen(name,"r");
+   if (in == NULL)
+   {
+      fprintf(stderr,"mrMakeTexture: can't open \"%s\".\n",name);
+      return miFALSE;
+   }
+
+   TIFFGetFieldDefaulted(in,TIFFTAG_IMAGEWIDTH,      &width);
+   TIFFGetFieldDefaulted(in,TIFFTAG_IMAGELENGTH,     &height);
+   TIFFGetFieldDefaulted(in,TIFFTAG_SAMPLESPERPIXEL, &numSamples);
+   TIFFGetFieldDefaulted(in,TIFFTAG_BITSPERSAMPLE,   &bitsPerSample);
+   TIFFGetFieldDefaulted(in,TIFFTAG_SAMPLEFORMAT,    &sampleFormat);
+   TIFFGetFieldDefaulted(in,TIFFTAG_PLANARCONFIG,    &planarConfig);
+
+   if ((planarConfig != PLANARCONFIG_CONTIG) ||
+       ((bitsPerSample != 8) && (bitsPerSample != 16) &&
+	!((bitsPerSample == 32) && (sampleFormat == SAMPLEFORMAT_IEEEFP))))
+   {
+      fprintf(stderr,"mrMakeTexture: \"%s\" must have interleaved 8 or "
+	      "16 bit samples, or 32 bit floats.\n",name);
+      TIFFClose(in);
+      return miFALSE;
+   }
+
+   img.width      = (int) width;
+   img.height     = (int) height;
+   img.numSamples = numSamples;
+   img.data       = new float[(size_t) width*height*numSamples];
+   bits   = bitsPerSample;
+   format = (bits == 32) ? (uint16) SAMPLEFORMAT_IEEEFP : sampleFormat;
+   if ((bits == 8) || (format != SAMPLEFORMAT_IEEEFP))
+      format = SAMPLEFORMAT_UINT;
+
+   pixelSize = numSamples*(bitsPerSample >> 3);
+
+   if (TIFFIsTiled(in))
+   {
+      TIFFGetFieldDefaulted(in,TIFFTAG_TILEWIDTH,  &tileWidth);
+      TIFFGetFieldDefaulted(in,TIFFTAG_TILELENGTH, &tileHeight);
+      buf = new unsigned char[TIFFTileSize(in)];
+
+      for (y=0;(y<(int) height) && ok;y+=tileHeight)
+	 for (x=0;(x<(int) width) && ok;x+=tileWidth)
+	 {
+	    if (TIFFReadTile(in,buf,x,y,0,0) < 0)
+	    {
+	       ok = miFALSE;
+	       break;
+	    }
+	    for (j=0;(j<(int) tileHeight) && (y+j < (int) height);j++)
+	       for (i=0;(i<(int) tileWidth) && (x+i < (int) width);i++)
+		  for (k=0;k<numSamples;k++)
+		     img.data[((size_t) (y+j)*width+x+i)*numSamples+k] =
+			readSample(buf + (j*tileWidth+i)*pixelSize +
+				   k*(bitsPerSample >> 3),
+				   bitsPerSample,sampleFormat);
+	 }
+   }
+   else
+   {
+      buf = new unsigned char[TIFFScanlineSize(in)];
+
+      for (y=0;y<(int) height;y++)
+      {
+	 if (TIFFReadScanline(in,buf,y,0) < 0)
+	 {
+	    ok = miFALSE;
+	    break;
+	 }
+	 for (i=0;i<(int) width*numSamples;i++)
+	    img.data[(size_t) y*width*numSamples+i] =
+	       readSample(buf + i*(bitsPerSample >> 3),bitsPerSample,
+			  sampleFormat);
+      }
+   }
+
+   delete [] buf;
+   TIFFClose(in);
+
+   if (!ok)
+   {
+      fprintf(stderr,"mrMakeTexture: can't read \"%s\".\n",name);
+      delete [] img.data;
+      img.data = NULL;
+   }
+   return ok;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	makeTaps
+// Description 	:	Work out the filter taps taking n texels to n2
+// Comments  :	The filter is evaluated in texels of the coarser
+//		level and the weights of each texel sum to 1.  Taps off
+//		the edge wrap around for periodic textures and are
+//		clamped otherwise.
+static void	makeTaps(CMakeTaps& taps,int n,int n2,
+			 filter::function f,float width,float radius,
+			 TTextureMode mode)
+{
+   const float	scale = (float) n / (float) n2;
+   int	i,j,first,last,src;
+   float	center,sum,w;
+
+   taps.tapsPer = (int) ceil(2*radius*scale) + 2;
+   taps.index.assign((size_t) n2*taps.tapsPer,0);
+   taps.weight.assign((size_t) n2*taps.tapsPer,0.0f);
+
+   for (i=0;i<n2;i++)
+   {
+      int	*index  = &taps.index[(size_t) i*taps.tapsPer];
+      float	*weight = &taps.weight[(size_t) i*taps.tapsPer];
+
+      // The texel centers of the finer level within the radius
+      center = (i + 0.5f)*scale - 0.5f;
+      first  = (int) ceil(center - radius*scale);
+      last   = (int) floor(center + radius*scale);
+      if (last - first + 1 > taps.tapsPer)	last = first + taps.tapsPer - 1;
+
+      for (sum=0,j=first;j<=last;j++)
+      {
+	 w = f((j - center) / scale,0.0f,width,width);
+
+	 src = j;
+	 if (mode == kTEXTURE_PERIODIC)
+	 {
+	    src %= n;
+	    if (src < 0)	src += n;
+	 }
+	 else
+	 {
+	    src = max(0,min(src,n-1));
+	 }
+
+	 index[j-first]  = src;
+	 weight[j-first] = w;
+	 sum += w;
+      }
+
+      // Normalize, or fall back to the nearest texel
+      if (fabs(sum) > 1e-6f)
+      {
+	 for (j=0;j<=last-first;j++)	weight[j] /= sum;
+      }
+      else
+      {
+	 for (j=0;j<taps.tapsPer;j++)	weight[j] = 0.0f;
+	 index[0]  = max(0,min((int) (center + 0.5f),n-1));
+	 weight[0] = 1.0f;
+      }
+   }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	resampleRows
+// Description 	:	Run a band of a resampling pass
+static void	resampleRows(void *data)
+{
+   const CMakeJob&	job = *(const CMakeJob *) data;
+   const CMakeImage&	src = *job.src;
+   CMakeImage&	dst = *job.dst;
+   const CMakeTaps&	taps = *job.taps;
+   const int	ns = src.numSamples;
+   int	x,y,j,k,s;
+   float	acc[16];
+
+   for (y=job.row0;y<job.row1;y++)
+      for (x=0;x<dst.width;x++)
+      {
+	 const int	o = job.vertical ? y : x;
+	 const int	*index  = &taps.index[(size_t) o*taps.tapsPer];
+	 const float	*weight = &taps.weight[(size_t) o*taps.tapsPer];
+	 float	*out = dst.data + ((size_t) y*dst.width + x)*ns;
+
+	 for (k=0;k<ns;k++)	acc[k] = 0.0f;
+
+	 for (j=0;j<taps.tapsPer;j++)
+	 {
+	    const float	w = weight[j];
+	    const float	*in;
+
+	    if (w == 0.0f)	continue;
+	    if (job.vertical)
+	       in = src.data + ((size_t) index[j]*src.width + x)*ns;
+	    else
+	       in = src.data + ((size_t) y*src.width + index[j])*ns;
+	    for (s=0;s<ns;s++)	acc[s] += w*in[s];
+	 }
+
+	 for (k=0;k<ns;k++)	out[k] = acc[k];
+      }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	resamplePass
+// Description 	:	Resample an image along one axis, with the rows
+//			split among numThreads threads
+static void	resamplePass(const CMakeImage& src,CMakeImage& dst,
+			     const CMakeTaps& taps,miBoolean vertical,
+			     int numThreads)
+{
+   std::vector<CMakeJob>	jobs(numThreads);
+   thread	*threads = new thread[numThreads];
+   int	i;
+
+   for (i=0;i<numThreads;i++)
+   {
+      jobs[i].src      = &src;
+      jobs[i].dst      = &dst;
+      jobs[i].taps     = &taps;
+      jobs[i].vertical = vertical;
+      jobs[i].row0     = (int) ((long) dst.height*i / numThreads);
+      jobs[i].row1     = (int) ((long) dst.height*(i+1) / numThreads);
+   }
+
+   // The calling thread does the first band itself
+   for (i=1;i<numThreads;i++)
+      if (!threads[i].start(resampleRows,&jobs[i]))	resampleRows(&jobs[i]);
+   resampleRows(&jobs[0]);
+   for (i=1;i<numThreads;i++)
+      threads[i].join();
+
+   delete [] threads;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	writeLevel
+// Description 	:	Write one level of the pyramid as a tiled
+//			directory
+// Return Value :	miTRUE on success
+// Comments  :	Integer samples (8 or 16 bits of SAMPLEFORMAT_UINT)
+//		are clamped to [0,1]
+static miBoolean	writeLevel(TIFF *out,const CMakeImage& img,
+				   int tileSize,int bits,uint16 format,
+				   uint16 compression,
+				   const char *description)
+{
+   const int	ns = img.numSamples;
+   const int	sampleSize = bits >> 3;
+   unsigned char	*tile;
+   int	x,y,i,j,k,sx,sy;
+
+   TIFFSetField(out,TIFFTAG_IMAGEWIDTH,      (uint32) img.width);
+   TIFFSetField(out,TIFFTAG_IMAGELENGTH,     (uint32) img.height);
+   TIFFSetField(out,TIFFTAG_SAMPLESPERPIXEL, (uint16) ns);
+   TIFFSetField(out,TIFFTAG_BITSPERSAMPLE,   (uint16) bits);
+   TIFFSetField(out,TIFFTAG_SAMPLEFORMAT,   format);
+   TIFFSetField(out,TIFFTAG_PLANARCONFIG,    PLANARCONFIG_CONTIG);
+   TIFFSetField(out,TIFFTAG_PHOTOMETRIC,
+		(ns >= 3) ? PHOTOMETRIC_RGB : PHOTOMETRIC_MINISBLACK);
+   TIFFSetField(out,TIFFTAG_COMPRESSION,     compression);
+   TIFFSetField(out,TIFFTAG_TILEWIDTH,       (uint32) tileSize);
+   TIFFSetField(out,TIFFTAG_TILELENGTH,      (uint32) tileSize);
+   if ((ns == 2) || (ns == 4))
+   {
+      uint16	extra = EXTRASAMPLE_ASSOCALPHA;
+      TIFFSetField(out,TIFFTAG_EXTRASAMPLES,1,&extra);
+   }
+   if (description != NULL)
+      TIFFSetField(out,TIFFTAG_IMAGEDESCRIPTION,description);
+
+   tile = new unsigned char[(size_t) tileSize*tileSize*ns*sampleSize];
+
+   for (y=0;y<img.height;y+=tileSize)
+      for (x=0;x<img.width;x+=tileSize)
+      {
+	 // Texels past the edge repeat the last ones
+	 for (j=0;j<tileSize;j++)
+	    for (i=0;i<tileSize;i++)
+	    {
+	       sx = min(x+i,img.width-1);
+	       sy = min(y+j,img.height-1);
+	       const float	*in = img.data + ((size_t) sy*img.width+sx)*ns;
+	       unsigned char	*p = tile + ((size_t) j*tileSize+i)*ns*sampleSize;
+
+	       for (k=0;k<ns;k++)
+	       {
+		  float	f = in[k];
+
+		  if (bits == 8)
+		  {
+		     if (!(f > 0))	f = 0;
+		     if (f > 1)	f = 1;
+		     p[k] = (unsigned char) (f*255.0f + 0.5f);
+		  }
+		  else if ((bits == 16) && (format == SAMPLEFORMAT_UINT))
+		  {
+		     if (!(f > 0))	f = 0;
+		     if (f > 1)	f = 1;
+		     unsigned short	u = (unsigned short) (f*65535.0f + 0.5f);
+		     memcpy(p + 2*k,&u,sizeof(u));
+		  }
+		  else if (bits == 16)
+		  {
+		     unsigned short	h = floatToHalf(f);
+		     memcpy(p + 2*k,&h,sizeof(h));
+		  }
+		  else
+		  {
+		     memcpy(p + 4*k,&f,sizeof(f));
+		  }
+	       }
+	    }
+
+	 if (TIFFWriteTile(out,tile,x,y,0,0) < 0)
+	 {
+	    delete [] tile;
+	    return miFALSE;
+	 }
+      }
+
+   delete [] tile;
+   return (TIFFWriteDirectory(out) != 0) ? miTRUE : miFALSE;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	parseMode
+// Description 	:	Turn a wrap mode name into a TTextureMode
+static miBoolean	parseMode(const char *name,TTextureMode& mode)
+{
+   if (strcmp(name,"periodic") == 0)	mode = kTEXTURE_PERIODIC;
+   else if (strcmp(name,"clamp") == 0)	mode = kTEXTURE_CLAMP;
+   else if (strcmp(name,"black") == 0)	mode = kTEXTURE_BLACK;
+   else	return miFALSE;
+   return miTRUE;
+}
+
+static const char	*modeName(TTextureMode mode)
+{
+   switch(mode) {
+      case kTEXTURE_CLAMP:	return "clamp";
+      case kTEXTURE_BLACK:	return "black";
+      default:		return "periodic";
+   }
+}
+
+
+int main(int argc,char *argv[])
+{
+   const CMakeFilter	*flt = NULL;
+   TTextureMode	sMode = kTEXTURE_PERIODIC,tMode = kTEXTURE_PERIODIC;
+   uint16	compression = COMPRESSION_NONE;
+   int	tileSize = 64,numThreads = numberOfCPUs();
+   float	width = -1.0f;
+   int	bits = 0,inBits,numLevels,level,i;
+   uint16	format = SAMPLEFORMAT_IEEEFP,inFormat;
+   const char	*inName = NULL,*outName = NULL;
+   CMakeImage	img,tmp,next;
+   CMakeTaps	taps;
+   char	description[256];
+   TIFF	*out;
+
+   for (i=0;kFilters[i].name != NULL;i++)
+      if (strcmp(kFilters[i].name,"gaussian") == 0)	flt = kFilters + i;
+
+   for (i=1;i<argc;i++)
+   {
+      const char	*arg = argv[i];
+      const char	*val = (i+1 < argc) ? argv[i+1] : NULL;
+
+      if (strcmp(arg,"-half") == 0)	bits = 16;
+      else if (strcmp(arg,"-float") == 0)	bits = 32;
+      else if (arg[0] == '-' && val == NULL)
+      {
+	 usage();
+	 return 1;
+      }
+      else if (strcmp(arg,"-tile") == 0)	tileSize = atoi(argv[++i]);
+      else if (strcmp(arg,"-width") == 0)	width = (float) atof(argv[++i]);
+      else if (strcmp(arg,"-threads") == 0)	numThreads = atoi(argv[++i]);
+      else if (strcmp(arg,"-filter") == 0)
+      {
+	 for (flt=kFilters;flt->name != NULL;flt++)
+	    if (strcmp(flt->name,val) == 0)	break;
+	 if (flt->name == NULL)
+	 {
+	    fprintf(stderr,"mrMakeTexture: unknown filter \"%s\".\n",val);
+	    return 1;
+	 }
+	 i++;
+      }
+      else if ((strcmp(arg,"-smode") == 0) || (strcmp(arg,"-tmode") == 0) ||
+	       (strcmp(arg,"-mode") == 0))
+      {
+	 TTextureMode	mode;
+	 if (parseMode(val,mode) == miFALSE)
+	 {
+	    fprintf(stderr,"mrMakeTexture: unknown wrap mode \"%s\".\n",val);
+	    return 1;
+	 }
+	 if (arg[1] != 't')	sMode = mode;
+	 if (arg[1] != 's')	tMode = mode;
+	 i++;
+      }
+      else if (strcmp(arg,"-compression") == 0)
+      {
+	 if (strcmp(val,"none") == 0)	compression = COMPRESSION_NONE;
+	 else if (strcmp(val,"lzw") == 0)	compression = COMPRESSION_LZW;
+	 else if (strcmp(val,"deflate") == 0)
+	    compression = COMPRESSION_ADOBE_DEFLATE;
+	 else
+	 {
+	    fprintf(stderr,"mrMakeTexture: unknown compression \"%s\".\n",
+		    val);
+	    return 1;
+	 }
+	 i++;
+      }
+      else if (arg[0] == '-')
+      {
+	 usage();
+	 return 1;
+      }
+      else if (inName == NULL)	inName = arg;
+      else if (outName == NULL)	outName = arg;
+      else
+      {
+	 usage();
+	 return 1;
+      }
+   }
+
+   if ((inName == NULL) || (outName == NULL))
+   {
+      usage();
+      return 1;
+   }
+
+   // TIFF wants tiles in multiples of 16, the cache powers of 2
+   if ((tileSize < 16) || (tileSize & (tileSize-1)))
+   {
+      fprintf(stderr,"mrMakeTexture: the tile size must be a power of 2, "
+	      "16 or more.\n");
+      return 1;
+   }
+   if (numThreads < 1)	numThreads = 1;
+   if (width <= 0)	width = flt->width;
+
+   if (readImage(inName,img,inBits,inFormat) == miFALSE)	return 1;
+   if (img.numSamples > 16)
+   {
+      fprintf(stderr,"mrMakeTexture: \"%s\" has too many channels.\n",
+	      inName);
+      return 1;
+   }
+   if (bits == 0)
+   {
+      bits   = inBits;
+      format = inFormat;
+   }
+
+   // Every level is half the size of the one above, down to a texel
+   for (numLevels=1;
+	((img.width >> numLevels) > 0) && ((img.height >> numLevels) > 0);
+	numLevels++);
+
+   out = TIFFOpen(outName,"w");
+   if (out == NULL)
+   {
+      fprintf(stderr,"mrMakeTexture: can't create \"%s\".\n",outName);
+      return 1;
+   }
+
+   // textureLoad() recognizes made textures by this description
+   sprintf(description,"#texture (%dx%d): smode: %s tmode: %s levels: %d ",
+	   img.width,img.height,modeName(sMode),modeName(tMode),numLevels);
+
+   for (level=0;level<numLevels;level++)
+   {
+      if (writeLevel(out,img,tileSize,bits,format,compression,
+		     (level == 0) ? description : NULL) == miFALSE)
+      {
+	 fprintf(stderr,"mrMakeTexture: error writing \"%s\".\n",outName);
+	 TIFFClose(out);
+	 return 1;
+      }
+
+      if (level == numLevels-1)	break;
+
+      // Filter down to the next level, across then down
+      const filter::function	f = filter::fromEnumeration(flt->type);
+      const float	radius = (flt->radius > 0) ? flt->radius*width :
+			 flt->fixedRadius;
+
+      tmp.width      = img.width >> 1;
+      tmp.height     = img.height;
+      tmp.numSamples = img.numSamples;
+      tmp.data       = new float[(size_t) tmp.width*tmp.height*
+				 tmp.numSamples];
+      makeTaps(taps,img.width,tmp.width,f,width,radius,sMode);
+      resamplePass(img,tmp,taps,miFALSE,numThreads);
+      delete [] img.data;
+
+      next.width      = tmp.width;
+      next.height     = img.height >> 1;
+      next.numSamples = img.numSamples;
+      next.data       = new float[(size_t) next.width*next.height*
+				  next.numSamples];
+      makeTaps(taps,tmp.height,next.height,f,width,radius,tMode);
+      resamplePass(tmp,next,taps,miTRUE,numThreads);
+      delete [] tmp.data;
+
+      img = next;
+   }
+
+   delete [] img.data;
+   TIFFClose(out);
+   return 0;
+}
@@ -52,19 +52,49 @@
 BEGIN_NAMESPACE( mr )
 
 
+//! Block cache statistics of a single texture layer (mip level).
+//! These are updated atomically, as a layer's tiles live in all shards.
+struct TextureUsage
+{
+     //! The number of tile fetches that missed the per thread tile caches
+     miUlong numFetches;
+     //! The number of tiles read from disk
+     miUlong numMisses;
+     //! The amount of texture data read from disk
+     miUlong transferredData;
+     //! The amount of distinct texture data read from disk.  Anything
+     //! transferred beyond this was read again after being flushed.
+     miUlong workingSetData;
+
+     TextureUsage() :
+     numFetches( 0 ),
+     numMisses( 0 ),
+     transferredData( 0 ),
+     workingSetData( 0 )
+     {
+     }
+};
+
+
 //! Stores statistics about texture access
 struct TextureStats
 {
      //! Number of open File Descriptors
      miUint numFileDescriptors; 
+     //! The number of file opens served by an idle handle in the pool
+     miUlong numFileReuses;
      //! The number of texture misses
      miUlong numTextureMisses;
      //! The number of texture references
      miUlong numTextureRef;
+     //! The number of tile fetches served by the per thread tile caches
+     miUlong numTileCacheHits;
      //! The total amount the texture data transmitted 
      miUlong transferredTextureData;
      //! The current number of textures
      miUlong numTextures;
+     //! The number of texture loads served by an already loaded texture
+     miUlong numSharedTextures;
      //! The current amount of textures in memory
      miUlong textureSize;
      //! The peak number of textures
@@ -73,6 +103,23 @@ struct TextureStats
      miUlong peakTextureSize;
      //! The number of times textures were flushed from memory
      miUlong textureFlushes;
+     //! The number of tiles queued for prefetching
+     miUlong prefetchRequests;
+     //! The number of prefetch requests dropped because the queue was full
+     miUlong prefetchDropped;
+     //! The number of prefetched tiles that got used
+     miUlong prefetchHits;
+     //! The number of prefetched tiles flushed without being used
+     miUlong prefetchMisses;
+     //! The number of misses served by the compressed tier
+     miUlong numCompressedHits;
+     //! The number of tiles dropped from the compressed tier for room
+     miUlong compressedDropped;
+     //! The current amount of memory the compressed tier uses
+     miUlong compressedSize;
+     //! The current amount of texture data in the compressed tier,
+     //! uncompressed
+     miUlong compressedData;
 
      void Print()
      {
@@ -84,26 +131,50 @@ struct TextureStats
 	mi_info("Ideal Memory Limit: %g", avg);
 	mi_info("Peak Textures #: %d", numPeakTextures);
 	mi_info("Peak Texture Memory: %d", peakTextureSize);
+	mi_info("Shared Texture Loads: %d", numSharedTextures);
+	mi_info("Open File Descriptors: %d", numFileDescriptors);
+	mi_info("File Handle Reuses: %d", numFileReuses);
 	mi_info("Texture Accesses: %d", numTextureRef);
+	mi_info("Tile Cache  Hits: %d", numTileCacheHits);
 	miUlong misses = numTextureMisses - numPeakTextures;
 	mi_info("Texture   Misses: %d", misses);
+	mi_info("Prefetch Requests: %d (%d dropped)", prefetchRequests,
+		prefetchDropped);
+	mi_info("Prefetch    Hits: %d", prefetchHits);
+	mi_info("Prefetch  Misses: %d", prefetchMisses);
+	mi_info("Compressed Hits: %d (%d dropped)", numCompressedHits,
+		compressedDropped);
+	mi_info("Compressed Memory: %d (holding %d)", compressedSize,
+		compressedData);
 	mi_info("---------------------------------------------");
      }
 
      void Init()
      {
 	numTextures = 0;
+	numSharedTextures = 0;
+	numFileReuses = 0;
 	numTextureMisses = 0;
 	numTextureRef = 0;
+	numTileCacheHits = 0;
 	transferredTextureData = 0;
 	textureSize = 0;
 	numPeakTextures = 0;
 	peakTextureSize = 0;
 	textureFlushes = 0;
+	prefetchRequests = 0;
+	prefetchDropped = 0;
+	prefetchHits = 0;
+	prefetchMisses = 0;
+	numCompressedHits = 0;
+	compressedDropped = 0;
      }
 
      TextureStats()
      {
+	numFileDescriptors = 0;
+	compressedSize = 0;
+	compressedData = 0;
 	Init();
      };
      
@@ -113,6 +184,18 @@ struct TextureStats
 
 extern MR_LIB_EXPORT TextureStats* Stats;
 
+//! Get the current statistics, including the counts each thread has
+//! not added to Stats yet
+MR_LIB_EXPORT void textureStatistics( TextureStats& stats );
+
+//! Write the statistics with a breakdown per texture and mip level.
+//! Files ending in .csv get one line per level, anything else gets JSON.
+MR_LIB_EXPORT miBoolean textureWriteStatistics( const char* fileName );
+
+//! Write the tile trace gathered so far as CSV, one line per event
+//! (see TextureCacheOptions::traceFile)
+MR_LIB_EXPORT miBoolean textureWriteTrace( const char* fileName );
+
 END_NAMESPACE( mr )
 
 
@@ -43,6 +43,35 @@
 
 #include "tiffio.h"
 
+#include <stdlib.h>   // for realpath() / _fullpath()
+#include <stdio.h>    // for vsnprintf()
+
+#ifndef WIN32
+#  include <sys/time.h> // for gettimeofday()
+#endif
+
+#ifdef WIN32
+#  define NOMINMAX
+#  include <windows.h>  // for SwitchToThread(), MapViewOfFile()
+#  define vsnprintf _vsnprintf
+#else
+#  include <sched.h>    // for sched_yield()
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/mman.h> // for mmap()
+#endif
+
+#ifndef mrPlatform_h
+#include "mrPlatform.h"
+#endif
+
+#ifdef MR_SSE2
+#  include <emmintrin.h>
+#endif
+#ifdef MR_F16C
+#  include <immintrin.h>
+#endif
+
 #ifndef mrTiff_h
 #include "mrTiff.h"
 #endif
@@ -59,20 +88,32 @@
 #include "mrMath.h"
 #endif
 
+#ifndef mrThread_h
+#include "mrThread.h"
+#endif
+
+#ifndef mrAtomic_h
+#include "mrAtomic.h"
+#endif
+
+BEGIN_NAMESPACE( mr )
+static void	textureMessage(miBoolean warning,const char *fmt,va_list ap);
+END_NAMESPACE( mr )
+
 extern "C"
 {
 
 static	void
 tiffErrorHandler(const char *module,const char *fmt, va_list ap)
 {
-   mi_error(fmt,ap);
+   mr::textureMessage(miFALSE,fmt,ap);
 }
 
 
 static	void
 tiffWarningHandler(const char *module,const char *fmt, va_list ap)
 {
-   mi_warning(fmt,ap);
+   mr::textureMessage(miTRUE,fmt,ap);
 }
 
 }
@@ -80,15 +121,283 @@ tiffWarningHandler(const char *module,const char *fmt, va_list ap)
 
 BEGIN_NAMESPACE( mr )
 
-#define INFINITY                  (float) 1e30
+static const float kDEPTH_INFINITY = 1e30f;	//<- Of empty depth map pixels
 
 // Stuff for fast caching
-static	miUint	refNumber = 0;	//<- The last reference number
-static	CTextureBlock	*usedBlocks = NULL;	//<- All blocks currently in use
-static	CTextureBlock	*freeBlocks = NULL;	//<- Free blocks
-static	miUint	numUsedBlocks =	0;	//<- Number of used blocks
-static	miUint	usedTextureMemory = 0;	//<- The amount of texture memory in use
+//
+// The block cache is split into kTEXTURE_SHARDS shards.  Each shard has
+// its own lock, its own block lists and its own share of the texture
+// memory.  Blocks are dealt out to the shards round-robin as they get
+// created, so neighbouring tiles end up in different shards and threads
+// working on different tiles rarely wait on each other.
+static const int kTEXTURE_SHARDS = 16;	//<- Must be a power of 2
+
+//! Block data that got paged out while some thread may still have it
+//! in its tile cache
+struct CRetiredData
+{
+     void	    *data;
+     miUint	     epoch;		//<- Epoch the data was paged out in
+     CRetiredData   *next;
+};
+
+//! A block paged out for the compressed tier, compressed once the
+//! shard is unlocked
+struct CPackJob
+{
+     CTextureBlock  *entry;
+     void	    *data;		//<- The paged out data
+     int	     size;
+     miUint	     ticket;		//<- entry->packTicket when paged out
+     miUint	     epoch;		//<- Epoch the data was paged out in
+     unsigned char  *packed;
+     int	     packedSize;
+     CPackJob	    *next;
+};
+
+struct CTraceChunk;
+
+struct CTextureShard
+{
+     miLock	     lock;		//<- Guards everything below
+     CTextureBlock  *usedBlocks;	//<- All blocks currently in use
+     CTextureBlock  *freeBlocks;	//<- Free blocks
+     CTextureBlock  *clockHand;		//<- Next resident block to look at
+     CRetiredData   *retired;		//<- Paged out data not freed yet
+     miUint	     usedTextureMemory;	//<- The amount of texture memory in use
+     miUint	     maxTextureMemory;	//<- This shard's share of the memory
+     miUint	     lowTextureMemory;	//<- What a flush trims the shard to
+     CTextureBlock  *packedHead;	//<- Compressed blocks, newest first
+     CTextureBlock  *packedTail;	//<- The oldest compressed block
+     miUint	     packedMemory;	//<- Memory of the compressed blocks
+     miUint	     maxPackedMemory;	//<- This shard's share of it
+     miUint	     packTickets;	//<- The last packTicket handed out
+     CTraceChunk    *trace;		//<- Tile trace, newest chunk first
+     char	     pad[64];		//<- Keep shards off each other's lines
+};
+
+static	CTextureShard	textureShards[kTEXTURE_SHARDS];
+static	miBoolean	shardsInitialized = miFALSE;
+static	int	textureUsers = 0;	//<- textureInit calls not shut down
+static	miUint	nextShard = 0;	//<- The shard of the next new block
 static	miUint	maxTextureMemory = 0;	//<- The maximum texture memory
+static	float	lowWaterMark = 0.5f;	//<- Fraction of it kept on a flush
+static	miBoolean	mapTextures = miFALSE;	//<- mmap uncompressed tiles
+static	int	environmentPrefilter = 0; //<- Height of environment pyramids
+static	TTextureStorage	floatStorage = kTEXTURE_STORE_NATIVE;
+static	TShadowFilter	shadowFilter = kSHADOW_PCF;
+static	float	shadowExponent = 80.0f;	//<- Of exponential shadow maps
+
+// Stuff for the per thread tile caches
+//
+// Each thread keeps a small direct mapped cache of the tiles it looked
+// at last, so that a hit neither locks a shard nor writes to memory
+// other threads use.  The caches are only valid within an epoch:
+// every flush and every block deletion starts a new one, and paged
+// out data is freed only once all threads looking up textures have
+// moved past the epoch it was paged out in.  As the clock hand only
+// clears reference bits inside a flush, a tile marked referenced when
+// it entered a tile cache stays marked for the rest of the epoch, so
+// hits don't need to mark it again.
+static const int kTILE_CACHE_SIZE = 64;	//<- Must be a power of 2
+static const int kMAX_TEXTURE_THREADS = 256;
+
+struct CTileCacheEntry
+{
+     CTextureBlock  *block;
+     const void	    *data;
+};
+
+struct CTextureThread
+{
+     volatile miUint announced;		//<- Epoch of the current lookup, or 0
+     miUint	     cacheEpoch;	//<- Epoch the tile cache is valid in
+     miUint	     numRefs;		//<- References not added to Stats yet
+     miUint	     numHits;		//<- Tile cache hits not added to Stats
+     CTileCacheEntry cache[kTILE_CACHE_SIZE];
+     char	     pad[64];		//<- Keep threads off each other's lines
+};
+
+static	threadLocal	textureThreadKey;	//<- Each thread's CTextureThread
+static	CTextureThread	noTileCache;	//<- Threads we ran out of slots for
+static	CTextureThread	*textureThreads[kMAX_TEXTURE_THREADS];
+static	volatile miUint	numTextureThreads = 0;
+static	volatile miUint	textureEpoch = 1;	//<- 0 means "not looking up"
+
+// Stuff for tile prefetching
+//
+// When a lookup misses on a tile, the tiles around it and the tile
+// below it in the next mip level are queued in a bounded ring buffer.
+// A small pool of threads pages them in through the same block cache
+// the render threads use.  If the queue is full, requests are dropped.
+struct CPrefetchRequest
+{
+     CTextureBlock  *block;		//<- NULL if the request got cancelled
+     const char	    *name;
+     int	     directory;
+     int	     x,y,size;
+     TTextureStorage storage;		//<- How the tile is kept
+};
+
+static	CPrefetchRequest *prefetchQueue = NULL;	//<- Ring of pending requests
+static	int	prefetchQueueSize = 0;
+static	int	prefetchHead = 0;	//<- Oldest pending request
+static	int	prefetchCount = 0;	//<- Number of pending requests
+static	miLock	prefetchLock;		//<- Guards the queue
+static	semaphore	*prefetchReady = NULL;	//<- Posted once per request
+static	thread	*prefetchThreads = NULL;
+static	int	numPrefetchThreads = 0;
+static	CTextureBlock	**prefetchActive = NULL; //<- Block each thread is on
+static	miBoolean	prefetchQuit = miFALSE;
+static	threadLocal	prefetchThreadKey;	//<- Non NULL on prefetch threads
+
+// libtiff errors on the prefetch threads can't go to mental ray from
+// there, so they wait here for the next render thread looking up a
+// texture.  Messages past kPREFETCH_MESSAGES are only counted.
+static const int kPREFETCH_MESSAGES = 8;
+
+struct CPrefetchMessage
+{
+     miBoolean	     warning;
+     char	     text[256];
+};
+
+static	CPrefetchMessage prefetchMessages[kPREFETCH_MESSAGES];
+static	volatile int	numPrefetchMessages = 0; //<- Guarded by prefetchLock
+static	int	prefetchMessagesDropped = 0;
+
+// Stuff for the texture registry
+//
+// Everybody loading the same directory of the same file shares one
+// texture, and with it the tiles in the cache.  The registry counts the
+// references handed out by textureLoad and deletes a texture when the
+// last one is given back.  The registry lock is only held to look
+// entries up: a texture gets an entry marked as loading before its file
+// is read, outside the lock, and threads asking for the same texture
+// meanwhile wait on that entry.
+static const int kTEXTURE_REGISTRY_SIZE = 256;	//<- Must be a power of 2
+
+struct CTextureEntry
+{
+     char	    *fileName;		//<- The resolved file name
+     int	     directory;		//<- The first directory of the texture
+     CTexture	    *texture;		//<- NULL while loading
+     int	     refCount;
+     volatile miBoolean loading;	//<- Some thread is reading the file
+     CTextureEntry  *next;
+};
+
+static	CTextureEntry	*textureRegistry[kTEXTURE_REGISTRY_SIZE];
+static	miLock	registryLock;		//<- Guards the registry
+
+// Stuff for the TIFF handle pool
+//
+// Paging a tile in used to open its file and parse the directory every
+// time.  Handles are kept open in a pool instead, most recently used
+// first, and the next miss on the same file takes one from there.  The
+// pool shares a single limit with all the other files the texture code
+// opens; the least recently used idle handles get closed to stay in it.
+// Without a limit, at most kMAX_IDLE_HANDLES are kept.  Idle handles
+// are also hashed on their file name, so finding one doesn't walk the
+// whole pool.
+static const int kIDLE_HANDLE_BUCKETS = 64;	//<- Must be a power of 2
+static const int kMAX_IDLE_HANDLES = 64;
+
+struct CTiffHandle
+{
+     char	    *name;		//<- The file name
+     miUint	     hash;		//<- Of the file name
+     TIFF	    *in;
+     int	     directory;		//<- Current directory (-1 if unknown)
+     CTiffHandle    *prev,*next;	//<- Neighbours in the idle list
+     CTiffHandle    *bucketNext;	//<- Next in its idle bucket
+};
+
+static	CTiffHandle	*idleHandles = NULL;	//<- Most recently used first
+static	CTiffHandle	*idleHandlesTail = NULL; //<- Least recently used
+static	CTiffHandle	*idleBuckets[kIDLE_HANDLE_BUCKETS];
+static	int	numIdleHandles = 0;
+static	int	numOpenFiles = 0;	//<- Idle handles included
+static	int	maxOpenFiles = 64;	//<- 0 for no limit
+static	miLock	tiffPoolLock;		//<- Guards the pool
+
+// Stuff for the statistics
+//
+// Each layer counts its block cache traffic in a record that outlives
+// it, so the statistics written at the end of a render still break
+// things down per texture and mip level after the shaders released
+// their textures.  The layer records hang off a record of the texture
+// they were loaded for, which is hashed like the registry.  Layers get
+// made while their texture loads, and find their texture's record in
+// the loading thread's loadingRecordKey.  The usage pointers the layers
+// and blocks hold are their records.
+struct CLayerRecord : public TextureUsage
+{
+     char	    *name;		//<- The file name
+     int	     directory;
+     int	     width,height;
+     CLayerRecord   *next;		//<- The next layer of the texture
+};
+
+struct CTextureRecord
+{
+     char	    *name;		//<- The resolved file name
+     int	     directory;		//<- The first directory of the texture
+     CLayerRecord   *firstLayer;
+     CLayerRecord   *lastLayer;
+     CTextureRecord *next;		//<- In the order they first loaded
+     CTextureRecord *bucketNext;
+};
+
+static	CTextureRecord	*firstRecord = NULL;
+static	CTextureRecord	*lastRecord = NULL;
+static	CTextureRecord	*recordTable[kTEXTURE_REGISTRY_SIZE];
+static	threadLocal	loadingRecordKey;	//<- Of the texture loading
+static	miLock	recordsLock;		//<- Guards the records
+static	char	*statsFileName = NULL;	//<- Written at textureShutdown
+
+// Stuff for the tile trace
+//
+// With TextureCacheOptions::traceFile set, blocks count the lookups
+// that touch them, and each shard logs when its blocks get read,
+// expanded from the compressed tier or paged out, along with how
+// often the block was looked at so far.  Deleting a block logs its
+// final count.  The log is kept in chunks under the shard lock and
+// written, in time order, by textureShutdown.  Mapped layers don't go
+// through blocks, so they don't show up in the trace.
+enum TTraceEvent
+{
+kTRACE_LOAD,
+kTRACE_UNPACK,
+kTRACE_EVICT,
+kTRACE_TILE
+};
+
+static const char* const traceEventNames[] = {
+"load", "unpack", "evict", "tile"
+};
+
+struct CTraceEvent
+{
+     double	     time;		//<- Seconds since textureInit
+     TextureUsage   *usage;		//<- The layer of the block
+     int	     tileX,tileY;
+     miUint	     accesses;
+     int	     kind;		//<- A TTraceEvent
+};
+
+static const int kTRACE_CHUNK_SIZE = 1024;
+
+struct CTraceChunk
+{
+     CTraceEvent     events[kTRACE_CHUNK_SIZE];
+     int	     numEvents;
+     CTraceChunk    *next;
+};
+
+static	miBoolean	traceTiles = miFALSE;
+static	char	*traceFileName = NULL;	//<- Written at textureShutdown
+static	double	traceStart = 0;
 
 const	float	inv255 = 1.0f / 255.0f;
 
@@ -118,213 +427,1098 @@ const char* const RI_BLACK	 = "black";
 
 
 ///////////////////////////////////////////////////////////////////////
-// Function  :	textureQuickSort
-// Description 	:	Sort the textures in the order of increasing last ref number
-static	void	textureQuickSort(CTextureBlock **activeBlocks,
-				 int start,int end)
+// Function  :	textureSafeEpoch
+// Description 	:	Find the oldest epoch a thread is looking up in
+// Return Value 	:	Data paged out in this epoch or before can go
+static miUint	textureSafeEpoch()
+{
+   miUint	safe = ~0U,a;
+   int  	i,n = numTextureThreads;
+
+   memoryBarrier();
+   for (i=0;i<n;i++)
+   {
+      a = textureThreads[i]->announced;
+      if ((a != 0) && (a < safe))	safe = a;
+   }
+   return safe;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureRetireData
+// Description 	:	Free paged out data, or queue it if a tile cache
+//			may still point at it
+// Comments  :	The shard must be locked
+static void	textureRetireData(CTextureShard *shard,void *data,
+				  miUint epoch)
 {
-   int  pivot = (rand() % (end - start)) + start;
-   int  i,last;
-   CTextureBlock* cBlock;
+   CRetiredData	*r;
+
+   if (numTextureThreads == 0)
+   {
+      delete [] (unsigned char *) data;
+      return;
+   }
+
+   r = new CRetiredData;
+   r->data  = data;
+   r->epoch = epoch;
+   r->next  = shard->retired;
+   shard->retired = r;
+}
 
-   cBlock  = activeBlocks[start];
-   activeBlocks[start] = activeBlocks[pivot];
-   activeBlocks[pivot] = cBlock;
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureReclaim
+// Description 	:	Free the retired data no thread can see anymore
+// Comments  :	The shard must be locked
+static void	textureReclaim(CTextureShard *shard)
+{
+   CRetiredData	*r,**p;
+   miUint	safe = textureSafeEpoch();
 
-   for (last=start,i=start+1;i<=end;i++) {
-      if (activeBlocks[i]->lastRefNumber < activeBlocks[last]->lastRefNumber)
+   for (p=&shard->retired;(r = *p) != NULL;)
+   {
+      if (r->epoch <= safe)
+      {
+	 *p = r->next;
+	 delete [] (unsigned char *) r->data;
+	 delete r;
+      }
+      else
       {
-	 cBlock   = activeBlocks[i];
-	 activeBlocks[i]  = activeBlocks[last];
-	 activeBlocks[last++] = cBlock;
+	 p = &r->next;
       }
    }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureTraceTime
+// Description 	:	Wall clock time in seconds
+static double	textureTraceTime()
+{
+#ifdef WIN32
+   LARGE_INTEGER	count,frequency;
+   QueryPerformanceCounter(&count);
+   QueryPerformanceFrequency(&frequency);
+   return (double) count.QuadPart / (double) frequency.QuadPart;
+#else
+   struct timeval	tv;
+   gettimeofday(&tv,NULL);
+   return tv.tv_sec + tv.tv_usec*1e-6;
+#endif
+}
 
-   cBlock  = activeBlocks[last];
-   activeBlocks[last] = activeBlocks[start];
-   activeBlocks[start] = cBlock;
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureTrace
+// Description 	:	Log something that happened to a block
+// Comments  :	The shard must be locked
+static void	textureTrace(CTextureShard *shard,CTextureBlock *entry,
+			     TTraceEvent kind)
+{
+   CTraceChunk	*c = shard->trace;
+   CTraceEvent	*e;
 
-   if ((last-1) > start)
-      textureQuickSort(activeBlocks,start,last-1);
+   if ((c == NULL) || (c->numEvents == kTRACE_CHUNK_SIZE))
+   {
+      c = new CTraceChunk;
+      c->numEvents = 0;
+      c->next = shard->trace;
+      shard->trace = c;
+   }
 
-   if (end > (last+1))
-      textureQuickSort(activeBlocks,last+1,end);
+   e = c->events + c->numEvents++;
+   e->time     = textureTraceTime() - traceStart;
+   e->usage    = entry->usage;
+   e->tileX    = entry->tileX;
+   e->tileY    = entry->tileY;
+   e->accesses = entry->accesses;
+   e->kind     = kind;
 }
 
 ///////////////////////////////////////////////////////////////////////
-// Function  :	textureMemFlush
-// Description 	:	Try to deallocate some textures from memory
-static int textureMemFlush(CTextureBlock *entry) {
-   int  i,j;
-   CTextureBlock	*cBlock;
-   CTextureBlock	**activeBlocks;
-   int  flushed = miFALSE;
-   
-   Stats->textureFlushes++;
-   
-   if (usedBlocks == NULL)	return miFALSE;
+// Function  :	textureYield
+// Description 	:	Give the cpu away while another thread pages in
+//			the block we are waiting for
+static inline void textureYield()
+{
+#ifdef WIN32
+   SwitchToThread();
+#else
+   sched_yield();
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureMessage
+// Description 	:	Report a libtiff error or warning
+// Comments  :	On the prefetch threads the message is queued for
+//		textureReportMessages instead
+static void	textureMessage(miBoolean warning,const char *fmt,va_list ap)
+{
+   char	text[256];
 
-   for (cBlock=usedBlocks,i=0;cBlock!=NULL;cBlock=cBlock->next)
+   vsnprintf(text,sizeof(text),fmt,ap);
+   text[sizeof(text)-1] = '\0';
+
+   if (prefetchThreadKey.get() == NULL)
    {
-      if (cBlock->data != NULL) {
-	 i++;
-      }
+      if (warning)	mi_warning("%s",text);
+      else		mi_error("%s",text);
+      return;
+   }
+
+   mi_lock(prefetchLock);
+   if (numPrefetchMessages < kPREFETCH_MESSAGES)
+   {
+      CPrefetchMessage	*m = prefetchMessages + numPrefetchMessages;
+      m->warning = warning;
+      strcpy(m->text,text);
+      numPrefetchMessages++;
+   }
+   else
+   {
+      prefetchMessagesDropped++;
    }
+   mi_unlock(prefetchLock);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureError
+// Description 	:	Report an error of ours the way libtiff's get
+//			reported
+static void	textureError(const char *fmt,...)
+{
+   va_list	ap;
 
-//     activeBlocks = (CTextureBlock **) ralloc(i*sizeof(CTextureBlock *));
-   activeBlocks = (CTextureBlock **) mi_mem_allocate(i*sizeof(CTextureBlock *));
+   va_start(ap,fmt);
+   textureMessage(miFALSE,fmt,ap);
+   va_end(ap);
+}
 
-   for (cBlock=usedBlocks,i=0;cBlock!=NULL;cBlock=cBlock->next)
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureReportMessages
+// Description 	:	Hand the messages queued by the prefetch threads
+//			to mental ray
+// Comments  :	Must be called from a mental ray thread
+static void	textureReportMessages()
+{
+   CPrefetchMessage	messages[kPREFETCH_MESSAGES];
+   int	i,n,dropped;
+
+   mi_lock(prefetchLock);
+   n = numPrefetchMessages;
+   dropped = prefetchMessagesDropped;
+   memcpy(messages,prefetchMessages,n*sizeof(CPrefetchMessage));
+   numPrefetchMessages = 0;
+   prefetchMessagesDropped = 0;
+   mi_unlock(prefetchLock);
+
+   for (i=0;i<n;i++)
    {
-      if (cBlock->data != NULL)
-      {
-	 if (cBlock != entry)
-	 {
-	    activeBlocks[i++] = cBlock;
-	 }
-      }
+      if (messages[i].warning)	mi_warning("%s",messages[i].text);
+      else			mi_error("%s",messages[i].text);
    }
+   if (dropped > 0)
+      mi_warning("%d more texture prefetch messages not shown",dropped);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureClockInsert
+// Description 	:	Add a block that just became resident to the
+//			clock of its shard
+// Comments  :	The shard must be locked.  The block goes right behind
+//		the hand, so it is the last one the hand gets to.
+static inline void textureClockInsert(CTextureShard *shard,
+				      CTextureBlock *entry)
+{
+   CTextureBlock	*hand = shard->clockHand;
 
-   if (i > 1)
-      textureQuickSort(activeBlocks,0,i-1);
+   entry->referenced = miTRUE;
 
-   for (j=0;(j<i) && (usedTextureMemory > (maxTextureMemory/2));j++)
+   if (hand == NULL)
    {
-      cBlock = activeBlocks[j];
+      entry->clockNext = entry->clockPrev = entry;
+      shard->clockHand = entry;
+      return;
+   }
 
-      Stats->textureSize   -= cBlock->size;
-      usedTextureMemory	   -= cBlock->size;
-      delete [] (unsigned char *) cBlock->data;
-      cBlock->data = NULL;
+   entry->clockNext = hand;
+   entry->clockPrev = hand->clockPrev;
+   hand->clockPrev->clockNext = entry;
+   hand->clockPrev = entry;
+}
 
-      flushed = miTRUE;
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureClockRemove
+// Description 	:	Take a block off the clock of its shard
+// Comments  :	The shard must be locked
+static inline void textureClockRemove(CTextureShard *shard,
+				      CTextureBlock *entry)
+{
+   if (entry->clockNext == entry)
+   {
+      shard->clockHand = NULL;
    }
+   else
+   {
+      if (shard->clockHand == entry)
+	 shard->clockHand = entry->clockNext;
+      entry->clockPrev->clockNext = entry->clockNext;
+      entry->clockNext->clockPrev = entry->clockPrev;
+   }
+   entry->clockNext = entry->clockPrev = NULL;
+}
 
-   mi_mem_release( activeBlocks );
+// Stuff for the compressed tier
+//
+// Blocks a flush pages out are kept compressed in memory, within a
+// budget of their own, so that missing on one of them again costs a
+// decompression instead of a read and a decode.  The codec is a byte
+// oriented LZ77 in the spirit of LZ4: a token holds the number of
+// literals in its high nibble and the match length minus 4 in its
+// low one (15 meaning more length bytes follow), then come the
+// literals and a 2 byte offset.  The last kPACK_LAST_LITERALS bytes
+// are always literals, which ends the data.  Blocks whose size is a
+// multiple of 4 are shuffled first, grouping the bytes of the texels
+// by their position in the word, so the slowly changing high bytes
+// of floats end up next to each other.
+static const int	kPACK_HASH_BITS = 12;
+static const int	kPACK_MIN_MATCH = 4;
+static const int	kPACK_LAST_LITERALS = 5;
+static const int	kPACK_MAX_OFFSET = 65535;
+
+static inline miUint	packRead32(const unsigned char *p)
+{
+   miUint	v;
+   memcpy(&v,p,sizeof(v));
+   return v;
+}
 
-   return flushed;
+static inline int	packPutLength(unsigned char *op,int len)
+{
+   int	n = 0;
+   for (;len >= 255;len -= 255) op[n++] = 255;
+   op[n++] = (unsigned char) len;
+   return n;
 }
 
 ///////////////////////////////////////////////////////////////////////
-// Function  :	textureLoadBlock
-// Description 	:	Read a block of texture from disk
-// Return Value 	:	Pointer to the new texture
-static void	textureAllocateBlock(CTextureBlock *entry)
+// Function  :	textureShuffle / textureUnshuffle
+// Description 	:	Regroup the bytes of a block by their position
+//			in 32 bit words, and back
+static void	textureShuffle(unsigned char *dst,const unsigned char *src,
+			       int size)
 {
-   Stats->textureSize  += entry->size;
-   
-   Stats->transferredTextureData += entry->size;
-   usedTextureMemory  += entry->size;
+   int	i,n = size >> 2;
 
-   entry->data   = new unsigned char[entry->size];
+   if (size & 3)
+   {
+      memcpy(dst,src,size);
+      return;
+   }
 
-   // If we exceeded the maximum texture memory, phase out the last texture
-   if (usedTextureMemory > maxTextureMemory)
-      textureMemFlush(entry);
-   
-   if (Stats->textureSize > Stats->peakTextureSize)
-      Stats->peakTextureSize = Stats->textureSize;
+   for (i=0;i<n;i++,src+=4)
+   {
+      dst[i]     = src[0];
+      dst[i+n]   = src[1];
+      dst[i+2*n] = src[2];
+      dst[i+3*n] = src[3];
+   }
 }
 
-///////////////////////////////////////////////////////////////////////
-// Function  :	textureLoadBlock
-// Description 	:	Read a block of texture from disk
-// Return Value 	:	Pointer to the new texture
-static void	textureLoadBlock(CTextureBlock *entry,char *name,
-				 int x,int y,int w,int h,int dir)
+static void	textureUnshuffle(unsigned char *dst,const unsigned char *src,
+				 int size)
 {
-   void 	*data = NULL;
-   TIFF 	*in;
+   int	i,n = size >> 2;
 
-   // Update the state
-   Stats->numTextureMisses++;
+   if (size & 3)
+   {
+      memcpy(dst,src,size);
+      return;
+   }
 
-   // Set the error handler so we don't crash
-   TIFFSetErrorHandler(tiffErrorHandler);
-   TIFFSetWarningHandler(tiffWarningHandler);
-     
-   in = TIFFOpen(name,"r");
+   for (i=0;i<n;i++,dst+=4)
+   {
+      dst[0] = src[i];
+      dst[1] = src[i+n];
+      dst[2] = src[i+2*n];
+      dst[3] = src[i+3*n];
+   }
+}
 
-   if (in != NULL)
-   { // Error, we opened this file before
-      // The stupid user must have deleted the 
-      // file or unmounted the drive while in progress
-      uint32	width,height;
-      uint16	numSamples;
-      int pixelSize;
-      int i;
-      uint16	bitspersample;
-      int tiled = TIFFIsTiled(in);
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureCompress
+// Description 	:	Compress size bytes of src into dst
+// Return Value :	The compressed size, 0 if it doesn't fit in cap
+// Comments  :	Matches are looked up in a hash table of the positions
+//		of the last 4 byte sequences.  The longer the run of
+//		literals, the bigger the steps, so data that doesn't
+//		compress is given up on quickly.
+static int	textureCompress(unsigned char *dst,int cap,
+				const unsigned char *src,int size)
+{
+   int	table[1 << kPACK_HASH_BITS];
+   int	ip = 1,anchor = 0,op = 0;
+   int	ref,len,lit,h,i;
+   miUint	seq;
+   unsigned char	*token;
 
-      TIFFSetDirectory(in,dir);
+   if (size < kPACK_MIN_MATCH + kPACK_LAST_LITERALS)
+      ip = size;		// Too small, all literals
 
-      // Get the texture properties
-      TIFFGetFieldDefaulted(in,TIFFTAG_IMAGEWIDTH,      &width);
-      TIFFGetFieldDefaulted(in,TIFFTAG_IMAGELENGTH,     &height);
-      TIFFGetFieldDefaulted(in,TIFFTAG_SAMPLESPERPIXEL, &numSamples);
-      TIFFGetFieldDefaulted(in,TIFFTAG_BITSPERSAMPLE,   &bitspersample);
+   for (i=0;i<(1 << kPACK_HASH_BITS);i++)	table[i] = -1;
 
-      if (bitspersample == 8) {
-	 pixelSize = numSamples*sizeof(unsigned char);
-      } else {
-	 pixelSize = numSamples*sizeof(float);
+   while (ip + kPACK_MIN_MATCH + kPACK_LAST_LITERALS <= size)
+   {
+      seq = packRead32(src + ip);
+      h   = (int) ((seq*2654435761U) >> (32 - kPACK_HASH_BITS));
+      ref = table[h];
+      table[h] = ip;
+
+      if ((ref < 0) || (ip - ref > kPACK_MAX_OFFSET) ||
+	  (packRead32(src + ref) != seq))
+      {
+	 ip += 1 + ((ip - anchor) >> 6);
+	 continue;
       }
 
-      // Allocate space for the texture
-      textureAllocateBlock(entry); 
-      data = (unsigned char *) entry->data;
+      // Extend the match both ways
+      len = kPACK_MIN_MATCH;
+      while ((ip + len < size - kPACK_LAST_LITERALS) &&
+	     (src[ref + len] == src[ip + len]))	len++;
+      while ((ip > anchor) && (ref > 0) && (src[ip-1] == src[ref-1]))
+      {
+	 ip--;
+	 ref--;
+	 len++;
+      }
 
-      // Do we need to read the entire texture ?
-      if ((x != 0) || (y != 0) || (w != (int) width) || (h != (int) height)) {
-	 // No , is the file tiled ?
-	 if (!tiled) {
-	    // No, read the required portion
-	    unsigned char	*tdata;
+      lit = ip - anchor;
+      if (op + 1 + lit/255 + 1 + lit + 2 +
+	  (len - kPACK_MIN_MATCH)/255 + 1 > cap)	return 0;
 
-//  	    tdata = (unsigned char *) ralloc(width*height*pixelSize);
-	    tdata = (unsigned char *) mi_mem_allocate(width*height*pixelSize);
+      token = dst + op++;
+      if (lit >= 15)
+      {
+	 *token = 15 << 4;
+	 op += packPutLength(dst + op,lit - 15);
+      }
+      else
+	 *token = (unsigned char) (lit << 4);
+      memcpy(dst + op,src + anchor,lit);
+      op += lit;
 
-	    // Read the entire image
-	    mrASSERT((int) (pixelSize*width) == TIFFScanlineSize(in));
-	    for (i=0;i<(int) height;i++) {
-	       TIFFReadScanline(in,&tdata[pixelSize*i*width],i,0);
-	       if (i >= (y+h))	break;	// If we read the last required scanline, break
-	    }
+      dst[op++] = (unsigned char) ((ip - ref) & 0xff);
+      dst[op++] = (unsigned char) ((ip - ref) >> 8);
 
-	    for (i=0;i<h;i++) {
-	       memcpy(&((unsigned char *) data)[i*pixelSize*w],
-		      &tdata[((y+i)*width + x)*pixelSize],
-		      w*pixelSize);
-	    }
+      len -= kPACK_MIN_MATCH;
+      if (len >= 15)
+      {
+	 *token |= 15;
+	 op += packPutLength(dst + op,len - 15);
+      }
+      else
+	 *token |= (unsigned char) len;
 
-	    mi_mem_release(tdata);
-	    
-	 } else {
-	    uint32	tileWidth,tileHeight;
+      ip += len + kPACK_MIN_MATCH;
+      anchor = ip;
+   }
 
-	    TIFFGetFieldDefaulted(in,TIFFTAG_TILEWIDTH , &tileWidth);
-	    TIFFGetFieldDefaulted(in,TIFFTAG_TILELENGTH, &tileHeight);
-	    mrASSERT(tileWidth == (uint32) w);
-	    mrASSERT(tileHeight == (uint32) h);
-	    mrASSERT((x % tileWidth) == 0);
-	    mrASSERT((y % tileHeight) == 0);
+   // The rest goes out as literals
+   lit = size - anchor;
+   if (op + 1 + lit/255 + 1 + lit > cap)	return 0;
 
-	    int	k = TIFFReadTile(in,data,x,y,0,0);
-	 }
-      } else {
-	 if (tiled) {
-	    uint32	tileWidth,tileHeight;
+   token = dst + op++;
+   if (lit >= 15)
+   {
+      *token = 15 << 4;
+      op += packPutLength(dst + op,lit - 15);
+   }
+   else
+      *token = (unsigned char) (lit << 4);
+   memcpy(dst + op,src + anchor,lit);
+   op += lit;
 
-	    TIFFGetFieldDefaulted(in,TIFFTAG_TILEWIDTH , &tileWidth);
-	    TIFFGetFieldDefaulted(in,TIFFTAG_TILELENGTH, &tileHeight);
+   return op;
+}
 
-	    if ((x != 0) || (y != 0) || (w != (int) tileWidth) ||
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureDecompress
+// Description 	:	Expand what textureCompress made
+// Return Value :	miTRUE if it expanded to exactly size bytes
+// Comments  :	Every length and offset is checked, so data that got
+//		damaged can't write or read out of the buffers
+static miBoolean	textureDecompress(unsigned char *dst,int size,
+					  const unsigned char *src,int srcSize)
+{
+   const unsigned char	*ip = src,*iend = src + srcSize;
+   unsigned char	*op = dst,*oend = dst + size;
+   const unsigned char	*ref;
+   int	token,len,off,b;
+
+   while (ip < iend)
+   {
+      token = *ip++;
+
+      len = token >> 4;
+      if (len == 15)
+      {
+	 do
+	 {
+	    if (ip >= iend)	return miFALSE;
+	    b = *ip++;
+	    len += b;
+	 } while (b == 255);
+      }
+      if ((len > iend - ip) || (len > oend - op))	return miFALSE;
+      memcpy(op,ip,len);
+      op += len;
+      ip += len;
+
+      if (ip == iend)	break;		// The last literals
+
+      if (iend - ip < 2)	return miFALSE;
+      off = ip[0] | (ip[1] << 8);
+      ip += 2;
+      if ((off == 0) || (off > op - dst))	return miFALSE;
+
+      len = token & 15;
+      if (len == 15)
+      {
+	 do
+	 {
+	    if (ip >= iend)	return miFALSE;
+	    b = *ip++;
+	    len += b;
+	 } while (b == 255);
+      }
+      len += kPACK_MIN_MATCH;
+      if (len > oend - op)	return miFALSE;
+
+      ref = op - off;
+      if (off >= len)
+      {
+	 memcpy(op,ref,len);
+	 op += len;
+      }
+      else
+      {
+	 // Overlapping, the match repeats what it just wrote
+	 while (len-- > 0)	*op++ = *ref++;
+      }
+   }
+
+   return (op == oend) ? miTRUE : miFALSE;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureUnlinkPacked
+// Description 	:	Take a block off the compressed tier, leaving
+//			its packed data to the caller
+// Comments  :	The shard must be locked
+static void	textureUnlinkPacked(CTextureShard *shard,CTextureBlock *entry)
+{
+   if (entry->packedPrev != NULL)
+      entry->packedPrev->packedNext = entry->packedNext;
+   else
+      shard->packedHead = entry->packedNext;
+   if (entry->packedNext != NULL)
+      entry->packedNext->packedPrev = entry->packedPrev;
+   else
+      shard->packedTail = entry->packedPrev;
+
+   shard->packedMemory -= entry->packedSize;
+   atomicAdd(&Stats->compressedSize,(miUlong) 0 - entry->packedSize);
+   atomicAdd(&Stats->compressedData,(miUlong) 0 - entry->size);
+
+   entry->packed     = NULL;
+   entry->packedSize = 0;
+   entry->packedPrev = entry->packedNext = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureDropPacked
+// Description 	:	Take a block off the compressed tier and free
+//			its packed data
+// Comments  :	The shard must be locked
+static inline void	textureDropPacked(CTextureShard *shard,
+					  CTextureBlock *entry)
+{
+   void	*packed = entry->packed;
+
+   textureUnlinkPacked(shard,entry);
+   delete [] (unsigned char *) packed;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	texturePackData
+// Description 	:	Compress the data of a block that was paged out
+// Comments  :	Runs with no lock held.  Data that doesn't compress
+//		is kept as is (packedSize == size), which still saves
+//		the read.
+static void	texturePackData(CPackJob *job)
+{
+   unsigned char	*tmp;
+   int	size = job->size;
+
+   tmp = new unsigned char[2*size];
+   textureShuffle(tmp,(const unsigned char *) job->data,size);
+   job->packedSize = textureCompress(tmp + size,size - 1,tmp,size);
+   if (job->packedSize > 0)
+   {
+      job->packed = new unsigned char[job->packedSize];
+      memcpy(job->packed,tmp + size,job->packedSize);
+   }
+   else
+   {
+      job->packedSize = size;
+      job->packed = new unsigned char[size];
+      memcpy(job->packed,job->data,size);
+   }
+   delete [] tmp;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureStorePacked
+// Description 	:	Put compressed data on the compressed tier
+// Comments  :	The shard must be locked.  The data is thrown away if
+//		the block was read again, paged out again or deleted
+//		while it was being compressed.  The oldest blocks of the
+//		tier make room.
+static void	textureStorePacked(CTextureShard *shard,CPackJob *job)
+{
+   CTextureBlock	*entry = job->entry;
+
+   if ((entry->packTicket != job->ticket) || (entry->data != NULL) ||
+       (entry->loading) || (entry->packed != NULL))
+   {
+      delete [] job->packed;
+      return;
+   }
+   entry->packTicket = 0;
+
+   while ((shard->packedTail != NULL) &&
+	  (shard->packedMemory + job->packedSize > shard->maxPackedMemory))
+   {
+      textureDropPacked(shard,shard->packedTail);
+      atomicAdd(&Stats->compressedDropped,(miUlong) 1);
+   }
+
+   entry->packed     = job->packed;
+   entry->packedSize = job->packedSize;
+   entry->packedPrev = NULL;
+   entry->packedNext = shard->packedHead;
+   if (shard->packedHead != NULL)
+      shard->packedHead->packedPrev = entry;
+   else
+      shard->packedTail = entry;
+   shard->packedHead = entry;
+
+   shard->packedMemory += job->packedSize;
+   atomicAdd(&Stats->compressedSize,(miUlong) job->packedSize);
+   atomicAdd(&Stats->compressedData,(miUlong) job->size);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	texturePackBlocks
+// Description 	:	Compress the blocks a flush paged out and put
+//			them on the compressed tier
+// Comments  :	The shard must be locked.  It is unlocked while the
+//		blocks are compressed, and locked again on return.
+//		Blocks looked up in the meantime are read from disk.
+static void	texturePackBlocks(CTextureShard *shard,CPackJob *jobs)
+{
+   CPackJob	*job;
+
+   mi_unlock(shard->lock);
+   for (job=jobs;job != NULL;job=job->next)
+      texturePackData(job);
+   mi_lock(shard->lock);
+
+   while ((job = jobs) != NULL)
+   {
+      jobs = job->next;
+      textureStorePacked(shard,job);
+      textureRetireData(shard,job->data,job->epoch);
+      delete job;
+   }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureUnpackBlock
+// Description 	:	Expand the packed data of a block
+// Return Value :	The block data, NULL if it didn't expand right
+static void	*textureUnpackBlock(CTextureBlock *entry,
+				    const unsigned char *packed,int packedSize)
+{
+   unsigned char	*data = new unsigned char[entry->size];
+   unsigned char	*tmp;
+
+   if (packedSize == entry->size)
+   {
+      memcpy(data,packed,packedSize);
+      return data;
+   }
+
+   tmp = new unsigned char[entry->size];
+   if (textureDecompress(tmp,entry->size,packed,packedSize) == miFALSE)
+   {
+      delete [] tmp;
+      delete [] data;
+      return NULL;
+   }
+   textureUnshuffle(data,tmp,entry->size);
+   delete [] tmp;
+
+   return data;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureMemFlush
+// Description 	:	Try to deallocate some textures from memory
+// Comments  :	The shard must be locked.
+//		This is a CLOCK (second chance) sweep: the hand goes
+//		around the resident blocks, giving referenced blocks a
+//		second chance and paging out the first unreferenced ones
+//		until the shard is back under its low water mark.  Each
+//		block looked at costs O(1), and nothing gets sorted.
+//		Paged out blocks meant for the compressed tier are only
+//		queued on jobs; see texturePackBlocks.
+static int textureMemFlush(CTextureShard *shard,CTextureBlock *entry,
+			   CPackJob **jobs) {
+   CTextureBlock	*cBlock;
+   CPackJob	*job;
+   int  flushed = miFALSE;
+   miUint	epoch;
+   
+   atomicAdd(&Stats->textureFlushes,(miUlong) 1);
+
+   // Invalidate the tile caches before touching any reference bit
+   epoch = atomicAdd(&textureEpoch,1);
+
+   while ( shard->usedTextureMemory > shard->lowTextureMemory )
+   {
+      cBlock = shard->clockHand;
+      if (cBlock == NULL)	break;
+
+      if (cBlock == entry)
+      {
+	 // Never page out the block we are making room for
+	 if (cBlock->clockNext == cBlock)	break;
+	 shard->clockHand = cBlock->clockNext;
+	 continue;
+      }
+
+      if (cBlock->referenced)
+      {
+	 cBlock->referenced = miFALSE;
+	 shard->clockHand   = cBlock->clockNext;
+	 continue;
+      }
+
+      textureClockRemove(shard,cBlock);
+
+      if (cBlock->prefetched)
+      {
+	 atomicAdd(&Stats->prefetchMisses,(miUlong) 1);
+	 cBlock->prefetched = miFALSE;
+      }
+
+      atomicAdd(&Stats->textureSize,(miUlong) 0 - cBlock->size);
+      shard->usedTextureMemory -= cBlock->size;
+      if (traceTiles)	textureTrace(shard,cBlock,kTRACE_EVICT);
+      if ((cBlock->size > 0) &&
+	  ((miUint) cBlock->size <= shard->maxPackedMemory))
+      {
+	 if (++shard->packTickets == 0)	++shard->packTickets;
+	 cBlock->packTicket = shard->packTickets;
+
+	 job = new CPackJob;
+	 job->entry  = cBlock;
+	 job->data   = cBlock->data;
+	 job->size   = cBlock->size;
+	 job->ticket = cBlock->packTicket;
+	 job->epoch  = epoch;
+	 job->packed = NULL;
+	 job->packedSize = 0;
+	 job->next   = *jobs;
+	 *jobs = job;
+      }
+      else
+      {
+	 textureRetireData(shard,cBlock->data,epoch);
+      }
+      cBlock->data = NULL;
+
+      flushed = miTRUE;
+   }
+
+   return flushed;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureInstallBlock
+// Description 	:	Make a block that was just read resident
+// Return Value :	The blocks paged out to make room that still have
+//			to be compressed (see texturePackBlocks)
+// Comments  :	The shard must be locked.  Blocks that came from the
+//		compressed tier rather than the disk (fromDisk is
+//		miFALSE) don't count as transferred.
+static CPackJob	*textureInstallBlock(CTextureShard *shard,
+				     CTextureBlock *entry,
+				     void *data,miBoolean fromDisk)
+{
+   CPackJob	*jobs = NULL;
+   miUlong	size = entry->size;
+
+   atomicMax(&Stats->peakTextureSize,
+	     atomicAdd(&Stats->textureSize,size));
+   shard->usedTextureMemory  += entry->size;
+
+   if (fromDisk == miFALSE)
+   {
+      atomicAdd(&Stats->numCompressedHits,(miUlong) 1);
+   }
+   else
+   {
+      atomicAdd(&Stats->transferredTextureData,size);
+   }
+
+   if (entry->usage != NULL)
+   {
+      atomicAdd(&entry->usage->numMisses,(miUlong) 1);
+      if (fromDisk)
+	 atomicAdd(&entry->usage->transferredData,size);
+      if (entry->loadedOnce == miFALSE)
+	 atomicAdd(&entry->usage->workingSetData,size);
+   }
+   entry->loadedOnce = miTRUE;
+
+   if (traceTiles)
+      textureTrace(shard,entry,fromDisk ? kTRACE_LOAD : kTRACE_UNPACK);
+
+   entry->data   = data;
+   textureClockInsert(shard,entry);
+
+   if (shard->retired != NULL)
+      textureReclaim(shard);
+
+   // If we exceeded the maximum texture memory, phase out the last texture
+   if (shard->usedTextureMemory > shard->maxTextureMemory)
+      textureMemFlush(shard,entry,&jobs);
+
+   return jobs;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureHandleHash
+// Description 	:	Hash the file name of a handle
+static miUint	textureHandleHash(const char *name)
+{
+   miUint	h = 5381;
+
+   for (;*name != '\0';name++)
+      h = h*33 + (unsigned char) *name;
+
+   return h;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureUnlinkHandle
+// Description 	:	Take a handle off the idle list
+// Comments  :	Called with the pool lock held
+static void	textureUnlinkHandle(CTiffHandle *handle)
+{
+   CTiffHandle	**link;
+
+   if (handle->prev != NULL)	handle->prev->next = handle->next;
+   else 	idleHandles = handle->next;
+   if (handle->next != NULL)	handle->next->prev = handle->prev;
+   else 	idleHandlesTail = handle->prev;
+   handle->prev = handle->next = NULL;
+
+   link = idleBuckets + (handle->hash & (kIDLE_HANDLE_BUCKETS-1));
+   while (*link != handle)	link = &(*link)->bucketNext;
+   *link = handle->bucketNext;
+   handle->bucketNext = NULL;
+
+   numIdleHandles--;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureFreeHandle
+// Description 	:	Close the file of a handle and delete it
+// Comments  :	Does not change the count of open files
+static void	textureFreeHandle(CTiffHandle *handle)
+{
+   TIFFClose(handle->in);
+   free(handle->name);
+   delete handle;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureAcquireDescriptor
+// Description 	:	Account for a file about to be opened
+// Comments  :	If the maximum number of files are open, the least
+//		recently used idle handle is closed to make room, or
+//		we wait for one to become idle.  A thread holds at most
+//		two files at once: a load maps levels of the TIFF it has
+//		open.  The second one is only open for the mmap call and
+//		doesn't wait (wait = miFALSE), going over the limit for
+//		that long instead, or loads running side by side could
+//		wait on each other's files forever.
+static void	textureAcquireDescriptor(miBoolean wait = miTRUE)
+{
+   CTiffHandle	*victim;
+
+   for (;;) {
+      victim = NULL;
+
+      mi_lock(tiffPoolLock);
+      if ((maxOpenFiles == 0) || (numOpenFiles < maxOpenFiles)) {
+	 numOpenFiles++;
+	 Stats->numFileDescriptors = numOpenFiles;
+      } else if ((victim = idleHandlesTail) != NULL) {
+	 // Take its place
+	 textureUnlinkHandle(victim);
+      } else if (wait == miFALSE) {
+	 numOpenFiles++;
+	 Stats->numFileDescriptors = numOpenFiles;
+      } else {
+	 mi_unlock(tiffPoolLock);
+	 textureYield();
+	 continue;
+      }
+      mi_unlock(tiffPoolLock);
+      break;
+   }
+
+   if (victim != NULL)	textureFreeHandle(victim);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureReleaseDescriptor
+// Description 	:	Account for a file that got closed
+static void	textureReleaseDescriptor()
+{
+   mi_lock(tiffPoolLock);
+   numOpenFiles--;
+   Stats->numFileDescriptors = numOpenFiles;
+   mi_unlock(tiffPoolLock);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureOpenTIFF
+// Description 	:	Get a handle to a TIFF file for reading, from the
+//			pool if it has one
+// Return Value 	:	The handle or NULL if the file can't be opened
+static CTiffHandle	*textureOpenTIFF(const char *name)
+{
+   CTiffHandle	*handle;
+   TIFF 	*in;
+   miUint	hash = textureHandleHash(name);
+
+   mi_lock(tiffPoolLock);
+   handle = idleBuckets[hash & (kIDLE_HANDLE_BUCKETS-1)];
+   for (;handle!=NULL;handle=handle->bucketNext)
+      if ((handle->hash == hash) && (strcmp(handle->name,name) == 0))
+	 break;
+   if (handle != NULL) {
+      textureUnlinkHandle(handle);
+      Stats->numFileReuses++;
+   }
+   mi_unlock(tiffPoolLock);
+
+   if (handle != NULL)	return handle;
+
+   // Set the error handler so we don't crash
+   TIFFSetErrorHandler(tiffErrorHandler);
+   TIFFSetWarningHandler(tiffWarningHandler);
+
+   textureAcquireDescriptor();
+   in = TIFFOpen(name,"r");
+   if (in == NULL) {
+      textureReleaseDescriptor();
+      return NULL;
+   }
+
+   handle  = new CTiffHandle;
+   handle->name  = strdup(name);
+   handle->hash  = hash;
+   handle->in  = in;
+   handle->directory = 0;
+   handle->prev  = NULL;
+   handle->next  = NULL;
+   handle->bucketNext = NULL;
+
+   return handle;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureCloseTIFF
+// Description 	:	Give a handle from textureOpenTIFF back to the pool
+static void	textureCloseTIFF(CTiffHandle *handle)
+{
+   CTiffHandle	**bucket = idleBuckets +
+			   (handle->hash & (kIDLE_HANDLE_BUCKETS-1));
+   CTiffHandle	*victim = NULL;
+
+   mi_lock(tiffPoolLock);
+   handle->prev = NULL;
+   handle->next = idleHandles;
+   if (idleHandles != NULL)	idleHandles->prev = handle;
+   else 	idleHandlesTail = handle;
+   idleHandles = handle;
+   handle->bucketNext = *bucket;
+   *bucket = handle;
+   numIdleHandles++;
+
+   // Without a limit on the open files, keep the pool bounded anyway
+   if ((maxOpenFiles == 0) && (numIdleHandles > kMAX_IDLE_HANDLES)) {
+      victim = idleHandlesTail;
+      textureUnlinkHandle(victim);
+      numOpenFiles--;
+      Stats->numFileDescriptors = numOpenFiles;
+   }
+   mi_unlock(tiffPoolLock);
+
+   if (victim != NULL)	textureFreeHandle(victim);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureSetDirectory
+// Description 	:	Make a directory of a handle current
+// Return Value 	:	miFALSE if there's no such directory
+static miBoolean	textureSetDirectory(CTiffHandle *handle,int dir)
+{
+   if (handle->directory == dir)	return miTRUE;
+
+   if (TIFFSetDirectory(handle->in,dir) == 0) {
+      handle->directory = -1;
+      return miFALSE;
+   }
+
+   handle->directory = dir;
+   return miTRUE;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureShutdownHandles
+// Description 	:	Close all idle handles
+static void	textureShutdownHandles()
+{
+   CTiffHandle	*handle;
+
+   mi_lock(tiffPoolLock);
+   while ((handle = idleHandles) != NULL) {
+      textureUnlinkHandle(handle);
+      textureFreeHandle(handle);
+      numOpenFiles--;
+   }
+   Stats->numFileDescriptors = numOpenFiles;
+   mi_unlock(tiffPoolLock);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureReadBlock
+// Description 	:	Read a block of texture from disk
+// Return Value :	The bits per sample of the file, 0 if it couldn't
+//			be opened
+// Comments  :	Called without any lock held.  size is the size of data.
+static int	textureReadBlock(int size,void *data,
+				 const char *name,
+				 int x,int y,int w,int h,int dir)
+{
+   CTiffHandle	*handle;
+
+   handle = textureOpenTIFF(name);
+
+   if (handle != NULL)
+   { // Error, we opened this file before
+      // The stupid user must have deleted the 
+      // file or unmounted the drive while in progress
+      uint32	width,height;
+      uint16	numSamples;
+      int pixelSize;
+      int i;
+      uint16	bitspersample;
+      TIFF	*in = handle->in;
+      int tiled;
+
+      textureSetDirectory(handle,dir);
+      tiled = TIFFIsTiled(in);
+
+      // Get the texture properties
+      TIFFGetFieldDefaulted(in,TIFFTAG_IMAGEWIDTH,      &width);
+      TIFFGetFieldDefaulted(in,TIFFTAG_IMAGELENGTH,     &height);
+      TIFFGetFieldDefaulted(in,TIFFTAG_SAMPLESPERPIXEL, &numSamples);
+      TIFFGetFieldDefaulted(in,TIFFTAG_BITSPERSAMPLE,   &bitspersample);
+
+      if (bitspersample == 8) {
+	 pixelSize = numSamples*sizeof(unsigned char);
+      } else if (bitspersample == 16) {
+	 pixelSize = numSamples*sizeof(unsigned short);
+      } else {
+	 pixelSize = numSamples*sizeof(float);
+      }
+
+      // Do we need to read the entire texture ?
+      if ((x != 0) || (y != 0) || (w != (int) width) || (h != (int) height)) {
+	 // No , is the file tiled ?
+	 if (!tiled) {
+	    // No, read the required portion
+	    unsigned char	*tdata;
+
+//  	    tdata = (unsigned char *) ralloc(width*height*pixelSize);
+	    tdata = (unsigned char *) mi_mem_allocate(width*height*pixelSize);
+
+	    // Read the entire image
+	    mrASSERT((int) (pixelSize*width) == TIFFScanlineSize(in));
+	    for (i=0;i<(int) height;i++) {
+	       TIFFReadScanline(in,&tdata[pixelSize*i*width],i,0);
+	       if (i >= (y+h))	break;	// If we read the last required scanline, break
+	    }
+
+	    for (i=0;i<h;i++) {
+	       memcpy(&((unsigned char *) data)[i*pixelSize*w],
+		      &tdata[((y+i)*width + x)*pixelSize],
+		      w*pixelSize);
+	    }
+
+	    mi_mem_release(tdata);
+	    
+	 } else {
+	    uint32	tileWidth,tileHeight;
+
+	    TIFFGetFieldDefaulted(in,TIFFTAG_TILEWIDTH , &tileWidth);
+	    TIFFGetFieldDefaulted(in,TIFFTAG_TILELENGTH, &tileHeight);
+	    mrASSERT(tileWidth == (uint32) w);
+	    mrASSERT(tileHeight == (uint32) h);
+	    mrASSERT((x % tileWidth) == 0);
+	    mrASSERT((y % tileHeight) == 0);
+
+	    if (TIFFReadTile(in,data,x,y,0,0) < 0) {
+	       memset(data,0,size);
+	       textureError("Could not read the tile at %d,%d of \"%s\".",
+			    x,y,name);
+	    }
+	 }
+      } else {
+	 if (tiled) {
+	    uint32	tileWidth,tileHeight;
+
+	    TIFFGetFieldDefaulted(in,TIFFTAG_TILEWIDTH , &tileWidth);
+	    TIFFGetFieldDefaulted(in,TIFFTAG_TILELENGTH, &tileHeight);
+
+	    if ((x != 0) || (y != 0) || (w != (int) tileWidth) ||
 		(h != (int) tileHeight))
 	    {
 	       mi_error("Tiled unmade texture.");
 //  	       error(CODE_BUG,"Tiled unmade texture.");
-	    } else {
-	       TIFFReadTile(in,data,x,y,0,0);
+	    } else if (TIFFReadTile(in,data,x,y,0,0) < 0) {
+	       memset(data,0,size);
+	       textureError("Could not read the tile at %d,%d of \"%s\".",
+			    x,y,name);
 	    }
 	 } else {
 	    int	i;
@@ -338,31 +1532,662 @@ static void	textureLoadBlock(CTextureBlock *entry,char *name,
       }
 
 
-      TIFFClose(in);
-   } else {
-      int	i;
+      textureCloseTIFF(handle);
+      return bitspersample;
+   } else {
+      memset(data,0,size);
+      return 0;
+   }
+}
+
+//! A texel channel kept as an IEEE half
+struct CHalf	{ unsigned short bits; };
+//! A texel channel in [0,1] kept as a 16 bit fixed point number
+struct CUnorm16	{ unsigned short bits; };
+
+#if defined(MR_SSE2) && !defined(MR_F16C)
+//! Widen the 4 halves in the low 16 bits of each lane to floats
+static inline __m128 halfToFloat(__m128i h)
+{
+   const __m128i	expmant = _mm_and_si128(h,_mm_set1_epi32(0x7fff));
+   const __m128i	infnan  = _mm_and_si128(
+				     _mm_cmpgt_epi32(expmant,
+						     _mm_set1_epi32(0x7bff)),
+				     _mm_set1_epi32(0x7f800000));
+   const __m128i	sign    = _mm_slli_epi32(_mm_xor_si128(h,expmant),16);
+   const __m128	scaled  = _mm_mul_ps(_mm_castsi128_ps(
+					      _mm_slli_epi32(expmant,13)),
+				     _mm_set1_ps(5.192296858534828e33f));
+
+   return _mm_or_ps(scaled,_mm_castsi128_ps(_mm_or_si128(sign,infnan)));
+}
+#endif
+
+//! Pack floats read from a file into halves
+static void	texelPack(CHalf *dst,const float *src,int n)
+{
+   int	i = 0;
+
+#ifdef MR_F16C
+   for (;i+4<=n;i+=4)
+      _mm_storel_epi64((__m128i *) (dst+i),
+		       _mm_cvtps_ph(_mm_loadu_ps(src+i),0));
+#endif
+
+   for (;i<n;i++)	dst[i].bits = floatToHalf(src[i]);
+}
+
+//! Pack floats read from a file into 16 bit fixed point, clamping
+//! them to [0,1]
+static void	texelPack(CUnorm16 *dst,const float *src,int n)
+{
+   int	i;
+
+   for (i=0;i<n;i++) {
+      float	f = src[i];
+
+      if (!(f > 0))	f = 0;		// NaNs too
+      if (f > 1)	f = 1;
+      dst[i].bits = (unsigned short) (f*65535.0f + 0.5f);
+   }
+}
+
+//! How texels of type T are kept, and the type they have in the file
+template <class T> struct CTexelStorage
+{
+     typedef T	File;
+     static const TTextureStorage	kind = kTEXTURE_STORE_NATIVE;
+};
+
+template <> struct CTexelStorage<CHalf>
+{
+     typedef float	File;
+     static const TTextureStorage	kind = kTEXTURE_STORE_HALF;
+};
+
+template <> struct CTexelStorage<CUnorm16>
+{
+     typedef float	File;
+     static const TTextureStorage	kind = kTEXTURE_STORE_UNORM16;
+};
+
+
+//! Pages a block of a TIFF directory in.
+//!
+//! Block loaders are called without any lock held, while the block is
+//! marked as loading.  They return the block data allocated with
+//! new unsigned char[], and may make entry->size smaller if the data
+//! takes less room than the block was created with.
+struct CTiffBlockLoader
+{
+     CTiffBlockLoader(const char *n,int d,int x0,int y0,int w0,int h0,
+		      TTextureStorage s = kTEXTURE_STORE_NATIVE) :
+     name( n ),
+     directory( d ),
+     x( x0 ), y( y0 ), w( w0 ), h( h0 ),
+     storage( s )
+     {
+     }
+
+     void *operator()(CTextureBlock *entry) const
+     {
+	void	*data = new unsigned char[entry->size];
+	float	*tmp;
+	int	n;
+
+	if (storage == kTEXTURE_STORE_NATIVE) {
+	   textureReadBlock(entry->size,data,name,x,y,w,h,directory);
+	   return data;
+	}
+
+	// Read the floats aside and pack them into the block.  Files
+	// of 16 bit samples are taken as they are: texLoad only keeps
+	// halves in CHalf blocks and 16 bit integers in CUnorm16 ones.
+	n   = entry->size / sizeof(CHalf);
+	tmp = new float[n];
+	if (textureReadBlock(n*sizeof(float),tmp,name,x,y,w,h,
+			     directory) == 16)
+	   memcpy(data,tmp,n*sizeof(CHalf));
+	else if (storage == kTEXTURE_STORE_HALF)
+	   texelPack((CHalf *) data,tmp,n);
+	else
+	   texelPack((CUnorm16 *) data,tmp,n);
+	delete [] tmp;
+
+	return data;
+     }
+
+     const char	*name;
+     int	directory;
+     int	x,y,w,h;
+     TTextureStorage	storage;
+};
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	texturePageIn
+// Description 	:	Make a block that is not resident, from the
+//			compressed tier if it is there, or else with the
+//			loader
+// Comments  :	The shard must be locked.  It is unlocked while the
+//		block is expanded or read and while the blocks it pushed
+//		out are compressed, and locked again on return.  The block
+//		may have been paged out again by then.
+template <class L>
+static void	texturePageIn(CTextureShard *shard,CTextureBlock *entry,
+			      const L& loader)
+{
+   unsigned char	*packed = (unsigned char *) entry->packed;
+   int	packedSize = entry->packedSize;
+   void 	*data = NULL;
+
+   entry->loading = miTRUE;
+   if (packed != NULL)	textureUnlinkPacked(shard,entry);
+   mi_unlock(shard->lock);
+
+   if (packed != NULL)
+   {
+      data = textureUnpackBlock(entry,packed,packedSize);
+      delete [] packed;
+   }
+   miBoolean fromDisk = (data == NULL) ? miTRUE : miFALSE;
+   if (fromDisk)	data = loader(entry);
+
+   mi_lock(shard->lock);
+   entry->loading = miFALSE;
+   CPackJob	*jobs = textureInstallBlock(shard,entry,data,fromDisk);
+   if (jobs != NULL)	texturePackBlocks(shard,jobs);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureAcquireBlock
+// Description 	:	Lock the shard owning a block, paging the block
+//			in first if it is not resident
+// Return Value 	:	The locked shard (see textureReleaseBlock)
+// Comments  :	The disk read happens outside of the lock, so misses on
+//		other blocks of the shard don't wait for it.  Threads that
+//		miss on a block that is already being read wait for that
+//		read instead of loading the block a second time.
+template <class L>
+static CTextureShard*	textureAcquireBlock(CTextureBlock *entry,
+					    const L& loader)
+{
+   CTextureShard	*shard = textureShards + entry->shard;
+
+   if (entry->usage != NULL)
+      atomicAdd(&entry->usage->numFetches,(miUlong) 1);
+   if (traceTiles)
+      atomicAdd(&entry->accesses,1);
+
+   mi_lock(shard->lock);
+   while (entry->data == NULL)
+   {
+      if (entry->loading)
+      {
+	 mi_unlock(shard->lock);
+	 textureYield();
+	 mi_lock(shard->lock);
+	 continue;
+      }
+
+      // Update the state
+      atomicAdd(&Stats->numTextureMisses,(miUlong) 1);
+      texturePageIn(shard,entry,loader);
+   }
+
+   // Texture cache management
+   entry->referenced = miTRUE;
+
+   if (entry->prefetched)
+   {
+      atomicAdd(&Stats->prefetchHits,(miUlong) 1);
+      entry->prefetched = miFALSE;
+   }
+
+   return shard;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureFlushThreadStats
+// Description 	:	Add a thread's counters to the global statistics
+static void	textureFlushThreadStats(CTextureThread *t)
+{
+   atomicAdd(&Stats->numTextureRef,(miUlong) t->numRefs);
+   atomicAdd(&Stats->numTileCacheHits,(miUlong) t->numHits);
+   t->numRefs = t->numHits = 0;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureBeginLookup
+// Description 	:	Enter the current epoch before using the tile cache
+// Return Value 	:	This thread's tile cache, or NULL if it has none
+// Comments  :	Must be paired with textureEndLookup.  Tile data got
+//		through textureBlockData stays valid until then.
+static inline CTextureThread	*textureBeginLookup()
+{
+   CTextureThread	*t = (CTextureThread *) textureThreadKey.get();
+   miUint	e;
+
+   if (numPrefetchMessages > 0)	textureReportMessages();
+
+   if (t == NULL)
+   {
+      mi_lock(tiffLock);
+      if (numTextureThreads < (miUint) kMAX_TEXTURE_THREADS)
+      {
+	 t = new CTextureThread;
+	 memset(t,0,sizeof(CTextureThread));
+	 textureThreads[numTextureThreads] = t;
+	 memoryBarrier();
+	 numTextureThreads++;
+      }
+      else
+      {
+	 t = &noTileCache;
+      }
+      mi_unlock(tiffLock);
+      textureThreadKey.set(t);
+   }
+   if (t == &noTileCache)	return NULL;
+
+   // Announce the epoch, and make sure it didn't move on meanwhile
+   do {
+      e = textureEpoch;
+      t->announced = e;
+      memoryBarrier();
+   } while (e != textureEpoch);
+
+   if (t->cacheEpoch != e)
+   {
+      memset(t->cache,0,sizeof(t->cache));
+      t->cacheEpoch = e;
+      textureFlushThreadStats(t);
+   }
+
+   return t;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureEndLookup
+// Description 	:	Leave the epoch entered by textureBeginLookup
+static inline void	textureEndLookup(CTextureThread *t)
+{
+   if (t == NULL)
+   {
+      atomicAdd(&Stats->numTextureRef,(miUlong) 1);
+      return;
+   }
+
+   memoryBarrier();
+   t->announced = 0;
+
+   if (++t->numRefs >= 1024)	textureFlushThreadStats(t);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureTileSlot
+// Description 	:	Where a block goes in a tile cache
+static inline CTileCacheEntry	*textureTileSlot(CTextureThread *t,
+						 CTextureBlock *entry)
+{
+   return t->cache + (((size_t) entry / sizeof(CTextureBlock)) &
+		      (kTILE_CACHE_SIZE-1));
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureCachedData
+// Description 	:	Look a block up in a tile cache
+// Return Value 	:	The block data, or NULL on a miss
+// Comments  :	Takes no lock and writes nothing shared
+static inline const void	*textureCachedData(CTextureThread *t,
+						   CTextureBlock *entry)
+{
+   CTileCacheEntry	*c;
+
+   if (t == NULL)	return NULL;
+
+   c = textureTileSlot(t,entry);
+   if (c->block != entry)	return NULL;
+
+   if (traceTiles)	atomicAdd(&entry->accesses,1);
+   t->numHits++;
+   return c->data;
+}
+
+static inline void	textureReleaseBlock(CTextureShard *shard);
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureBlockData
+// Description 	:	Page a block in and put it in the tile cache
+// Return Value 	:	The block data
+// Comments  :	If shard is not NULL on return, the thread has no tile
+//		cache and the caller must textureReleaseBlock(shard)
+//		once it is done with the data.
+template <class L>
+static inline const void	*textureBlockData(CTextureThread *t,
+						  CTextureBlock *entry,
+						  const L& loader,
+						  CTextureShard *&shard)
+{
+   CTileCacheEntry	*c;
+   const void	*data;
+
+   shard = textureAcquireBlock(entry,loader);
+   data  = entry->data;
+
+   if (t != NULL)
+   {
+      textureReleaseBlock(shard);
+      shard = NULL;
+
+      c = textureTileSlot(t,entry);
+      c->block = entry;
+      c->data  = data;
+   }
+
+   return data;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureFetchBlock
+// Description 	:	Page a block in ahead of time, if nobody else has
+// Comments  :	Called by the prefetch threads.  The block is left
+//		unreferenced, so it is the first to go if it isn't used.
+template <class L>
+static void	textureFetchBlock(CTextureBlock *entry,const L& loader)
+{
+   CTextureShard	*shard = textureShards + entry->shard;
+
+   mi_lock(shard->lock);
+   if ((entry->data != NULL) || entry->loading)
+   {
+      mi_unlock(shard->lock);
+      return;
+   }
+   texturePageIn(shard,entry,loader);
+   if (entry->data != NULL)
+   {
+      entry->referenced = miFALSE;
+      entry->prefetched = miTRUE;
+   }
+   mi_unlock(shard->lock);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	texturePrefetchWorker
+// Description 	:	Body of the prefetch threads
+static void	texturePrefetchWorker(void *data)
+{
+   int	id = (int) (size_t) data;
+   CPrefetchRequest	r;
+
+   prefetchThreadKey.set(prefetchThreads + id);
+
+   for (;;)
+   {
+      prefetchReady->wait();
+
+      mi_lock(prefetchLock);
+      if (prefetchQuit)
+      {
+	 mi_unlock(prefetchLock);
+	 return;
+      }
+      if (prefetchCount == 0)
+      {
+	 mi_unlock(prefetchLock);
+	 continue;
+      }
+      r = prefetchQueue[prefetchHead];
+      prefetchHead = (prefetchHead + 1) % prefetchQueueSize;
+      prefetchCount--;
+      prefetchActive[id] = r.block;
+      mi_unlock(prefetchLock);
+
+      if (r.block != NULL)
+	 textureFetchBlock(r.block,CTiffBlockLoader(r.name,r.directory,
+						    r.x,r.y,r.size,r.size,
+						    r.storage));
+
+      mi_lock(prefetchLock);
+      prefetchActive[id] = NULL;
+      mi_unlock(prefetchLock);
+   }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	texturePrefetch
+// Description 	:	Queue a tile to be paged in in the background
+// Comments  :	Does nothing if the tile is resident or the queue full
+static void	texturePrefetch(CTextureBlock *entry,const char *name,
+				int directory,int x,int y,int size,
+				TTextureStorage storage)
+{
+   CPrefetchRequest	*r;
+
+   if (numPrefetchThreads == 0)	return;
+
+   // Only a hint, textureFetchBlock checks again under the lock
+   if ((entry->data != NULL) || entry->loading)	return;
+
+   mi_lock(prefetchLock);
+   if (prefetchCount == prefetchQueueSize)
+   {
+      Stats->prefetchDropped++;
+      mi_unlock(prefetchLock);
+      return;
+   }
+
+   r = prefetchQueue + (prefetchHead + prefetchCount) % prefetchQueueSize;
+   r->block     = entry;
+   r->name      = name;
+   r->directory = directory;
+   r->x = x; r->y = y; r->size = size;
+   r->storage   = storage;
+   prefetchCount++;
+   Stats->prefetchRequests++;
+   mi_unlock(prefetchLock);
+
+   prefetchReady->post();
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureCancelPrefetch
+// Description 	:	Make sure no prefetch thread touches a block that
+//			is about to be deleted
+static void	textureCancelPrefetch(CTextureBlock *entry)
+{
+   int	i;
+   miBoolean	busy;
+
+   if (numPrefetchThreads == 0)	return;
+
+   mi_lock(prefetchLock);
+   for (i=0;i<prefetchCount;i++)
+   {
+      CPrefetchRequest *r = prefetchQueue +
+			    (prefetchHead + i) % prefetchQueueSize;
+      if (r->block == entry)	r->block = NULL;
+   }
+
+   do {
+      for (busy=miFALSE,i=0;i<numPrefetchThreads;i++)
+	 if (prefetchActive[i] == entry)	busy = miTRUE;
+      if (busy)
+      {
+	 mi_unlock(prefetchLock);
+	 textureYield();
+	 mi_lock(prefetchLock);
+      }
+   } while (busy);
+   mi_unlock(prefetchLock);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	texturePrefetchStart
+// Description 	:	Start the prefetch threads
+static void	texturePrefetchStart(int threads,int queueSize)
+{
+   int	i;
+
+   if ((threads <= 0) || (queueSize <= 0))	return;
+
+   mi_init_lock(&prefetchLock);
+   prefetchQueue	= new CPrefetchRequest[queueSize];
+   prefetchQueueSize	= queueSize;
+   prefetchHead = prefetchCount = 0;
+   prefetchQuit	= miFALSE;
+   prefetchReady	= new semaphore(0);
+   prefetchActive	= new CTextureBlock*[threads];
+   prefetchThreads	= new thread[threads];
+
+   for (i=0;i<threads;i++)
+   {
+      prefetchActive[i] = NULL;
+      if (!prefetchThreads[i].start(texturePrefetchWorker,
+				    (void *) (size_t) numPrefetchThreads))
+	 break;
+      numPrefetchThreads++;
+   }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	texturePrefetchStop
+// Description 	:	Stop the prefetch threads, dropping pending requests
+static void	texturePrefetchStop()
+{
+   int	i;
+
+   if (prefetchThreads == NULL)	return;
+
+   mi_lock(prefetchLock);
+   prefetchQuit = miTRUE;
+   mi_unlock(prefetchLock);
+
+   for (i=0;i<numPrefetchThreads;i++)	prefetchReady->post();
+   for (i=0;i<numPrefetchThreads;i++)	prefetchThreads[i].join();
+   textureReportMessages();
+
+   delete [] prefetchThreads;
+   delete [] prefetchActive;
+   delete [] prefetchQueue;
+   delete prefetchReady;
+   mi_delete_lock(&prefetchLock);
+
+   prefetchThreads	= NULL;
+   prefetchActive	= NULL;
+   prefetchQueue	= NULL;
+   prefetchReady	= NULL;
+   prefetchQueueSize	= prefetchCount = 0;
+   numPrefetchThreads	= 0;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureReleaseBlock
+// Description 	:	Unlock a shard locked by textureAcquireBlock
+static inline void	textureReleaseBlock(CTextureShard *shard)
+{
+   mi_unlock(shard->lock);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureMapGranularity
+// Description 	:	The alignment file offsets must have to be mapped
+static size_t	textureMapGranularity()
+{
+#ifdef WIN32
+   SYSTEM_INFO	info;
+   GetSystemInfo(&info);
+   return (size_t) info.dwAllocationGranularity;
+#else
+   return (size_t) sysconf(_SC_PAGESIZE);
+#endif
+}
 
-      data = new unsigned char[entry->size];
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureMapFile
+// Description 	:	Map part of a file read-only into memory
+// Return Value 	:	The start of the mapping or NULL on failure
+// Comments  :	start must be a multiple of textureMapGranularity().
+//		The file itself is closed again right away, the mapping
+//		stays valid until textureUnmapFile.
+static void	*textureMapFile(const char *name,toff_t start,size_t length)
+{
+   void	*base;
+#ifdef WIN32
+   HANDLE	file,mapping;
+   
+   textureAcquireDescriptor(miFALSE);
+   file = CreateFileA(name,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,
+		      FILE_ATTRIBUTE_NORMAL,NULL);
+   if (file == INVALID_HANDLE_VALUE)
+   {
+      textureReleaseDescriptor();
+      return NULL;
+   }
 
-      for (i=0;i<entry->size;i++) {
-	 ((unsigned char *) data)[i] = 0;
-      }
+   mapping = CreateFileMappingA(file,NULL,PAGE_READONLY,0,0,NULL);
+   CloseHandle(file);
+   textureReleaseDescriptor();
+   if (mapping == NULL)	return NULL;
+
+   base = MapViewOfFile(mapping,FILE_MAP_READ,
+			(DWORD) (((ULONGLONG) start) >> 32),
+			(DWORD) (start & 0xffffffff),length);
+   CloseHandle(mapping);
+   return base;
+#else
+   int	fd;
+
+   textureAcquireDescriptor(miFALSE);
+   fd = open(name,O_RDONLY);
+   if (fd < 0)
+   {
+      textureReleaseDescriptor();
+      return NULL;
    }
 
-   entry->data = data;
+   base = mmap(NULL,length,PROT_READ,MAP_SHARED,fd,(off_t) start);
+   close(fd);
+   textureReleaseDescriptor();
+   if (base == MAP_FAILED)	return NULL;
+
+   return base;
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureUnmapFile
+// Description 	:	Release a mapping made by textureMapFile
+static void	textureUnmapFile(void *base,size_t length)
+{
+#ifdef WIN32
+   UnmapViewOfFile(base);
+#else
+   munmap(base,length);
+#endif
 }
 
 //////////////////////////////////////////////////////////////////////
 // Function  :	textureNewBlock
 // Description 	:	Create a new texture block
 // Return Value 	:	Pointer to the new block
-static CTextureBlock	*textureNewBlock(int size) {
+static CTextureBlock	*textureNewBlock(int size,TextureUsage *usage = NULL,
+					 int tileX = 0,int tileY = 0) {
    CTextureBlock	*cEntry = NULL;
+   CTextureShard	*shard;
+   int  s;
+
+   mi_lock(tiffLock);
+   s = nextShard++ & (kTEXTURE_SHARDS-1);
+   mi_unlock(tiffLock);
+
+   shard = textureShards + s;
+   mi_lock(shard->lock);
 	
-   if (freeBlocks != NULL)
+   if (shard->freeBlocks != NULL)
    {
-      cEntry = freeBlocks;
-      freeBlocks = cEntry->next;
+      cEntry = shard->freeBlocks;
+      shard->freeBlocks = cEntry->next;
    }
 
    if (cEntry == NULL)
@@ -370,12 +2195,27 @@ static CTextureBlock	*textureNewBlock(int size) {
       cEntry = new CTextureBlock;
    }
 
-   cEntry->next = usedBlocks;
-   usedBlocks   = cEntry;
+   cEntry->next = shard->usedBlocks;
+   shard->usedBlocks   = cEntry;
 
    cEntry->data = NULL;
-   cEntry->lastRefNumber = refNumber;
+   cEntry->clockNext = cEntry->clockPrev = NULL;
+   cEntry->referenced = miFALSE;
+   cEntry->prefetched = miFALSE;
    cEntry->size = size;
+   cEntry->shard = s;
+   cEntry->loading = miFALSE;
+   cEntry->usage = usage;
+   cEntry->loadedOnce = miFALSE;
+   cEntry->packed = NULL;
+   cEntry->packedSize = 0;
+   cEntry->packedPrev = cEntry->packedNext = NULL;
+   cEntry->packTicket = 0;
+   cEntry->tileX = tileX;
+   cEntry->tileY = tileY;
+   cEntry->accesses = 0;
+
+   mi_unlock(shard->lock);
 
    return cEntry;
 }
@@ -388,35 +2228,152 @@ static CTextureBlock	*textureNewBlock(int size) {
 // Date last edited :	7/7/2001
 static void textureDeleteBlock(CTextureBlock *cEntry)
 {
+   CTextureShard	*shard = textureShards + cEntry->shard;
    CTextureBlock	*pBlock,*cBlock;
 
-   for (pBlock=NULL,cBlock=usedBlocks; cBlock != NULL;
+   textureCancelPrefetch(cEntry);
+
+   mi_lock(shard->lock);
+
+   for (pBlock=NULL,cBlock=shard->usedBlocks; cBlock != NULL;
 	pBlock = cBlock,cBlock = cBlock->next)
    {
       if (cBlock == cEntry)
       {
 	 if (pBlock == NULL)
-	    usedBlocks = cBlock->next;
+	    shard->usedBlocks = cBlock->next;
 	 else
 	    pBlock->next = cBlock->next;
 
 	 if (cBlock->data != NULL)
 	 {
-	    Stats->textureSize	-= cBlock->size;
-	    usedTextureMemory	-= cBlock->size;
-	    delete [] (unsigned char *) cBlock->data;
+	    textureClockRemove(shard,cBlock);
+	    atomicAdd(&Stats->textureSize,(miUlong) 0 - cBlock->size);
+	    shard->usedTextureMemory -= cBlock->size;
+	    textureRetireData(shard,cBlock->data,
+			      atomicAdd(&textureEpoch,1));
 	 }
+	 if (cBlock->packed != NULL)
+	    textureDropPacked(shard,cBlock);
+	 cBlock->packTicket = 0;
+	 if (traceTiles && ((cBlock->accesses > 0) || cBlock->loadedOnce))
+	    textureTrace(shard,cBlock,kTRACE_TILE);
  	
-	 cBlock->next = freeBlocks;
-	 freeBlocks  = cBlock;
+	 cBlock->next = shard->freeBlocks;
+	 shard->freeBlocks  = cBlock;
 
+	 mi_unlock(shard->lock);
 	 return;
       }
    }
 
+   mi_unlock(shard->lock);
+
    mrASSERT(miFALSE);
 }
 
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureRegistryHash
+// Description 	:	Hash a registry key
+// Return Value :	The registry bucket of the key
+static int	textureRegistryHash(const char *fileName,int directory)
+{
+   miUint	h = 5381;
+
+   for (;*fileName != '\0';fileName++)
+      h = h*33 + (unsigned char) *fileName;
+   h = h*33 + (miUint) directory;
+
+   return (int) (h & (kTEXTURE_REGISTRY_SIZE-1));
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureBeginRecord
+// Description 	:	Make the statistics record of a texture the one
+//			the layers made from now on count into
+// Comments  :	Only for the calling thread, until textureEndRecord.
+//		A texture loaded again counts into the record of its
+//		first load.
+static void	textureBeginRecord(const char *fileName,int directory)
+{
+   CTextureRecord	*cRecord;
+   int	bucket = textureRegistryHash(fileName,directory);
+
+   mi_lock(recordsLock);
+
+   for (cRecord=recordTable[bucket];cRecord!=NULL;
+	cRecord=cRecord->bucketNext)
+      if ((cRecord->directory == directory) &&
+	  (strcmp(cRecord->name,fileName) == 0))	break;
+
+   if (cRecord == NULL)
+   {
+      cRecord  = new CTextureRecord;
+      cRecord->name  = strdup(fileName);
+      cRecord->directory = directory;
+      cRecord->firstLayer = NULL;
+      cRecord->lastLayer  = NULL;
+      cRecord->next  = NULL;
+      cRecord->bucketNext = recordTable[bucket];
+      recordTable[bucket] = cRecord;
+
+      if (lastRecord != NULL)	lastRecord->next = cRecord;
+      else 	firstRecord = cRecord;
+      lastRecord = cRecord;
+   }
+
+   mi_unlock(recordsLock);
+
+   loadingRecordKey.set(cRecord);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureEndRecord
+// Description 	:	Done making the layers of a texture
+static inline void	textureEndRecord()
+{
+   loadingRecordKey.set(NULL);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureLayerUsage
+// Description 	:	Find the statistics record of a layer
+// Return Value 	:	The counters of the record
+// Comments  :	Only looks at the layers of the texture the calling
+//		thread is loading
+static TextureUsage	*textureLayerUsage(const char *name,int directory,
+					   int width,int height)
+{
+   CTextureRecord	*cTexture = (CTextureRecord *) loadingRecordKey.get();
+   CLayerRecord	*cRecord;
+
+   if (cTexture == NULL)	return NULL;
+
+   mi_lock(recordsLock);
+
+   for (cRecord=cTexture->firstLayer;cRecord!=NULL;cRecord=cRecord->next)
+      if ((cRecord->directory == directory) &&
+	  (strcmp(cRecord->name,name) == 0))	break;
+
+   if (cRecord == NULL)
+   {
+      cRecord  = new CLayerRecord;
+      cRecord->name  = strdup(name);
+      cRecord->directory = directory;
+      cRecord->width  = width;
+      cRecord->height  = height;
+      cRecord->next  = NULL;
+
+      if (cTexture->lastLayer != NULL)	cTexture->lastLayer->next = cRecord;
+      else 	cTexture->firstLayer = cRecord;
+      cTexture->lastLayer = cRecord;
+   }
+
+   mi_unlock(recordsLock);
+
+   return cRecord;
+}
+
 
 
 
@@ -442,7 +2399,8 @@ template <class T> class CBasicTexture : public CTextureLayer
      CTextureLayer(name,directory,width,height,numSamples,
 		   fileWidth,fileHeight)
      {
-	this->dataBlock = textureNewBlock(width*height*numSamples*sizeof(T));
+	this->dataBlock = textureNewBlock(width*height*numSamples*sizeof(T),
+					  this->usage);
      }
 
      // Description 	:	Dtor
@@ -473,6 +2431,7 @@ template <class T> class CTiledTexture : public CTextureLayer {
 
 	this->tileSize = tileSize;
 	this->tileSizeShift = tileSizeShift;
+	this->nextLevel = NULL;
 	tileLength  = tileSize*tileSize*numSamples*sizeof(T);
 
 	xTiles = (int) ceil((float) width / (float) tileSize);
@@ -483,7 +2442,7 @@ template <class T> class CTiledTexture : public CTextureLayer {
 	   dataBlocks[i] = new CTextureBlock*[xTiles];
 
 	   for (j=0;j<xTiles;j++) {
-	      dataBlocks[i][j] = textureNewBlock(tileLength);
+	      dataBlocks[i][j] = textureNewBlock(tileLength,this->usage,j,i);
 	   }
 	}
      }
@@ -503,9 +2462,25 @@ template <class T> class CTiledTexture : public CTextureLayer {
 	delete [] dataBlocks;
      }
 
+     //! Queue the tile holding pixel x,y for background loading
+     void	prefetch(int,int);
+
+     //! The next (coarser) mip level, if any
+     CTextureLayer	*nextLevel;
+
    protected:
      //! Pixel lookup
      void 	lookupPixel(float *,int,int,const CTextureLookup& );
+     //! Bilinear lookups of n points, fetching each tile once
+     void	lookupBatch(float *,const float *,const float *,int,
+			    const CTextureLookup& );
+     //! Copy a block of depths, a tile at a time
+     void	fetchDepths(float *,int,int,int,int,const CTextureLookup& );
+
+     //! Queue a tile for background loading
+     void	prefetchTile(int,int);
+     //! Queue the neighbours of a tile and the tile below it
+     void	prefetchAround(int,int);
 
      CTextureBlock	***dataBlocks;
      int  xTiles,yTiles;
@@ -515,19 +2490,251 @@ template <class T> class CTiledTexture : public CTextureLayer {
 
 
 
+//! This class holds info about a tiled texture whose tiles are mapped
+//! straight from the file (uncompressed tiled directories only).
+//! Tiles are neither copied nor allocated, paging is left to the OS.
+template <class T> class CMappedTexture : public CTextureLayer {
+   public:
+     // Description 	:	Ctor
+     CMappedTexture(const char *name,int directory,int width,int height,
+		    int numSamples,int fileWidth,int fileHeight,
+		    int tileSize,int tileSizeShift,
+		    void *base,size_t length,const T **tiles) :
+     CTextureLayer(name,directory,width,height,numSamples,
+		   fileWidth,fileHeight),
+     tiles( tiles ),
+     base( base ),
+     length( length ),
+     tileSizeShift( tileSizeShift )
+     {
+	xTiles = (int) ceil((float) width / (float) tileSize);
+     }
+
+     // Description 	:	Dtor
+     ~CMappedTexture() {
+	textureUnmapFile(base,length);
+	delete [] tiles;
+     }
+
+   protected:
+     //! Pixel lookup
+     void 	lookupPixel(float *,int,int,const CTextureLookup& );
+
+     const T	**tiles;	//<- Start of each tile, in row order
+     void	*base;		//<- The mapping
+     size_t	length;		//<- Length of the mapping
+     int	xTiles;
+     int	tileSizeShift;
+};
+
+//! Turn the first 3 channels of a texel into floats, using the fill
+//! color for missing channels.  n is the number of channels the texel
+//! has from data on.  res gets 4 floats, the last one is garbage.
+static inline void texelFetch(float *res,const float *data,int n,
+			      const CTextureLookup& l)
+{
+   int	j;
+
+#ifdef MR_SSE2
+   if (n >= 4)
+   {
+      _mm_storeu_ps(res,_mm_loadu_ps(data));
+      return;
+   }
+#endif
+
+   res[0] = l.fill[0]; res[1] = l.fill[1]; res[2] = l.fill[2];
+   n = min(n,3);
+   for (j=0;j<n;j++) {
+      res[j] = data[j];
+   }
+}
+
+static inline void texelFetch(float *res,const unsigned char *data,int n,
+			      const CTextureLookup& l)
+{
+   int	j;
+
+#ifdef MR_SSE2
+   if (n >= 3)
+   {
+      // Widen the 3 bytes to 32 bit ints and convert them all at once
+      const __m128i	zero = _mm_setzero_si128();
+      __m128i	bits = _mm_cvtsi32_si128(data[0] | (data[1] << 8) |
+					 (data[2] << 16));
+      bits = _mm_unpacklo_epi16(_mm_unpacklo_epi8(bits,zero),zero);
+      _mm_storeu_ps(res,_mm_mul_ps(_mm_cvtepi32_ps(bits),
+				   _mm_set1_ps(inv255)));
+      return;
+   }
+#endif
+
+   res[0] = l.fill[0]; res[1] = l.fill[1]; res[2] = l.fill[2];
+   n = min(n,3);
+   for (j=0;j<n;j++) {
+      res[j] = data[j]*inv255;
+   }
+}
+
+#ifdef MR_SSE2
+//! The first 3 of a run of 16 bit values, in the low 16 bit lanes
+static inline __m128i	texelLoad16(const unsigned short *d)
+{
+   const __m128i	bits = _mm_cvtsi32_si128((int) (d[0] |
+							 ((miUint) d[1] << 16)));
+   return _mm_insert_epi16(bits,d[2],2);
+}
+#endif
+
+static inline void texelFetch(float *res,const CHalf *data,int n,
+			      const CTextureLookup& l)
+{
+   int	j;
+
+#ifdef MR_SSE2
+   if (n >= 3)
+   {
+      const __m128i	bits = texelLoad16((const unsigned short *) data);
+#ifdef MR_F16C
+      _mm_storeu_ps(res,_mm_cvtph_ps(bits));
+#else
+      _mm_storeu_ps(res,halfToFloat(_mm_unpacklo_epi16(bits,
+						       _mm_setzero_si128())));
+#endif
+      return;
+   }
+#endif
+
+   res[0] = l.fill[0]; res[1] = l.fill[1]; res[2] = l.fill[2];
+   n = min(n,3);
+   for (j=0;j<n;j++) {
+      res[j] = halfToFloat(data[j].bits);
+   }
+}
+
+static inline void texelFetch(float *res,const CUnorm16 *data,int n,
+			      const CTextureLookup& l)
+{
+   int	j;
+
+#ifdef MR_SSE2
+   if (n >= 3)
+   {
+      const __m128i	bits = texelLoad16((const unsigned short *) data);
+      _mm_storeu_ps(res,_mm_mul_ps(_mm_cvtepi32_ps(
+				      _mm_unpacklo_epi16(bits,
+							 _mm_setzero_si128())),
+				   _mm_set1_ps(1.0f / 65535.0f)));
+      return;
+   }
+#endif
+
+   res[0] = l.fill[0]; res[1] = l.fill[1]; res[2] = l.fill[2];
+   n = min(n,3);
+   for (j=0;j<n;j++) {
+      res[j] = data[j].bits*(1.0f / 65535.0f);
+   }
+}
+
+#ifdef MR_SSE2
+//! Bilinear blend of a 2x2 footprint, as filled in by lookupPixel
+static inline __m128 texelBilerp(const float *res,float dx,float dy)
+{
+   const __m128	x  = _mm_set1_ps(dx);
+   const __m128	y  = _mm_set1_ps(dy);
+   __m128	t0 = _mm_loadu_ps(res);
+   __m128	t1 = _mm_loadu_ps(res+4);
+   __m128	t2 = _mm_loadu_ps(res+8);
+   __m128	t3 = _mm_loadu_ps(res+12);
+
+   // Blend along x on both rows, then the rows along y
+   t0 = _mm_add_ps(t0,_mm_mul_ps(_mm_sub_ps(t1,t0),x));
+   t2 = _mm_add_ps(t2,_mm_mul_ps(_mm_sub_ps(t3,t2),x));
+   return _mm_add_ps(t0,_mm_mul_ps(_mm_sub_ps(t2,t0),y));
+}
+
+//! Store the color part of a register
+static inline void texelStore(float *r,const __m128 c)
+{
+   float	tmp[4];
+   _mm_storeu_ps(tmp,c);
+   r[0] = tmp[0];
+   r[1] = tmp[1];
+   r[2] = tmp[2];
+}
+#else
+//! Bilinear blend of a 2x2 footprint, as filled in by lookupPixel
+static inline void texelBilerp(float *r,const float *res,float dx,float dy)
+{
+   float	tmp;
+
+   tmp = (1-dx)*(1-dy);
+   r[0] = res[0]*tmp;
+   r[1] = res[1]*tmp;
+   r[2] = res[2]*tmp;
+
+   tmp = dx*(1-dy);
+   r[0] += res[4]*tmp;
+   r[1] += res[5]*tmp;
+   r[2] += res[6]*tmp;
+
+   tmp = (1-dx)*dy;
+   r[0] += res[8]*tmp;
+   r[1] += res[9]*tmp;
+   r[2] += res[10]*tmp;
+
+   tmp = dx*dy;
+   r[0] += res[12]*tmp;
+   r[1] += res[13]*tmp;
+   r[2] += res[14]*tmp;
+}
+#endif
+
+//! Bilinear blend of a 2x2 footprint into the color r
+static inline void texelBlend(float *r,const float *res,float dx,float dy)
+{
+#ifdef MR_SSE2
+   texelStore(r,texelBilerp(res,dx,dy));
+#else
+   texelBilerp(r,res,dx,dy);
+#endif
+}
+
+//! Number of points lookupBatch sorts and filters at a time
+static const int kBATCH_SIZE = 64;
+
+//! A point of a batch, keyed by the tile its footprint starts in
+struct CBatchPoint
+{
+     int	tile;		//<- Tile of the top left texel
+     int	index;		//<- Position of the point in the batch
+};
+
+//! qsort order of batch points, by tile and then by position
+static int	batchPointOrder(const void *a,const void *b)
+{
+   const CBatchPoint *pa = (const CBatchPoint *) a;
+   const CBatchPoint *pb = (const CBatchPoint *) b;
+
+   if (pa->tile != pb->tile) return pa->tile - pb->tile;
+   return pa->index - pb->index;
+}
+
+
 ///////////////////////////////////////////////////////////////////////
 // Class  :	CTextureLayer
 // Method  :	CTextureLayer
 // Description 	:	Ctor
 CTextureLayer::CTextureLayer(const char *n,int dir,int w,int h,
 			     int ns,int fw,int fh) :
+name( mi_mem_strdup(n) ),
 directory( dir ),
 width( w ),
 height( h ),
 numSamples( ns ),
 fileWidth( fw ),
 fileHeight( fh ),
-name( mi_mem_strdup(n) )
+usage( textureLayerUsage(n,dir,w,h) )
 {
 }
 
@@ -544,19 +2751,25 @@ CTextureLayer::~CTextureLayer()
 
 ///////////////////////////////////////////////////////////////////////
 // Class  :	CTextureLayer
-// Method  :	lookup
-// Description 	:	Lookup a pixel in the texture (bilinear lookup)
-// Return Value 	:	Color in r
+// Method  :	prefetch
+// Description 	:	Queue the tile holding pixel x,y for background
+//			loading.  Layers that aren't tiled have nothing to do.
+void CTextureLayer::prefetch(int x,int y)
+{
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CTextureLayer
+// Method  :	lookupFootprint
+// Description 	:	Fetch the 2x2 texels around a point
+// Return Value 	:	The texels in res, the weights in dx,dy
 // Comments  :	0 <= (x,y) <= 1
-void CTextureLayer::lookup( const miState* const state,
-			    float* r,float x,float y, const CTextureLookup& l)
+void CTextureLayer::lookupFootprint(float *res,float x,float y,
+				    float& dx,float& dy,
+				    const CTextureLookup& l)
 {
    int xi;
    int yi;
-   float	dx;
-   float	dy;
-   float	res[4*3];
-   float	tmp;
 
    x *= width;   // To the pixel space
    y *= height;
@@ -569,28 +2782,79 @@ void CTextureLayer::lookup( const miState* const state,
    if (yi >= height) yi -= height;
 
    lookupPixel(res,xi,yi,l);
+}
 
-   tmp = (1-dx)*(1-dy);  // Bilinear interpolation
-   r[0] = res[0]*tmp;
-   r[1] = res[1]*tmp;
-   r[2] = res[2]*tmp;
+///////////////////////////////////////////////////////////////////////
+// Class  :	CTextureLayer
+// Method  :	lookup
+// Description 	:	Lookup a pixel in the texture (bilinear lookup)
+// Return Value 	:	Color in r
+// Comments  :	0 <= (x,y) <= 1
+void CTextureLayer::lookup( const miState* const state,
+			    float* r,float x,float y, const CTextureLookup& l)
+{
+   float	dx;
+   float	dy;
+   float	res[4*4];
 
-   tmp = dx*(1-dy);
-   r[0] += res[3]*tmp;
-   r[1] += res[4]*tmp;
-   r[2] += res[5]*tmp;
+   lookupFootprint(res,x,y,dx,dy,l);
 
-   tmp = (1-dx)*dy;
-   r[0] += res[6]*tmp;
-   r[1] += res[7]*tmp;
-   r[2] += res[8]*tmp;
+#ifdef MR_SSE2
+   texelStore(r,texelBilerp(res,dx,dy));
+#else
+   texelBilerp(r,res,dx,dy);
+#endif
+}
 
-   tmp = dx*dy;
-   r[0] += res[9]*tmp;
-   r[1] += res[10]*tmp;
-   r[2] += res[11]*tmp;
+///////////////////////////////////////////////////////////////////////
+// Class  :	CTextureLayer
+// Method  :	lookup
+// Description 	:	Lookup a pixel in this layer and the next one and
+//			blend them (trilinear lookup)
+// Return Value 	:	Color in r
+// Comments  :	0 <= (x,y) <= 1, 0 <= offset <= 1 is the weight of next
+void CTextureLayer::lookup( const miState* const state,
+			    float* r,float x,float y,
+			    CTextureLayer* next,float offset,
+			    const CTextureLookup& l)
+{
+   float	dx0,dy0,dx1,dy1;
+   float	res0[4*4];
+   float	res1[4*4];
+
+   lookupFootprint(res0,x,y,dx0,dy0,l);
+   next->lookupFootprint(res1,x,y,dx1,dy1,l);
+
+#ifdef MR_SSE2
+   const __m128	c0 = texelBilerp(res0,dx0,dy0);
+   const __m128	c1 = texelBilerp(res1,dx1,dy1);
+   texelStore(r,_mm_add_ps(c0,_mm_mul_ps(_mm_sub_ps(c1,c0),
+					 _mm_set1_ps(offset))));
+#else
+   float	c0[3],c1[3];
+   texelBilerp(c0,res0,dx0,dy0);
+   texelBilerp(c1,res1,dx1,dy1);
+   r[0] = c0[0] + (c1[0] - c0[0])*offset;
+   r[1] = c0[1] + (c1[1] - c0[1])*offset;
+   r[2] = c0[2] + (c1[2] - c0[2])*offset;
+#endif
 }
 
+///////////////////////////////////////////////////////////////////////
+// Class  :	CTextureLayer
+// Method  :	lookupBatch
+// Description 	:	Bilinear lookup of n points
+// Return Value 	:	3 floats of color per point in r
+// Comments  :	0 <= (x,y) <= 1.  Layers that aren't tiled have
+//		nothing to gain from sorting, so look the points up in turn.
+void CTextureLayer::lookupBatch(float *r,const float *x,const float *y,
+				int n,const CTextureLookup& l)
+{
+   int	i;
+
+   for (i=0;i<n;i++)
+      lookup(NULL,r+3*i,x[i],y[i],l);
+}
 
 ///////////////////////////////////////////////////////////////////////
 // Class  :	CTextureLayer
@@ -604,7 +2868,7 @@ void CTextureLayer::lookupz(const miState* const state,
 {
    int xi;
    int yi;
-   float	res[4*3];
+   float	res[4*4];
 
    x *= width;
    y *= height;
@@ -614,64 +2878,37 @@ void CTextureLayer::lookupz(const miState* const state,
    yi = fastmath<float>::floor(y);
 
    if ((xi < 0)	|| (yi < 0) || (xi >= (width-1)) || (yi >= (height-1))) {
-      r[0] = INFINITY;
-      r[1] = INFINITY;
-      r[2] = INFINITY;
+      r[0] = kDEPTH_INFINITY;
+      r[1] = kDEPTH_INFINITY;
+      r[2] = kDEPTH_INFINITY;
       return;
    }
 	
    lookupPixel(res,xi,yi,l);
 
-   r[0] = max(res[0],res[3]);
-   r[0] = max(r[0],res[6]);
-   r[0] = max(r[0],res[9]);
+   r[0] = max(res[0],res[4]);
+   r[0] = max(r[0],res[8]);
+   r[0] = max(r[0],res[12]);
 }
 
 ///////////////////////////////////////////////////////////////////////
-// Class  :	CBasicTexture
-// Method  :	lookup
-// Description 	:	Lookup a pixel in the texture
-// Return Value 	:
-// Comments  :	0 <= (x,y) <= 1
-// Date last edited :	2/28/2002
-void	CBasicTexture<float>::lookupPixel(float *res,int x,int y,
-					  const CTextureLookup& l)
+// Class  :	CTextureLayer
+// Method  :	fetchDepths
+// Description 	:	Copy the depths of a block of pixels
+// Return Value 	:	w*h depths in r, row after row
+// Comments  :	The block must be inside the layer.  Layers that
+//		aren't tiled fetch the pixels one at a time.
+void CTextureLayer::fetchDepths(float *r,int x0,int y0,int w,int h,
+				const CTextureLookup& l)
 {
-   const float	*data;
-   int 	i,j;
-   int 	xi,yi;
-
-   if (dataBlock->data == NULL)
-   {
-      // The data is cached out
-      textureLoadBlock(dataBlock,name,0,0,width,height,directory);
-   }
-
-   // Texture cache management
-   refNumber++;
-   Stats->numTextureRef++;
-   dataBlock->lastRefNumber = refNumber;
-
-   i = min(numSamples - l.channel,3);
-   xi = x+1;
-   yi = y+1;
-   if (xi >= width)	xi	-= width;
-   if (yi >= height)	yi	-= height;
-
-#define access(__x,__y) 	\
-	res[0] = l.fill[0]; res[1] = l.fill[1]; res[2] = l.fill[2]; \
-	data = &((float *) dataBlock->data)[(__y*fileWidth+__x)*numSamples+l.channel];	\
-	for (j=0;j<i;j++) { 	\
-            res[j] = data[j];	\
-	}   	\
-	res += 3;
-
-   access(x,y);
-   access(xi,y);
-   access(x,yi);
-   access(xi,yi);
+   float	res[4*4];
+   int	x,y;
 
-#undef access
+   for (y=0;y<h;y++)
+      for (x=0;x<w;x++) {
+	 lookupPixel(res,x0+x,y0+y,l);
+	 *r++ = res[0];
+      }
 }
 
 ///////////////////////////////////////////////////////////////////////
@@ -681,25 +2918,21 @@ void	CBasicTexture<float>::lookupPixel(float *res,int x,int y,
 // Return Value 	:
 // Comments  :	0 <= (x,y) <= 1
 // Date last edited :	2/28/2002
-void	CBasicTexture<unsigned char>::lookupPixel(float *res,int x,int y,
-						  const CTextureLookup& l)
+template <class T>
+void	CBasicTexture<T>::lookupPixel(float *res,int x,int y,
+				      const CTextureLookup& l)
 {
-   const unsigned char	*data;
-   int  	i,j;
+   CTextureShard	*shard;
+   const T	*data;
    int  	xi,yi;
 
-   if (dataBlock->data == NULL)
-   {
-      // The data is cached out
-      textureLoadBlock(dataBlock,name,0,0,width,height,directory);
-   }
-
-   // Texture cache management
-   refNumber++;
-   Stats->numTextureRef++;
-   dataBlock->lastRefNumber = refNumber;
+   // Page the data in if it is cached out
+   shard = textureAcquireBlock(dataBlock,
+			       CTiffBlockLoader(name,directory,0,0,
+						width,height,
+						CTexelStorage<T>::kind));
+   atomicAdd(&Stats->numTextureRef,(miUlong) 1);
 
-   i = min(numSamples-l.channel,3);
    xi = x+1;
    yi = y+1;
    if (xi >= width)	xi	-= width;
@@ -711,19 +2944,62 @@ void	CBasicTexture<unsigned char>::lookupPixel(float *res,int x,int y,
    mrASSERT(yi < height);
 
 #define access(__x,__y)  \
-	res[0] = l.fill[0]; res[1] = l.fill[1]; res[2] = l.fill[2]; \
-	data = &((unsigned char *) dataBlock->data)[(__y*fileWidth+__x)*numSamples+l.channel];	\
-	for (j=0;j<i;j++) {  \
-            res[j] = data[j]*inv255;	\
-	}    \
-	res += 3;
+	data = &((const T *) dataBlock->data)[(__y*fileWidth+__x)*numSamples+l.channel];	\
+	texelFetch(res,data,numSamples-l.channel,l);	\
+	res += 4;
+
+   access(x,y);
+   access(xi,y);
+   access(x,yi);
+   access(xi,yi);
+
+#undef access
+
+   textureReleaseBlock(shard);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CTiledTexture
+// Method  :	prefetchTile
+// Description 	:	Queue a tile for background loading
+template <class T>
+void	CTiledTexture<T>::prefetchTile(int xTile,int yTile)
+{
+   if ((xTile < 0) || (yTile < 0) || (xTile >= xTiles) || (yTile >= yTiles))
+      return;
+
+   texturePrefetch(dataBlocks[yTile][xTile],name,directory,
+		   xTile << tileSizeShift,yTile << tileSizeShift,
+		   1 << tileSizeShift,CTexelStorage<T>::kind);
+}
 
-   access(x,y);
-   access(xi,y);
-   access(x,yi);
-   access(xi,yi);
+///////////////////////////////////////////////////////////////////////
+// Class  :	CTiledTexture
+// Method  :	prefetch
+// Description 	:	Queue the tile holding pixel x,y for background loading
+template <class T>
+void	CTiledTexture<T>::prefetch(int x,int y)
+{
+   prefetchTile(x >> tileSizeShift,y >> tileSizeShift);
+}
 
-#undef access
+///////////////////////////////////////////////////////////////////////
+// Class  :	CTiledTexture
+// Method  :	prefetchAround
+// Description 	:	Queue the 4 neighbours of a tile and the tile under
+//			it in the next mip level, which lookup4 will want
+//			next when it blends two levels
+template <class T>
+void	CTiledTexture<T>::prefetchAround(int xTile,int yTile)
+{
+   prefetchTile(xTile+1,yTile);
+   prefetchTile(xTile-1,yTile);
+   prefetchTile(xTile,yTile+1);
+   prefetchTile(xTile,yTile-1);
+
+   if (nextLevel != NULL)
+      nextLevel->prefetch((xTile << tileSizeShift) >> 1,
+			  (yTile << tileSizeShift) >> 1);
 }
 
 ///////////////////////////////////////////////////////////////////////
@@ -733,20 +3009,21 @@ void	CBasicTexture<unsigned char>::lookupPixel(float *res,int x,int y,
 // Return Value 	:
 // Comments  :	0 <= (x,y) <= 1
 // Date last edited :	2/28/2002
-void	CTiledTexture<float>::lookupPixel(float *res,int x,int y,
-					  const CTextureLookup& l)
+template <class T>
+void	CTiledTexture<T>::lookupPixel(float *res,int x,int y,
+				      const CTextureLookup& l)
 {
    int  	xTile;
    int  	yTile;
    CTextureBlock *block;
-   int  	i,j,t;
-   const float 	*data;
+   CTextureShard *shard;
+   CTextureThread *tls;
+   int  	t;
+   const T 	*data;
    int  	xi,yi;
 
-   refNumber++;
-   Stats->numTextureRef++;
+   tls = textureBeginLookup();
 
-   i = min(numSamples-l.channel,3);
    t = (1 << tileSizeShift) - 1;
    xi = x+1;
    yi = y+1;
@@ -757,19 +3034,18 @@ void	CTiledTexture<float>::lookupPixel(float *res,int x,int y,
 	xTile = __x >> tileSizeShift;   \
 	yTile = __y >> tileSizeShift;   \
 	block = dataBlocks[yTile][xTile];  	\
+	shard = NULL;	\
+	data = (const T *) textureCachedData(tls,block);	\
+	if (data == NULL) {	\
+	   if ((block->data == NULL) || block->prefetched)	\
+	      prefetchAround(xTile,yTile);	\
+	   data = (const T *) textureBlockData(tls,block,CTiffBlockLoader(name,directory,xTile << tileSizeShift,yTile << tileSizeShift,1 << tileSizeShift,1 << tileSizeShift,CTexelStorage<T>::kind),shard);	\
+	}	\
        	\
-	if (block->data == NULL) {    \
- textureLoadBlock(block,name,xTile << tileSizeShift,yTile << tileSizeShift,1 << tileSizeShift,1 << tileSizeShift,directory);	\
-	}       \
-       	\
-	block->lastRefNumber = refNumber;  	\
-       	\
-	res[0] = l.fill[0]; res[1] = l.fill[1]; res[2] = l.fill[2]; \
-	data = &((float *) block->data)[(((__y & t) << tileSizeShift)+(__x & t))*numSamples+l.channel];	\
-	for (j=0;j<i;j++) {     \
-             res[j] = data[j];    \
-	}       \
-	res += 3;
+	data += (((__y & t) << tileSizeShift)+(__x & t))*numSamples+l.channel;	\
+	texelFetch(res,data,numSamples-l.channel,l);	\
+	if (shard != NULL) textureReleaseBlock(shard);	\
+	res += 4;
 
    access(x,y);
    access(xi,y);
@@ -777,29 +3053,188 @@ void	CTiledTexture<float>::lookupPixel(float *res,int x,int y,
    access(xi,yi);
 
 #undef access
+
+   textureEndLookup(tls);
 }
 
+
 ///////////////////////////////////////////////////////////////////////
-// Class  :	CBasicTexture
+// Class  :	CTiledTexture
+// Method  :	lookupBatch
+// Description 	:	Bilinear lookup of n points
+// Return Value 	:	3 floats of color per point in r
+// Comments  :	0 <= (x,y) <= 1.  The points are sorted by tile, so each
+//		tile is found (and locked) once for all the points in it.
+//		Footprints straddling a tile edge go through lookupPixel
+//		once the tile is released.
+template <class T>
+void	CTiledTexture<T>::lookupBatch(float *r,const float *x,const float *y,
+				      int n,const CTextureLookup& l)
+{
+   CBatchPoint	points[kBATCH_SIZE];
+   int		xs[kBATCH_SIZE],ys[kBATCH_SIZE];
+   float	dx[kBATCH_SIZE],dy[kBATCH_SIZE];
+   int		edges[kBATCH_SIZE];
+   float	res[4*4];
+   int		start,m,numEdges;
+   int		i,j,k,p;
+   int		xTile,yTile;
+   int		t,xi,yi;
+   float	fx,fy;
+   CTextureBlock *block;
+   CTextureShard *shard;
+   CTextureThread *tls;
+   const T	*data;
+   const T	*d;
+   const int	stride = numSamples << tileSizeShift;
+
+   t = (1 << tileSizeShift) - 1;
+
+   for (start=0;start<n;start+=kBATCH_SIZE) {
+      m = min(n-start,kBATCH_SIZE);
+
+      // To the pixel space, as lookupFootprint does
+      for (i=0;i<m;i++) {
+	 fx = x[start+i]*width;
+	 fy = y[start+i]*height;
+	 xi = fastmath<float>::floor(fx);
+	 yi = fastmath<float>::floor(fy);
+	 dx[i] = fx - xi;
+	 dy[i] = fy - yi;
+	 if (xi >= width)  xi -= width;
+	 if (yi >= height) yi -= height;
+
+	 xs[i] = xi;
+	 ys[i] = yi;
+	 points[i].tile  = (yi >> tileSizeShift)*xTiles + (xi >> tileSizeShift);
+	 points[i].index = i;
+      }
+
+      qsort(points,m,sizeof(CBatchPoint),batchPointOrder);
+
+      tls = textureBeginLookup();
+      numEdges = 0;
+
+      for (i=0;i<m;i=j) {
+	 for (j=i+1;(j<m) && (points[j].tile == points[i].tile);j++);
+
+	 xTile = points[i].tile % xTiles;
+	 yTile = points[i].tile / xTiles;
+	 block = dataBlocks[yTile][xTile];
+	 shard = NULL;
+	 data = (const T *) textureCachedData(tls,block);
+	 if (data == NULL) {
+	    if ((block->data == NULL) || block->prefetched)
+	       prefetchAround(xTile,yTile);
+	    data = (const T *) textureBlockData(tls,block,CTiffBlockLoader(name,directory,xTile << tileSizeShift,yTile << tileSizeShift,1 << tileSizeShift,1 << tileSizeShift,CTexelStorage<T>::kind),shard);
+	 }
+
+	 for (k=i;k<j;k++) {
+	    p = points[k].index;
+	    if (((xs[p] & t) == t) || ((ys[p] & t) == t) ||
+		(xs[p]+1 >= width) || (ys[p]+1 >= height)) {
+	       edges[numEdges++] = p;
+	       continue;
+	    }
+
+	    d = data + (((ys[p] & t) << tileSizeShift)+(xs[p] & t))*numSamples+l.channel;
+	    texelFetch(res,d,numSamples-l.channel,l);
+	    texelFetch(res+4,d+numSamples,numSamples-l.channel,l);
+	    texelFetch(res+8,d+stride,numSamples-l.channel,l);
+	    texelFetch(res+12,d+stride+numSamples,numSamples-l.channel,l);
+	    texelBlend(r+3*(start+p),res,dx[p],dy[p]);
+	 }
+
+	 if (shard != NULL) textureReleaseBlock(shard);
+      }
+
+      // Every point is a reference, textureEndLookup counts one of them
+      if (m - numEdges > 1) {
+	 if (tls != NULL) tls->numRefs += m - numEdges - 1;
+	 else atomicAdd(&Stats->numTextureRef,(miUlong) (m - numEdges - 1));
+      }
+      textureEndLookup(tls);
+
+      for (k=0;k<numEdges;k++) {
+	 p = edges[k];
+	 lookupPixel(res,xs[p],ys[p],l);
+	 texelBlend(r+3*(start+p),res,dx[p],dy[p]);
+      }
+   }
+}
+
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CTiledTexture
+// Method  :	fetchDepths
+// Description 	:	Copy the depths of a block of pixels
+// Return Value 	:	w*h depths in r, row after row
+// Comments  :	The block must be inside the layer.  Each tile it
+//		overlaps is found (and locked) once.
+template <class T>
+void	CTiledTexture<T>::fetchDepths(float *r,int x0,int y0,int w,int h,
+				      const CTextureLookup& l)
+{
+   int  	xTile,yTile;
+   int  	xa,xb,ya,yb;
+   int  	x,y,t;
+   CTextureBlock *block;
+   CTextureShard *shard;
+   CTextureThread *tls;
+   const T 	*data;
+   float	res[4];
+
+   tls = textureBeginLookup();
+
+   t = (1 << tileSizeShift) - 1;
+
+   for (yTile=y0 >> tileSizeShift;yTile<=(y0+h-1) >> tileSizeShift;yTile++) {
+      ya = max(y0,yTile << tileSizeShift);
+      yb = min(y0+h,(yTile+1) << tileSizeShift);
+
+      for (xTile=x0 >> tileSizeShift;xTile<=(x0+w-1) >> tileSizeShift;xTile++) {
+	 xa = max(x0,xTile << tileSizeShift);
+	 xb = min(x0+w,(xTile+1) << tileSizeShift);
+
+	 block = dataBlocks[yTile][xTile];
+	 shard = NULL;
+	 data = (const T *) textureCachedData(tls,block);
+	 if (data == NULL) {
+	    if ((block->data == NULL) || block->prefetched)
+	       prefetchAround(xTile,yTile);
+	    data = (const T *) textureBlockData(tls,block,CTiffBlockLoader(name,directory,xTile << tileSizeShift,yTile << tileSizeShift,1 << tileSizeShift,1 << tileSizeShift,CTexelStorage<T>::kind),shard);
+	 }
+
+	 for (y=ya;y<yb;y++)
+	    for (x=xa;x<xb;x++) {
+	       texelFetch(res,data + (((y & t) << tileSizeShift)+(x & t))*numSamples+l.channel,numSamples-l.channel,l);
+	       r[(y-y0)*w + x-x0] = res[0];
+	    }
+
+	 if (shard != NULL) textureReleaseBlock(shard);
+      }
+   }
+
+   textureEndLookup(tls);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CMappedTexture
 // Method  :	lookup
 // Description 	:	Lookup a pixel in the texture
 // Return Value 	:
-// Comments  :	0 <= (x,y) <= 1
-// Date last edited :	2/28/2002
-void	CTiledTexture<unsigned char>::lookupPixel(float *res,int x,int y,
-						  const CTextureLookup& l)
+// Comments  :	No lock is taken, the tiles are always "resident"
+template <class T>
+void	CMappedTexture<T>::lookupPixel(float *res,int x,int y,
+				       const CTextureLookup& l)
 {
-   int   xTile;
-   int   yTile;
-   CTextureBlock 	*block;
-   int   i,j,t;
-   const unsigned char *data;
-   int   xi,yi;
+   int  	t;
+   const T 	*data;
+   int  	xi,yi;
 
-   refNumber++;
-   Stats->numTextureRef++;
+   atomicAdd(&Stats->numTextureRef,(miUlong) 1);
 
-   i = min(numSamples-l.channel,3);
    t = (1 << tileSizeShift) - 1;
    xi = x+1;
    yi = y+1;
@@ -807,22 +3242,10 @@ void	CTiledTexture<unsigned char>::lookupPixel(float *res,int x,int y,
    if (yi >= height)	yi	-= height;
 
 #define	access(__x,__y)     \
-	xTile = __x >> tileSizeShift;   \
-	yTile = __y >> tileSizeShift;   \
-	block = dataBlocks[yTile][xTile];  	\
-       	\
-	if (block->data == NULL) {    \
- textureLoadBlock(block,name,xTile << tileSizeShift,yTile << tileSizeShift,1 << tileSizeShift,1 << tileSizeShift,directory);	\
-	}       \
-       	\
-	block->lastRefNumber = refNumber;  	\
-       	\
-	res[0] = l.fill[0]; res[1] = l.fill[1]; res[2] = l.fill[2]; \
-	data = &((unsigned char *) block->data)[(((__y & t) << tileSizeShift)+(__x & t))*numSamples+l.channel];	\
-	for (j=0;j<i;j++) {     \
-            res[j] = data[j]*inv255;   	\
-	}       \
-	res += 3;
+	data = tiles[(__y >> tileSizeShift)*xTiles + (__x >> tileSizeShift)] + \
+	       (((__y & t) << tileSizeShift)+(__x & t))*numSamples+l.channel;	\
+	texelFetch(res,data,numSamples-l.channel,l);	\
+	res += 4;
 
    access(x,y);
    access(xi,y);
@@ -881,6 +3304,32 @@ void CTexture::lookup4( const miState* const state,
    initv(s,l.fill);
 }
 
+///////////////////////////////////////////////////////////////////////
+// Class  :	CTexture
+// Method  :	lookupBox
+// Description 	:	Box filtered lookup without a state
+// Comments  :	Textures without a pyramid just do a point lookup
+void CTexture::lookupBox( float *result,float s,float t,float size,
+			  const CTextureLookup& l)
+{
+   lookup(NULL,result,s,t,l);
+}
+
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CTexture
+// Method  :	lookupBatch
+// Description 	:	Box filtered lookup of n points without a state
+// Comments  :	Falls back on lookupBox for each point
+void CTexture::lookupBatch( float *result,const float *s,const float *t,
+			    const float *size,int n,const CTextureLookup& l)
+{
+   int	i;
+
+   for (i=0;i<n;i++)
+      lookupBox(result+3*i,s[i],t[i],(size != NULL) ? size[i] : 0,l);
+}
+
 
 ///////////////////////////////////////////////////////////////////////
 // Class				:	CMadeTexture
@@ -964,6 +3413,376 @@ void	 CMadeTexture::lookup(const miState* const state,
    layers[0]->lookup(state, result,s,t,l);
 }
 
+///////////////////////////////////////////////////////////////////////
+// Class  :	CMadeTexture
+// Method  :	lookupBox
+// Description 	:	Box filtered lookup without a state
+// Comments  :	Blends the two levels whose texels are closest to size
+void	 CMadeTexture::lookupBox(float *result,float s,float t,float size,
+				 const CTextureLookup& l)
+{
+   float	level;
+   int	i;
+
+   if (s < 0)  s = 0;
+   if (s > 1)  s = 1;
+   if (t < 0)  t = 0;
+   if (t > 1)  t = 1;
+
+   level = size*max(width,height);
+   level = (level > 1) ? math<float>::log(level) / math<float>::log(2.0f) : 0;
+   i  = (int) level;
+
+   if (i >= numLayers-1)
+      layers[numLayers-1]->lookup(NULL,result,s,t,l);
+   else
+      layers[i]->lookup(NULL,result,s,t,layers[i+1],level-i,l);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CMadeTexture
+// Method  :	lookupBatch
+// Description 	:	Box filtered lookup of n points without a state
+// Comments  :	Same filtering as lookupBox, but the points are grouped
+//		by mip level and each level looks its group up in one
+//		batch, so that the tiles are fetched once per batch.
+void	 CMadeTexture::lookupBatch(float *result,const float *s,
+				   const float *t,const float *size,int n,
+				   const CTextureLookup& l)
+{
+   float	S[kBATCH_SIZE],T[kBATCH_SIZE];
+   float	offset[kBATCH_SIZE];
+   int		level[kBATCH_SIZE];
+   int		order[kBATCH_SIZE];
+   float	c0[3*kBATCH_SIZE],c1[3*kBATCH_SIZE];
+   float	bs[kBATCH_SIZE],bt[kBATCH_SIZE];
+   int		start,m,k,i,j,lv;
+   miBoolean	blend;
+   float	f;
+
+   for (start=0;start<n;start+=kBATCH_SIZE) {
+      m = min(n-start,kBATCH_SIZE);
+
+      for (i=0;i<m;i++) {
+	 S[i] = s[start+i];
+	 T[i] = t[start+i];
+	 if (S[i] < 0)  S[i] = 0;
+	 if (S[i] > 1)  S[i] = 1;
+	 if (T[i] < 0)  T[i] = 0;
+	 if (T[i] > 1)  T[i] = 1;
+
+	 f = (size != NULL) ? size[start+i]*max(width,height) : 0;
+	 f = (f > 1) ? math<float>::log(f) / math<float>::log(2.0f) : 0;
+	 lv = (int) f;
+	 if (lv >= numLayers-1) {
+	    level[i]  = numLayers-1;
+	    offset[i] = 0;
+	 } else {
+	    level[i]  = lv;
+	    offset[i] = f - lv;
+	 }
+      }
+
+      // One batch per level, blended with the next level if needed
+      for (lv=0;lv<numLayers;lv++) {
+	 k = 0;
+	 blend = miFALSE;
+	 for (i=0;i<m;i++) {
+	    if (level[i] != lv) continue;
+	    order[k] = i;
+	    bs[k] = S[i];
+	    bt[k] = T[i];
+	    if (offset[i] > 0) blend = miTRUE;
+	    k++;
+	 }
+	 if (k == 0) continue;
+
+	 layers[lv]->lookupBatch(c0,bs,bt,k,l);
+	 if (blend) {
+	    layers[lv+1]->lookupBatch(c1,bs,bt,k,l);
+	    for (j=0;j<k;j++) {
+	       f = offset[order[j]];
+	       c0[3*j]   += (c1[3*j]   - c0[3*j])*f;
+	       c0[3*j+1] += (c1[3*j+1] - c0[3*j+1])*f;
+	       c0[3*j+2] += (c1[3*j+2] - c0[3*j+2])*f;
+	    }
+	 }
+
+	 for (j=0;j<k;j++) {
+	    float *r = result + 3*(start+order[j]);
+	    r[0] = c0[3*j];
+	    r[1] = c0[3*j+1];
+	    r[2] = c0[3*j+2];
+	 }
+      }
+   }
+}
+
+
+//! Gaussian weights for the EWA filter, indexed by the squared
+//! distance to the center of the ellipse (1 = on the ellipse)
+static const int	kEWA_LUT_SIZE	= 128;
+//! Maximum eccentricity of the EWA ellipse
+static const float	kEWA_MAX_ANISOTROPY = 16.0f;
+
+static struct CEWAWeights
+{
+     CEWAWeights()
+     {
+	const float alpha = 2.0f;
+	for (int i=0;i<kEWA_LUT_SIZE;i++)
+	{
+	   float r2 = (float) i / (float) (kEWA_LUT_SIZE-1);
+	   w[i] = expf(-alpha*r2) - expf(-alpha);
+	}
+     }
+
+     float	w[kEWA_LUT_SIZE];
+} ewaWeights;
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	ewaWrap
+// Description 	:	Apply a wrap mode to a texel coordinate
+// Return Value 	:	The wrapped coordinate, inside is set to miFALSE
+//			if the texel is outside of a black texture
+static inline int	ewaWrap(int x,int w,TTextureMode mode,
+				miBoolean& inside)
+{
+   inside = miTRUE;
+   switch(mode) {
+      case kTEXTURE_PERIODIC:
+	 x %= w;
+	 if (x < 0) x += w;
+	 return x;
+      case kTEXTURE_BLACK:
+	 inside = (x >= 0) && (x < w);
+	 // fall through
+      case kTEXTURE_CLAMP:
+      default:
+	 if (x < 0)  return 0;
+	 if (x >= w) return w-1;
+	 return x;
+   }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class    : CMadeTexture
+// Method    : lookupEWALevel
+// Description   : Elliptical weighted average on a single mip level
+// Return Value   : -
+// Comments    :	(s,t) is the center in [0,1], sxx,sxy,syy the
+//		covariance of the footprint in texels of the first level
+void  CMadeTexture::lookupEWALevel(int level,float *result,float s,float t,
+				   float sxx,float sxy,float syy,
+				   const CTextureLookup& lookup)
+{
+   CTextureLayer	*layer = layers[level];
+   const float	kx = (float) layer->width  / (float) width;
+   const float	ky = (float) layer->height / (float) height;
+   float	A,B,C,F;
+   float	det,du,dv;
+   float	ss,tt,r2,w,sum;
+   float	res[4*4];
+   int  	x,y,x0,x1,y0,y1,dx,dy;
+   int  	xw,yw,xn,yn;
+   miBoolean	inX,inY,inXn,inYn;
+
+   // To this level's texels (texel centers are at +0.5)
+   s    = s*layer->width  - 0.5f;
+   t    = t*layer->height - 0.5f;
+   sxx *= kx*kx;
+   sxy *= kx*ky;
+   syy *= ky*ky;
+
+   // The implicit ellipse A ss^2 + B ss tt + C tt^2 < 1, widened by one
+   // texel for reconstruction
+   A  = syy + 1;
+   B  = -2*sxy;
+   C  = sxx + 1;
+   F  = A*C - B*B*0.25f;
+   A /= F;
+   B /= F;
+   C /= F;
+
+   // Its bounding box
+   det = 4*A*C - B*B;
+   du  = 2*math<float>::sqrt(C/det);
+   dv  = 2*math<float>::sqrt(A/det);
+   du  = min(du,(float) layer->width);
+   dv  = min(dv,(float) layer->height);
+   x0  = (int) ceil(s - du);
+   x1  = (int) floor(s + du);
+   y0  = (int) ceil(t - dv);
+   y1  = (int) floor(t + dv);
+
+   result[0] = result[1] = result[2] = 0;
+   sum = 0;
+
+   // Fetch the texels 2x2 at a time, as lookupPixel returns them
+   for (y=y0;y<=y1;y+=2)
+   {
+      yw = ewaWrap(y,layer->height,tMode,inY);
+      yn = ewaWrap(y+1,layer->height,tMode,inYn);
+
+      for (x=x0;x<=x1;x+=2)
+      {
+	 xw = ewaWrap(x,layer->width,sMode,inX);
+	 xn = ewaWrap(x+1,layer->width,sMode,inXn);
+
+	 layer->lookupPixel(res,xw,yw,lookup);
+
+	 for (dy=0;dy<2;dy++)
+	 {
+	    if (y+dy > y1)	break;
+	    tt = (float) (y+dy) - t;
+
+	    for (dx=0;dx<2;dx++)
+	    {
+	       if (x+dx > x1)	break;
+	       ss = (float) (x+dx) - s;
+
+	       r2 = A*ss*ss + B*ss*tt + C*tt*tt;
+	       if (r2 >= 1)	continue;
+
+	       w = ewaWeights.w[(int) (r2*(kEWA_LUT_SIZE-1))];
+	       sum += w;
+
+	       if (!(dx ? inXn : inX) || !(dy ? inYn : inY))
+	       {
+		  // Outside of a black texture
+		  result[0] += lookup.fill[0]*w;
+		  result[1] += lookup.fill[1]*w;
+		  result[2] += lookup.fill[2]*w;
+		  continue;
+	       }
+
+	       // lookupPixel wraps x+1 and y+1 around, clamping repeats
+	       // the last row/column instead
+	       const float *texel = res +
+				    ((dy && yn != yw ? 2 : 0) +
+				     (dx && xn != xw ? 1 : 0))*4;
+	       result[0] += texel[0]*w;
+	       result[1] += texel[1]*w;
+	       result[2] += texel[2]*w;
+	    }
+	 }
+      }
+   }
+
+   if (sum > 0)
+   {
+      w = 1 / sum;
+      mulvf(result,w);
+   }
+   else
+   {
+      layer->lookup(NULL,result,(s+0.5f)/layer->width,
+		    (t+0.5f)/layer->height,lookup);
+   }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class    : CMadeTexture
+// Method    : lookupEWA
+// Description   : Area lookup with an elliptical weighted average
+// Return Value   : -
+// Comments    :	The ellipse is fit to all 4 corners, through their
+//		covariance, so the corner order doesn't matter.  The mip
+//		level is picked from the minor axis, and the two levels
+//		around it are blended.
+void  CMadeTexture::lookupEWA(const miState* const state,
+			      float *result,const float *u,const float *v,
+			      const CTextureLookup& lookup)
+{
+   const float  cs = (u[0] + u[1] + u[2] + u[3]) * (float) 0.25;
+   const float  ct = (v[0] + v[1] + v[2] + v[3]) * (float) 0.25;
+   float   s,t,ds,dt;
+   float   sxx,sxy,syy;
+   float   mid,dev,lmin,lmax,d;
+   float   l,offset;
+   float   r0[3],r1[3];
+   int     i;
+
+   // The covariance of the corners, in texels of the first level
+   sxx = sxy = syy = 0;
+   for (i=0;i<4;i++)
+   {
+      ds   = (u[i] - cs)*width;
+      dt   = (v[i] - ct)*height;
+      sxx += ds*ds;
+      sxy += ds*dt;
+      syy += dt*dt;
+   }
+
+   // Its eigenvalues are the squared axes of the ellipse.  Keep the
+   // eccentricity in check by widening the ellipse if needed.
+   mid  = (sxx + syy)*0.5f;
+   dev  = math<float>::sqrt((sxx - syy)*(sxx - syy)*0.25f + sxy*sxy);
+   lmax = mid + dev;
+   lmin = max(mid - dev,0.f);
+   d    = kEWA_MAX_ANISOTROPY*kEWA_MAX_ANISOTROPY;
+   if (lmax > lmin*d)
+   {
+      d = (lmax - lmin*d) / (d - 1);
+      sxx  += d;
+      syy  += d;
+      lmin += d;
+   }
+
+   // Do the s,t modes on the center
+   s = cs;
+   t = ct;
+   if (sMode == kTEXTURE_PERIODIC) {
+      s = (float) fmod(s,1);
+      if (s < 0) s += 1;
+   }
+   if (tMode == kTEXTURE_PERIODIC) {
+      t = (float) fmod(t,1);
+      if (t < 0) t += 1;
+   }
+
+   // Find the levels to probe
+   l = (lmin > 1) ? (float) (math<float>::log(lmin)*0.5 /
+			     math<float>::log(2)) : 0;
+   i = (int) floor(l);
+   if (i >= (numLayers-1))
+   {
+      lookupEWALevel(numLayers-1,result,s,t,sxx,sxy,syy,lookup);
+      return;
+   }
+   offset = l - i;
+
+   lookupEWALevel(i,r0,s,t,sxx,sxy,syy,lookup);
+   if (offset <= 0)
+   {
+      initv(result,r0);
+      return;
+   }
+   lookupEWALevel(i+1,r1,s,t,sxx,sxy,syy,lookup);
+
+   result[0] = r0[0] + (r1[0] - r0[0])*offset;
+   result[1] = r0[1] + (r1[1] - r0[1])*offset;
+   result[2] = r0[2] + (r1[2] - r0[2])*offset;
+}
+
+//! Blend n samples of two levels and add them to result, weighted by w
+static void lookup4Batch(float *result,CTextureLayer *layer0,
+			 CTextureLayer *layer1,float offset,
+			 const float *s,const float *t,const float *w,
+			 float *c0,float *c1,int n,
+			 const CTextureLookup& lookup)
+{
+   int	j;
+
+   layer0->lookupBatch(c0,s,t,n,lookup);
+   layer1->lookupBatch(c1,s,t,n,lookup);
+
+   for (j=0;j<n;j++) {
+      result[0] += (c0[3*j]   + (c1[3*j]   - c0[3*j])*offset)*w[j];
+      result[1] += (c0[3*j+1] + (c1[3*j+1] - c0[3*j+1])*offset)*w[j];
+      result[2] += (c0[3*j+2] + (c1[3*j+2] - c0[3*j+2])*offset)*w[j];
+   }
+}
 
 ///////////////////////////////////////////////////////////////////////
 // Class    : CMadeTexture
@@ -986,6 +3805,12 @@ void  CMadeTexture::lookup4(const miState* const state,
    const float  ct = (v[0] + v[1] + v[2] + v[3]) * (float) 0.25;
    float   ds,dt,d;
 
+   if (lookup.ewa)
+   {
+      lookupEWA(state,result,u,v,lookup);
+      return;
+   }
+
    ds  = u[0] - cs;
    dt  = v[0] - ct;
    diag = ds*ds*width*width + dt*dt*height*height;
@@ -1017,6 +3842,11 @@ void  CMadeTexture::lookup4(const miState* const state,
 
    initvf(result,0);     // Result is black
 
+   // The samples are looked up in batches, sorted by tile
+   float   S[kBATCH_SIZE],T[kBATCH_SIZE],W[kBATCH_SIZE];
+   float   c0[3*kBATCH_SIZE],c1[3*kBATCH_SIZE];
+   int     numBatch = 0;
+
    int counter = 0;
    double r[2];
    miUint samples = lookup.numSamples;
@@ -1024,7 +3854,6 @@ void  CMadeTexture::lookup4(const miState* const state,
 		     2, &samples ) )
    {
       float   s,t;
-      vector   C,CC0,CC1;
       float   contribution;
 
       s     = ( (u[0]*(1.0f-(float)r[0]) +
@@ -1070,20 +3899,19 @@ void  CMadeTexture::lookup4(const miState* const state,
 	    break;
       }
 
-      // lookup (s,t) and add it to the result
-      layer0->lookup(state, (float*)&CC0,s,t,lookup);
-      layer1->lookup(state, (float*)&CC1,s,t,lookup);
-
-      miScalar one_offset = 1.0f - offset;
-      C.x = CC0.x * one_offset + CC1.x * offset;
-      C.y = CC0.y * one_offset + CC1.y * offset;
-      C.z = CC0.z * one_offset + CC1.z * offset;
+      S[numBatch] = s;
+      T[numBatch] = t;
+      W[numBatch] = contribution;
+      if (++numBatch < kBATCH_SIZE) continue;
 
-      result[0]  += C[0]*contribution;
-      result[1]  += C[1]*contribution;
-      result[2]  += C[2]*contribution;
+      // lookup the batch in both levels and add it to the result
+      lookup4Batch(result,layer0,layer1,offset,S,T,W,c0,c1,numBatch,lookup);
+      numBatch = 0;
    }
 
+   if (numBatch > 0)
+      lookup4Batch(result,layer0,layer1,offset,S,T,W,c0,c1,numBatch,lookup);
+
    float tmp = 1 / totalContribution;
    mulvf(result,tmp);
 }
@@ -1235,13 +4063,181 @@ void  CRegularTexture::lookup4( const miState* const state,
       // lookup (s,t) and add it to the result
       layer->lookup( state, (float*)&C, s, t, lookup);
 
-      result[0] += C[0]*contribution;
-      result[1] += C[1]*contribution;
-      result[2] += C[2]*contribution;
+      result[0] += C[0]*contribution;
+      result[1] += C[1]*contribution;
+      result[2] += C[2]*contribution;
+   }
+
+   float	tmp = 1.0f / totalContribution;
+   mulvf(result,tmp);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CUdimTexture
+// Method  :	CUdimTexture
+// Description 	:	Ctor
+// Comments  :	No file is opened here.  The size is that of the first
+//		tile loaded.
+CUdimTexture::CUdimTexture(const char *name,TSearchpath *p,int d) :
+CTexture(name,0,0,kTEXTURE_BLACK,kTEXTURE_BLACK),
+path( p ),
+directory( d )
+{
+   int	i;
+
+   for (i=0;i<MR_UDIM_COLUMNS*MR_UDIM_ROWS;i++) {
+      tiles[i]  = NULL;
+      loaded[i] = 0;
+   }
+
+   mi_init_lock( &loadLock );
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CUdimTexture
+// Method  :	~CUdimTexture
+// Description 	:	Dtor
+CUdimTexture::~CUdimTexture()
+{
+   int	i;
+
+   for (i=0;i<MR_UDIM_COLUMNS*MR_UDIM_ROWS;i++)
+      textureRelease(tiles[i]);
+
+   mi_delete_lock( &loadLock );
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CUdimTexture
+// Method  :	tile
+// Description 	:	The texture of a square, loaded on first use
+// Return Value 	:	NULL if there is no file for the square
+// Comments  :	Once loaded is set, tiles is read without the lock.
+//		A missing file is only looked for once.
+CTexture*	CUdimTexture::tile(int i)
+{
+   char 	fn[OS_MAX_PATH_LENGTH];
+   char 	udim[8];
+   const char	*p;
+   size_t	n;
+
+   if (loaded[i]) {
+      memoryBarrier();
+      return tiles[i];
+   }
+
+   mi_lock(loadLock);
+
+   if (!loaded[i]) {
+      p = strstr(name,"<UDIM>");
+      n = p - name;
+      sprintf(udim,"%04d",1001 + i);
+
+      if (n + 4 + strlen(p + 6) < sizeof(fn)) {
+	 memcpy(fn,name,n);
+	 strcpy(fn + n,udim);
+	 strcat(fn + n,p + 6);
+
+	 tiles[i] = textureLoad(fn,path,directory);
+	 if ((tiles[i] != NULL) && (width == 0)) {
+	    width  = tiles[i]->width;
+	    height = tiles[i]->height;
+	 }
+      }
+
+      memoryBarrier();
+      loaded[i] = 1;
+   }
+
+   mi_unlock(loadLock);
+
+   return tiles[i];
+}
+
+//! The UDIM square (s,t) falls in, moving (s,t) into it
+//! \return -1 outside of the set
+static int	udimSquare(float& s,float& t)
+{
+   const int	u = fastmath<float>::floor(s);
+   const int	v = fastmath<float>::floor(t);
+
+   if ((u < 0) || (u >= MR_UDIM_COLUMNS) || (v < 0) || (v >= MR_UDIM_ROWS))
+      return -1;
+
+   s -= u;
+   t -= v;
+   return v*MR_UDIM_COLUMNS + u;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CUdimTexture
+// Method  :	lookup
+// Description 	:	Point lookup in the square (s,t) falls in
+void  CUdimTexture::lookup( const miState* const state,
+			    float *result,float s,float t,
+			    const CTextureLookup& l)
+{
+   CTexture	*txt;
+   int	i;
+
+   if (((i = udimSquare(s,t)) < 0) || ((txt = tile(i)) == NULL)) {
+      initv(result,l.fill);
+      return;
+   }
+
+   txt->lookup(state,result,s,t,l);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CUdimTexture
+// Method  :	lookup4
+// Description 	:	Area lookup in the square the center falls in
+// Comments  :	The corners are moved by the same amount, so footprints
+//		straddling two squares read over the edge of one of them
+void  CUdimTexture::lookup4( const miState* const state,
+			     float *result,const float *u,const float *v,
+			     const CTextureLookup& l)
+{
+   CTexture	*txt;
+   float	cs = (u[0] + u[1] + u[2] + u[3]) * (float) 0.25;
+   float	ct = (v[0] + v[1] + v[2] + v[3]) * (float) 0.25;
+   float	du,dv;
+   float	U[4],V[4];
+   int	i;
+
+   du = cs;
+   dv = ct;
+   if (((i = udimSquare(cs,ct)) < 0) || ((txt = tile(i)) == NULL)) {
+      initv(result,l.fill);
+      return;
+   }
+
+   du -= cs;
+   dv -= ct;
+   for (i=0;i<4;i++) {
+      U[i] = u[i] - du;
+      V[i] = v[i] - dv;
    }
 
-   float	tmp = 1.0f / totalContribution;
-   mulvf(result,tmp);
+   txt->lookup4(state,result,U,V,l);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CUdimTexture
+// Method  :	lookupBox
+// Description 	:	Box filtered lookup in the square (s,t) falls in
+void  CUdimTexture::lookupBox( float *result,float s,float t,float size,
+			       const CTextureLookup& l)
+{
+   CTexture	*txt;
+   int	i;
+
+   if (((i = udimSquare(s,t)) < 0) || ((txt = tile(i)) == NULL)) {
+      initv(result,l.fill);
+      return;
+   }
+
+   txt->lookupBox(result,s,t,size,l);
 }
 
 
@@ -1257,14 +4253,132 @@ NY,
 NZ,
 } ESide;
 
-typedef enum {
-XYZ,
-XZY,
-YXZ,
-YZX,
-ZXY,
-ZYX
-} EOrder;
+//! The axes spanning the sides of a cube, by major axis
+static const int	kCUBE_UAXIS[3] = { 1, 0, 0 };
+static const int	kCUBE_VAXIS[3] = { 2, 2, 1 };
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	cubeSide
+// Description 	:	Find the side of a cube a direction points at
+// Return Value 	:	The side, its major axis in axis
+// Comments  :	Ties go to x, then y.  Written as selects rather than
+//		nested branches so that it compiles to conditional moves.
+static inline int	cubeSide(const float *D,int& axis)
+{
+   const float	ax = math<float>::fabs(D[0]);
+   const float	ay = math<float>::fabs(D[1]);
+   const float	az = math<float>::fabs(D[2]);
+
+   axis = (ay > ax);
+   axis = (az > (axis ? ay : ax)) ? 2 : axis;
+   return axis + ((D[axis] > 0) ? PX : NX);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	latLongDirection
+// Description 	:	The direction through the center of a texel of
+//			a w by h lat-long map
+static inline void	latLongDirection(float *D,int x,int y,int w,int h)
+{
+   const float	phi   = ((x + 0.5f) / w - 0.5f) * (float) (2*M_PI);
+   const float	theta = ((y + 0.5f) / h) * (float) M_PI;
+   const float	st    = math<float>::sin(theta);
+
+   D[0] = st*math<float>::cos(phi);
+   D[1] = st*math<float>::sin(phi);
+   D[2] = math<float>::cos(theta);
+}
+
+
+//! A lat-long pyramid of an environment.  Level l is (2*height >> l)
+//! by (height >> l) rgb texels, blurred by about the size of a texel,
+//! so that a lookup of any width is a bilinear fetch in two levels.
+class	CEnvironmentPyramid {
+   public:
+     CEnvironmentPyramid(int);
+     ~CEnvironmentPyramid();
+
+     //! Bilinear fetch in a level, 0 <= (s,t) <= 1
+     void	fetch(float *,int,float,float) const;
+
+     int	height;		//<- Of level 0
+     int	numLevels;
+     float	**levels;
+};
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CEnvironmentPyramid
+// Method  :	CEnvironmentPyramid
+// Description 	:	Ctor
+// Comments  :	The levels go down to 4x2
+CEnvironmentPyramid::CEnvironmentPyramid(int h) :
+height( h ),
+numLevels( 0 )
+{
+   int	l;
+
+   while ((height >> numLevels) >= 2)	numLevels++;
+
+   levels = new float*[numLevels];
+   for (l=0;l<numLevels;l++)
+      levels[l] = new float[3*2*(height >> l)*(height >> l)];
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CEnvironmentPyramid
+// Method  :	~CEnvironmentPyramid
+// Description 	:	Dtor
+CEnvironmentPyramid::~CEnvironmentPyramid()
+{
+   int	l;
+
+   for (l=0;l<numLevels;l++)	delete [] levels[l];
+   delete [] levels;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CEnvironmentPyramid
+// Method  :	fetch
+// Description 	:	Bilinear fetch in a level
+// Comments  :	Wraps around in s, clamps in t
+void	CEnvironmentPyramid::fetch(float *r,int l,float s,float t) const
+{
+   const int	h = height >> l;
+   const int	w = 2*h;
+   const float	*data = levels[l];
+   float	res[4*4];
+   float	x,y,dx,dy;
+   int	x0,x1,y0,y1,i;
+
+   x  = s*w - 0.5f;
+   y  = t*h - 0.5f;
+   x0 = fastmath<float>::floor(x);
+   y0 = fastmath<float>::floor(y);
+   dx = x - x0;
+   dy = y - y0;
+
+   if (x0 < 0)	x0 += w;
+   if (x0 >= w)	x0 -= w;
+   x1 = (x0 + 1 < w) ? x0 + 1 : 0;
+   y1 = (y0 + 1 < h) ? y0 + 1 : h - 1;
+   if (y0 < 0)	y0 = 0;
+   if (y0 >= h)	y0 = h - 1;
+
+   const float	*texels[4] = { data + 3*(y0*w + x0), data + 3*(y0*w + x1),
+			       data + 3*(y1*w + x0), data + 3*(y1*w + x1) };
+   for (i=0;i<4;i++) {
+      res[4*i]   = texels[i][0];
+      res[4*i+1] = texels[i][1];
+      res[4*i+2] = texels[i][2];
+      res[4*i+3] = 0;
+   }
+
+#ifdef MR_SSE2
+   texelStore(r,texelBilerp(res,dx,dy));
+#else
+   texelBilerp(r,res,dx,dy);
+#endif
+}
 
 
 ///////////////////////////////////////////////////////////////////////
@@ -1272,7 +4386,8 @@ ZYX
 // Method  :	CEnvironment
 // Description 	:	Ctor
 CEnvironment::CEnvironment(const char *n) :
-name( mi_mem_strdup(n) )
+name( mi_mem_strdup(n) ),
+pyramid( NULL )
 {
 }
 
@@ -1282,6 +4397,7 @@ name( mi_mem_strdup(n) )
 // Description 	:	Dtor
 CEnvironment::~CEnvironment()
 {
+   delete pyramid;
 }
 
 ///////////////////////////////////////////////////////////////////////
@@ -1297,26 +4413,566 @@ void 	CEnvironment::lookup( const miState* const state,
    result[2] = 1.0f-lookup.fill[2];
 }
 
+///////////////////////////////////////////////////////////////////////
+// Class  :	CEnvironment
+// Method  :	sample
+// Description 	:	Average the map around a direction
+// Comments  :	Only maps that prefilter() override this
+void	CEnvironment::sample(float *result,const float *D,float angle)
+{
+   initvf(result,0);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CEnvironment
+// Method  :	prefilter
+// Description 	:	Build the prefiltered pyramid
+// Comments  :	The finest level is sampled from the map.  Each coarser
+//		level blurs the one above it with a spherical gaussian,
+//		so that the blurs add up to about half a texel of the
+//		level, whatever the latitude.
+void	CEnvironment::prefilter()
+{
+   const float	pi = (float) M_PI;
+   float	D[3];
+   float	*dirs,*weights;
+   int	l,x,y,i,j;
+
+   if (environmentPrefilter < 2)	return;
+
+   pyramid = new CEnvironmentPyramid(environmentPrefilter);
+
+   {
+      const int	h = pyramid->height;
+      const int	w = 2*h;
+      float	*dst = pyramid->levels[0];
+
+      for (y=0;y<h;y++)
+	 for (x=0;x<w;x++,dst+=3) {
+	    latLongDirection(D,x,y,w,h);
+	    sample(dst,D,pi/h);
+	 }
+   }
+
+   for (l=1;l<pyramid->numLevels;l++) {
+      const int	sh = pyramid->height >> (l-1);
+      const int	sw = 2*sh;
+      const int	h  = sh >> 1;
+      const int	w  = 2*h;
+      const float	*src = pyramid->levels[l-1];
+      float	*dst = pyramid->levels[l];
+      const float	sigmaSrc = 0.5f*pi/sh;
+      const float	sigmaDst = 0.5f*pi/h;
+      const float	var = sigmaDst*sigmaDst - sigmaSrc*sigmaSrc;
+      const float	k = 1 / var;
+      const float	cutoff = 1 - 4.5f*var;	// About 3 deviations out
+
+      // The directions and solid angles of the texels above
+      dirs    = new float[3*sw*sh];
+      weights = new float[sw*sh];
+      for (i=0,y=0;y<sh;y++)
+	 for (x=0;x<sw;x++,i++) {
+	    latLongDirection(dirs+3*i,x,y,sw,sh);
+	    weights[i] = math<float>::sin(((y + 0.5f) / sh)*pi);
+	 }
+
+      for (y=0;y<h;y++)
+	 for (x=0;x<w;x++,dst+=3) {
+	    float	total = 0;
+
+	    latLongDirection(D,x,y,w,h);
+	    initvf(dst,0);
+
+	    for (j=0;j<sw*sh;j++) {
+	       const float	*sd = dirs + 3*j;
+	       const float	c = D[0]*sd[0] + D[1]*sd[1] + D[2]*sd[2];
+	       float	wt;
+
+	       if (c < cutoff)	continue;
+
+	       wt = math<float>::exp((c - 1)*k)*weights[j];
+	       dst[0] += src[3*j]*wt;
+	       dst[1] += src[3*j+1]*wt;
+	       dst[2] += src[3*j+2]*wt;
+	       total  += wt;
+	    }
+
+	    if (total > 0) {
+	       total = 1 / total;
+	       mulvf(dst,total);
+	    }
+	 }
+
+      delete [] dirs;
+      delete [] weights;
+   }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CEnvironment
+// Method  :	lookupPrefiltered
+// Description 	:	Lookup the prefiltered pyramid
+// Return Value 	:	miFALSE if the footprint is narrower than a
+//			texel of the pyramid (or there is none)
+// Comments  :	The blur of the lookup widens the footprint, in radians
+miBoolean	CEnvironment::lookupPrefiltered(float *result,const float *D,
+						const float *Du,const float *Dv,
+						const CTextureLookup& lookup)
+{
+   float	l2,angle,level,offset,s,t;
+   float	c1[3];
+   int	i;
+
+   if (pyramid == NULL)	return miFALSE;
+
+   l2 = D[0]*D[0] + D[1]*D[1] + D[2]*D[2];
+   if (l2 <= 0)	return miFALSE;
+
+   angle = max(Du[0]*Du[0] + Du[1]*Du[1] + Du[2]*Du[2],
+	       Dv[0]*Dv[0] + Dv[1]*Dv[1] + Dv[2]*Dv[2]);
+   angle = math<float>::sqrt(angle / l2) + lookup.blur;
+
+   // Texels of level l are pi*2^l/height wide
+   level = angle*pyramid->height / (float) M_PI;
+   if (level < 1)	return miFALSE;
+
+   level  = math<float>::log(level) / math<float>::log(2.0f);
+   i      = (int) level;
+   offset = level - i;
+   if (i >= pyramid->numLevels-1) {
+      i      = pyramid->numLevels-1;
+      offset = 0;
+   }
+
+   t = D[2] / math<float>::sqrt(l2);
+   if (t < -1)	t = -1;
+   if (t > 1)	t = 1;
+   s = math<float>::atan2(D[1],D[0]) * (float) (0.5/M_PI) + 0.5f;
+   t = math<float>::acos(t) * (float) (1/M_PI);
+
+   pyramid->fetch(result,i,s,t);
+   if (offset > 0) {
+      pyramid->fetch(c1,i+1,s,t);
+      result[0] += (c1[0] - result[0])*offset;
+      result[1] += (c1[1] - result[1])*offset;
+      result[2] += (c1[2] - result[2])*offset;
+   }
+
+   return miTRUE;
+}
+
+//! Largest block of depths percentage closer filtering fetches at once
+static const int kSHADOW_REGION = 64*64;
+//! Smallest variance of variance shadow maps, against precision loss
+static const float kSHADOW_MIN_VARIANCE = 1e-5f;
+
+//! A pyramid of the depth moments of a shadow map, 2 floats a texel:
+//! the depth and its square for variance shadow maps, the exponential
+//! of the depth for exponential ones.  Level l is the map halved l
+//! times, down to 1x1, each texel the average of 2x2 of the level above.
+class	CShadowMoments {
+   public:
+     CShadowMoments(int,int);
+     ~CShadowMoments();
+
+     //! Bilinear fetch in a level, 0 <= (s,t) <= 1
+     void	fetch(float *,int,float,float) const;
+     //! Average level l-1 into level l
+     void	reduce(int);
+
+     int	width,height;	//<- Of level 0
+     int	numLevels;
+     float	**levels;
+};
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CShadowMoments
+// Method  :	CShadowMoments
+// Description 	:	Ctor
+CShadowMoments::CShadowMoments(int w,int h) :
+width( w ),
+height( h ),
+numLevels( 1 )
+{
+   int	l;
+
+   while (((width >> (numLevels-1)) > 1) || ((height >> (numLevels-1)) > 1))
+      numLevels++;
+
+   levels = new float*[numLevels];
+   for (l=0;l<numLevels;l++)
+      levels[l] = new float[2*max(width >> l,1)*max(height >> l,1)];
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CShadowMoments
+// Method  :	~CShadowMoments
+// Description 	:	Dtor
+CShadowMoments::~CShadowMoments()
+{
+   int	l;
+
+   for (l=0;l<numLevels;l++)	delete [] levels[l];
+   delete [] levels;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CShadowMoments
+// Method  :	reduce
+// Description 	:	Average level l-1 into level l
+// Comments  :	Odd sizes repeat the last row or column
+void	CShadowMoments::reduce(int l)
+{
+   const int	sw = max(width >> (l-1),1);
+   const int	sh = max(height >> (l-1),1);
+   const int	w  = max(width >> l,1);
+   const int	h  = max(height >> l,1);
+   const float	*src = levels[l-1];
+   float	*dst = levels[l];
+   int	x,y,x0,x1,y0,y1;
+
+   for (y=0;y<h;y++) {
+      y0 = min(2*y,sh-1);
+      y1 = min(2*y+1,sh-1);
+      for (x=0;x<w;x++,dst+=2) {
+	 x0 = min(2*x,sw-1);
+	 x1 = min(2*x+1,sw-1);
+	 dst[0] = (src[2*(y0*sw+x0)]   + src[2*(y0*sw+x1)] +
+		   src[2*(y1*sw+x0)]   + src[2*(y1*sw+x1)])*0.25f;
+	 dst[1] = (src[2*(y0*sw+x0)+1] + src[2*(y0*sw+x1)+1] +
+		   src[2*(y1*sw+x0)+1] + src[2*(y1*sw+x1)+1])*0.25f;
+      }
+   }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CShadowMoments
+// Method  :	fetch
+// Description 	:	Bilinear fetch in a level
+// Comments  :	Clamps in both s and t
+void	CShadowMoments::fetch(float *r,int l,float s,float t) const
+{
+   const int	w = max(width >> l,1);
+   const int	h = max(height >> l,1);
+   const float	*data = levels[l];
+   float	x,y,dx,dy;
+   int	x0,x1,y0,y1;
+
+   x  = s*w - 0.5f;
+   y  = t*h - 0.5f;
+   x0 = fastmath<float>::floor(x);
+   y0 = fastmath<float>::floor(y);
+   dx = x - x0;
+   dy = y - y0;
+
+   x1 = min(x0+1,w-1);
+   y1 = min(y0+1,h-1);
+   x0 = min(max(x0,0),w-1);
+   y0 = min(max(y0,0),h-1);
+   x1 = max(x1,0);
+   y1 = max(y1,0);
+
+   const float	*t00 = data + 2*(y0*w + x0);
+   const float	*t10 = data + 2*(y0*w + x1);
+   const float	*t01 = data + 2*(y1*w + x0);
+   const float	*t11 = data + 2*(y1*w + x1);
+   float	a,b;
+
+   a    = t00[0] + (t10[0] - t00[0])*dx;
+   b    = t01[0] + (t11[0] - t01[0])*dx;
+   r[0] = a + (b - a)*dy;
+   a    = t00[1] + (t10[1] - t00[1])*dx;
+   b    = t01[1] + (t11[1] - t01[1])*dx;
+   r[1] = a + (b - a)*dy;
+}
+
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CShadow
+// Method  :	CShadow
+// Description 	:	Ctor
+// Comments  :	Variance and exponential maps build their moments
+//		pyramid here, as the map loads
 CShadow::CShadow(const char *n,float *em,CTextureLayer *s) :
-CEnvironment(n)
+CEnvironment(n),
+moments( NULL ),
+filter( kSHADOW_PCF ),
+exponent( shadowExponent ),
+zMin( 0 ),
+zScale( 1 )
 {
 //     movmm(toNDC,em);
    memcpy(toNDC, em, sizeof( miMatrix ) );
    side  = s;
+
+   if (side != NULL)	buildMoments(shadowFilter,shadowExponent);
 }
 
 CShadow::~CShadow()
 {
    if (side != NULL)	delete side;
+   delete moments;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CShadow
+// Method  :	buildMoments
+// Description 	:	Build the moments pyramid
+// Comments  :	The depths are read a band of rows at a time.  They are
+//		mapped to [0,1] over the map first, for the squares and
+//		the exponentials to keep their precision, and empty
+//		pixels (kDEPTH_INFINITY deep) go to 1.
+void	CShadow::buildMoments(TShadowFilter f,float c)
+{
+   const int	w = side->width;
+   const int	h = side->height;
+   const int	band = max(kSHADOW_REGION / w,1);
+   float	*depths,*dst;
+   float	zMax,z;
+   int	y,i,n,l;
+
+   if (f == kSHADOW_PCF)	return;
+
+   TextureOptions	lookup;
+
+   moments = new CShadowMoments(w,h);
+   depths  = new float[w*band];
+
+   // Read the depths into level 0, keeping their range
+   zMin = kDEPTH_INFINITY;
+   zMax = -kDEPTH_INFINITY;
+   dst  = moments->levels[0];
+   for (y=0;y<h;y+=band) {
+      n = w*min(band,h-y);
+      side->fetchDepths(depths,0,y,w,min(band,h-y),lookup);
+      for (i=0;i<n;i++,dst+=2) {
+	 z = depths[i];
+	 dst[0] = z;
+	 if (z >= kDEPTH_INFINITY)	continue;
+	 if (z < zMin)	zMin = z;
+	 if (z > zMax)	zMax = z;
+      }
+   }
+   delete [] depths;
+
+   if (zMax < zMin)	zMin = zMax = 0;	// Nothing in the map
+   zScale = (zMax > zMin) ? 1 / (zMax - zMin) : 1;
+
+   dst = moments->levels[0];
+   for (i=0;i<w*h;i++,dst+=2) {
+      z = (dst[0] >= kDEPTH_INFINITY) ? 1 : (dst[0] - zMin)*zScale;
+      if (f == kSHADOW_VARIANCE) {
+	 dst[0] = z;
+	 dst[1] = z*z;
+      } else {
+	 dst[0] = math<float>::exp(c*z);
+	 dst[1] = 0;
+      }
+   }
+
+   for (l=1;l<moments->numLevels;l++)	moments->reduce(l);
+
+   filter   = f;
+   exponent = c;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CShadow
+// Method  :	lookupMoments
+// Description 	:	Filter the moments pyramid over a lookup footprint
+// Return Value 	:	The shadowing in result
+// Comments  :	The footprint is the one the samples of lookup would
+//		cover, read from the level whose texels are about its
+//		size.  Variance maps bound the shadowing with Chebyshev's
+//		inequality, exponential ones with the filtered exponential.
+void	CShadow::lookupMoments(float *result,const float *D,const float *Du,
+			       const float *Dv,const CTextureLookup& lookup)
+{
+   const float	blur = 0.5f*(1 + lookup.blur);
+   float	s,t,d,size,level,offset;
+   float	m[2],m1[2];
+   int	i;
+
+   point cP( D[0], D[1], D[2] );
+   point cU( D[0] + Du[0]*blur, D[1] + Du[1]*blur, D[2] + Du[2]*blur );
+   point cV( D[0] + Dv[0]*blur, D[1] + Dv[1]*blur, D[2] + Dv[2]*blur );
+   cP *= toNDC;
+   cU *= toNDC;
+   cV *= toNDC;
+
+   s = cP.x;
+   t = cP.y;
+   result[0] = result[1] = result[2] = 0;
+   if ((s < 0) || (s > 1) || (t < 0) || (t > 1))	return;
+
+   // Width of the footprint in pixels of the map
+   size = max(math<float>::fabs(cU.x - s),math<float>::fabs(cV.x - s))*
+	  side->width;
+   size = max(size,max(math<float>::fabs(cU.y - t),
+		       math<float>::fabs(cV.y - t))*side->height);
+   size *= 2;
+
+   level  = (size > 1) ? math<float>::log(size) / math<float>::log(2.0f) : 0;
+   i      = (int) level;
+   offset = level - i;
+   if (i >= moments->numLevels-1) {
+      i      = moments->numLevels-1;
+      offset = 0;
+   }
+
+   moments->fetch(m,i,s,t);
+   if (offset > 0) {
+      moments->fetch(m1,i+1,s,t);
+      m[0] += (m1[0] - m[0])*offset;
+      m[1] += (m1[1] - m[1])*offset;
+   }
+
+   // Note:  cP.z was not / w (tmp[3])
+   d = (cP.z - lookup.shadowBias - zMin)*zScale;
+   d = min(max(d,0.0f),1.0f);
+
+   if (filter == kSHADOW_VARIANCE) {
+      float	var,delta;
+
+      if (d <= m[0])	return;
+      var   = max(m[1] - m[0]*m[0],kSHADOW_MIN_VARIANCE);
+      delta = d - m[0];
+      result[0] = 1 - var / (var + delta*delta);
+   } else {
+      result[0] = 1 - min(m[0]*math<float>::exp(-exponent*d),1.0f);
+   }
+
+   result[1] = result[0];
+   result[2] = result[0];
+}
+
+///////////////////////////////////////////////////////////////////////
+// Class  :	CShadow
+// Method  :	percentageCloser
+// Description 	:	Compare n samples against the map
+// Return Value 	:	The total weight of the occluded samples
+// Comments  :	0 <= (s,t) <= 1.  Each sample takes the farthest of the
+//		2x2 depths around it, like lookupz.  The depths under all
+//		samples are fetched as one block, then compared 4 samples
+//		at a time.  Footprints too wide for a block go through
+//		lookupz instead.
+float	CShadow::percentageCloser(const float *s,const float *t,
+				  const float *z,const float *w,int n,
+				  const CTextureLookup& lookup)
+{
+   float	depths[kSHADOW_REGION];
+   int		xs[kBATCH_SIZE],ys[kBATCH_SIZE];
+   int		index[kBATCH_SIZE];
+   float	weights[kBATCH_SIZE],zs[kBATCH_SIZE];
+   int		x0,y0,x1,y1,rw,rh;
+   int		i,m;
+   float	x,y,C;
+   float	occluded = 0;
+
+   x0 = y0 = 1 << 30;
+   x1 = y1 = -1;
+   for (i=0;i<n;i++) {
+      x = s[i]*side->width  - (float) 0.5; // Look up the pixel center
+      y = t[i]*side->height - (float) 0.5;
+      xs[i] = fastmath<float>::floor(x);
+      ys[i] = fastmath<float>::floor(y);
+
+      // Outside of the map is not shadowed
+      if ((xs[i] < 0) || (ys[i] < 0) ||
+	  (xs[i] >= (side->width-1)) || (ys[i] >= (side->height-1))) {
+	 xs[i] = -1;
+	 continue;
+      }
+
+      x0 = min(x0,xs[i]);
+      y0 = min(y0,ys[i]);
+      x1 = max(x1,xs[i]+1);
+      y1 = max(y1,ys[i]+1);
+   }
+
+   if (x1 < 0)	return 0;
+
+   rw = x1 - x0 + 1;
+   rh = y1 - y0 + 1;
+   if (rw*rh > kSHADOW_REGION) {
+      for (i=0;i<n;i++) {
+	 if (xs[i] < 0)	continue;
+	 side->lookupz(NULL,&C,s[i],t[i],lookup);
+	 if ((z[i] - lookup.shadowBias) > C)	occluded += w[i];
+      }
+      return occluded;
+   }
+
+   side->fetchDepths(depths,x0,y0,rw,rh,lookup);
+
+   // Pad to a multiple of 4 with samples that don't count
+   m = (n + 3) & ~3;
+   for (i=0;i<m;i++) {
+      if ((i >= n) || (xs[i] < 0)) {
+	 index[i]   = 0;
+	 weights[i] = 0;
+	 zs[i]      = 0;
+	 continue;
+      }
+      index[i]   = (ys[i] - y0)*rw + xs[i] - x0;
+      weights[i] = w[i];
+      zs[i]      = z[i] - lookup.shadowBias;
+   }
+
+#ifdef MR_SSE2
+   __m128	sum = _mm_setzero_ps();
+   float	tmp[4];
+
+   for (i=0;i<m;i+=4) {
+      const int	*k = index + i;
+      const __m128	d00 = _mm_setr_ps(depths[k[0]],depths[k[1]],
+					  depths[k[2]],depths[k[3]]);
+      const __m128	d10 = _mm_setr_ps(depths[k[0]+1],depths[k[1]+1],
+					  depths[k[2]+1],depths[k[3]+1]);
+      const __m128	d01 = _mm_setr_ps(depths[k[0]+rw],depths[k[1]+rw],
+					  depths[k[2]+rw],depths[k[3]+rw]);
+      const __m128	d11 = _mm_setr_ps(depths[k[0]+rw+1],depths[k[1]+rw+1],
+					  depths[k[2]+rw+1],depths[k[3]+rw+1]);
+      const __m128	c = _mm_max_ps(_mm_max_ps(d00,d10),_mm_max_ps(d01,d11));
+      const __m128	mask = _mm_cmpgt_ps(_mm_loadu_ps(zs+i),c);
+
+      sum = _mm_add_ps(sum,_mm_and_ps(mask,_mm_loadu_ps(weights+i)));
+   }
+
+   _mm_storeu_ps(tmp,sum);
+   occluded = (tmp[0] + tmp[1]) + (tmp[2] + tmp[3]);
+#else
+   for (i=0;i<m;i++) {
+      const float	*d = depths + index[i];
+
+      C = max(max(d[0],d[1]),max(d[rw],d[rw+1]));
+      if (zs[i] > C)	occluded += weights[i];
+   }
+#endif
+
+   return occluded;
 }
 
-//! Shadow lookup
+///////////////////////////////////////////////////////////////////////
+// Class  :	CShadow
+// Method  :	lookup
+// Description 	:	Shadow lookup
+// Comments  :	The samples are gathered and filtered kBATCH_SIZE at a
+//		time, unless the map has a moments pyramid
 void 	CShadow::lookup( const miState* const state, float *result,
 			 const float *D,const float *Du,
 			 const float *Dv,const CTextureLookup& lookup)
 {
    float totalContribution = 0;
    float blur  = 1 + lookup.blur;
+   float S[kBATCH_SIZE],T[kBATCH_SIZE],Z[kBATCH_SIZE],W[kBATCH_SIZE];
+   int   numBatch = 0;
+
+   if (moments != NULL)
+   {
+      lookupMoments(result,D,Du,Dv,lookup);
+      return;
+   }
 
    result[0] = 0;
    
@@ -1328,7 +4984,6 @@ void 	CShadow::lookup( const miState* const state, float *result,
    {
       float	x,y;
       float	s,t;
-      float	C;
       float	contribution;
 
       x   = (float)r[0] - 0.5f;	// Assume x,y are gaussian samples
@@ -1357,14 +5012,18 @@ void 	CShadow::lookup( const miState* const state, float *result,
 	 continue;
       }
 
-      side->lookupz(state, &C,s,t,lookup);
+      S[numBatch] = s;
+      T[numBatch] = t;
+      Z[numBatch] = cP.z;
+      W[numBatch] = contribution;
+      if (++numBatch < kBATCH_SIZE) continue;
 
-      // Note:  cP.z was not / w (tmp[3])
-      if ((cP.z - lookup.shadowBias) > C)	{
-	 result[0] += contribution;
-      }
+      result[0] += percentageCloser(S,T,Z,W,numBatch,lookup);
+      numBatch = 0;
    }
 
+   if (numBatch > 0)
+      result[0] += percentageCloser(S,T,Z,W,numBatch,lookup);
 
    result[0]	/= totalContribution;
    result[1] = result[0];
@@ -1376,12 +5035,19 @@ void 	CShadow::lookup( const miState* const state, float *result,
 // Class  :	CDeepShadow
 // Method  :	CDeepShadow
 // Description 	:	Ctor
+// Comments  :	Takes over the file, positioned after the magic, and
+//		its descriptor.  It stays mapped (or open if it can't be
+//		mapped) for the tiles to be read from
 CDeepShadow::CDeepShadow(const char *n,const char *fn,
 			 const float *toWorld,FILE *in) :
-CEnvironment(n)
+CEnvironment(n),
+fileData( NULL ),
+fileLength( 0 ),
+file( NULL )
 {
    int i,k;
    miMatrix	mtmp;
+   TextureUsage	*usage;
 
    fileName = strdup(fn);
 
@@ -1401,6 +5067,7 @@ CEnvironment(n)
    fileStart = ftell(in);
 
    // Init the tiles
+   usage = textureLayerUsage(fn,0,header.xres,header.yres);
    tiles = new CDeepTile*[header.yTiles];
    for (k=0,i=0;i<header.yTiles;i++) {
       int	j;
@@ -1414,13 +5081,25 @@ CEnvironment(n)
 	 if (k == 0)	size = tileIndices[k] - fileStart;
 	 else size = tileIndices[k] - tileIndices[k-1];
 
-	 cTile->block = textureNewBlock(size);
-	 cTile->data  = new float*[header.tileSize*header.tileSize];
-	 cTile->lastData = new float*[header.tileSize*header.tileSize];
+	 cTile->block = textureNewBlock(size,usage,j,i);
       }
    }
 
-   fclose(in);
+   // Keep the file around for the tiles
+   mi_init_lock(&fileLock);
+   if (mapTextures && (header.xTiles*header.yTiles > 0))
+   {
+      fileLength = (size_t) tileIndices[header.xTiles*header.yTiles-1];
+      fileData   = (const unsigned char *) textureMapFile(fn,0,fileLength);
+   }
+
+   if (fileData != NULL) {
+      fclose(in);
+      textureReleaseDescriptor();
+   } else {
+      fileLength = 0;
+      file = in;
+   }
 }
 
 ///////////////////////////////////////////////////////////////////////
@@ -1434,8 +5113,6 @@ CDeepShadow::~CDeepShadow()
    for (j=0;j<header.yTiles;j++) {
       for (i=0;i<header.xTiles;i++) {
 	 textureDeleteBlock(tiles[j][i].block);
-	 delete [] tiles[j][i].lastData;
-	 delete [] tiles[j][i].data;
       }
       delete [] tiles[j];
    }
@@ -1443,49 +5120,183 @@ CDeepShadow::~CDeepShadow()
 
    delete [] tileIndices;
 
+   if (fileData != NULL)
+      textureUnmapFile((void *) fileData,fileLength);
+   if (file != NULL) {
+      fclose(file);
+      textureReleaseDescriptor();
+   }
+   mi_delete_lock(&fileLock);
+
    free(fileName);
 }
 
 
+///////////////////////////////////////////////////////////////////////
+// Function  :	deepQuantize
+// Description 	:	Quantize a transmittance to 16 bits
+static inline unsigned short	deepQuantize(float c)
+{
+   if (c <= 0)	return 0;
+   if (c >= 1)	return 65535;
+   return (unsigned short) (c*65535.0f + 0.5f);
+}
+
 ///////////////////////////////////////////////////////////////////////
 // Class  :	CDeepShadow
 // Method  :	loadTile
 // Description 	:	Cache in a tile
-void	CDeepShadow::loadTile(int x,int y)
+// Return Value :	The compacted tile (see CDeepTile)
+// Comments  :	Called without any lock held
+void*	CDeepShadow::loadTile(int x,int y,CTextureBlock *entry)
 {
+   const int	n = header.tileSize*header.tileSize;
    int 	index = y*header.xTiles+x;
-   CDeepTile	*cTile = tiles[y]+x;
-   FILE *in = fopen(fileName,"rb");
-   float **cData;
-   float **cLastData;
-   float *data;
-   int 	i;
-   int 	startIndex;
-
-   mrASSERT(in != NULL);
+   const unsigned char	*raw;
+   unsigned char	*tmp = NULL;
+   unsigned char	*tileData;
+   miUint	*sIndex,*cIndex;
+   float	*depth;
+   unsigned short	*color;
+   float	sample[4];
+   int 	numSamples,numColors;
+   int 	startIndex,size;
+   int 	i,j,k,c;
 
    if (index == 0)	startIndex = fileStart;
    else 	startIndex = tileIndices[index-1];
+   size = tileIndices[index] - startIndex;
+
+   if (fileData != NULL)
+   {
+      raw = fileData + startIndex;
+   }
+   else
+   {
+      tmp = new unsigned char[size];
+
+      mi_lock(fileLock);
+      fseek(file,startIndex,SEEK_SET);
+      if (fread(tmp,sizeof(unsigned char),size,file) != (size_t) size)
+	 memset(tmp,0,size);
+      mi_unlock(fileLock);
+
+      raw = tmp;
+   }
+
+   // Where each pixel starts and whether it is grey.  The raw data may
+   // not be aligned, so the samples are copied out.
+   numSamples = size / (4*sizeof(float));
+   sIndex  = new miUint[2*(n+1)];
+   cIndex  = sIndex + n + 1;
+
+   for (i=0,j=0,numColors=0;i<n;i++) {
+      miBoolean	grey = miTRUE;
+
+      sIndex[i] = j;
+      for (k=j;k<numSamples;k++) {
+	 memcpy(sample,raw + k*sizeof(sample),sizeof(sample));
+	 if ((k > j) && (sample[0] == -kDEEP_INFINITY))	break;
+	 if ((sample[1] != sample[2]) || (sample[1] != sample[3]))
+	    grey = miFALSE;
+      }
+      if (i == n-1)	k = numSamples;
+
+      cIndex[i]  = numColors;
+      numColors += (k-j)*(grey ? 1 : 3);
+      j = k;
+   }
+   sIndex[n] = j;
+   cIndex[n] = numColors;
+
+   // Lay the tile out
+   entry->size = 2*(n+1)*sizeof(miUint) + (j+8)*sizeof(float) +
+		 ((numColors+1) & ~1)*sizeof(unsigned short);
+   tileData = new unsigned char[entry->size];
+
+   memcpy(tileData,sIndex,2*(n+1)*sizeof(miUint));
+   depth = (float *) (tileData + 2*(n+1)*sizeof(miUint));
+   color = (unsigned short *) (depth + j + 8);
+
+   for (i=0;i<n;i++) {
+      const int channels = (sIndex[i+1] > sIndex[i]) ?
+			   (cIndex[i+1] - cIndex[i]) /
+			   (sIndex[i+1] - sIndex[i]) : 1;
+
+      for (k=sIndex[i];k<(int) sIndex[i+1];k++) {
+	 memcpy(sample,raw + k*sizeof(sample),sizeof(sample));
+	 depth[k] = sample[0];
+	 for (c=0;c<channels;c++)
+	    *color++ = deepQuantize(sample[1+c]);
+      }
+   }
+   for (k=0;k<8;k++)	depth[j+k] = kDEEP_INFINITY;
+
+   delete [] sIndex;
+   delete [] tmp;
+
+   return tileData;
+}
+
+//! Pages a deep shadow tile in
+struct CDeepTileLoader
+{
+     CDeepTileLoader(CDeepShadow *s,int x0,int y0) :
+     shadow( s ),
+     x( x0 ), y( y0 )
+     {
+     }
 
-   textureAllocateBlock(cTile->block);
-   fseek(in,startIndex,SEEK_SET);
-   fread(cTile->block->data,sizeof(unsigned char),cTile->block->size,in);
-   fclose(in);
+     void *operator()(CTextureBlock *entry) const
+     {
+	return shadow->loadTile(x,y,entry);
+     }
 
-   data  = (float *) cTile->block->data;
-   cLastData = cTile->lastData;
-   cData  = cTile->data;
-   for (i=header.tileSize*header.tileSize;i>0;i--) {
-      cData[0] = data;
-      cLastData[0] = data;
-      cData++;
-      cLastData++;
+     CDeepShadow	*shadow;
+     int	x,y;
+};
 
-      if (i != 1) {
-	 data += 4;
-	 while(*data != -INFINITY)	data += 4;
+///////////////////////////////////////////////////////////////////////
+// Function  :	deepSearch
+// Description 	:	Find the first of n sorted depths that is not
+//			in front of w
+// Return Value :	Its index (n if all are in front)
+// Comments  :	Bisects down to 8 depths and compares those at
+//		once.  Up to 7 depths past the end are read.
+static inline int	deepSearch(const float *depth,int n,float w)
+{
+   int	lo = 0;
+   int	half;
+
+   while (n > 8) {
+      half = n >> 1;
+      if (depth[lo+half] < w) {
+	 lo += half+1;
+	 n  -= half+1;
+      } else {
+	 n   = half;
       }
    }
+
+#ifdef MR_SSE2
+   const __m128	wv = _mm_set1_ps(w);
+   int	mask;
+
+   mask = _mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(depth+lo),wv)) |
+	  (_mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(depth+lo+4),wv)) << 4);
+   mask &= (1 << n) - 1;
+
+   // The depths are sorted, so these bits are all at the bottom
+   mask = mask - ((mask >> 1) & 0x55);
+   mask = (mask & 0x33) + ((mask >> 2) & 0x33);
+   return lo + ((mask + (mask >> 4)) & 0x0f);
+#else
+   while ((n > 0) && (depth[lo] < w)) {
+      lo++;
+      n--;
+   }
+   return lo;
+#endif
 }
 
 ///////////////////////////////////////////////////////////////////////
@@ -1496,16 +5307,20 @@ void	CDeepShadow::lookup( const miState* const state,
 			     float *result,const float *D,const float *Du,
 			     const float *Dv,const CTextureLookup& lookup)
 {
+   const int	n = header.tileSize*header.tileSize;
    float totalContribution = 0;
+   CTextureThread	*tls;
 
    result[0] = 0;
    result[1] = 0;
    result[2] = 0;
-   
+
+   tls = textureBeginLookup();
+
    int    counter = 0;
    double 	r[2];
    miUint samples = lookup.numSamples;
-   while (mi_sample( r, &counter, const_cast< miState* >( state ), 
+   while (mi_sample( r, &counter, const_cast< miState* >( state ),
 		     2, &samples ) )
    {
       float x,y; // Assume x,y are gaussian samples
@@ -1514,7 +5329,13 @@ void	CDeepShadow::lookup( const miState* const state,
       int 	px,py;
       int 	bx,by;
       CDeepTile	*cTile;
-      float *cPixel;
+      CTextureShard	*shard;
+      const unsigned char	*data;
+      const miUint	*sIndex,*cIndex;
+      const float	*depth;
+      const unsigned short	*color;
+      int 	p,lo,cnt,k,channels;
+      float	vis[3];
 
       x   = (float)r[0] - 0.5f;
       y   = (float)r[1] - 0.5f;
@@ -1532,7 +5353,7 @@ void	CDeepShadow::lookup( const miState* const state,
 		D[1] +	Du[1]*x + Dv[1]*y,
 		D[2] +	Du[2]*x + Dv[2]*y );
 
-      
+
       cP *= header.toNDC;
       s = cP.x;
       t = cP.y;
@@ -1554,37 +5375,63 @@ void	CDeepShadow::lookup( const miState* const state,
 
       cTile  = tiles[by]+bx;
 
-      if (cTile->block->data == NULL)	loadTile(bx,by);
-
-      cPixel  = cTile->lastData[py*header.tileSize+px];
-
-      while(miTRUE) {
-	 if (cPixel[0] > w) cPixel	-= 4;
-	 else if (cPixel[4] < w)	cPixel += 4;
-	 else {
-	    const float	alpha = (w - cPixel[0]) / (cPixel[4] - cPixel[0]);
-
-	    result[0] += (1-((1-alpha)*cPixel[1] + alpha*cPixel[5]))*contribution;
-	    result[1] += (1-((1-alpha)*cPixel[2] + alpha*cPixel[6]))*contribution;
-	    result[2] += (1-((1-alpha)*cPixel[3] + alpha*cPixel[7]))*contribution;
-
-	    cTile->lastData[py*header.tileSize+px] = cPixel;
-
-	    break;
+      shard  = NULL;
+      data   = (const unsigned char *) textureCachedData(tls,cTile->block);
+      if (data == NULL)
+	 data = (const unsigned char *)
+		textureBlockData(tls,cTile->block,
+				 CDeepTileLoader(this,bx,by),shard);
+
+      sIndex = (const miUint *) data;
+      cIndex = sIndex + n + 1;
+      depth  = (const float *) (cIndex + n + 1);
+      color  = (const unsigned short *) (depth + sIndex[n] + 8);
+
+      // Find the samples around w
+      p   = py*header.tileSize+px;
+      lo  = sIndex[p];
+      cnt = sIndex[p+1] - lo;
+      channels = (cnt > 0) ? (cIndex[p+1] - cIndex[p]) / cnt : 1;
+      color += cIndex[p];
+
+      if (cnt == 0) {
+	 vis[0] = vis[1] = vis[2] = 1;
+      } else {
+	 k = deepSearch(depth+lo,cnt,w);
+
+	 if ((k == 0) || (k == cnt)) {
+	    // In front of the first or behind the last sample
+	    if (k == cnt)	k--;
+	    color += k*channels;
+	    vis[0] = color[0] * (1.0f / 65535.0f);
+	    vis[1] = color[channels > 1 ? 1 : 0] * (1.0f / 65535.0f);
+	    vis[2] = color[channels > 1 ? 2 : 0] * (1.0f / 65535.0f);
+	 } else {
+	    const float	z0 = depth[lo+k-1];
+	    const float	z1 = depth[lo+k];
+	    const float	alpha = (z1 > z0) ? (w - z0) / (z1 - z0) : 1;
+	    const unsigned short *c0 = color + (k-1)*channels;
+	    const unsigned short *c1 = c0 + channels;
+
+	    vis[0] = ((1-alpha)*c0[0] + alpha*c1[0]) * (1.0f / 65535.0f);
+	    if (channels > 1) {
+	       vis[1] = ((1-alpha)*c0[1] + alpha*c1[1]) * (1.0f / 65535.0f);
+	       vis[2] = ((1-alpha)*c0[2] + alpha*c1[2]) * (1.0f / 65535.0f);
+	    } else {
+	       vis[1] = vis[2] = vis[0];
+	    }
 	 }
       }
 
-      //	0	-	z
-      //	1	-	r
-      //	2	-	g
-      //	3	-	b
+      if (shard != NULL)	textureReleaseBlock(shard);
 
-      //	4	-	z
-      //	5	-	r
-      //	6	-	g
-      //	7	-	b
+      result[0] += (1-vis[0])*contribution;
+      result[1] += (1-vis[1])*contribution;
+      result[2] += (1-vis[2])*contribution;
    }
 
+   textureEndLookup(tls);
+
    result[0]	/= totalContribution;
    result[1]	/= totalContribution;
    result[2]	/= totalContribution;
@@ -1603,6 +5450,8 @@ CEnvironment(n)
    sides[3] = s[3];
    sides[4] = s[4];
    sides[5] = s[5];
+
+   prefilter();
 }
 
 ///////////////////////////////////////////////////////////////////////
@@ -1623,86 +5472,76 @@ CCubicEnvironment::~CCubicEnvironment()
 // Class  :	CCubicEnvironment
 // Method  :	Lookup
 // Description 	:	Environment lookup
+// Comments  :	The footprint corners are D, D+Du, D+Dv and D+Du+Dv,
+//		projected on the side D points at
 void 	CCubicEnvironment::lookup( const miState* const state, float *result,
 				   const float *D,
 				   const float *Du,const float *Dv,
 				   const CTextureLookup& lookup)
 {
-   EOrder order;
-   float c;
-   int 	axis;
+   float	c,t;
+   int 	side,axis;
    int 	uaxis,vaxis;
-   vector cDu,cDv;
-   CTexture	*side;
-   vector u,v;
-   float t;
+   vector	corners[4];
+   float	u[4],v[4];
+   int	i;
 
-   addvv(cDu,D,Du);
-   addvv(cDv,D,Dv);
+   if (lookupPrefiltered(result,D,Du,Dv,lookup))	return;
 
-   // Find the side of the cube that we're looking at
-   if (math<float>::fabs(D[1]) > math<float>::fabs(D[0])) {
-      if (math<float>::fabs(D[2]) > math<float>::fabs(D[1])) {
-	 order = ZYX;
-      } else {
-	 if (math<float>::fabs(D[2]) > math<float>::fabs(D[0]))
-	    order = YZX;
-	 else
-	    order = YXZ;
-      }
-   } else if (math<float>::fabs(D[2]) > math<float>::fabs(D[1])) {
-      if (math<float>::fabs(D[2]) > math<float>::fabs(D[0]))
-	 order = ZXY;
-      else
-	 order = XZY;
-   } else {
-      order = XYZ;
-   }
+   side  = cubeSide(D,axis);
+   uaxis = kCUBE_UAXIS[axis];
+   vaxis = kCUBE_VAXIS[axis];
+   c     = (D[axis] > 0) ? 0.5f : -0.5f;
 
-   switch(order) {
-      case XYZ:
-      case XZY:
-	 if (D[0] > 0) {	side = sides[PX];	c = 1;	}
-	 else  {	side = sides[NX];	c = -1;	}
-	 axis = 0;
-	 uaxis = 1;
-	 vaxis = 2;
-	 break;
-      case YXZ:
-      case YZX:
-	 if (D[1] > 0) {	side = sides[PY];	c = 1;	}
-	 else  {	side = sides[NY];	c = -1;	}
-	 axis = 1;
-	 uaxis = 0;
-	 vaxis = 2;
-	 break;
-      case ZXY:
-      case ZYX:
-	 if (D[2] > 0) {	side = sides[PZ];	c = 1;	}
-	 else  {	side = sides[NZ];	c = -1;	}
-	 axis = 2;
-	 uaxis = 0;
-	 vaxis = 1;
-	 break;
+   initv(corners[0],D);
+   addvv(corners[1],D,Du);
+   addvv(corners[2],D,Dv);
+   addvv(corners[3],corners[1],Dv);
+
+   for (i=0;i<4;i++) {
+      const float	*P = (const float *) &corners[i];
+
+      t    = c / P[axis];
+      u[i] = P[uaxis]*t + 0.5f;
+      v[i] = P[vaxis]*t + 0.5f;
    }
 
+   sides[side]->lookup4(state,result,u,v,lookup);
+}
 
-   t = c / D[axis];
-   u[0] = D[uaxis]*t;
-   v[0] = D[vaxis]*t;
+///////////////////////////////////////////////////////////////////////
+// Class  :	CCubicEnvironment
+// Method  :	sample
+// Description 	:	Average the map around a direction
+void	CCubicEnvironment::sample(float *result,const float *D,float angle)
+{
+   const TextureOptions	opts;
+   float	c;
+   int	side,axis;
+
+   side = cubeSide(D,axis);
+   c    = 0.5f / math<float>::fabs(D[axis]);
+
+   // A side spans 2 units at distance 1
+   sides[side]->lookupBox(result,
+			  D[kCUBE_UAXIS[axis]]*c + 0.5f,
+			  D[kCUBE_VAXIS[axis]]*c + 0.5f,
+			  angle*0.5f,opts);
+}
 
-   t = c / cDu[axis];
-   u[1] = cDu[uaxis]*t - u[0];
-   v[1] = cDu[vaxis]*t - v[0];
 
-   t = c / cDv[axis];
-   u[2] = cDv[uaxis]*t - u[0];
-   v[2] = cDv[vaxis]*t - v[0];
+///////////////////////////////////////////////////////////////////////
+// Function  :	sphereMap
+// Description 	:	Where a direction lands on a spherical map
+static inline void	sphereMap(const float *D,float& u,float& v)
+{
+   const float	m = 2*math<float>::sqrt(D[0]*D[0] + D[1]*D[1] +
+					(D[2]+1)*(D[2]+1));
 
-   side->lookup4(state,result,(float*)&u,(float*)&v,lookup);
+   u = D[0] / m + 0.5f;
+   v = D[1] / m + 0.5f;
 }
 
-
 ///////////////////////////////////////////////////////////////////////
 // Class  :	CSphericalEnvironment
 // Method  :	CSphericalEnvironment
@@ -1714,6 +5553,8 @@ CSphericalEnvironment::CSphericalEnvironment(const char *n,CTexture *s) :
 CEnvironment(n)
 {
    side = s;
+
+   if (side != NULL)	prefilter();
 }
 
 ///////////////////////////////////////////////////////////////////////
@@ -1733,36 +5574,114 @@ CSphericalEnvironment::~CSphericalEnvironment()
 // Method  :	Lookup
 // Description 	:	Environment lookup
 // Return Value 	:	-
-// Comments  :
+// Comments  :	The footprint corners are D, D+Du, D+Dv and D+Du+Dv
 // Date last edited :	2/28/2002
 void 	CSphericalEnvironment::lookup( const miState* const state,
 				       float *result,const float *D,
 				       const float *Du,const float *Dv,
 				       const CTextureLookup& lookup)
 {
-   vector cDu,cDv;
-   vector u,v;
-   float m;
+   vector cDu,cDv,cDuv;
+   float u[4],v[4];
+
+   if (lookupPrefiltered(result,D,Du,Dv,lookup))	return;
 
    addvv(cDu,D,Du);
    addvv(cDv,D,Dv);
+   addvv(cDuv,cDu,Dv);
 
-   m   = (float) (2*sqrt(D[0]*D[0] + D[1]*D[1] + (D[2]+1)*(D[2]+1)));
-   u[0]  = D[0] / m + (float) 0.5;
-   v[0]  = D[1] / m + (float) 0.5;
+   sphereMap(D,u[0],v[0]);
+   sphereMap((const float *) &cDu,u[1],v[1]);
+   sphereMap((const float *) &cDv,u[2],v[2]);
+   sphereMap((const float *) &cDuv,u[3],v[3]);
 
-   m   = (float) (2*sqrt(cDu[0]*cDu[0] + cDu[1]*cDu[1] + (cDu[2]+1)*(cDu[2]+1)));
-   u[1]  = cDu[0] / m + (float) 0.5 - u[0];
-   v[1]  = cDu[1] / m + (float) 0.5 - v[0];
+   side->lookup4(state,result,u,v,lookup);
+}
 
-   m   = (float) (2*sqrt(cDv[0]*cDv[0] + cDv[1]*cDv[1] + (cDv[2]+1)*(cDv[2]+1)));
-   u[2]  = cDv[0] / m + (float) 0.5 - u[0];
-   v[2]  = cDv[1] / m + (float) 0.5 - v[0];
+///////////////////////////////////////////////////////////////////////
+// Class  :	CSphericalEnvironment
+// Method  :	sample
+// Description 	:	Average the map around a direction
+// Comments  :	The map is a quarter unit per radian at its center
+void	CSphericalEnvironment::sample(float *result,const float *D,float angle)
+{
+   const TextureOptions	opts;
+   float	u,v;
 
-   side->lookup4(state,result,(float*)&u,(float*)&v,lookup);
+   sphereMap(D,u,v);
+   side->lookupBox(result,u,v,angle*0.25f,opts);
 }
 
 
+///////////////////////////////////////////////////////////////////////
+// Function  :	mapTiledLayer
+// Description 	:	Try to map the current directory of a tiled file
+// Return Value 	:	The new layer or NULL if the directory can't be
+//			mapped (compressed, byte swapped, odd layout...)
+template <class T>
+static CTextureLayer	*mapTiledLayer(const char *name,TIFF *in,int dir,
+				       int width,int height,int numSamples,
+				       int fileWidth,int fileHeight,
+				       int tileSize,int tileSizeShift)
+{
+   uint16  	compression,planarConfig,bitsPerSample;
+   toff_t  	*offsets,*byteCounts;
+   toff_t  	start,end,granularity;
+   size_t  	tileLength;
+   int   	numTiles,xTiles,yTiles,i;
+   void  	*base;
+   const T	**tiles;
+
+   compression  = COMPRESSION_NONE;
+   planarConfig = PLANARCONFIG_CONTIG;
+   TIFFGetFieldDefaulted(in,TIFFTAG_COMPRESSION,  &compression);
+   TIFFGetFieldDefaulted(in,TIFFTAG_PLANARCONFIG, &planarConfig);
+   TIFFGetFieldDefaulted(in,TIFFTAG_BITSPERSAMPLE,&bitsPerSample);
+
+   if ((compression != COMPRESSION_NONE) ||
+       (bitsPerSample != 8*sizeof(T)) ||
+       (planarConfig != PLANARCONFIG_CONTIG) ||
+       (TIFFIsByteSwapped(in) && sizeof(T) > 1) ||
+       (TIFFIsTiled(in) == 0))
+      return NULL;
+
+   if ((TIFFGetField(in,TIFFTAG_TILEOFFSETS,   &offsets) == 0) ||
+       (TIFFGetField(in,TIFFTAG_TILEBYTECOUNTS,&byteCounts) == 0))
+      return NULL;
+
+   xTiles  = (int) ceil((float) width / (float) tileSize);
+   yTiles  = (int) ceil((float) height / (float) tileSize);
+   numTiles  = xTiles*yTiles;
+   tileLength  = tileSize*tileSize*numSamples*sizeof(T);
+
+   if ((int) TIFFNumberOfTiles(in) < numTiles)	return NULL;
+
+   // Every tile must be stored whole and aligned for T
+   start = offsets[0];
+   end   = 0;
+   for (i=0;i<numTiles;i++)
+   {
+      if ((byteCounts[i] < tileLength) || (offsets[i] % sizeof(T)))
+	 return NULL;
+      if (offsets[i] < start)	start = offsets[i];
+      if (offsets[i] + tileLength > end)	end = offsets[i] + tileLength;
+   }
+
+   granularity = (toff_t) textureMapGranularity();
+   start -= start % granularity;
+
+   base = textureMapFile(name,start,(size_t) (end - start));
+   if (base == NULL)	return NULL;
+
+   tiles = new const T*[numTiles];
+   for (i=0;i<numTiles;i++)
+      tiles[i] = (const T *) ((const char *) base + (offsets[i] - start));
+
+   return new CMappedTexture<T>(name,dir,width,height,numSamples,
+				fileWidth,fileHeight,tileSize,tileSizeShift,
+				base,(size_t) (end - start),tiles);
+}
+
 ///////////////////////////////////////////////////////////////////////
 // Function  :	readMadeTexture
 // Description 	:	Read the pyramid layers
@@ -1775,10 +5694,11 @@ static CTexture	*readMadeTexture(const char *name,const char *aname,TIFF *in,
 				 char *tmode,int pyramidSize,T enforcer)
 {
    CMadeTexture 	*cTexture;
+   CTiledTexture<T>	*tiled,*cTiled;
    int   i,j;
    uint32  	fileWidth,fileHeight;
    uint32  	tileWidth,tileHeight;
-   uint16  	numSamples;
+   uint16  	numSamples,bitsPerSample;
    int   cwidth,cheight;
    TTextureMode 	sMode,tMode;
    int   tileSize,tileSizeShift;
@@ -1793,6 +5713,7 @@ static CTexture	*readMadeTexture(const char *name,const char *aname,TIFF *in,
    TIFFGetFieldDefaulted(in,TIFFTAG_SAMPLESPERPIXEL, &numSamples);
    TIFFGetFieldDefaulted(in,TIFFTAG_TILEWIDTH,       &tileWidth);
    TIFFGetFieldDefaulted(in,TIFFTAG_TILELENGTH,      &tileHeight);
+   TIFFGetFieldDefaulted(in,TIFFTAG_BITSPERSAMPLE,   &bitsPerSample);
 
    mrASSERT(tileWidth == tileHeight);
 
@@ -1832,14 +5753,40 @@ static CTexture	*readMadeTexture(const char *name,const char *aname,TIFF *in,
 
    cwidth  = width;
    cheight  = height;
+   tiled   = NULL;
    for (i=0;i<pyramidSize;i++)
    {
       TIFFGetFieldDefaulted(in,TIFFTAG_IMAGEWIDTH,  &fileWidth);
       TIFFGetFieldDefaulted(in,TIFFTAG_IMAGELENGTH, &fileHeight);
-      cTexture->layers[i] = new CTiledTexture<T>(name,dstart+i,cwidth,cheight,
-						 numSamples,fileWidth,
-						 fileHeight,tileSize,
-						 tileSizeShift);
+
+      cTexture->layers[i] = NULL;
+      if (mapTextures && (bitsPerSample == 8*sizeof(T)))
+	 cTexture->layers[i] = mapTiledLayer<T>(name,in,dstart+i,
+						cwidth,cheight,numSamples,
+						fileWidth,fileHeight,
+						tileSize,tileSizeShift);
+      else if (mapTextures)
+	 cTexture->layers[i] =
+	    mapTiledLayer<typename CTexelStorage<T>::File>(name,in,dstart+i,
+							    cwidth,cheight,
+							    numSamples,
+							    fileWidth,
+							    fileHeight,
+							    tileSize,
+							    tileSizeShift);
+
+      cTiled = NULL;
+      if (cTexture->layers[i] == NULL)
+      {
+	 cTiled = new CTiledTexture<T>(name,dstart+i,cwidth,cheight,
+				       numSamples,fileWidth,fileHeight,
+				       tileSize,tileSizeShift);
+	 cTexture->layers[i] = cTiled;
+      }
+
+      // Let the previous level prefetch into this one
+      if (tiled != NULL)	tiled->nextLevel = cTexture->layers[i];
+      tiled = cTiled;
       
       if (i != (pyramidSize-1))
 	 TIFFSetDirectory(in,dstart+i+1);
@@ -1895,10 +5842,19 @@ static	CTexture	*texLoad(const char *name,const char *aname,TIFF *in,
    CTexture *cTexture = NULL;
    char 	smode[32],tmode[32];
    int  width,height;
-   uint16 	bitspersample;
+   uint16 	bitspersample,sampleformat;
+   miBoolean	halfFile,unormFile;
 
    TIFFSetDirectory(in,dstart);
    TIFFGetFieldDefaulted(in,TIFFTAG_BITSPERSAMPLE, &bitspersample);
+   TIFFGetFieldDefaulted(in,TIFFTAG_SAMPLEFORMAT,  &sampleformat);
+
+   // 16 bit files are kept as they are: halves if the samples are
+   // floats, 16 bit fixed point otherwise
+   halfFile  = ((bitspersample == 16) &&
+		(sampleformat == SAMPLEFORMAT_IEEEFP)) ? miTRUE : miFALSE;
+   unormFile = ((bitspersample == 16) &&
+		(sampleformat != SAMPLEFORMAT_IEEEFP)) ? miTRUE : miFALSE;
 	
    cTexture = NULL;
 
@@ -1920,6 +5876,18 @@ static	CTexture	*texLoad(const char *name,const char *aname,TIFF *in,
 	    cTexture = readMadeTexture<unsigned char>(name,aname,in,dstart,
 						      width, height,smode,
 						      tmode,pyramidSize,1);
+	 } else if (halfFile ||
+		    ((floatStorage == kTEXTURE_STORE_HALF) && !unormFile))
+	 {
+	    cTexture = readMadeTexture<CHalf>(name,aname,in,dstart,
+					      width,height,smode,tmode,
+					      pyramidSize,CHalf());
+	 } else if (unormFile ||
+		    (floatStorage == kTEXTURE_STORE_UNORM16))
+	 {
+	    cTexture = readMadeTexture<CUnorm16>(name,aname,in,dstart,
+						 width,height,smode,tmode,
+						 pyramidSize,CUnorm16());
 	 } else
 	 {
 	    cTexture = readMadeTexture<float>(name,aname,in,dstart,
@@ -1936,6 +5904,11 @@ static	CTexture	*texLoad(const char *name,const char *aname,TIFF *in,
    if (cTexture == NULL) {
       if (bitspersample == 8) {
 	 cTexture = readTexture<unsigned char>(name,aname,in,dstart,1);
+      } else if (halfFile ||
+		 ((floatStorage == kTEXTURE_STORE_HALF) && !unormFile)) {
+	 cTexture = readTexture<CHalf>(name,aname,in,dstart,CHalf());
+      } else if (unormFile || (floatStorage == kTEXTURE_STORE_UNORM16)) {
+	 cTexture = readTexture<CUnorm16>(name,aname,in,dstart,CUnorm16());
       } else {
 	 cTexture = readTexture<float>(name,aname,in,dstart,1);
       }
@@ -1955,35 +5928,473 @@ static	CTexture	*texLoad(const char *name,const char *aname,TIFF *in,
 // Function  :	textureInit
 // Description 	:	This function is called before any texturemapping stuff to init
 // Return Value :	miTRUE on success
-void textureInit(int maxMemory)
+// Comments  :	Every call must be matched by a textureShutdown.  Only
+//		the last one deletes the textures.
+void textureInit(int maxMemory,const TextureCacheOptions& opts)
 {
+   miUint	usedTextureMemory;
+   int	i;
+
+   textureUsers++;
+
+   if ( shardsInitialized == miFALSE )
+   {
+      mi_init_lock( &tiffLock );
+      mi_init_lock( &registryLock );
+      mi_init_lock( &tiffPoolLock );
+      mi_init_lock( &recordsLock );
+
+      for (i=0;i<kTEXTURE_REGISTRY_SIZE;i++)
+	 textureRegistry[i] = NULL;
+
+      for (i=0;i<kTEXTURE_SHARDS;i++)
+      {
+	 CTextureShard	*shard = textureShards + i;
+
+	 mi_init_lock( &shard->lock );
+	 shard->usedBlocks  = NULL;
+	 shard->freeBlocks  = NULL;
+	 shard->clockHand   = NULL;
+	 shard->retired     = NULL;
+	 shard->usedTextureMemory = 0;
+	 shard->packedHead  = NULL;
+	 shard->packedTail  = NULL;
+	 shard->packedMemory = 0;
+	 shard->packTickets = 0;
+	 shard->trace       = NULL;
+      }
+
+      nextShard = 0;
+      shardsInitialized = miTRUE;
+   }
+
+   for (usedTextureMemory=0,i=0;i<kTEXTURE_SHARDS;i++)
+      usedTextureMemory += textureShards[i].usedTextureMemory;
+
    if ( usedTextureMemory == 0 )
    {
-      refNumber  = 0; 	// Last texture fererence number
-      usedBlocks  = NULL;
-      freeBlocks  = NULL;
-      numUsedBlocks  = 0;
-      usedTextureMemory = 0;
       maxTextureMemory = maxMemory;
+      lowWaterMark = opts.lowWaterMark;
+      mapTextures  = opts.mapUncompressed;
+
+      if ( numPrefetchThreads == 0 )
+	 texturePrefetchStart( opts.prefetchThreads, opts.prefetchQueueSize );
+      maxOpenFiles = ( opts.maxFileDescriptors > 0 ?
+		       max( opts.maxFileDescriptors, 2 ) : 0 );
+      environmentPrefilter = max( opts.environmentPrefilter, 0 );
+      floatStorage = opts.floatStorage;
+      shadowFilter = opts.shadowFilter;
+      shadowExponent = min( max( opts.shadowExponent, 1.0f ), 88.0f );
+
+      if ( opts.statsFile != NULL )
+      {
+	 free( statsFileName );
+	 statsFileName = strdup( opts.statsFile );
+      }
+      if ( opts.traceFile != NULL )
+      {
+	 free( traceFileName );
+	 traceFileName = strdup( opts.traceFile );
+	 traceStart = textureTraceTime();
+	 traceTiles = miTRUE;
+      }
+      if ( lowWaterMark < 0.0f ) lowWaterMark = 0.0f;
+      if ( lowWaterMark > 1.0f ) lowWaterMark = 1.0f;
+
+      for (i=0;i<kTEXTURE_SHARDS;i++)
+      {
+	 CTextureShard	*shard = textureShards + i;
+
+	 shard->maxTextureMemory = maxMemory / kTEXTURE_SHARDS;
+	 shard->lowTextureMemory = (miUint)( shard->maxTextureMemory *
+					     lowWaterMark );
+	 shard->maxPackedMemory  = (miUint)( shard->maxTextureMemory *
+					     max( opts.compressedMemory,
+						  0.0f ) );
+      }
    }
 }
 
 ///////////////////////////////////////////////////////////////////////
 // Function  :	textureShutdown
 // Description 	:	Delete everything about textures
-// Return Value :	miTRUE on success
-void textureShutdown()
+// Return Value :	miTRUE if everything got deleted
+// Comments  :	Does nothing but count until the last textureInit
+//		is matched, and nothing at all once it was
+miBoolean textureShutdown()
 {
    CTextureBlock	*cBlock,*nBlock;
+   CRetiredData	*r;
+   CTextureEntry	*cEntry;
+   CTextureRecord	*cRecord;
+   CLayerRecord	*cLayer;
+   int	i,numLeft;
+
+   if ( shardsInitialized == miFALSE ) return miFALSE;
+   if ( textureUsers == 0 || --textureUsers > 0 ) return miFALSE;
+
+   texturePrefetchStop();
+
+   if (statsFileName != NULL)
+   {
+      textureWriteStatistics(statsFileName);
+      free(statsFileName);
+      statsFileName = NULL;
+   }
+
+   // Textures still referenced go away with their blocks
+   for (numLeft=0,i=0;i<kTEXTURE_REGISTRY_SIZE;i++)
+   {
+      while ((cEntry = textureRegistry[i]) != NULL) {
+	 textureRegistry[i] = cEntry->next;
+	 delete cEntry->texture;
+	 free(cEntry->fileName);
+	 delete cEntry;
+	 numLeft++;
+      }
+   }
+   if (numLeft > 0)
+      mi_warning("%d textures were never released.",numLeft);
+
+   for (i=0;i<kTEXTURE_SHARDS;i++)
+   {
+      CTextureShard	*shard = textureShards + i;
+
+      while(shard->usedBlocks != NULL)
+	 textureDeleteBlock(shard->usedBlocks);
+
+      for (cBlock=shard->freeBlocks;cBlock!=NULL;) {
+	 nBlock = cBlock->next;
+	 delete cBlock;
+	 cBlock = nBlock;
+      }
+      shard->freeBlocks = NULL;
+
+      // Nobody is looking textures up anymore
+      while ((r = shard->retired) != NULL) {
+	 shard->retired = r->next;
+	 delete [] (unsigned char *) r->data;
+	 delete r;
+      }
+   }
+
+   // The blocks just deleted logged their final counts
+   if (traceFileName != NULL)
+   {
+      textureWriteTrace(traceFileName);
+      free(traceFileName);
+      traceFileName = NULL;
+   }
+   traceTiles = miFALSE;
+
+   for (i=0;i<kTEXTURE_SHARDS;i++)
+   {
+      CTextureShard	*shard = textureShards + i;
+      CTraceChunk	*c;
+
+      while ((c = shard->trace) != NULL) {
+	 shard->trace = c->next;
+	 delete c;
+      }
+   }
+
+   textureShutdownHandles();
+
+   // Start counting from scratch in the next render
+   while ((cRecord = firstRecord) != NULL) {
+      firstRecord = cRecord->next;
+      while ((cLayer = cRecord->firstLayer) != NULL) {
+	 cRecord->firstLayer = cLayer->next;
+	 free(cLayer->name);
+	 delete cLayer;
+      }
+      free(cRecord->name);
+      delete cRecord;
+   }
+   lastRecord = NULL;
+   for (i=0;i<kTEXTURE_REGISTRY_SIZE;i++)
+      recordTable[i] = NULL;
+
+   return miTRUE;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureStatistics
+// Description 	:	Get the current statistics
+// Comments  :	The counts the threads haven't added to Stats yet are
+//		read while the threads may still be changing them, so
+//		they may be a little behind.
+void textureStatistics(TextureStats& stats)
+{
+   miUint	i,n;
+
+   stats = *Stats;
+
+   n = numTextureThreads;
+   memoryBarrier();
+   for (i=0;i<n;i++)
+   {
+      stats.numTextureRef    += textureThreads[i]->numRefs;
+      stats.numTileCacheHits += textureThreads[i]->numHits;
+   }
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureWriteName
+// Description 	:	Write a file name as a quoted CSV or JSON string
+static void	textureWriteName(FILE *out,const char *name,miBoolean csv)
+{
+   fputc('"',out);
+   for (;*name != '\0';name++)
+   {
+      if (*name == '"')	fputc(csv ? '"' : '\\',out);
+      else if ((*name == '\\') && !csv)	fputc('\\',out);
+      fputc(*name,out);
+   }
+   fputc('"',out);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureWriteStatistics
+// Description 	:	Write the statistics with a breakdown per texture
+//			and mip level
+// Return Value :	miFALSE if the file can't be written
+// Comments  :	The working set is the amount of distinct data read
+//		from disk.  A memory limit above the sum of the working
+//		sets never reads a tile twice.
+miBoolean textureWriteStatistics(const char *fileName)
+{
+   TextureStats	s;
+   TextureUsage	total,sum;
+   CTextureRecord	*cTexture;
+   CLayerRecord	*cRecord;
+   FILE 	*out;
+   size_t	len;
+   miBoolean	csv;
+   int  	level;
+
+   len = strlen(fileName);
+   csv = (len > 4) && (strcmp(fileName + len - 4,".csv") == 0);
+
+   out = fopen(fileName,"w");
+   if (out == NULL)
+   {
+      mi_error("Could not write texture statistics to \"%s\".",fileName);
+      return miFALSE;
+   }
+
+   textureStatistics(s);
+
+   mi_lock(recordsLock);
+
+   if (csv)
+   {
+      fprintf(out,"texture,level,directory,width,height,"
+	      "fetches,misses,transferred,workingSet\n");
+
+      for (cTexture=firstRecord;cTexture!=NULL;cTexture=cTexture->next)
+      {
+	 for (level=0,cRecord=cTexture->firstLayer;cRecord!=NULL;
+	      level++,cRecord=cRecord->next)
+	 {
+	    textureWriteName(out,cRecord->name,miTRUE);
+	    fprintf(out,",%d,%d,%d,%d,%lu,%lu,%lu,%lu\n",
+		    level,cRecord->directory,cRecord->width,cRecord->height,
+		    (unsigned long) cRecord->numFetches,
+		    (unsigned long) cRecord->numMisses,
+		    (unsigned long) cRecord->transferredData,
+		    (unsigned long) cRecord->workingSetData);
+	 }
+      }
+   }
+   else
+   {
+      for (cTexture=firstRecord;cTexture!=NULL;cTexture=cTexture->next)
+	 for (cRecord=cTexture->firstLayer;cRecord!=NULL;
+	      cRecord=cRecord->next)
+	    total.workingSetData += cRecord->workingSetData;
+
+      fprintf(out,"{\n");
+      fprintf(out,"  \"memoryLimit\": %lu,\n",
+	      (unsigned long) maxTextureMemory);
+      fprintf(out,"  \"workingSet\": %lu,\n",
+	      (unsigned long) total.workingSetData);
+      fprintf(out,"  \"transferred\": %lu,\n",
+	      (unsigned long) s.transferredTextureData);
+      fprintf(out,"  \"flushes\": %lu,\n",
+	      (unsigned long) s.textureFlushes);
+      fprintf(out,"  \"peakTextureMemory\": %lu,\n",
+	      (unsigned long) s.peakTextureSize);
+      fprintf(out,"  \"lookups\": %lu,\n",
+	      (unsigned long) s.numTextureRef);
+      fprintf(out,"  \"tileCacheHits\": %lu,\n",
+	      (unsigned long) s.numTileCacheHits);
+      fprintf(out,"  \"misses\": %lu,\n",
+	      (unsigned long) s.numTextureMisses);
+      fprintf(out,"  \"prefetchRequests\": %lu,\n",
+	      (unsigned long) s.prefetchRequests);
+      fprintf(out,"  \"prefetchDropped\": %lu,\n",
+	      (unsigned long) s.prefetchDropped);
+      fprintf(out,"  \"prefetchHits\": %lu,\n",
+	      (unsigned long) s.prefetchHits);
+      fprintf(out,"  \"prefetchMisses\": %lu,\n",
+	      (unsigned long) s.prefetchMisses);
+      fprintf(out,"  \"compressedHits\": %lu,\n",
+	      (unsigned long) s.numCompressedHits);
+      fprintf(out,"  \"compressedDropped\": %lu,\n",
+	      (unsigned long) s.compressedDropped);
+      fprintf(out,"  \"compressedMemory\": %lu,\n",
+	      (unsigned long) s.compressedSize);
+      fprintf(out,"  \"compressedData\": %lu,\n",
+	      (unsigned long) s.compressedData);
+      fprintf(out,"  \"openFiles\": %lu,\n",
+	      (unsigned long) s.numFileDescriptors);
+      fprintf(out,"  \"fileReuses\": %lu,\n",
+	      (unsigned long) s.numFileReuses);
+      fprintf(out,"  \"sharedTextures\": %lu,\n",
+	      (unsigned long) s.numSharedTextures);
+      fprintf(out,"  \"textures\": [");
+
+      for (cTexture=firstRecord;cTexture!=NULL;cTexture=cTexture->next)
+      {
+	 sum = TextureUsage();
+	 for (cRecord=cTexture->firstLayer;cRecord!=NULL;
+	      cRecord=cRecord->next)
+	 {
+	    sum.numFetches      += cRecord->numFetches;
+	    sum.numMisses       += cRecord->numMisses;
+	    sum.transferredData += cRecord->transferredData;
+	    sum.workingSetData  += cRecord->workingSetData;
+	 }
+
+	 fprintf(out,"%s\n    {\n      \"file\": ",
+		 (cTexture == firstRecord) ? "" : ",");
+	 textureWriteName(out,cTexture->name,miFALSE);
+	 fprintf(out,",\n      \"fetches\": %lu, \"misses\": %lu, "
+		 "\"transferred\": %lu, \"workingSet\": %lu,\n"
+		 "      \"levels\": [",
+		 (unsigned long) sum.numFetches,
+		 (unsigned long) sum.numMisses,
+		 (unsigned long) sum.transferredData,
+		 (unsigned long) sum.workingSetData);
+
+	 for (cRecord=cTexture->firstLayer;cRecord!=NULL;
+	      cRecord=cRecord->next)
+	 {
+	    fprintf(out,"%s\n        { \"directory\": %d, "
+		    "\"width\": %d, \"height\": %d, "
+		    "\"fetches\": %lu, \"misses\": %lu, "
+		    "\"transferred\": %lu, \"workingSet\": %lu }",
+		    (cRecord == cTexture->firstLayer) ? "" : ",",
+		    cRecord->directory,cRecord->width,cRecord->height,
+		    (unsigned long) cRecord->numFetches,
+		    (unsigned long) cRecord->numMisses,
+		    (unsigned long) cRecord->transferredData,
+		    (unsigned long) cRecord->workingSetData);
+	 }
+
+	 fprintf(out,"\n      ]\n    }");
+      }
+
+      fprintf(out,"\n  ]\n}\n");
+   }
+
+   mi_unlock(recordsLock);
+
+   fclose(out);
+   return miTRUE;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureTraceOrder
+// Description 	:	qsort comparison putting trace events in time order
+static int	textureTraceOrder(const void *a,const void *b)
+{
+   const double	ta = ((const CTraceEvent *) a)->time;
+   const double	tb = ((const CTraceEvent *) b)->time;
+
+   return (ta < tb) ? -1 : ((ta > tb) ? 1 : 0);
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureWriteTrace
+// Description 	:	Write the tile trace as CSV
+// Return Value :	miFALSE if the file can't be written
+// Comments  :	One line per event: when it happened, what it was,
+//		the layer and tile, and how many lookups touched the
+//		tile up to then.  "tile" lines give the final count of
+//		tiles that were deleted.  Tiles read over and over again
+//		show up as many load/evict pairs, levels finer than any
+//		lookup needed as tiles that got few or no accesses.
+miBoolean textureWriteTrace(const char *fileName)
+{
+   CTraceEvent	*events;
+   CTraceChunk	*c;
+   CLayerRecord	*cRecord;
+   FILE 	*out;
+   int	numEvents,i,n;
+
+   out = fopen(fileName,"w");
+   if (out == NULL)
+   {
+      mi_error("Could not write the texture trace to \"%s\".",fileName);
+      return miFALSE;
+   }
+
+   // Gather the events of all shards
+   for (numEvents=0,i=0;i<kTEXTURE_SHARDS;i++)
+   {
+      mi_lock(textureShards[i].lock);
+      for (c=textureShards[i].trace;c!=NULL;c=c->next)
+	 numEvents += c->numEvents;
+      mi_unlock(textureShards[i].lock);
+   }
+
+   events = new CTraceEvent[numEvents + 1];
+   for (n=0,i=0;i<kTEXTURE_SHARDS;i++)
+   {
+      mi_lock(textureShards[i].lock);
+      for (c=textureShards[i].trace;(c!=NULL) && (n < numEvents);c=c->next)
+      {
+	 int	k = min(c->numEvents,numEvents - n);
+	 memcpy(events + n,c->events,k*sizeof(CTraceEvent));
+	 n += k;
+      }
+      mi_unlock(textureShards[i].lock);
+   }
+
+   qsort(events,n,sizeof(CTraceEvent),textureTraceOrder);
+
+   fprintf(out,"time,event,texture,directory,width,height,"
+	   "tileX,tileY,accesses\n");
 
-   while(usedBlocks != NULL)
-      textureDeleteBlock(usedBlocks);
+   mi_lock(recordsLock);
 
-   for (cBlock=freeBlocks;cBlock!=NULL;) {
-      nBlock = cBlock->next;
-      delete cBlock;
-      cBlock = nBlock;
+   for (i=0;i<n;i++)
+   {
+      const CTraceEvent&	e = events[i];
+
+      cRecord = static_cast<CLayerRecord *>(e.usage);
+
+      fprintf(out,"%.6f,%s,",e.time,traceEventNames[e.kind]);
+      if (cRecord != NULL)
+      {
+	 textureWriteName(out,cRecord->name,miTRUE);
+	 fprintf(out,",%d,%d,%d",cRecord->directory,
+		 cRecord->width,cRecord->height);
+      }
+      else
+      {
+	 fprintf(out,"\"\",0,0,0");
+      }
+      fprintf(out,",%d,%d,%u\n",e.tileX,e.tileY,e.accesses);
    }
+
+   mi_unlock(recordsLock);
+
+   delete [] events;
+   fclose(out);
+   return miTRUE;
 }
 
 struct TSearchpath
@@ -1994,58 +6405,228 @@ struct TSearchpath
 miBoolean locateFile( char* const fn, const char* const name,
 		      TSearchpath *path )
 {
+   // Resolve the name, so textures are shared no matter how the
+   // shaders spell the path to them
+#ifdef WIN32
+   if ( _fullpath( fn, name, OS_MAX_PATH_LENGTH ) != NULL )
+      return miTRUE;
+#else
+   char* full = realpath( name, NULL );
+   if ( full != NULL )
+   {
+      miBoolean fits = ( strlen( full ) < (size_t) OS_MAX_PATH_LENGTH );
+      if ( fits ) strcpy( fn, full );
+      free( full );
+      if ( fits ) return miTRUE;
+   }
+#endif
    strcpy( fn, name );
    return miTRUE;
 }
 
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureRegister
+// Description 	:	Add a texture to the registry, with one reference
+// Return Value :	The new entry
+// Comments  :	The registry lock must be held.  A NULL texture makes
+//		an entry that is loading.
+static CTextureEntry	*textureRegister(int bucket,const char *fn,
+					 int directory,CTexture *cTexture)
+{
+   CTextureEntry	*cEntry;
+
+   cEntry  = new CTextureEntry;
+   cEntry->fileName  = strdup(fn);
+   cEntry->directory = directory;
+   cEntry->texture   = cTexture;
+   cEntry->refCount  = 1;
+   cEntry->loading   = (cTexture == NULL) ? miTRUE : miFALSE;
+   cEntry->next  = textureRegistry[bucket];
+   textureRegistry[bucket] = cEntry;
+
+   return cEntry;
+}
+
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureUnregister
+// Description 	:	Take an entry out of the registry and delete it
+// Comments  :	The registry lock must be held.  Doesn't delete the
+//		texture.
+static void	textureUnregister(int bucket,CTextureEntry *entry)
+{
+   CTextureEntry	**pEntry;
+
+   for (pEntry=textureRegistry+bucket;*pEntry!=NULL;
+	pEntry=&(*pEntry)->next) {
+      if (*pEntry == entry) {
+	 *pEntry = entry->next;
+	 break;
+      }
+   }
+
+   free(entry->fileName);
+   delete entry;
+}
+
 ///////////////////////////////////////////////////////////////////////
 // Function  :	textureLoad
 // Description 	:	Load a texture from disk
 // Return Value :	Pointer to the new texture
-CTexture* textureLoad(const char *name,TSearchpath *path) {
+// Comments  :	The file is read without holding the registry lock.
+//		Threads loading the same texture meanwhile wait for
+//		its entry to be done loading.
+CTexture* textureLoad(const char *name,TSearchpath *path,int directory) {
+   CTiffHandle	*handle;
    TIFF 	*in;
    CTexture *cTexture = NULL;
+   CTextureEntry	*cEntry;
    char 	fn[OS_MAX_PATH_LENGTH];
-   int  directory = 0;
+   int  	bucket;
+   int  	dstart = directory;
 
-   if (locateFile(fn,name,path) == miFALSE)
+   // UDIM sets are keyed on their name, their files load lazily
+   if (strstr(name,"<UDIM>") != NULL) {
+      if (strlen(name) >= sizeof(fn))	return NULL;
+      strcpy(fn,name);
+   }
+   else if (locateFile(fn,name,path) == miFALSE)
       return NULL;
 
-   // Set the error handler so we don't crash
-   TIFFSetErrorHandler(tiffErrorHandler);
-   TIFFSetWarningHandler(tiffWarningHandler);
-   
+   bucket = textureRegistryHash(fn,directory);
+
+   mi_lock(registryLock);
+
+   // Is it loaded already ?
+   for (cEntry=textureRegistry[bucket];cEntry!=NULL;) {
+      if ((cEntry->directory != directory) ||
+	  (strcmp(cEntry->fileName,fn) != 0)) {
+	 cEntry = cEntry->next;
+	 continue;
+      }
+
+      if (cEntry->loading) {
+	 // The entry may be gone once we look again
+	 mi_unlock(registryLock);
+	 textureYield();
+	 mi_lock(registryLock);
+	 cEntry = textureRegistry[bucket];
+	 continue;
+      }
+
+      cEntry->refCount++;
+      Stats->numSharedTextures++;
+      mi_unlock(registryLock);
+      return cEntry->texture;
+   }
+
+   if (strstr(fn,"<UDIM>") != NULL)
+   {
+      cTexture = new CUdimTexture(fn,path,directory);
+      textureRegister(bucket,fn,directory,cTexture);
+      mi_unlock(registryLock);
+      return cTexture;
+   }
+
+   cEntry = textureRegister(bucket,fn,directory,NULL);
+   mi_unlock(registryLock);
+
    // Open the texture
-   in  = TIFFOpen(fn,"r");
-   if (in == NULL)
+   handle  = textureOpenTIFF(fn);
+   if (handle == NULL)
    {
       mi_error("Could not open TIFF file \"%s\".", fn);
+   }
+   else if (textureSetDirectory(handle,directory) == miFALSE)
+   {
+      textureCloseTIFF(handle);
+      handle = NULL;
+      mi_error("No directory %d in TIFF file \"%s\".", directory, fn);
+   }
+
+   if (handle == NULL)
+   {
+      mi_lock(registryLock);
+      textureUnregister(bucket,cEntry);
+      mi_unlock(registryLock);
       return NULL;
    }
+
+   in  = handle->in;
    
    char	*textureSpec = NULL;
    char	tmp[1024];
    
+   textureBeginRecord(fn,directory);
    if (TIFFGetField(in,TIFFTAG_IMAGEDESCRIPTION, &textureSpec) == 1)
    {
       strcpy(tmp,textureSpec);
       textureSpec = tmp;
       
       if (strncmp(textureSpec,"#texture",8) == 0)
-	 cTexture = texLoad(fn,name,in,directory,textureSpec);
+	 cTexture = texLoad(fn,name,in,dstart,textureSpec);
       else
-	 cTexture = texLoad(fn,name,in,directory,NULL);
+	 cTexture = texLoad(fn,name,in,dstart,NULL);
    }
    else
    {
-      cTexture = texLoad(fn,name,in,directory,NULL);
+      cTexture = texLoad(fn,name,in,dstart,NULL);
    }
-   
-   TIFFClose(in);
+   textureEndRecord();
+
+   // texLoad moved around the directories
+   handle->directory = -1;
+   textureCloseTIFF(handle);
+
+   // Whoever waits on the entry takes its reference from here on
+   mi_lock(registryLock);
+   if (cTexture != NULL) {
+      cEntry->texture = cTexture;
+      cEntry->loading = miFALSE;
+   } else {
+      textureUnregister(bucket,cEntry);
+   }
+   mi_unlock(registryLock);
 
    return cTexture;
 }
 
+///////////////////////////////////////////////////////////////////////
+// Function  :	textureRelease
+// Description 	:	Give back a reference to a texture
+// Comments  :	The texture is deleted with its last reference, once
+//		it is out of the registry
+void textureRelease(CTexture *texture) {
+   CTextureEntry	*cEntry,**pEntry;
+   int  	i;
+
+   if (texture == NULL)	return;
+
+   mi_lock(registryLock);
+
+   for (i=0;i<kTEXTURE_REGISTRY_SIZE;i++) {
+      for (pEntry=textureRegistry+i;(cEntry=*pEntry)!=NULL;
+	   pEntry=&cEntry->next) {
+	 if (cEntry->texture != texture)	continue;
+
+	 if (--cEntry->refCount > 0) {
+	    mi_unlock(registryLock);
+	    return;
+	 }
+
+	 // Deleted unlocked, as UDIM sets give back their own textures
+	 *pEntry = cEntry->next;
+	 mi_unlock(registryLock);
+
+	 delete cEntry->texture;
+	 free(cEntry->fileName);
+	 delete cEntry;
+	 return;
+      }
+   }
+
+   mi_unlock(registryLock);
+}
+
 
 ///////////////////////////////////////////////////////////////////////
 // Function  :	environmentLoad
@@ -2055,7 +6636,9 @@ CEnvironment* environmentLoad(const char *name,
 			      TSearchpath *path,
 			      float *toWorld)
 {
+   CTiffHandle	*handle;
    TIFF 	*in;
+   FILE 	*tmpin;
    char 	fileName[OS_MAX_PATH_LENGTH];
    char 	*ext = NULL;
    CEnvironment	*cTexture = NULL;
@@ -2064,25 +6647,43 @@ CEnvironment* environmentLoad(const char *name,
    if (locateFile(fileName,name,path) == miFALSE)
       return NULL;
 
-   // Check if the file is a transparency shadow map
-//     FILE 	*tmpin;
-//     tmpin = ropen(fileName,"rb",fileTransparencyShadow,miTRUE);
-//     if (tmpin != NULL)
-//        return new CDeepShadow(name, fileName, toWorld, tmpin);
+   // Check if the file is a deep shadow map
+   textureAcquireDescriptor();
+   tmpin = fopen(fileName,"rb");
+   if (tmpin != NULL)
+   {
+      char	magic[sizeof(MR_DEEP_SHADOW_MAGIC)];
+
+      if (fread(magic,sizeof(magic),1,tmpin) == 1 &&
+	  memcmp(magic,MR_DEEP_SHADOW_MAGIC,sizeof(magic)) == 0)
+      {
+	 textureBeginRecord(fileName,0);
+	 cTexture = new CDeepShadow(name,fileName,toWorld,tmpin);
+	 textureEndRecord();
+	 return cTexture;
+      }
+      fclose(tmpin);
+   }
+   textureReleaseDescriptor();
 
-   // Set the error handler so we don't crash
-   TIFFSetErrorHandler(tiffErrorHandler);
-   TIFFSetWarningHandler(tiffWarningHandler);
-   
    // Open the texture
-   in  = TIFFOpen(fileName,"r");
+   handle  = textureOpenTIFF(fileName);
 
-   if (in != NULL)
+   if (handle != NULL && textureSetDirectory(handle,0) == miFALSE)
+   {
+      textureCloseTIFF(handle);
+      handle = NULL;
+   }
+
+   if (handle != NULL)
    {
       char  tmp[1024];
       char  *textureSpec = NULL;
       miMatrix  envMat;
 
+      in  = handle->in;
+
+      textureBeginRecord(fileName,0);
       if (TIFFGetField(in,TIFFTAG_IMAGEDESCRIPTION, &textureSpec) == 1)
       {
 	 strcpy(tmp,textureSpec);
@@ -2231,8 +6832,11 @@ CEnvironment* environmentLoad(const char *name,
 	    cTexture = new CShadow(name,trans,side);
 	 }
       }
+      textureEndRecord();
 
-      TIFFClose(in);
+      // texLoad moved around the directories
+      handle->directory = -1;
+      textureCloseTIFF(handle);
    }
 
    return cTexture;
@@ -61,6 +61,10 @@ BEGIN_NAMESPACE( mr )
 class	CTexture;
 class	CEnvironment;
 class	CMadeTexture;
+class	CEnvironmentPyramid;
+class	CShadowMoments;
+struct	CDeepTileLoader;
+struct	TSearchpath;
 
 
 //! This class holds information about a particular texture lookup
@@ -82,6 +86,8 @@ struct	CTextureLookup	{
      int		channel;
      //! The fill in value for the lookup
      color		fill;
+     //! Use an elliptical weighted average filter on mipmaps
+     miBoolean		ewa;
 };
 
 
@@ -92,7 +98,8 @@ struct TextureOptions : public CTextureLookup
 		     const float inSwidth = 0.0f, const float inTwidth = 0.0f,
 		     const float inSblur = 0.0f, const float inTblur = 0.0f,
 		     const int inSamples = 1, const int inChannel = 0,
-		     const color inFill = 0.0f
+		     const color inFill = 0.0f,
+		     const miBoolean inEwa = miFALSE
 		    ) 
      {
 	filter = inFilter;
@@ -102,6 +109,7 @@ struct TextureOptions : public CTextureLookup
 	numSamples = inSamples;
 	channel = inChannel;
 	fill = inFill;
+	ewa = inEwa;
 	shadowBias = 0.0f;
 	blur = 0.0f;
      }
@@ -124,6 +132,7 @@ struct ShadowOptions : public CTextureLookup
 	shadowBias = inShadowBias;
 	channel = 0;
 	fill = 0.0f;
+	ewa = miFALSE;
      }
 };
 
@@ -135,10 +144,35 @@ class	CTextureBlock
      void		*data;
      //! Size of the block in bytes
      int		size;
-     //! Last time this block was referenced
-     int		lastRefNumber;
+     //! Set on every reference, cleared by the clock hand
+     miBoolean		referenced;
+     //! The cache shard that owns this block
+     int		shard;
+     //! miTRUE while a thread is reading the block from disk
+     miBoolean		loading;
+     //! miTRUE if the block was prefetched and not looked at since
+     miBoolean		prefetched;
      //! Pointer to the next used / empty block
      CTextureBlock	*next;
+     //! Neighbours on the clock of resident blocks (NULL if paged out)
+     CTextureBlock	*clockPrev,*clockNext;
+     //! The statistics of the layer the block belongs to (may be NULL)
+     TextureUsage	*usage;
+     //! miTRUE once the block was read from disk
+     miBoolean		loadedOnce;
+     //! The data of a paged out block, kept compressed (or NULL)
+     void		*packed;
+     //! Size of packed in bytes (size if it is a plain copy)
+     int		packedSize;
+     //! Neighbours on the list of packed blocks of the shard
+     CTextureBlock	*packedPrev,*packedNext;
+     //! Set while the block's paged out data is compressed outside of
+     //! the shard lock, 0 otherwise
+     miUint		packTicket;
+     //! Where the block is in its layer, in tiles (for the trace)
+     int		tileX,tileY;
+     //! Lookups that touched the block, counted while tracing
+     miUint		accesses;
 };
 
 //! Texture wrapping mode
@@ -148,6 +182,57 @@ kTEXTURE_BLACK,
 kTEXTURE_CLAMP
 } TTextureMode;
 
+//! How float textures are kept in memory
+typedef enum {
+kTEXTURE_STORE_NATIVE,		//<- As 32 bit floats, like in the file
+kTEXTURE_STORE_HALF,		//<- As IEEE halves
+kTEXTURE_STORE_UNORM16		//<- As 16 bit fixed point, clamped to [0,1]
+} TTextureStorage;
+
+//! How shadow maps loaded from then on are filtered
+typedef enum {
+kSHADOW_PCF,			//<- Percentage closer, on the depths
+kSHADOW_VARIANCE,		//<- Variance shadow map (depth and its square)
+kSHADOW_EXPONENTIAL		//<- Exponential shadow map
+} TShadowFilter;
+
+//! Round a float to the nearest half (F. Giesen's float_to_half_fast3)
+inline unsigned short floatToHalf(float f)
+{
+   union { float f; miUint u; } v;
+   miUint	sign;
+
+   v.f  = f;
+   sign = (v.u >> 16) & 0x8000;
+   v.u &= 0x7fffffff;
+
+   if (v.u >= 0x47800000)	// Too large, infinite or not a number
+      return (unsigned short) (sign | ((v.u > 0x7f800000) ? 0x7e00 : 0x7c00));
+
+   if (v.u < 0x38800000) {
+      // Denormal: let the FPU round it into the low bits
+      v.f += 0.5f;
+      return (unsigned short) (sign | (v.u - 0x3f000000));
+   }
+
+   // Rebias the exponent and round to nearest even
+   v.u += 0xc8000fff + ((v.u >> 13) & 1);
+   return (unsigned short) (sign | (v.u >> 13));
+}
+
+//! Widen a half to a float
+inline float halfToFloat(unsigned short h)
+{
+   union { float f; miUint u; } v;
+
+   v.u = (miUint) (h & 0x7fff) << 13;
+   v.f *= 5.192296858534828e33f;	// 2^112 rebiases the exponent
+   if ((h & 0x7fff) > 0x7bff)		// Infinite or not a number
+      v.u |= 0x7f800000;
+   v.u |= (miUint) (h & 0x8000) << 16;
+   return v.f;
+}
+
 
 //! This class encapsulates a single 2D texture layer in a file
 class	CTextureLayer  {
@@ -157,16 +242,34 @@ class	CTextureLayer  {
      //! Color lookup
      void	lookup(const miState* const, float *,float,float,
 		       const CTextureLookup& );
+     //! Color lookup blended with the same lookup in another layer
+     void	lookup(const miState* const, float *,float,float,
+		       CTextureLayer *,float,const CTextureLookup& );
+     //! Color lookups of n points, 3 floats of result each
+     virtual void	lookupBatch(float *,const float *,const float *,int,
+				    const CTextureLookup& );
      //! Depth lookup
      void	lookupz(const miState* const, float *,float,float,
 			const CTextureLookup& );
+     //! Copy the depths of a w by h block of pixels starting at x,y,
+     //! which must be inside the layer
+     virtual void	fetchDepths(float *,int,int,int,int,
+				    const CTextureLookup& );
+     //! Queue the data around pixel x,y for background loading
+     virtual void	prefetch(int,int);
 
      char*		name;	//<- The filename of the texture
      int	   directory;	//<- The directory index in the tiff file
      int	width,height,numSamples;  //<- The image info
      int	fileWidth,fileHeight;	  //<- The physical size in the file
+     TextureUsage*	usage;		  //<- Block cache statistics
    protected:
-     //! Lookup 4 pixel values
+     friend class CMadeTexture;
+
+     //! Lookup the 2x2 pixels around a point and their weights
+     void	lookupFootprint(float *,float,float,float&,float&,
+				const CTextureLookup& );
+     //! Lookup 4 pixel values, 4 floats each (the 4th is unused)
      //! This function must be overriden by the child class
      virtual void lookupPixel(float *,int,int,const CTextureLookup& ) = 0;
 };
@@ -186,6 +289,15 @@ class	CTexture {
      //! Area access
      virtual void lookup4(const miState* const, float*, const float*,
 			  const float*, const CTextureLookup& );
+     //! Box filtered access outside of shading, over a square the given
+     //! size in texture space
+     virtual void lookupBox(float*, float, float, float,
+			    const CTextureLookup& );
+     //! Box filtered access of n points at once, outside of shading.
+     //! The sizes are those of lookupBox (NULL for point lookups) and
+     //! the result gets 3 floats per point.
+     virtual void lookupBatch(float*, const float*, const float*,
+			      const float*, int, const CTextureLookup& );
      //! The dimensions of the texture (used to figure out the blur amount)
      int  width,height;
      //! The texture wrapping mode
@@ -204,10 +316,21 @@ public:
 		       const CTextureLookup& );
      void	lookup4(const miState* const, float *,const float *,
 			const float *, const CTextureLookup& );
+     void	lookupBox(float *,float,float,float,const CTextureLookup& );
+     void	lookupBatch(float *,const float *,const float *,const float *,
+			    int,const CTextureLookup& );
      
      //! The number of layers (pyramids)
      int	     numLayers;
      CTextureLayer** layers;
+
+   protected:
+     //! Elliptical weighted average over the mip levels
+     void	lookupEWA(const miState* const, float *,const float *,
+			  const float *, const CTextureLookup& );
+     //! Elliptical weighted average on a single mip level
+     void	lookupEWALevel(int,float *,float,float,float,float,float,
+			       const CTextureLookup& );
 };
 
 
@@ -227,6 +350,38 @@ class	CRegularTexture : public CTexture {
 };
 
 
+//! The tiles of a UDIM set: 10 across, up to 100 rows
+#define MR_UDIM_COLUMNS	10
+#define MR_UDIM_ROWS	100
+
+//! A UDIM set, one texture per unit square of (s,t), from the files
+//! named like the set with <UDIM> replaced by 1001 + s + 10*t.  A file
+//! is loaded the first time a lookup lands in its square, through the
+//! registry like any other texture, and shares the same cache.
+class	CUdimTexture : public CTexture {
+   public:
+     CUdimTexture(const char *,TSearchpath *,int);
+     virtual ~CUdimTexture();
+
+     void lookup(const miState* const, float *,float,float,
+		 const CTextureLookup& );
+     void lookup4(const miState* const, float *,const float *,const float *,
+		  const CTextureLookup& );
+     void lookupBox(float *,float,float,float,const CTextureLookup& );
+
+   protected:
+     //! The texture of a square, loading it if needed
+     //! \return NULL if there is no file for it
+     CTexture*	tile(int);
+
+     TSearchpath*	path;
+     int		directory;
+     CTexture*		tiles[MR_UDIM_COLUMNS*MR_UDIM_ROWS];
+     volatile int	loaded[MR_UDIM_COLUMNS*MR_UDIM_ROWS];  //<- Tried yet
+     miLock		loadLock;	//<- Serializes the loads
+};
+
+
 //! An environment map (also encapsulates shadow maps)
 class	CEnvironment {
    public:
@@ -238,6 +393,19 @@ class	CEnvironment {
 			 float *,const float *,const float *,
 			 const float *,const CTextureLookup& );
      char*		name;	//<- The filename of the texture
+
+   protected:
+     //! Build the prefiltered pyramid from sample(), if enabled
+     void	prefilter();
+     //! Lookup the prefiltered pyramid
+     //! \return miFALSE if there is none or the footprint is too narrow
+     //!         for it
+     miBoolean	lookupPrefiltered(float *,const float *,const float *,
+				  const float *,const CTextureLookup& );
+     //! Average the map over about the given angle around a direction
+     virtual void	sample(float *,const float *,float);
+
+     CEnvironmentPyramid*	pyramid;  //<- NULL if not prefiltered
 };
 
 //! A single sided shadow map
@@ -252,10 +420,34 @@ class	CShadow : public CEnvironment{
 
      CTextureLayer*              side;
      miMatrix			toNDC;
+
+   protected:
+     //! Percentage closer filtering of n samples
+     //! \return The total weight of the occluded ones
+     float	percentageCloser(const float *,const float *,const float *,
+				 const float *,int,const CTextureLookup& );
+     //! Build the moments pyramid for variance or exponential maps
+     void	buildMoments(TShadowFilter,float);
+     //! Filter the moments pyramid over the footprint of a lookup
+     void	lookupMoments(float *,const float *,const float *,
+			      const float *,const CTextureLookup& );
+
+     CShadowMoments*	moments;	//<- NULL for percentage closer
+     TShadowFilter	filter;
+     float		exponent;	//<- Of exponential maps
+     float		zMin,zScale;	//<- Map depths to [0,1] in moments
 };
 
 
 
+//! Deep shadow map files start with this, including its NUL, followed
+//! by the header and the end offset of each tile
+#define MR_DEEP_SHADOW_MAGIC	"#deepshadow"
+
+//! The depth of the last sample of each deep shadow map pixel, and
+//! negated, of its first
+const float kDEEP_INFINITY = 1e30f;
+
 //! The deep shadow map header
 class	CDeepShadowHeader {
    public:
@@ -272,10 +464,20 @@ class	CDeepShadowHeader {
 
 //! A deep shadow map
 class	CDeepShadow : public CEnvironment{
+     //! A tile of the map.  In the file, each pixel is a run of
+     //! (z,r,g,b) samples starting with z = -kDEEP_INFINITY.  Paged
+     //! in, the tile is kept as
+     //!	 miUint		 index[n+1];	  first sample of each pixel
+     //!	 miUint		 colorIndex[n+1]; first color of each pixel
+     //!	 float		 depth[samples+8]; padded with kDEEP_INFINITY
+     //!	 unsigned short	 color[colors];	  0..65535
+     //! where n = tileSize*tileSize.  Pixels that are grey throughout
+     //! keep one color per sample instead of three.  The depths are not
+     //! delta encoded: deepSearch bisects them where they are and
+     //! compares the last 8 at once with SSE2, which deltas would turn
+     //! into a running sum over the pixel on every lookup.
      class	CDeepTile {
 	public:
-	  float			**data;
-	  float			**lastData;
 	  CTextureBlock	*block;
      };
 
@@ -288,7 +490,9 @@ class	CDeepShadow : public CEnvironment{
 		 const float *,const CTextureLookup& );
 
    private:
-     void  loadTile(int,int);
+     friend struct CDeepTileLoader;
+
+     void* loadTile(int,int,CTextureBlock *);
 
      char	*fileName;
      CDeepTile	**tiles;
@@ -296,6 +500,11 @@ class	CDeepShadow : public CEnvironment{
 
      CDeepShadowHeader	header;		// The header
      int	fileStart;		// The offset in the file
+
+     const unsigned char* fileData;	// The mapped file or NULL
+     size_t	fileLength;		// The length of the mapping
+     FILE*	file;			// Kept open if not mapped
+     miLock	fileLock;		// Guards file
 };
 
 
@@ -311,6 +520,9 @@ class	CCubicEnvironment : public CEnvironment{
 		 const float *,const CTextureLookup& );
 
      CTexture*   sides[6];
+
+   protected:
+     void	sample(float *,const float *,float);
 };
 
 
@@ -325,15 +537,107 @@ class	CSphericalEnvironment : public CEnvironment{
 		 const float *,const CTextureLookup& );
      
      CTexture* side;
+
+   protected:
+     void	sample(float *,const float *,float);
 };
 
-struct TSearchpath;  // we don't use this for now
+//! Options for the texture block cache
+struct TextureCacheOptions
+{
+     //! All options at their defaults.  Set the ones you need by name:
+     //!
+     //!   TextureCacheOptions opts;
+     //!   opts.prefetchThreads = 2;
+     //!   textureInit( maxMemory, opts );
+     TextureCacheOptions() :
+     lowWaterMark( 0.5f ),
+     mapUncompressed( sizeof(void*) >= 8 ? miTRUE : miFALSE ),
+     prefetchThreads( 0 ),
+     prefetchQueueSize( 256 ),
+     maxFileDescriptors( 64 ),
+     statsFile( NULL ),
+     environmentPrefilter( 0 ),
+     floatStorage( kTEXTURE_STORE_NATIVE ),
+     compressedMemory( 0.25f ),
+     traceFile( NULL ),
+     shadowFilter( kSHADOW_PCF ),
+     shadowExponent( 80.0f )
+     {
+     }
 
-MR_LIB_EXPORT void textureInit(int maxMemory);
-MR_LIB_EXPORT void textureShutdown();
+     //! Fraction of the memory limit the cache is trimmed down to once
+     //! it goes over the limit
+     float	lowWaterMark;
+     //! Map uncompressed tiled mipmaps straight from the file instead of
+     //! paging their tiles through the cache (off by default on 32-bit
+     //! hosts, where address space is scarce)
+     miBoolean	mapUncompressed;
+     //! Number of threads paging tiles in ahead of the lookups (0 = off,
+     //! the default).  Worth it when the files are on a slow disk or
+     //! on the network.
+     int	prefetchThreads;
+     //! Maximum number of pending prefetch requests
+     int	prefetchQueueSize;
+     //! Maximum number of files the texture code keeps open at once,
+     //! idle TIFF handles kept around for reuse included (0 = no limit,
+     //! otherwise at least 2)
+     int	maxFileDescriptors;
+     //! If not NULL, textureShutdown writes the statistics to this file
+     //! (see textureWriteStatistics)
+     const char*	statsFile;
+     //! Height of the blurred lat-long pyramid built for cube and
+     //! spherical environments as they load (0 = none, the default).
+     //! Lookups wider than one of its texels read the pyramid instead
+     //! of the map.  Building it is brute force and grows with the
+     //! square of the number of texels, so keep it small (32 or 64).
+     int	environmentPrefilter;
+     //! How the tiles of float textures loaded from then on are kept.
+     //! Halves and 16 bit fixed point double what fits in the memory
+     //! limit.  Shadow maps and mapped levels always stay floats.
+     //! 16 bit files are kept as they are whatever this says: as
+     //! halves if their samples are floats, as fixed point otherwise.
+     TTextureStorage	floatStorage;
+     //! Memory for tiles paged out by a flush and kept compressed, as a
+     //! fraction of the memory limit (on top of it, 0 = none).  Missing
+     //! on one of them again costs a decompression instead of a read.
+     float	compressedMemory;
+     //! If not NULL, every tile counts its lookups and its loads and
+     //! evictions get logged, and textureShutdown writes it all to
+     //! this file as CSV.  Costs an atomic add per lookup.
+     const char*	traceFile;
+     //! How shadow maps loaded from then on are filtered.  Variance
+     //! and exponential maps build a pyramid of depth moments as they
+     //! load, so that filters of any width cost the same.
+     TShadowFilter	shadowFilter;
+     //! Sharpness of exponential shadow maps, over depths mapped to
+     //! [0,1] (at most 88, for the exponentials to fit a float)
+     float	shadowExponent;
+};
 
+//! Start using the texture cache.  The options only take while the
+//! cache is empty.  Every call must be matched by a textureShutdown.
+MR_LIB_EXPORT void textureInit(int maxMemory,
+			       const TextureCacheOptions& opts =
+			       TextureCacheOptions());
+//! Stop using the texture cache.  The last of them deletes everything
+//! and returns miTRUE.
+MR_LIB_EXPORT miBoolean textureShutdown();
+
+//! Get a reference to the texture in the given directory of a file.
+//! Textures are shared by everybody loading the same directory of the
+//! same file, so give them back with textureRelease, don't delete them.
+//! A name with <UDIM> in it loads a UDIM set, without opening any file
+//! until a lookup needs it.
+MR_LIB_EXPORT
+CTexture* textureLoad(const char *name,TSearchpath *path = NULL,
+		      int directory = 0);
+//! Give back a texture returned by textureLoad
+MR_LIB_EXPORT void textureRelease(CTexture* texture);
+//! Load an environment, cube or deep shadow map
 MR_LIB_EXPORT
-CTexture* textureLoad(const char *name,TSearchpath *path = NULL);
+CEnvironment* environmentLoad(const char *name,TSearchpath *path,
+			      float *toWorld);
 
 END_NAMESPACE( mr )
 
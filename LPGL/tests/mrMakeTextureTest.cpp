@@ -0,0 +1,193 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Checks that what mrMakeTexture writes is what textureLoad() reads,
+// for each of the sample types it stores.  mrMakeTexture.cpp is
+// included with its main() renamed, mrTiff.cpp is linked with the
+// stand-in for mental ray:
+//
+//    g++ -O2 -msse2 -I../../mrClasses -I.. -I<mental ray>/include
+//        mrMakeTextureTest.cpp ../mrTiff.cpp mrTestHost.cpp
+//        -ltiff -lpthread -o mrMakeTextureTest
+//
+// It returns the number of failed checks.
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#define main mrMakeTexture
+#include "../mrMakeTexture.cpp"
+#undef main
+
+#include "mrTest.h"
+
+BEGIN_NAMESPACE( mr )
+TextureStats* Stats = NULL;
+END_NAMESPACE( mr )
+
+
+static const int kWIDTH  = 64;
+static const int kHEIGHT = 32;
+
+//! The test image, smooth in [0,1]
+static float	testTexel( int x, int y, int c )
+{
+   return 0.5f + 0.45f * sinf( x * 0.3f + y * 0.2f + c );
+}
+
+//! Write the test image with samples of the given size and format
+static void	testWriteImage( const char* name, int bits, uint16 format )
+{
+   TIFF* out = TIFFOpen( name, "w" );
+   CHECK( out != NULL );
+   if ( out == NULL ) return;
+
+   TIFFSetField( out, TIFFTAG_IMAGEWIDTH, kWIDTH );
+   TIFFSetField( out, TIFFTAG_IMAGELENGTH, kHEIGHT );
+   TIFFSetField( out, TIFFTAG_SAMPLESPERPIXEL, 3 );
+   TIFFSetField( out, TIFFTAG_BITSPERSAMPLE, bits );
+   TIFFSetField( out, TIFFTAG_SAMPLEFORMAT, format );
+   TIFFSetField( out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG );
+   TIFFSetField( out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB );
+   TIFFSetField( out, TIFFTAG_ROWSPERSTRIP, 1 );
+
+   unsigned char* row = new unsigned char[kWIDTH * 3 * 4];
+   for ( int y = 0; y < kHEIGHT; ++y )
+   {
+      for ( int i = 0; i < kWIDTH * 3; ++i )
+      {
+	 float f = testTexel( i / 3, y, i % 3 );
+
+	 if ( bits == 8 )
+	    row[i] = (unsigned char) ( f * 255.0f + 0.5f );
+	 else if ( bits == 16 )
+	    ((unsigned short*) row)[i] = (unsigned short)
+					 ( f * 65535.0f + 0.5f );
+	 else
+	    ((float*) row)[i] = f;
+      }
+      TIFFWriteScanline( out, row, y, 0 );
+   }
+   delete [] row;
+   TIFFClose( out );
+}
+
+//! Run mrMakeTexture on in.tif, check the levels it wrote and look
+//! them up through the texture cache
+static void	testMake( const char* option, int bits, uint16 format,
+			  int madeBits, uint16 madeFormat, float eps )
+{
+   static const char* in   = "mrMakeTextureTest.in.tif";
+   static const char* made = "mrMakeTextureTest.tif";
+   const char* argv[6];
+   int	argc = 0;
+
+   fprintf( stderr, "%d bit input, %s\n", bits,
+	    option != NULL ? option : "stored as is" );
+
+   testWriteImage( in, bits, format );
+
+   argv[argc++] = "mrMakeTexture";
+   argv[argc++] = "-tile";
+   argv[argc++] = "16";
+   if ( option != NULL ) argv[argc++] = option;
+   argv[argc++] = in;
+   argv[argc++] = made;
+   CHECK( mrMakeTexture( argc, (char**) argv ) == 0 );
+
+   // 64x32 down to 2x1 is 6 levels, all tiled alike
+   TIFF* tif = TIFFOpen( made, "r" );
+   CHECK( tif != NULL );
+   if ( tif == NULL ) return;
+
+   char*  description = NULL;
+   uint16 fileBits = 0, fileFormat = 0;
+   uint32 tileWidth = 0;
+   CHECK( TIFFGetField( tif, TIFFTAG_IMAGEDESCRIPTION, &description ) &&
+	  strncmp( description, "#texture", 8 ) == 0 );
+   TIFFGetFieldDefaulted( tif, TIFFTAG_BITSPERSAMPLE, &fileBits );
+   TIFFGetFieldDefaulted( tif, TIFFTAG_SAMPLEFORMAT, &fileFormat );
+   CHECK( TIFFIsTiled( tif ) );
+   CHECK( TIFFGetField( tif, TIFFTAG_TILEWIDTH, &tileWidth ) &&
+	  tileWidth == 16 );
+   CHECK( fileBits == madeBits );
+   CHECK( fileFormat == madeFormat );
+   CHECK( TIFFNumberOfDirectories( tif ) == 6 );
+   TIFFClose( tif );
+
+   // The finest level gives back the image at the texels
+   textureInit( 1 << 20 );
+   CTexture* t = textureLoad( made );
+   CHECK( t != NULL );
+   if ( t != NULL )
+   {
+      TextureOptions opts;
+      float	     s[kWIDTH], u[kWIDTH], r[3*kWIDTH];
+      int	     x, y, c;
+
+      CHECK( t->width == kWIDTH && t->height == kHEIGHT );
+      for ( y = 0; y < kHEIGHT; ++y )
+      {
+	 for ( x = 0; x < kWIDTH; ++x )
+	 {
+	    s[x] = (float) x / kWIDTH;
+	    u[x] = (float) y / kHEIGHT;
+	 }
+	 t->lookupBatch( r, s, u, NULL, kWIDTH, opts );
+	 for ( x = 0; x < kWIDTH; ++x )
+	    for ( c = 0; c < 3; ++c )
+	       CHECK_NEAR( r[3*x+c], testTexel( x, y, c ), eps );
+      }
+
+      // The coarsest level averages the image
+      double mean = 0;
+      for ( y = 0; y < kHEIGHT; ++y )
+	 for ( x = 0; x < kWIDTH; ++x )
+	    mean += testTexel( x, y, 0 );
+      mean /= kWIDTH * kHEIGHT;
+
+      t->lookupBox( r, 0.5f, 0.5f, 1.0f, opts );
+      CHECK_NEAR( r[0], mean, 0.05 );
+
+      textureRelease( t );
+   }
+   textureShutdown();
+
+   remove( in );
+   remove( made );
+}
+
+
+int main()
+{
+   Stats = new TextureStats;
+
+   testMake( NULL,     8,  SAMPLEFORMAT_UINT,   8,  SAMPLEFORMAT_UINT,
+	     0.5 / 255.0 + 1e-6 );
+   testMake( NULL,     16, SAMPLEFORMAT_UINT,   16, SAMPLEFORMAT_UINT,
+	     1.0 / 65535.0 + 1e-6 );
+   testMake( NULL,     32, SAMPLEFORMAT_IEEEFP, 32, SAMPLEFORMAT_IEEEFP,
+	     1e-6 );
+   testMake( "-half",  32, SAMPLEFORMAT_IEEEFP, 16, SAMPLEFORMAT_IEEEFP,
+	     1.0 / 2048.0 );
+   testMake( "-float", 8,  SAMPLEFORMAT_UINT,   32, SAMPLEFORMAT_IEEEFP,
+	     0.5 / 255.0 + 1e-6 );
+
+   if ( testFailures > 0 )
+      fprintf( stderr, "%d checks failed\n", testFailures );
+   delete Stats;
+   return testFailures;
+}
@@ -0,0 +1,54 @@
+////////////////////////////////////////////////////////////////////////
+//
+// The few macros the checks next to the texture code share.  A failed
+// check is reported and counted, and the program goes on, so that one
+// run shows everything that broke.  main() returns testFailures.
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef mrTest_h
+#define mrTest_h
+
+#include <stdio.h>
+#include <math.h>
+
+static int testFailures = 0;
+
+#define CHECK(x) \
+   do { \
+      if ( !(x) ) \
+      { \
+	 fprintf( stderr, "%s:%d: check failed: %s\n", \
+		  __FILE__, __LINE__, #x ); \
+	 testFailures++; \
+      } \
+   } while (0)
+
+//! Check that a and b are at most eps apart
+#define CHECK_NEAR(a,b,eps) \
+   do { \
+      double _a = (a), _b = (b); \
+      if ( !(fabs( _a - _b ) <= (eps)) ) \
+      { \
+	 fprintf( stderr, "%s:%d: check failed: %s (%g) near %s (%g)\n", \
+		  __FILE__, __LINE__, #a, _a, #b, _b ); \
+	 testFailures++; \
+      } \
+   } while (0)
+
+#endif // mrTest_h
@@ -0,0 +1,186 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Stands in for the few mental ray functions the texture code calls,
+// so that its checks run as standalone programs.  It does not include
+// shader.h: the functions are only matched by their C names, and the
+// mental ray locks are assumed to be at least as wide as an int.
+//
+// Locks are kept in a table of mutexes, the lock handed out being the
+// index in it.  mi_sample() steps through a radical inverse sequence.
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#ifdef WIN32
+#  define NOMINMAX
+#  include <windows.h>
+typedef CRITICAL_SECTION	hostMutex;
+#  define hostMutexInit(m)	InitializeCriticalSection(m)
+#  define hostMutexDestroy(m)	DeleteCriticalSection(m)
+#  define hostMutexLock(m)	EnterCriticalSection(m)
+#  define hostMutexUnlock(m)	LeaveCriticalSection(m)
+#else
+#  include <pthread.h>
+typedef pthread_mutex_t		hostMutex;
+#  define hostMutexInit(m)	pthread_mutex_init(m,NULL)
+#  define hostMutexDestroy(m)	pthread_mutex_destroy(m)
+#  define hostMutexLock(m)	pthread_mutex_lock(m)
+#  define hostMutexUnlock(m)	pthread_mutex_unlock(m)
+#endif
+
+static const int kHOST_LOCKS = 1024;
+
+static hostMutex	hostLocks[kHOST_LOCKS];
+static int		numHostLocks = 0;
+
+static void	hostMessage(const char *kind,const char *fmt,va_list ap)
+{
+   fprintf(stderr,"%s: ",kind);
+   vfprintf(stderr,fmt,ap);
+   fputc('\n',stderr);
+}
+
+extern "C" {
+
+//! Number of mi_error() calls so far, for checks expecting an error
+int	hostErrors = 0;
+
+void	mi_init_lock(int *l)
+{
+   if (numHostLocks == kHOST_LOCKS)
+   {
+      fprintf(stderr,"mrTestHost: out of locks\n");
+      abort();
+   }
+   hostMutexInit(hostLocks + numHostLocks);
+   *l = numHostLocks++;
+}
+
+void	mi_delete_lock(int *l)
+{
+   // The slot isn't reused, so that a lock deleted twice can't take
+   // down a newer one
+   hostMutexDestroy(hostLocks + *l);
+}
+
+void	mi_lock(int l)		{ hostMutexLock(hostLocks + l); }
+void	mi_unlock(int l)	{ hostMutexUnlock(hostLocks + l); }
+
+void	*mi_mem_allocate(int size)
+{
+   void	*p = calloc(1,size > 0 ? size : 1);
+   if (p == NULL)	abort();
+   return p;
+}
+
+void	*mi_mem_reallocate(void *p,int size)
+{
+   p = realloc(p,size > 0 ? size : 1);
+   if (p == NULL)	abort();
+   return p;
+}
+
+void	mi_mem_release(void *p)		{ free(p); }
+
+char	*mi_mem_strdup(const char *s)
+{
+   char	*d = (char *) mi_mem_allocate((int) strlen(s) + 1);
+   strcpy(d,s);
+   return d;
+}
+
+// What the mi_mem_ macros of some shader.h versions call
+void	*mi_mem_int_allocate(const char *,int,int size)
+{
+   return mi_mem_allocate(size);
+}
+
+void	*mi_mem_int_reallocate(const char *,int,void *p,int size)
+{
+   return mi_mem_reallocate(p,size);
+}
+
+void	mi_mem_int_release(const char *,int,void *p)	{ free(p); }
+
+void	mi_error(const char *fmt,...)
+{
+   va_list	ap;
+
+   hostErrors++;
+   va_start(ap,fmt);
+   hostMessage("error",fmt,ap);
+   va_end(ap);
+}
+
+void	mi_warning(const char *fmt,...)
+{
+   va_list	ap;
+
+   va_start(ap,fmt);
+   hostMessage("warning",fmt,ap);
+   va_end(ap);
+}
+
+void	mi_info(const char *fmt,...)
+{
+   va_list	ap;
+
+   va_start(ap,fmt);
+   hostMessage("info",fmt,ap);
+   va_end(ap);
+}
+
+//! res = a * b, for row vectors
+void	mi_matrix_prod(float *res,const float *a,const float *b)
+{
+   float	r[16];
+   int	i,j;
+
+   for (i=0;i<4;i++)
+      for (j=0;j<4;j++)
+	 r[i*4+j] = a[i*4+0]*b[0*4+j] + a[i*4+1]*b[1*4+j] +
+		    a[i*4+2]*b[2*4+j] + a[i*4+3]*b[3*4+j];
+   memcpy(res,r,sizeof(r));
+}
+
+//! Sample *counter of *n, in dim dimensions
+int	mi_sample(double *sample,int *counter,void *,int dim,int *n)
+{
+   static const int	primes[] = { 2, 3, 5, 7, 11, 13, 17, 19 };
+   int	i;
+
+   if ((n != NULL) && (*counter >= *n))	return 0;
+
+   for (i=0;i<dim && i<8;i++)
+   {
+      double	f = 1.0/primes[i],r = 0.0;
+      int	k = *counter + 1;
+
+      for (;k>0;k/=primes[i],f/=primes[i])
+	 r += f*(k % primes[i]);
+      sample[i] = r;
+   }
+   (*counter)++;
+   return 1;
+}
+
+}
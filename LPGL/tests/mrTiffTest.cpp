@@ -0,0 +1,519 @@
+////////////////////////////////////////////////////////////////////////
+//
+// Checks of the texture cache in mrTiff.cpp.  mrTiff.cpp is included
+// rather than linked, so that its static functions can be reached,
+// and mrTestHost.cpp stands in for mental ray:
+//
+//    g++ -O2 -msse2 -I../../mrClasses -I.. -I<mental ray>/include
+//        mrTiffTest.cpp mrTestHost.cpp -ltiff -lpthread -o mrTiffTest
+//
+// It returns the number of failed checks.
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public
+// License as published by the Free Software Foundation; either
+// version 2 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "../mrTiff.cpp"
+
+#include "mrTest.h"
+
+extern "C" int hostErrors;	// Counted by mrTestHost.cpp
+
+BEGIN_NAMESPACE( mr )
+TextureStats* Stats = NULL;
+END_NAMESPACE( mr )
+
+using namespace mr;
+
+
+//! Pages blocks in with their first byte set to fill
+struct CTestLoader
+{
+     unsigned char fill;
+
+     CTestLoader( unsigned char f ) : fill( f ) {};
+
+     void* operator()( CTextureBlock* e ) const
+     {
+	unsigned char* data = new unsigned char[e->size];
+	memset( data, fill, e->size );
+	return data;
+     }
+};
+
+//! Get a new block of shard 0.  The blocks of the other shards made
+//! on the way get deleted with the others by textureShutdown.
+static CTextureBlock*	testBlock( int size )
+{
+   CTextureBlock*	b;
+
+   do {
+      b = textureNewBlock( size );
+   } while ( b->shard != 0 );
+
+   return b;
+}
+
+//! Page a block in and let go of it again
+static void	testTouch( CTextureBlock* b, unsigned char fill )
+{
+   textureReleaseBlock( textureAcquireBlock( b, CTestLoader( fill ) ) );
+}
+
+
+//! The CLOCK sweep pages out unreferenced blocks only, gives the
+//! referenced ones a second chance and stops at the low water mark
+static void	testClock()
+{
+   TextureCacheOptions opts;
+   opts.lowWaterMark     = 0.5f;
+   opts.compressedMemory = 0.0f;
+
+   // Four blocks of 1024 bytes per shard
+   textureInit( kTEXTURE_SHARDS * 4 * 1024, opts );
+
+   CTextureShard* shard = textureShards;
+   CTextureBlock* a = testBlock( 1024 );
+   CTextureBlock* b = testBlock( 1024 );
+   CTextureBlock* c = testBlock( 1024 );
+   CTextureBlock* d = testBlock( 1024 );
+   CTextureBlock* e = testBlock( 1024 );
+
+   miUlong flushes = Stats->textureFlushes;
+
+   testTouch( a, 'a' );
+   testTouch( b, 'b' );
+   testTouch( c, 'c' );
+   testTouch( d, 'd' );
+   CHECK( shard->usedTextureMemory == 4096 );
+   CHECK( Stats->textureFlushes == flushes );
+
+   a->referenced = c->referenced = d->referenced = miFALSE;
+
+   testTouch( e, 'e' );
+   CHECK( Stats->textureFlushes == flushes + 1 );
+   CHECK( a->data == NULL );
+   CHECK( c->data == NULL );
+   CHECK( d->data == NULL );
+   CHECK( b->data != NULL && *(unsigned char*) b->data == 'b' );
+   CHECK( e->data != NULL && *(unsigned char*) e->data == 'e' );
+   CHECK( b->referenced == miFALSE );
+   CHECK( shard->usedTextureMemory == 2048 );
+
+   // Paged out blocks come back on the next look
+   testTouch( a, 'A' );
+   CHECK( a->data != NULL && *(unsigned char*) a->data == 'A' );
+   CHECK( shard->usedTextureMemory == 3072 );
+
+   CHECK( textureShutdown() == miTRUE );
+   CHECK( shard->usedTextureMemory == 0 );
+}
+
+
+//! A number in [0,1) that changes a lot from one i to the next
+static float	testValue( int i )
+{
+   return (float) ( ( i * 2654435761u ) >> 8 ) / (float) ( 1 << 24 );
+}
+
+//! Bilinear blend of the footprint res, as the scalar build does it
+static void	testBilerp( double* r, const float* res, float dx, float dy )
+{
+   for ( int j = 0; j < 3; ++j )
+      r[j] = ( res[j]    * (1.0 - dx) + res[4+j]  * dx ) * (1.0 - dy) +
+	     ( res[8+j]  * (1.0 - dx) + res[12+j] * dx ) * dy;
+}
+
+//! Texels fetched and blended by the SIMD path match the scalar
+//! conversions and blend, and missing channels take the fill color
+static void	testFootprint()
+{
+   TextureOptions opts( mr::filter::box, 0.0f, 0.0f, 0.0f, 0.0f, 1, 0,
+			color( 0.5f, 0.25f, 0.125f ) );
+   float	 floats[4*4];
+   unsigned char bytes[4*4];
+   float	 res[4*4];
+   float	 r[3];
+   double	 ref[3];
+   int		 i, j;
+
+   for ( i = 0; i < 4*4; ++i )
+   {
+      floats[i] = testValue( i ) * 4.0f - 1.0f;
+      bytes[i]  = (unsigned char) ( testValue( i + 100 ) * 256.0f );
+   }
+
+   for ( i = 0; i < 4; ++i )
+   {
+      texelFetch( res + 4*i, floats + 4*i, 4, opts );
+      for ( j = 0; j < 3; ++j )
+	 CHECK( res[4*i+j] == floats[4*i+j] );
+
+      texelFetch( res + 4*i, bytes + 4*i, 3, opts );
+      for ( j = 0; j < 3; ++j )
+	 CHECK_NEAR( res[4*i+j], bytes[4*i+j] / 255.0, 1e-7 );
+
+      texelFetch( res + 4*i, bytes + 4*i, 1, opts );
+      CHECK_NEAR( res[4*i], bytes[4*i] / 255.0, 1e-7 );
+      CHECK( res[4*i+1] == 0.25f && res[4*i+2] == 0.125f );
+   }
+
+   for ( i = 0; i < 4; ++i )
+      texelFetch( res + 4*i, floats + 4*i, 4, opts );
+
+   for ( i = 0; i < 64; ++i )
+   {
+      float dx = testValue( 2*i ), dy = testValue( 2*i + 1 );
+
+      texelBlend( r, res, dx, dy );
+      testBilerp( ref, res, dx, dy );
+      for ( j = 0; j < 3; ++j )
+	 CHECK_NEAR( r[j], ref[j], 1e-5 );
+   }
+
+   // The corners give back the texels
+   texelBlend( r, res, 0.0f, 0.0f );
+   CHECK( r[0] == res[0] && r[1] == res[1] && r[2] == res[2] );
+   texelBlend( r, res, 1.0f, 1.0f );
+   CHECK_NEAR( r[0], res[12], 1e-6 );
+}
+
+
+//! Write a w x h RGB image of 8 bit channels, value(x,y,c) each
+static void	testWriteImage( const char* name, int w, int h,
+				unsigned char (*value)( int, int, int ) )
+{
+   TIFF* out = TIFFOpen( name, "w" );
+   CHECK( out != NULL );
+   if ( out == NULL ) return;
+
+   TIFFSetField( out, TIFFTAG_IMAGEWIDTH, w );
+   TIFFSetField( out, TIFFTAG_IMAGELENGTH, h );
+   TIFFSetField( out, TIFFTAG_SAMPLESPERPIXEL, 3 );
+   TIFFSetField( out, TIFFTAG_BITSPERSAMPLE, 8 );
+   TIFFSetField( out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG );
+   TIFFSetField( out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB );
+   TIFFSetField( out, TIFFTAG_ROWSPERSTRIP, 1 );
+
+   unsigned char* row = new unsigned char[w*3];
+   for ( int y = 0; y < h; ++y )
+   {
+      for ( int x = 0; x < w; ++x )
+	 for ( int c = 0; c < 3; ++c )
+	    row[x*3+c] = value( x, y, c );
+      TIFFWriteScanline( out, row, y, 0 );
+   }
+   delete [] row;
+   TIFFClose( out );
+}
+
+static unsigned char	testGradient( int x, int y, int c )
+{
+   return (unsigned char) ( c == 0 ? x * 16 : c == 1 ? y * 16 : 128 );
+}
+
+//! The references a texture has in the registry, 0 if it's not there
+static int	testRefCount( CTexture* t )
+{
+   for ( int i = 0; i < kTEXTURE_REGISTRY_SIZE; ++i )
+      for ( CTextureEntry* e = textureRegistry[i]; e != NULL; e = e->next )
+	 if ( e->texture == t ) return e->refCount;
+   return 0;
+}
+
+//! Loading a texture twice, under any spelling of its name, shares it
+//! until the last reference is given back.  Only the last of nested
+//! textureInit calls gets to shut the cache down.
+static void	testRegistry()
+{
+   static const char* name = "mrTiffTest.tif";
+
+   testWriteImage( name, 16, 16, testGradient );
+
+   textureInit( 1 << 20 );
+   textureInit( 1 << 20 );
+
+   miUlong shared = Stats->numSharedTextures;
+
+   CTexture* t0 = textureLoad( name );
+   CTexture* t1 = textureLoad( "./mrTiffTest.tif" );
+   CHECK( t0 != NULL );
+   CHECK( t0 == t1 );
+   CHECK( Stats->numSharedTextures == shared + 1 );
+   CHECK( testRefCount( t0 ) == 2 );
+
+   textureRelease( t1 );
+   CHECK( testRefCount( t0 ) == 1 );
+
+   // A file that isn't there leaves nothing behind
+   int errors = hostErrors;
+   CHECK( textureLoad( "mrTiffTest.missing.tif" ) == NULL );
+   CHECK( hostErrors > errors );
+   for ( int i = 0; i < kTEXTURE_REGISTRY_SIZE; ++i )
+      for ( CTextureEntry* e = textureRegistry[i]; e != NULL; e = e->next )
+	 CHECK( e->texture != NULL && e->loading == miFALSE );
+
+   textureRelease( t0 );
+   CHECK( testRefCount( t0 ) == 0 );
+
+   // A texture loaded again after its release is a new one
+   t0 = textureLoad( name );
+   CHECK( testRefCount( t0 ) == 1 );
+   textureRelease( t0 );
+
+   CHECK( textureShutdown() == miFALSE );
+   CHECK( textureShutdown() == miTRUE );
+   CHECK( textureShutdown() == miFALSE );
+
+   remove( name );
+}
+
+
+//! deepSearch finds what a linear scan of the depths finds, for runs
+//! of any length, with repeated depths and with w on a depth
+static void	testDeepSearch()
+{
+   static const int kMAX = 40;
+   float depth[kMAX + 8];
+   int	 n, i, j, k;
+
+   for ( n = 0; n <= kMAX; ++n )
+   {
+      // Sorted, with runs of equal depths, then the padding of a tile
+      for ( i = 0; i < n; ++i )
+	 depth[i] = (float) ( ( i * 3 ) / 4 );
+      for ( ; i < kMAX + 8; ++i )
+	 depth[i] = kDEEP_INFINITY;
+
+      for ( j = -2; j <= 2 * kMAX; ++j )
+      {
+	 float w = j * 0.5f;
+
+	 for ( k = 0; k < n && depth[k] < w; ++k ) ;
+	 CHECK( deepSearch( depth, n, w ) == k );
+      }
+      CHECK( deepSearch( depth, n, kDEEP_INFINITY ) == n );
+   }
+}
+
+
+//! Every half comes back from a float unchanged, floats round to the
+//! nearest half, and the packed texels read back through texelFetch
+//! the way the scalar conversions read them
+static void	testHalf()
+{
+   TextureOptions opts;
+   CHalf	  halves[4];
+   CUnorm16	  unorms[4];
+   float	  floats[4];
+   float	  res[4];
+   int		  h, i;
+
+   for ( h = 0; h < 0x10000; ++h )
+   {
+      float f = halfToFloat( (unsigned short) h );
+
+      if ( ( h & 0x7fff ) > 0x7c00 )
+	 CHECK( f != f && ( floatToHalf( f ) & 0x7fff ) > 0x7c00 );
+      else
+	 CHECK( floatToHalf( f ) == h );
+
+      // Three halves at a time, as a texel
+      halves[h % 3].bits = (unsigned short) h;
+      if ( h % 3 == 2 )
+      {
+	 texelFetch( res, halves, 3, opts );
+	 for ( i = 0; i < 3; ++i )
+	 {
+	    float ref = halfToFloat( halves[i].bits );
+	    CHECK( res[i] == ref || ( res[i] != res[i] && ref != ref ) );
+	 }
+      }
+   }
+
+   // Halves have 11 bits of precision, and stop at 65504
+   for ( i = 0; i < 1000; ++i )
+   {
+      float f = ( testValue( i ) - 0.5f ) * 131072.0f;
+      float r = halfToFloat( floatToHalf( f ) );
+
+      if ( fabs( f ) < 65520.0f )
+	 CHECK( fabs( r - f ) <= fabs( f ) / 2048.0f + 1e-7f );
+      else
+	 CHECK( fabs( r ) > 1e38f );
+   }
+
+   // The F16C conversions round like floatToHalf
+   float src[11];
+   CHalf dst[11];
+   for ( i = 0; i < 11; ++i )
+      src[i] = ( testValue( i + 7 ) - 0.5f ) * 10.0f;
+   texelPack( dst, src, 11 );
+   for ( i = 0; i < 11; ++i )
+      CHECK( dst[i].bits == floatToHalf( src[i] ) );
+
+   // 16 bit fixed point holds every one of its steps, clamps to [0,1]
+   // and takes NaNs as 0
+   for ( h = 0; h < 0x10000; ++h )
+   {
+      floats[0] = h / 65535.0f;
+      texelPack( unorms, floats, 1 );
+      CHECK( unorms[0].bits == h );
+   }
+
+   floats[0] = -1.0f;
+   floats[1] = 2.0f;
+   floats[2] = sqrtf( -1.0f );
+   floats[3] = 0.25f;
+   texelPack( unorms, floats, 4 );
+   CHECK( unorms[0].bits == 0 );
+   CHECK( unorms[1].bits == 65535 );
+   CHECK( unorms[2].bits == 0 );
+   texelFetch( res, unorms + 1, 3, opts );
+   CHECK( res[0] == 1.0f && res[1] == 0.0f );
+   CHECK_NEAR( res[2], 0.25, 1.0 / 65535.0 );
+}
+
+
+//! Shuffle, compress, expand and unshuffle size bytes
+static void	testPackRoundTrip( const unsigned char* src, int size )
+{
+   unsigned char* shuffled = new unsigned char[size + 1];
+   unsigned char* packed   = new unsigned char[2*size + 16];
+   unsigned char* expanded = new unsigned char[size + 1];
+   unsigned char* back     = new unsigned char[size + 1];
+
+   textureShuffle( shuffled, src, size );
+   int n = textureCompress( packed, 2*size + 16, shuffled, size );
+   CHECK( n > 0 );
+   CHECK( textureDecompress( expanded, size, packed, n ) == miTRUE );
+   textureUnshuffle( back, expanded, size );
+   CHECK( memcmp( back, src, size ) == 0 );
+
+   // Damaged data is turned down, not expanded out of the buffers
+   if ( n > 1 )
+      CHECK( textureDecompress( expanded, size, packed, n - 1 ) == miFALSE );
+   CHECK( textureDecompress( expanded, size - 1, packed, n ) == miFALSE );
+
+   delete [] shuffled;
+   delete [] packed;
+   delete [] expanded;
+   delete [] back;
+}
+
+//! Pages blocks in with a ramp of floats, counting the reads
+struct CRampLoader
+{
+     int* reads;
+
+     CRampLoader( int* r ) : reads( r ) {};
+
+     void* operator()( CTextureBlock* e ) const
+     {
+	float* data = new float[e->size / sizeof(float)];
+	for ( int i = 0; i < e->size / (int) sizeof(float); ++i )
+	   data[i] = i * 0.25f;
+	++*reads;
+	return data;
+     }
+};
+
+//! Compressed data expands to what it was made of, and blocks paged
+//! out come back from the compressed tier instead of the loader
+static void	testCompressedTier()
+{
+   static const int kSIZE = 4096;
+   unsigned char	 data[kSIZE];
+   int			 i, size;
+
+   for ( size = 1; size <= 40; ++size )
+   {
+      for ( i = 0; i < size; ++i ) data[i] = (unsigned char) ( i % 5 );
+      testPackRoundTrip( data, size );
+   }
+
+   // Long runs, needing several length bytes
+   memset( data, 7, kSIZE );
+   testPackRoundTrip( data, kSIZE );
+
+   // Floats, smooth and with noise in the low bits
+   float* f = (float*) data;
+   for ( i = 0; i < kSIZE / 4; ++i ) f[i] = sinf( i * 0.01f );
+   testPackRoundTrip( data, kSIZE );
+
+   // Noise doesn't fit in less than it takes
+   miUint seed = 1;
+   for ( i = 0; i < kSIZE; ++i )
+   {
+      seed = seed * 1103515245u + 12345u;
+      data[i] = (unsigned char) ( seed >> 16 );
+   }
+   unsigned char packed[kSIZE];
+   CHECK( textureCompress( packed, kSIZE - 1, data, kSIZE ) == 0 );
+
+   TextureCacheOptions opts;
+   opts.lowWaterMark     = 0.5f;
+   opts.compressedMemory = 1.0f;
+   textureInit( kTEXTURE_SHARDS * 4 * 1024, opts );
+
+   CTextureBlock* b[6];
+   int	 reads = 0;
+
+   for ( i = 0; i < 6; ++i )
+      b[i] = testBlock( 1024 );
+   for ( i = 0; i < 6; ++i )
+      textureReleaseBlock( textureAcquireBlock( b[i], CRampLoader( &reads ) ) );
+   CHECK( reads == 6 );
+
+   // The flush paged out the first blocks and compressed them
+   miUlong hits = Stats->numCompressedHits;
+   CHECK( b[0]->data == NULL && b[0]->packed != NULL );
+   CHECK( b[0]->packedSize < b[0]->size );
+   CHECK( textureShards[0].packedMemory > 0 );
+
+   textureReleaseBlock( textureAcquireBlock( b[0], CRampLoader( &reads ) ) );
+   CHECK( reads == 6 );
+   CHECK( Stats->numCompressedHits == hits + 1 );
+   CHECK( b[0]->packed == NULL );
+   CHECK( b[0]->data != NULL );
+   if ( b[0]->data != NULL )
+   {
+      f = (float*) b[0]->data;
+      for ( i = 0; i < 256; ++i )
+	 CHECK( f[i] == i * 0.25f );
+   }
+
+   CHECK( textureShutdown() == miTRUE );
+   CHECK( textureShards[0].packedMemory == 0 );
+}
+
+
+int main()
+{
+   Stats = new TextureStats;
+
+   testClock();
+   testFootprint();
+   testRegistry();
+   testDeepSearch();
+   testHalf();
+   testCompressedTier();
+
+   if ( testFailures > 0 )
+      fprintf( stderr, "%d checks failed\n", testFailures );
+   delete Stats;
+   return testFailures;
+}
@@ -0,0 +1,111 @@
+//
+//  Copyright (c) 2004, Gonzalo Garramuno
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//  *       Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//  *       Redistributions in binary form must reproduce the above
+//  copyright notice, this list of conditions and the following disclaimer
+//  in the documentation and/or other materials provided with the
+//  distribution.
+//  *       Neither the name of Gonzalo Garramuno nor the names of
+//  its other contributors may be used to endorse or promote products derived
+//  from this software without specific prior written permission. 
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef mrAtomic_h
+#define mrAtomic_h
+
+#ifdef WIN32
+#  ifndef NOMINMAX
+#    define NOMINMAX
+#  endif
+#  include <windows.h>
+#endif
+
+#ifndef SHADER_H
+#include "shader.h"
+#endif
+
+#ifndef mrMacros_h
+#include "mrMacros.h"
+#endif
+
+BEGIN_NAMESPACE( mr )
+
+//! \brief
+//! Lock free helpers for counters shared between threads.
+//!
+//! Use these for statistics and sequence numbers that are bumped from
+//! many threads, where taking an miLock for each update would cost more
+//! than the update itself.
+
+//! Atomically add v to *p, returning the new value
+inline miUint  atomicAdd( volatile miUint* p, const miUint v )
+{
+#ifdef WIN32
+   return (miUint) InterlockedExchangeAdd( (volatile LONG*) p,
+					   (LONG) v ) + v;
+#else
+   return __sync_add_and_fetch( p, v );
+#endif
+}
+
+//! Atomically add v to *p, returning the new value
+inline miUlong atomicAdd( volatile miUlong* p, const miUlong v )
+{
+#ifdef WIN32
+   return (miUlong) InterlockedExchangeAdd( (volatile LONG*) p,
+					    (LONG) v ) + v;
+#else
+   return __sync_add_and_fetch( p, v );
+#endif
+}
+
+//! Atomically raise *p to v, if v is bigger
+inline void    atomicMax( volatile miUlong* p, const miUlong v )
+{
+   miUlong old;
+   do {
+      old = *p;
+      if ( old >= v ) return;
+#ifdef WIN32
+   } while ( (miUlong) InterlockedCompareExchange( (volatile LONG*) p,
+						   (LONG) v,
+						   (LONG) old ) != old );
+#else
+   } while ( !__sync_bool_compare_and_swap( p, old, v ) );
+#endif
+}
+
+//! Full memory barrier.  Neither the compiler nor the cpu move loads
+//! or stores across it.
+inline void    memoryBarrier()
+{
+#ifdef WIN32
+   LONG barrier;
+   InterlockedExchange( &barrier, 0 );
+#else
+   __sync_synchronize();
+#endif
+}
+
+END_NAMESPACE( mr )
+
+#endif // mrAtomic_h
@@ -119,6 +119,19 @@ void bump(
 }
 
 
+//! Perform Blinn bump mapping from the gradient of the bump function
+//! in the space of dPds and dPdt, like SPerlin::snoise_grad() returns
+inline
+void bump(
+	  miState* const state,
+	  const vector& dPds, const vector& dPdt,
+	  const vector& grad
+	  )
+{
+   bump( state, dPds, dPdt, grad % dPds, grad % dPdt );
+}
+
+
 //! Perform parallax bump mapping 
 //! This routine will modify all state->tex_list[] coordinates.
 //! See: http://vrsj.t.u-tokyo.ac.jp/ic-at/papers/01205.pdf 
@@ -41,6 +41,16 @@ BEGIN_NAMESPACE( mr )
 
 BEGIN_NAMESPACE( distances )
 
+//! The distance measures below, to pick one at run time without a
+//! virtual call per distance (see FWorley::noise())
+enum Metric
+{
+kEuclidian,
+kManhattan,
+kChessboard,
+kSuperquadratic
+};
+
 //!
 //! Different functors that can be used to measure common distance
 //! measurements.
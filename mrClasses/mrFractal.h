@@ -0,0 +1,345 @@
+//
+//  Copyright (c) 2004, Gonzalo Garramuno
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//  *       Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//  *       Redistributions in binary form must reproduce the above
+//  copyright notice, this list of conditions and the following disclaimer
+//  in the documentation and/or other materials provided with the
+//  distribution.
+//  *       Neither the name of Gonzalo Garramuno nor the names of
+//  its other contributors may be used to endorse or promote products derived
+//  from this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//
+// Musgrave's fractals (fBm, turbulence, ridged multifractal) and
+// filtered noises, built on top of SPerlin, VPerlin and FWorley.
+//
+// All of them take a filter width, in the units of P, and are
+// band-limited with it:  an octave whose lattice gets smaller than
+// about a pixel is faded to its average value and no more octaves are
+// evaluated past it.  Use noisewidth() to get that width from the pixel
+// footprint of the current sample.
+//
+//   point Pn = P * freq;
+//   miScalar fw = noisewidth( state, freq );
+//   miScalar f  = fBm< SPerlin >( Pn, fw, 8 );
+//   vector   v  = fBm< VPerlin >( Pn, fw, 8 );   // vfBm
+//   miScalar c  = turbulence< FWorley >( Pn, fw, 4 );
+//
+
+#ifndef mrFractal_h
+#define mrFractal_h
+
+#ifndef mrMacros_h
+#include "mrMacros.h"
+#endif
+
+#ifndef mrMath_h
+#include "mrMath.h"
+#endif
+
+#ifndef mrVector_h
+#include "mrVector.h"
+#endif
+
+#ifndef mrDerivs_h
+#include "mrDerivs.h"
+#endif
+
+#ifndef mrPerlin_h
+#include "mrPerlin.h"
+#endif
+
+#ifndef mrWorley_h
+#include "mrWorley.h"
+#endif
+
+
+BEGIN_NAMESPACE( mr )
+
+
+//! Filter width of a noise looked up at freq times internal space,
+//! from the pixel footprint (see area()).
+inline miScalar noisewidth( const miState* const state,
+			    const miScalar freq = 1.0f )
+{
+   miScalar fw = math<float>::sqrt( area( state ) ) * freq;
+   return ( fw > 1e-7f ? fw : 1e-7f );
+}
+
+
+//! How much of a noise octave survives a filter of width fw (in lattice
+//! units).  1 below 0.2, 0 past 0.75 -ie. past Nyquist.
+inline miScalar noisefade( const miScalar fw )
+{
+   if ( fw <= 0.2f )  return 1.0f;
+   if ( fw >= 0.75f ) return 0.0f;
+   miScalar t = (fw - 0.2f) * (1.0f / 0.55f);
+   return 1.0f - t * t * (3.0f - 2.0f * t);
+}
+
+
+//! Basis noises for the fractals.  Each evaluates its noise at P and
+//! gives the average of it and of its absolute value, which is what
+//! an octave is faded to once it goes past Nyquist.
+template< class Noise >
+struct fractal_basis;
+
+
+//! Signed perlin noise
+template<>
+struct fractal_basis< SPerlin >
+{
+     typedef miScalar type;
+
+     inline static miScalar eval( const point& P )
+     {
+	return SPerlin::snoise( P );
+     }
+     inline static miScalar abs( const miScalar x )
+     {
+	return math<float>::fabs( x );
+     }
+     inline static miScalar mean()    { return 0.0f; }
+     inline static miScalar absmean() { return 0.2216f; }
+};
+
+
+//! Signed vector perlin noise (vfBm)
+template<>
+struct fractal_basis< VPerlin >
+{
+     typedef vector type;
+
+     inline static vector eval( const point& P )
+     {
+	return VPerlin::snoise( P );
+     }
+     inline static vector abs( const vector& x )
+     {
+	return vector( math<float>::fabs( x.x ), math<float>::fabs( x.y ),
+		       math<float>::fabs( x.z ) );
+     }
+     inline static vector mean()
+     {
+	return vector( 0.0f, 0.0f, 0.0f );
+     }
+     inline static vector absmean()
+     {
+	return vector( 0.2216f, 0.2216f, 0.2216f );
+     }
+};
+
+
+//! Worley's F1 (distance to closest feature point), which FWorley
+//! scales to an average of 1.
+template<>
+struct fractal_basis< FWorley >
+{
+     typedef miScalar type;
+
+     inline static miScalar eval( const point& P )
+     {
+	miScalar F;
+	FWorley::noise( P, 1, &F );
+	return F;
+     }
+     inline static miScalar abs( const miScalar x ) { return x; }
+     inline static miScalar mean()    { return 1.0f; }
+     inline static miScalar absmean() { return 1.0f; }
+};
+
+
+
+//! sum += x * k, for both miScalar and vector sums
+template< typename T >
+inline void fractal_add( T& sum, const T& x, const miScalar k )
+{
+   T t( x );
+   t *= k;
+   sum += t;
+}
+
+
+//! Noise at P, faded to its average as the filter width fw (in units
+//! of P) goes past Nyquist.
+template< class Noise >
+inline typename fractal_basis< Noise >::type
+filterednoise( const point& P, const miScalar fw )
+{
+   typedef fractal_basis< Noise > B;
+   miScalar fade = noisefade( fw );
+   if ( fade <= 0.0f ) return B::mean();
+
+   typename B::type n = B::eval( P );
+   if ( fade >= 1.0f ) return n;
+   n *= fade;
+   fractal_add( n, B::mean(), 1.0f - fade );
+   return n;
+}
+
+
+//! Musgrave's VLNoise (variable lacunarity).  The lattice of Noise is
+//! distorted by a vector perlin noise of the given strength.
+template< class Noise >
+inline typename fractal_basis< Noise >::type
+vlnoise( const point& P, const miScalar fw,
+	 const miScalar distortion = 1.0f )
+{
+   // Offset so that the distortion does not correlate with Noise
+   point Pd( P.x + 5.17f, P.y + 1.53f, P.z + 3.31f );
+   vector D = VPerlin::snoise( Pd );
+   D *= distortion;
+   D += P;
+   return filterednoise< Noise >( point( D ), fw );
+}
+
+
+//! Fractional brownian motion.  Sums up to octaves octaves of Noise,
+//! each lacunarity times the frequency and gain times the amplitude of
+//! the previous one.  Octaves past Nyquist for filter width fw (in
+//! units of P) are not evaluated, and the last one is faded out.
+//!
+//! fBm< VPerlin > is vfBm.
+template< class Noise >
+inline typename fractal_basis< Noise >::type
+fBm( const point& P, miScalar fw, const int octaves = 8,
+     const miScalar lacunarity = 2.0f, const miScalar gain = 0.5f )
+{
+   typedef fractal_basis< Noise > B;
+   typename B::type sum = B::mean();
+   sum *= 0.0f;
+
+   point pp( P );
+   miScalar amp = 1.0f;
+   int i = 0;
+   for ( ; i < octaves; ++i )
+   {
+      miScalar fade = noisefade( fw );
+      if ( fade <= 0.0f ) break;
+
+      fractal_add( sum, B::eval( pp ), amp * fade );
+      if ( fade < 1.0f )
+	 fractal_add( sum, B::mean(), amp * (1.0f - fade) );
+
+      amp *= gain;  pp *= lacunarity;  fw *= lacunarity;
+   }
+
+   // Octaves past Nyquist just add their average
+   for ( ; i < octaves; ++i )
+   {
+      fractal_add( sum, B::mean(), amp );
+      amp *= gain;
+   }
+   return sum;
+}
+
+
+//! Perlin's turbulence.  Like fBm(), but summing the absolute value of
+//! each octave.
+template< class Noise >
+inline typename fractal_basis< Noise >::type
+turbulence( const point& P, miScalar fw, const int octaves = 8,
+	    const miScalar lacunarity = 2.0f, const miScalar gain = 0.5f )
+{
+   typedef fractal_basis< Noise > B;
+   typename B::type sum = B::absmean();
+   sum *= 0.0f;
+
+   point pp( P );
+   miScalar amp = 1.0f;
+   int i = 0;
+   for ( ; i < octaves; ++i )
+   {
+      miScalar fade = noisefade( fw );
+      if ( fade <= 0.0f ) break;
+
+      fractal_add( sum, B::abs( B::eval( pp ) ), amp * fade );
+      if ( fade < 1.0f )
+	 fractal_add( sum, B::absmean(), amp * (1.0f - fade) );
+
+      amp *= gain;  pp *= lacunarity;  fw *= lacunarity;
+   }
+
+   for ( ; i < octaves; ++i )
+   {
+      fractal_add( sum, B::absmean(), amp );
+      amp *= gain;
+   }
+   return sum;
+}
+
+
+//! Musgrave's ridged multifractal.  Each octave is a ridge
+//! (offset - |noise|)^2, weighted by the previous octave times gain and
+//! scaled by lacunarity^-(i*H).  Octaves past Nyquist are faded to the
+//! ridge of an average noise value.
+//!
+//! Musgrave's defaults are H = 1, offset = 1, gain = 2.
+template< class Noise >
+inline miScalar
+ridged( const point& P, miScalar fw, const int octaves = 8,
+	const miScalar lacunarity = 2.0f, const miScalar H = 1.0f,
+	const miScalar offset = 1.0f, const miScalar gain = 2.0f )
+{
+   typedef fractal_basis< Noise > B;
+
+   const miScalar octaveScale = math<float>::pow( lacunarity, -H );
+   miScalar avg = offset - B::absmean();
+   avg *= avg;
+
+   point pp( P );
+   miScalar sum = 0.0f, amp = 1.0f, weight = 1.0f;
+   int i = 0;
+   for ( ; i < octaves; ++i )
+   {
+      miScalar fade = noisefade( fw );
+      if ( fade <= 0.0f ) break;
+
+      miScalar signal = offset - B::abs( B::eval( pp ) );
+      signal *= signal;
+      signal  = avg + fade * ( signal - avg );
+      signal *= weight;
+      sum    += signal * amp;
+
+      weight = signal * gain;
+      if      ( weight > 1.0f ) weight = 1.0f;
+      else if ( weight < 0.0f ) weight = 0.0f;
+
+      amp *= octaveScale;  pp *= lacunarity;  fw *= lacunarity;
+   }
+
+   for ( ; i < octaves; ++i )
+   {
+      sum   += avg * weight * amp;
+      weight = avg * weight * gain;
+      if ( weight > 1.0f ) weight = 1.0f;
+      amp *= octaveScale;
+   }
+   return sum;
+}
+
+
+
+END_NAMESPACE( mr )
+
+
+#endif // mrFractal_h
@@ -70,6 +70,7 @@
 #include "mrPerlin.h"
 #include "mrCell.h"
 #include "mrWorley.h"
+#include "mrFractal.h"
 
 // Caches
 #include "mrPointCache.h"
@@ -61,8 +61,6 @@ BEGIN_NAMESPACE( mr )
 //! @todo: rewrite snoise( 4 channels) as the indexes are wrong and
 //!        so is the gradient.
 
-//! @todo: Make noise functions that return the gradient?
-
 //! Perlin Class returning a miScalar
 class SPerlin
 {
@@ -75,30 +73,28 @@ class SPerlin
 				 const miScalar b) 
      { return a + t * (b - a); }
      
-     inline static miScalar grad(const int hashv, const miScalar x) 
+     //! The gradient of a 1D lattice point
+     inline static miScalar grad1(const int hashv)
      {
 	static const miScalar g[2] = 
 	{
 	-1, 1,
 	};
-	int h = hashv & 0x1;
-	return x * g[h];
+	return g[hashv & 0x1];
      }
-     
-     inline static miScalar grad(const int hashv, const miScalar x, 
-				 const miScalar y) 
+
+     //! The gradient of a 2D lattice point
+     inline static const miScalar* grad2(const int hashv)
      {
 	static const miScalar g2[4][2] = 
 	{
 	{ 1, 0},{-1, 0},{ 0, 1},{ 0, -1}, // center of square to edges 
 	};
-
-	int h = hashv & 0x3;
-	return x * g2[h][0] + y * g2[h][1];
+	return g2[hashv & 0x3];
      }
 
-     inline static miScalar grad(const int hashv, const miScalar x, 
-				 const miScalar y, const miScalar z) 
+     //! The gradient of a 3D lattice point
+     inline static const miScalar* grad3(const int hashv)
      {
 	static const miScalar g3[16][3] = 
 	{
@@ -107,10 +103,178 @@ class SPerlin
 	{ 0, 1, 1},{ 0,-1, 1},{ 0, 1,-1},{ 0,-1,-1},
 	{ 1, 1, 0},{-1, 1, 0},{ 0,-1, 1},{ 0,-1,-1}  // tetrahedron
 	};
-	int h = hashv & 15;
-	return x * g3[h][0] + y * g3[h][1] + z * g3[h][2];
+	return g3[hashv & 15];
+     }
+
+     inline static miScalar grad(const int hashv, const miScalar x) 
+     {
+	return x * grad1(hashv);
      }
      
+     inline static miScalar grad(const int hashv, const miScalar x, 
+				 const miScalar y) 
+     {
+	const miScalar* g = grad2(hashv);
+	return x * g[0] + y * g[1];
+     }
+
+     inline static miScalar grad(const int hashv, const miScalar x, 
+				 const miScalar y, const miScalar z) 
+     {
+	const miScalar* g = grad3(hashv);
+	return x * g[0] + y * g[1] + z * g[2];
+     }
+
+     //! A value with its derivatives along N axes, for the _grad
+     //! functions.  The values go through the same operations as in
+     //! snoise(), so they come out the same.
+     template< int N >
+     struct dual
+     {
+	  miScalar v;
+	  miScalar d[N];
+     };
+
+     //! fade() of the coordinate along axis k
+     template< int N >
+     inline static dual<N> fade(const miScalar t, const int k)
+     {
+	dual<N> r;
+	r.v = fade(t);
+	for ( int i = 0; i < N; ++i ) r.d[i] = 0.0f;
+	r.d[k] = 30.0f * t * t * (t * (t - 2) + 1);
+	return r;
+     }
+
+     template< int N >
+     inline static dual<N> lerp(const dual<N>& t, const dual<N>& a,
+				const dual<N>& b)
+     {
+	dual<N> r;
+	const miScalar ba = b.v - a.v;
+	r.v = a.v + t.v * ba;
+	for ( int i = 0; i < N; ++i )
+	   r.d[i] = a.d[i] + t.d[i] * ba + t.v * (b.d[i] - a.d[i]);
+	return r;
+     }
+
+     inline static dual<1> gradd(const int hashv, const miScalar x)
+     {
+	dual<1> r;
+	r.d[0] = grad1(hashv);
+	r.v = x * r.d[0];
+	return r;
+     }
+
+     inline static dual<2> gradd(const int hashv, const miScalar x,
+				 const miScalar y)
+     {
+	dual<2> r;
+	const miScalar* g = grad2(hashv);
+	r.v = x * g[0] + y * g[1];
+	r.d[0] = g[0]; r.d[1] = g[1];
+	return r;
+     }
+
+     inline static dual<3> gradd(const int hashv, const miScalar x,
+				 const miScalar y, const miScalar z)
+     {
+	dual<3> r;
+	const miScalar* g = grad3(hashv);
+	r.v = x * g[0] + y * g[1] + z * g[2];
+	r.d[0] = g[0]; r.d[1] = g[1]; r.d[2] = g[2];
+	return r;
+     }
+
+     //! The 4D noise takes its second set of 3D gradients along x,y,t
+     inline static dual<4> gradd(const int hashv, const miScalar x,
+				 const miScalar y, const miScalar z,
+				 const int zAxis)
+     {
+	dual<4> r;
+	const miScalar* g = grad3(hashv);
+	r.v = x * g[0] + y * g[1] + z * g[2];
+	r.d[0] = g[0]; r.d[1] = g[1];
+	r.d[2] = r.d[3] = 0.0f;
+	r.d[zAxis] = g[2];
+	return r;
+     }
+
+     //! snoise_grad() of n coordinates
+     inline static miScalar snoise_gradn(const miScalar* x, miScalar* d,
+					 const int n)
+     {
+	switch( n )
+	{
+	   case 1:
+	      return snoise_grad( x[0], d[0] );
+	   case 2:
+	      return snoise_grad( x[0], x[1], d[0], d[1] );
+	   case 3:
+	      return snoise_grad( x[0], x[1], x[2], d[0], d[1], d[2] );
+	   default:
+	      return snoise_grad( x[0], x[1], x[2], x[3],
+				  d[0], d[1], d[2], d[3] );
+	}
+     }
+
+     //! The periodic blend of spnoise() (or pnoise() if not isSigned)
+     //! over N coordinates, with its gradient in d
+     template< int N >
+     inline static miScalar pgrad(const miScalar* xi, const miScalar* period,
+				  miScalar* d, const bool isSigned)
+     {
+	miScalar x[N], a[N], da[N];
+	miScalar value = 0.0f, total = 1.0f;
+	int i, k, c;
+
+	for ( i = 0; i < N; ++i )
+	{
+	   mrASSERT( period[i] != 0.0f );
+	   x[i] = math<float>::fmod( xi[i], period[i] ) + period[i] * (xi[i] < 0);
+	   total *= period[i];
+	   d[i] = 0.0f;
+	}
+
+	// Each corner c takes the lattice copy period[i] back along
+	// the axes i whose bit is set
+	for ( c = 0; c < (1 << N); ++c )
+	{
+	   miScalar weight = 1.0f;
+	   for ( i = 0; i < N; ++i )
+	   {
+	      const bool back = ( ( c >> i ) & 1 ) != 0;
+	      a[i] = back ? x[i] - period[i] : x[i];
+	      weight *= back ? x[i] : period[i] - x[i];
+	   }
+
+	   miScalar n = snoise_gradn( a, da, N );
+	   if ( !isSigned )
+	   {
+	      n = 0.5f + 0.5f * n;
+	      for ( i = 0; i < N; ++i ) da[i] *= 0.5f;
+	   }
+	   value += n * weight;
+
+	   for ( k = 0; k < N; ++k )
+	   {
+	      // The weight without its factor k, times that factor's slope
+	      miScalar dw = ( ( c >> k ) & 1 ) ? 1.0f : -1.0f;
+	      for ( i = 0; i < N; ++i )
+	      {
+		 if ( i == k ) continue;
+		 dw *= ( ( c >> i ) & 1 ) ? x[i] : period[i] - x[i];
+	      }
+	      d[k] += da[k] * weight + n * dw;
+	   }
+	}
+
+	total = 1.0f / total;
+	for ( k = 0; k < N; ++k ) d[k] *= total;
+	return value * total;
+     }
+
+
    public:
      inline static miScalar snoise(miScalar x)
      {
@@ -234,6 +398,160 @@ class SPerlin
      {
 	return snoise( P.x, P.y, P.z, t );
      }
+
+     //! Signed noise of n points, each moved by offset first.  Points
+     //! are done 8 at a time with AVX2, 4 at a time with SSE2, and the
+     //! results are the same as those of snoise( P[i] + offset ).
+     static MR_LIB_EXPORT void snoise( const point* P, const vector& offset,
+				       miScalar* out, const int n );
+
+     inline static void snoise( const point* P, miScalar* out, const int n )
+     {
+	snoise( P, vector( 0.0f, 0.0f, 0.0f ), out, n );
+     }
+
+
+
+     //! snoise(x) and its derivative, from the same lattice lookups
+     inline static miScalar snoise_grad(miScalar x, miScalar& dx)
+     {
+	int xf= fastmath<float>::floor(x);
+	int X = xf & 255;
+	x -= xf;
+	dual<1> u = fade<1>(x, 0);
+	int A = p[X], B = p[X+1];
+
+	dual<1> r = lerp(u, gradd(p[A], x  ),
+			    gradd(p[B], x-1));
+	dx = r.d[0];
+	return r.v;
+     }
+
+     //! snoise(x,y) and its gradient
+     inline static miScalar snoise_grad(miScalar x, miScalar y,
+					miScalar& dx, miScalar& dy)
+     {
+	int xf = fastmath<float>::floor(x);
+	int yf = fastmath<float>::floor(y);
+	int X = xf & 255;
+	int Y = yf & 255;
+	x -= xf;
+	y -= yf;
+	dual<2> u = fade<2>(x, 0);
+	dual<2> v = fade<2>(y, 1);
+	int A = p[X]+Y, B = p[X+1]+Y;
+
+	dual<2> r = lerp(v, lerp(u, gradd(p[A], x  , y  ),
+				    gradd(p[B], x-1, y  )),
+			    lerp(u, gradd(p[A+1], x  , y-1  ),
+				    gradd(p[B+1], x-1, y-1  )));
+	dx = r.d[0];
+	dy = r.d[1];
+	return r.v;
+     }
+
+     //! snoise(x,y,z) and its gradient
+     inline static miScalar snoise_grad(miScalar x, miScalar y, miScalar z,
+					miScalar& dx, miScalar& dy,
+					miScalar& dz)
+     {
+	int xf = fastmath<float>::floor(x);
+	int yf = fastmath<float>::floor(y);
+	int zf = fastmath<float>::floor(z);
+	int X = xf & 255;
+	int Y = yf & 255;
+	int Z = zf & 255;
+	x -= xf;
+	y -= yf;
+	z -= zf;
+	dual<3> u = fade<3>(x, 0);
+	dual<3> v = fade<3>(y, 1);
+	dual<3> w = fade<3>(z, 2);
+	int A = p[X]+Y,   AA = p[A]+Z, AB = p[A+1]+Z,
+	    B = p[X+1]+Y, BA = p[B]+Z, BB = p[B+1]+Z;
+
+	dual<3> r = lerp(w, lerp(v, lerp(u, gradd(p[AA], x  , y  , z   ),
+					    gradd(p[BA], x-1, y  , z   )),
+				    lerp(u, gradd(p[AB], x  , y-1, z   ),
+					    gradd(p[BB], x-1, y-1, z   ))),
+			    lerp(v, lerp(u, gradd(p[AA+1], x  , y  , z-1 ),
+					    gradd(p[BA+1], x-1, y  , z-1 )),
+				    lerp(u, gradd(p[AB+1], x  , y-1, z-1 ),
+					    gradd(p[BB+1], x-1, y-1, z-1 ))));
+	dx = r.d[0];
+	dy = r.d[1];
+	dz = r.d[2];
+	return r.v;
+     }
+
+     //! snoise(x,y,z,t) and its gradient
+     inline static miScalar snoise_grad(miScalar x, miScalar y,
+					miScalar z, miScalar t,
+					miScalar& dx, miScalar& dy,
+					miScalar& dz, miScalar& dt)
+     {
+	int xf = fastmath<float>::floor(x);
+	int yf = fastmath<float>::floor(y);
+	int zf = fastmath<float>::floor(z);
+	int tf = fastmath<float>::floor(t);
+	int X = xf & 255;
+	int Y = yf & 255;
+	int Z = zf & 255;
+	int T = tf & 255;
+	x -= xf;
+	y -= yf;
+	z -= zf;
+	t -= tf;
+	dual<4> u = fade<4>(x, 0);
+	dual<4> v = fade<4>(y, 1);
+	dual<4> w = fade<4>(z, 2);
+	dual<4> s = fade<4>(t, 3);
+	int A = p[X]+Y,   AA = p[A]+Z, AB = p[A+1]+Z,
+	B = p[X+1]+Y, BA = p[B]+Z, BB = p[B+1]+Z,
+	AAA= p[A]+T, ABB= p[A+1]+T,
+	BAA= p[B]+T, BBB= p[B+1]+T;
+
+	dual<4> r = 
+	lerp(s, 
+	     lerp(w, lerp(v, lerp(u, gradd(p[AA  ], x  , y  , z  , 2),
+				     gradd(p[BA  ], x-1, y  , z  , 2)),
+			     lerp(u, gradd(p[AB  ], x  , y-1, z  , 2),
+				     gradd(p[BB  ], x-1, y-1, z  , 2))),
+		     lerp(v, lerp(u, gradd(p[AA+1], x  , y  , z-1, 2),
+				     gradd(p[BA+1], x-1, y  , z-1, 2)),
+			     lerp(u, gradd(p[AB+1], x  , y-1, z-1, 2),
+				     gradd(p[BB+1], x-1, y-1, z-1, 2)))),
+	     lerp(w, lerp(v, lerp(u, gradd(p[AAA  ], x  , y  , t  , 3),
+				     gradd(p[BAA  ], x-1, y  , t  , 3)),
+			     lerp(u, gradd(p[ABB  ], x  , y-1, t  , 3),
+				     gradd(p[BBB  ], x-1, y-1, t  , 3))),
+		     lerp(v, lerp(u, gradd(p[AAA+1], x  , y  , t-1, 3),
+				     gradd(p[BAA+1], x-1, y  , t-1, 3)),
+			     lerp(u, gradd(p[ABB+1], x  , y-1, t-1, 3),
+				     gradd(p[BBB+1], x-1, y-1, t-1, 3))))
+	     );
+	dx = r.d[0];
+	dy = r.d[1];
+	dz = r.d[2];
+	dt = r.d[3];
+	return r.v;
+     }
+
+     inline static miScalar snoise_grad( const vector2d& P, vector2d& dP )
+     {
+	return snoise_grad( P.u, P.v, dP.u, dP.v );
+     }
+
+     inline static miScalar snoise_grad( const point& P, vector& dP )
+     {
+	return snoise_grad( P.x, P.y, P.z, dP.x, dP.y, dP.z );
+     }
+
+     inline static miScalar snoise_grad( const point& P, const miScalar t,
+					 vector& dP, miScalar& dt )
+     {
+	return snoise_grad( P.x, P.y, P.z, t, dP.x, dP.y, dP.z, dt );
+     }
      
 
 
@@ -273,6 +591,13 @@ class SPerlin
 	return 0.5f + 0.5f * snoise(P, t);
      }
 
+     inline static void noise( const point* P, miScalar* out, const int n )
+     {
+	snoise( P, out, n );
+	for ( int i = 0; i < n; ++i )
+	   out[i] = 0.5f + 0.5f * out[i];
+     }
+
 
 
      
@@ -402,7 +727,7 @@ class SPerlin
 		F(x, y, z_d, t_p)     * (w_xXh_y) * (zXt) + 
 		F(x, y_h, z_d, t_p)   * (w_xXy)   * (zXt) + 
 		F(x_w, y, z_d, t_p)   * (xXh_y)   * (zXt)
-		) / (w * h * d * t);
+		) / (w * h * d * p);
 #undef F
      }
 
@@ -555,7 +880,7 @@ class SPerlin
 		F(x, y, z_d, t_p)     * (w_xXh_y) * (zXt) + 
 		F(x, y_h, z_d, t_p)   * (w_xXy)   * (zXt) + 
 		F(x_w, y, z_d, t_p)   * (xXh_y)   * (zXt)
-		) / (w * h * d * t);
+		) / (w * h * d * p);
 #undef F
      }
 
@@ -579,6 +904,95 @@ class SPerlin
 			Pperiod.y, Pperiod.z, tperiod  );
      }
 
+
+
+     //! spnoise() and pnoise() with their gradients.  The blend weights
+     //! are differentiated too, so the gradient is that of the periodic
+     //! noise, not of the noise under it.
+     inline static miScalar spnoise_grad( const miScalar x,
+					  const miScalar period, miScalar& dx )
+     {
+	return pgrad<1>( &x, &period, &dx, true );
+     }
+
+     inline static miScalar spnoise_grad( const vector2d& P,
+					  const vector2d& period,
+					  vector2d& dP )
+     {
+	const miScalar x[2] = { P.u, P.v };
+	const miScalar w[2] = { period.u, period.v };
+	miScalar d[2];
+	const miScalar r = pgrad<2>( x, w, d, true );
+	dP.u = d[0]; dP.v = d[1];
+	return r;
+     }
+
+     inline static miScalar spnoise_grad( const point& P,
+					  const vector& period, vector& dP )
+     {
+	const miScalar x[3] = { P.x, P.y, P.z };
+	const miScalar w[3] = { period.x, period.y, period.z };
+	miScalar d[3];
+	const miScalar r = pgrad<3>( x, w, d, true );
+	dP.x = d[0]; dP.y = d[1]; dP.z = d[2];
+	return r;
+     }
+
+     inline static miScalar spnoise_grad( const point& P, const miScalar t,
+					  const vector& Pperiod,
+					  const miScalar tperiod,
+					  vector& dP, miScalar& dt )
+     {
+	const miScalar x[4] = { P.x, P.y, P.z, t };
+	const miScalar w[4] = { Pperiod.x, Pperiod.y, Pperiod.z, tperiod };
+	miScalar d[4];
+	const miScalar r = pgrad<4>( x, w, d, true );
+	dP.x = d[0]; dP.y = d[1]; dP.z = d[2]; dt = d[3];
+	return r;
+     }
+
+     inline static miScalar pnoise_grad( const miScalar x,
+					 const miScalar period, miScalar& dx )
+     {
+	return pgrad<1>( &x, &period, &dx, false );
+     }
+
+     inline static miScalar pnoise_grad( const vector2d& P,
+					 const vector2d& period,
+					 vector2d& dP )
+     {
+	const miScalar x[2] = { P.u, P.v };
+	const miScalar w[2] = { period.u, period.v };
+	miScalar d[2];
+	const miScalar r = pgrad<2>( x, w, d, false );
+	dP.u = d[0]; dP.v = d[1];
+	return r;
+     }
+
+     inline static miScalar pnoise_grad( const point& P,
+					 const vector& period, vector& dP )
+     {
+	const miScalar x[3] = { P.x, P.y, P.z };
+	const miScalar w[3] = { period.x, period.y, period.z };
+	miScalar d[3];
+	const miScalar r = pgrad<3>( x, w, d, false );
+	dP.x = d[0]; dP.y = d[1]; dP.z = d[2];
+	return r;
+     }
+
+     inline static miScalar pnoise_grad( const point& P, const miScalar t,
+					 const vector& Pperiod,
+					 const miScalar tperiod,
+					 vector& dP, miScalar& dt )
+     {
+	const miScalar x[4] = { P.x, P.y, P.z, t };
+	const miScalar w[4] = { Pperiod.x, Pperiod.y, Pperiod.z, tperiod };
+	miScalar d[4];
+	const miScalar r = pgrad<4>( x, w, d, false );
+	dP.x = d[0]; dP.y = d[1]; dP.z = d[2]; dt = d[3];
+	return r;
+     }
+
 }; // SPerlin
 
 
@@ -648,6 +1062,20 @@ class VPerlin
 	return snoise( P.x, P.y, P.z, t );
      }
      
+     //! Signed noise of n points, see SPerlin::snoise( P, offset, out, n )
+     inline static void snoise( const point* P, vector* out, const int n )
+     {
+	miScalar c[3][64];
+	for ( int i = 0; i < n; i += 64 )
+	{
+	   const int m = ( n - i < 64 ) ? n - i : 64;
+	   SPerlin::snoise( P + i, vector( P1x, P1y, P1z ), c[0], m );
+	   SPerlin::snoise( P + i, vector( P2x, P2y, P2z ), c[1], m );
+	   SPerlin::snoise( P + i, vector( P3x, P3y, P3z ), c[2], m );
+	   for ( int j = 0; j < m; ++j )
+	      out[i+j] = vector( c[0][j], c[1][j], c[2][j] );
+	}
+     }
 
 
 
@@ -696,6 +1124,14 @@ class VPerlin
      {
 	return noise( P.x, P.y, P.z, t );
      }
+
+     inline static void noise( const point* P, vector* out, const int n )
+     {
+	snoise( P, out, n );
+	for ( int i = 0; i < n; ++i )
+	   out[i] = vector( 0.5f + 0.5f * out[i].x, 0.5f + 0.5f * out[i].y,
+			    0.5f + 0.5f * out[i].z );
+     }
      
      
 
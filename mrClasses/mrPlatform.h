@@ -56,4 +56,28 @@
 #define MR_LIB_EXPORT
 #endif
 
+// SIMD code paths.  Define MR_NO_SSE to build without them.
+#if !defined(MR_NO_SSE) && !defined(MR_SSE2)
+#  if defined(__SSE2__) || defined(_M_X64) || \
+      ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+#    define MR_SSE2
+#  endif
+#endif
+
+// 8 wide integer SIMD with gathers.  Define MR_NO_AVX2 to build without.
+#if defined(MR_SSE2) && !defined(MR_NO_AVX2) && !defined(MR_AVX2)
+#  if defined(__AVX2__)
+#    define MR_AVX2
+#  endif
+#endif
+
+// Half float conversions.  Define MR_NO_F16C to build without them.
+// gcc and clang say so with __F16C__; MSVC has no such macro, but all
+// the cpus its /arch:AVX2 targets have F16C.
+#if defined(MR_SSE2) && !defined(MR_NO_F16C) && !defined(MR_F16C)
+#  if defined(__F16C__) || ( defined(_MSC_VER) && defined(__AVX2__) )
+#    define MR_F16C
+#  endif
+#endif
+
 #endif // mrPlatform_h
@@ -0,0 +1,147 @@
+//
+//  Copyright (c) 2004, Gonzalo Garramuno
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//  *       Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//  *       Redistributions in binary form must reproduce the above
+//  copyright notice, this list of conditions and the following disclaimer
+//  in the documentation and/or other materials provided with the
+//  distribution.
+//  *       Neither the name of Gonzalo Garramuno nor the names of
+//  its other contributors may be used to endorse or promote products derived
+//  from this software without specific prior written permission. 
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+#ifndef mrThread_h
+#define mrThread_h
+
+#ifdef WIN32
+#  ifndef NOMINMAX
+#    define NOMINMAX
+#  endif
+#  include <windows.h>
+#  include <process.h>
+#else
+#  include <pthread.h>
+#endif
+
+#ifndef mrMacros_h
+#include "mrMacros.h"
+#endif
+
+BEGIN_NAMESPACE( mr )
+
+//! \brief
+//! Thin wrapper around a native (non mental ray) thread.
+//!
+//! mental ray does not know about these threads, so code running in
+//! them must not call mi_* functions that expect a miState or a
+//! mental ray thread (mi_mem_*, mi_info, etc).  Plain miLocks are ok.
+//!
+//! Example:
+//!
+//! \code
+//!  static void worker( void* data ) { ... }
+//!
+//!  mr::thread t;
+//!  t.start( worker, myData );
+//!  ...
+//!  t.join();
+//! \endcode
+//!
+struct thread
+{
+     typedef void (*function)( void* );
+
+  inline thread();
+     //! Does not join the thread.  Call join() first.
+  inline ~thread();
+
+     //! Start running f(data) in a new thread
+  inline bool start( function f, void* data );
+     //! Wait for the thread to finish
+  inline void join();
+
+private:
+#ifdef WIN32
+  static unsigned __stdcall entry( void* self );
+  HANDLE      handle;
+#else
+  static void* entry( void* self );
+  pthread_t   handle;
+#endif
+  bool        running;
+  function    func;
+  void*       data;
+}; // thread
+
+
+//! \brief
+//! Counting semaphore, used to put worker threads to sleep
+//! while they have nothing to do.
+struct semaphore
+{
+  inline semaphore( int count = 0 );
+  inline ~semaphore();
+
+     //! Wait until the count is positive, then decrement it
+  inline void wait();
+     //! Increment the count, waking up one waiting thread
+  inline void post();
+
+private:
+#ifdef WIN32
+  HANDLE          handle;
+#else
+  pthread_mutex_t mLock;
+  pthread_cond_t  mCond;
+  int             count;
+#endif
+}; // semaphore
+
+
+//! \brief
+//! A pointer with a separate value for each thread.
+//!
+//! Each thread sees NULL until it set()s its own value.  Values are not
+//! deleted when threads exit.  Instances should be created statically.
+struct threadLocal
+{
+  inline threadLocal();
+  inline ~threadLocal();
+
+     //! This thread's value
+  inline void* get() const;
+     //! Change this thread's value
+  inline void  set( void* value );
+
+private:
+#ifdef WIN32
+  DWORD         key;
+#else
+  pthread_key_t key;
+#endif
+}; // threadLocal
+
+END_NAMESPACE( mr )
+
+#include "mrThread.inl"
+
+#endif // mrThread_h
@@ -0,0 +1,179 @@
+//
+//  Copyright (c) 2004, Gonzalo Garramuno
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//  *       Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//  *       Redistributions in binary form must reproduce the above
+//  copyright notice, this list of conditions and the following disclaimer
+//  in the documentation and/or other materials provided with the
+//  distribution.
+//  *       Neither the name of Gonzalo Garramuno nor the names of
+//  its other contributors may be used to endorse or promote products derived
+//  from this software without specific prior written permission. 
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+BEGIN_NAMESPACE( mr )
+
+
+inline thread::thread() :
+running( false ),
+func( NULL ),
+data( NULL )
+{
+}
+
+inline thread::~thread()
+{
+#ifdef WIN32
+   if ( running ) CloseHandle( handle );
+#else
+   if ( running ) pthread_detach( handle );
+#endif
+}
+
+#ifdef WIN32
+inline unsigned __stdcall thread::entry( void* self )
+{
+   thread* t = (thread*) self;
+   t->func( t->data );
+   return 0;
+}
+#else
+inline void* thread::entry( void* self )
+{
+   thread* t = (thread*) self;
+   t->func( t->data );
+   return NULL;
+}
+#endif
+
+inline bool thread::start( function f, void* d )
+{
+   if ( running ) return false;
+   func = f;
+   data = d;
+#ifdef WIN32
+   handle = (HANDLE) _beginthreadex( NULL, 0, entry, this, 0, NULL );
+   running = ( handle != 0 );
+#else
+   running = ( pthread_create( &handle, NULL, entry, this ) == 0 );
+#endif
+   return running;
+}
+
+inline void thread::join()
+{
+   if ( !running ) return;
+#ifdef WIN32
+   WaitForSingleObject( handle, INFINITE );
+   CloseHandle( handle );
+#else
+   pthread_join( handle, NULL );
+#endif
+   running = false;
+}
+
+
+
+inline semaphore::semaphore( int c )
+{
+#ifdef WIN32
+   handle = CreateSemaphore( NULL, c, 0x7fffffff, NULL );
+#else
+   count = c;
+   pthread_mutex_init( &mLock, NULL );
+   pthread_cond_init( &mCond, NULL );
+#endif
+}
+
+inline semaphore::~semaphore()
+{
+#ifdef WIN32
+   CloseHandle( handle );
+#else
+   pthread_cond_destroy( &mCond );
+   pthread_mutex_destroy( &mLock );
+#endif
+}
+
+inline void semaphore::wait()
+{
+#ifdef WIN32
+   WaitForSingleObject( handle, INFINITE );
+#else
+   pthread_mutex_lock( &mLock );
+   while ( count <= 0 )
+      pthread_cond_wait( &mCond, &mLock );
+   --count;
+   pthread_mutex_unlock( &mLock );
+#endif
+}
+
+inline void semaphore::post()
+{
+#ifdef WIN32
+   ReleaseSemaphore( handle, 1, NULL );
+#else
+   pthread_mutex_lock( &mLock );
+   ++count;
+   pthread_cond_signal( &mCond );
+   pthread_mutex_unlock( &mLock );
+#endif
+}
+
+
+inline threadLocal::threadLocal()
+{
+#ifdef WIN32
+   key = TlsAlloc();
+#else
+   pthread_key_create( &key, NULL );
+#endif
+}
+
+inline threadLocal::~threadLocal()
+{
+#ifdef WIN32
+   TlsFree( key );
+#else
+   pthread_key_delete( key );
+#endif
+}
+
+inline void* threadLocal::get() const
+{
+#ifdef WIN32
+   return TlsGetValue( key );
+#else
+   return pthread_getspecific( key );
+#endif
+}
+
+inline void threadLocal::set( void* value )
+{
+#ifdef WIN32
+   TlsSetValue( key, value );
+#else
+   pthread_setspecific( key, value );
+#endif
+}
+
+
+END_NAMESPACE( mr )
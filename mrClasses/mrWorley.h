@@ -50,6 +50,10 @@
 BEGIN_NAMESPACE( mr )
 
 
+//! Scales lookups so that the mean value of F[0] is 1.0
+const miScalar kWorleyDensity = 0.398150f;
+
+
 //! Worley noise class returning arbitrary number of floats.
 class FWorley
 {
@@ -60,14 +64,28 @@ class FWorley
 			    const miUlong max_order,
 			    const miVector& at, miScalar* const F,
 			    miVector* const delta, miUlong* const ID);
-     static void AddSamples(const mr::distances::Type& DistanceMeasure,
-			    const miVector& scale,
+
+     //! AddSamples() with the distance measure D
+     template< class Distance >
+     static void addSamples(const Distance& D, const vector& scale,
 			    const long xi, const long yi, const long zi,
 			    const miUlong max_order,
 			    const miVector& at, miScalar* const F,
 			    miVector* const delta, miUlong* const ID);
+
+     //! noise() with the distance measure D
+     template< class Distance >
+     static void noiseWith(const Distance& D, const vector& scale,
+			   const miScalar x, const miScalar y,
+			   const miScalar z, const miUlong max_order,
+			   miScalar* const F, miVector* const delta,
+			   miUlong* const ID);
      
    public:
+     //! How many feature points a cube has, by the top 8 bits of its
+     //! seed.  Approximately Poisson, with a mean of 2.5.
+     static MR_LIB_EXPORT int Poisson_count[256];
+     
      
      static MR_LIB_EXPORT
      void noise(const miScalar x, const miScalar y,
@@ -82,6 +100,50 @@ class FWorley
 	return noise(P.x, P.y, P.z, max_order, F, delta, ID);
      }
      
+     //! noise() with one of the distance measures of mrDistances.h,
+     //! which gets inlined in the search.  scale is passed to it.
+     //! Unscaled euclidian distances use the SSE2 kernel of noise().
+     static MR_LIB_EXPORT
+     void noise(const mr::distances::Metric metric,
+		const miVector& scale,
+		const miScalar x, const miScalar y,
+		const miScalar z, const miUlong max_order,
+		miScalar* const F, miVector* const delta = NULL,
+		miUlong* const ID = NULL);
+     
+     static void noise(const mr::distances::Metric metric,
+		       const miVector& scale,
+		       const miVector& P, const miUlong max_order,
+		       miScalar* const F, miVector* const delta = NULL,
+		       miUlong* const ID = NULL)
+     {
+	return noise(metric, scale, P.x, P.y, P.z, max_order, F, delta, ID);
+     }
+     
+     //! noise() with a distance measure whose class is known at
+     //! compile time, like those of mrDistances.h or classes derived
+     //! from them.  The measure gets inlined in the search.
+     template< class Distance >
+     static void noise(const Distance& DistanceMeasure,
+		       const miVector& scale,
+		       const miScalar x, const miScalar y,
+		       const miScalar z, const miUlong max_order,
+		       miScalar* const F, miVector* const delta = NULL,
+		       miUlong* const ID = NULL);
+     
+     template< class Distance >
+     static void noise(const Distance& DistanceMeasure,
+		       const miVector& scale,
+		       const miVector& P, const miUlong max_order,
+		       miScalar* const F, miVector* const delta = NULL,
+		       miUlong* const ID = NULL)
+     {
+	return noise(DistanceMeasure, scale, P.x, P.y, P.z,
+		     max_order, F, delta, ID);
+     }
+     
+     //! noise() with a distance measure only known through its base
+     //! class.  It is called through the vtable for each feature point.
      static MR_LIB_EXPORT
      void noise(const mr::distances::Type& DistanceMeasure,
 		const miVector& scale,
@@ -106,4 +168,6 @@ class FWorley
 END_NAMESPACE( mr )
 
 
+#include "mrWorley.inl"
+
 #endif // mrWorley_h
@@ -29,8 +29,17 @@
 //  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 //
 
+#include "mrPlatform.h"
 #include "mrPerlin.h"
 
+#ifdef MR_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef MR_AVX2
+#include <immintrin.h>
+#endif
+
 BEGIN_NAMESPACE( mr )
 
 // Perlin Table, repeated twice for convenience.
@@ -90,4 +99,258 @@ int SPerlin::p[512] =
      66,215,61,156,180
    };
 
+// The gradients of SPerlin::grad( hash, x, y, z ), an axis at a time
+static const miScalar kGradX[16] = 
+   { 1,-1, 1,-1,  1,-1, 1,-1,  0, 0, 0, 0,  1,-1, 0, 0 };
+static const miScalar kGradY[16] = 
+   { 1, 1,-1,-1,  0, 0, 0, 0,  1,-1, 1,-1,  1, 1,-1,-1 };
+static const miScalar kGradZ[16] = 
+   { 0, 0, 0, 0,  1, 1,-1,-1,  1, 1,-1,-1,  0, 0, 1,-1 };
+
+// fastmath<float>::floor rounds to 16.16 fixed point before flooring,
+// which the batches do too, as long as the coordinates fit in it.
+static const float kFIXED_MAX = 32768.0f;
+
+
+#ifdef MR_SSE2
+
+static inline __m128 fade4( const __m128 t )
+{
+   // t * t * t * (t * (t * 6 - 15) + 10), in the same order
+   return _mm_mul_ps( _mm_mul_ps( _mm_mul_ps( t, t ), t ),
+		      _mm_add_ps( _mm_mul_ps( t,
+					      _mm_sub_ps( _mm_mul_ps( t, _mm_set1_ps(6.0f) ),
+							  _mm_set1_ps(15.0f) ) ),
+				  _mm_set1_ps(10.0f) ) );
+}
+
+static inline __m128 lerp4( const __m128 t, const __m128 a, const __m128 b )
+{
+   return _mm_add_ps( a, _mm_mul_ps( t, _mm_sub_ps( b, a ) ) );
+}
+
+static inline __m128 grad4( const int* h, const __m128 x, const __m128 y,
+			    const __m128 z )
+{
+   const __m128 gx = _mm_setr_ps( kGradX[h[0] & 15], kGradX[h[1] & 15],
+				  kGradX[h[2] & 15], kGradX[h[3] & 15] );
+   const __m128 gy = _mm_setr_ps( kGradY[h[0] & 15], kGradY[h[1] & 15],
+				  kGradY[h[2] & 15], kGradY[h[3] & 15] );
+   const __m128 gz = _mm_setr_ps( kGradZ[h[0] & 15], kGradZ[h[1] & 15],
+				  kGradZ[h[2] & 15], kGradZ[h[3] & 15] );
+   return _mm_add_ps( _mm_add_ps( _mm_mul_ps( x, gx ), _mm_mul_ps( y, gy ) ),
+		      _mm_mul_ps( z, gz ) );
+}
+
+//! Whether all 4 coordinates fit in 16.16 fixed point
+static inline bool fits4( const __m128 v )
+{
+   const __m128 a = _mm_andnot_ps( _mm_set1_ps(-0.0f), v );
+   return _mm_movemask_ps( _mm_cmplt_ps( a, _mm_set1_ps(kFIXED_MAX) ) ) == 0xf;
+}
+
+static inline __m128i floor4( const __m128 v )
+{
+   return _mm_srai_epi32( _mm_cvtps_epi32( _mm_mul_ps( v, _mm_set1_ps(65536.0f) ) ),
+			  16 );
+}
+
+//! SPerlin::snoise( x, y, z ) of 4 points
+//! \return false if they don't fit the batch, with nothing done
+static bool snoise4( const int* p, __m128 x, __m128 y, __m128 z,
+		     miScalar* out )
+{
+   int X[4], Y[4], Z[4];
+   int h[8][4];
+
+   if ( !fits4(x) || !fits4(y) || !fits4(z) ) return false;
+
+   const __m128i xf = floor4( x );
+   const __m128i yf = floor4( y );
+   const __m128i zf = floor4( z );
+   const __m128i mask = _mm_set1_epi32( 255 );
+   _mm_storeu_si128( (__m128i*) X, _mm_and_si128( xf, mask ) );
+   _mm_storeu_si128( (__m128i*) Y, _mm_and_si128( yf, mask ) );
+   _mm_storeu_si128( (__m128i*) Z, _mm_and_si128( zf, mask ) );
+   x = _mm_sub_ps( x, _mm_cvtepi32_ps( xf ) );
+   y = _mm_sub_ps( y, _mm_cvtepi32_ps( yf ) );
+   z = _mm_sub_ps( z, _mm_cvtepi32_ps( zf ) );
+
+   for ( int k = 0; k < 4; ++k )
+   {
+      int A = p[X[k]]+Y[k],   AA = p[A]+Z[k], AB = p[A+1]+Z[k],
+	  B = p[X[k]+1]+Y[k], BA = p[B]+Z[k], BB = p[B+1]+Z[k];
+      h[0][k] = p[AA];   h[1][k] = p[BA];
+      h[2][k] = p[AB];   h[3][k] = p[BB];
+      h[4][k] = p[AA+1]; h[5][k] = p[BA+1];
+      h[6][k] = p[AB+1]; h[7][k] = p[BB+1];
+   }
+
+   const __m128 u = fade4( x );
+   const __m128 v = fade4( y );
+   const __m128 w = fade4( z );
+   const __m128 one = _mm_set1_ps( 1.0f );
+   const __m128 x1 = _mm_sub_ps( x, one );
+   const __m128 y1 = _mm_sub_ps( y, one );
+   const __m128 z1 = _mm_sub_ps( z, one );
+
+   _mm_storeu_ps( out,
+		  lerp4( w, lerp4( v, lerp4( u, grad4( h[0], x , y , z ),
+					     grad4( h[1], x1, y , z ) ),
+				   lerp4( u, grad4( h[2], x , y1, z ),
+					  grad4( h[3], x1, y1, z ) ) ),
+			 lerp4( v, lerp4( u, grad4( h[4], x , y , z1 ),
+					  grad4( h[5], x1, y , z1 ) ),
+				lerp4( u, grad4( h[6], x , y1, z1 ),
+				       grad4( h[7], x1, y1, z1 ) ) ) ) );
+   return true;
+}
+
+#endif // MR_SSE2
+
+
+#ifdef MR_AVX2
+
+static inline __m256 fade8( const __m256 t )
+{
+   return _mm256_mul_ps( _mm256_mul_ps( _mm256_mul_ps( t, t ), t ),
+			 _mm256_add_ps( _mm256_mul_ps( t,
+						       _mm256_sub_ps( _mm256_mul_ps( t, _mm256_set1_ps(6.0f) ),
+								      _mm256_set1_ps(15.0f) ) ),
+					_mm256_set1_ps(10.0f) ) );
+}
+
+static inline __m256 lerp8( const __m256 t, const __m256 a, const __m256 b )
+{
+   return _mm256_add_ps( a, _mm256_mul_ps( t, _mm256_sub_ps( b, a ) ) );
+}
+
+static inline __m256 grad8( const __m256i hash, const __m256 x,
+			    const __m256 y, const __m256 z )
+{
+   const __m256i h = _mm256_and_si256( hash, _mm256_set1_epi32( 15 ) );
+   const __m256 gx = _mm256_i32gather_ps( kGradX, h, 4 );
+   const __m256 gy = _mm256_i32gather_ps( kGradY, h, 4 );
+   const __m256 gz = _mm256_i32gather_ps( kGradZ, h, 4 );
+   return _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( x, gx ),
+					_mm256_mul_ps( y, gy ) ),
+			 _mm256_mul_ps( z, gz ) );
+}
+
+static inline bool fits8( const __m256 v )
+{
+   const __m256 a = _mm256_andnot_ps( _mm256_set1_ps(-0.0f), v );
+   return _mm256_movemask_ps( _mm256_cmp_ps( a, _mm256_set1_ps(kFIXED_MAX),
+					     _CMP_LT_OQ ) ) == 0xff;
+}
+
+static inline __m256i floor8( const __m256 v )
+{
+   return _mm256_srai_epi32( _mm256_cvtps_epi32( _mm256_mul_ps( v, _mm256_set1_ps(65536.0f) ) ),
+			     16 );
+}
+
+//! SPerlin::snoise( x, y, z ) of 8 points, with the hashes gathered
+//! \return false if they don't fit the batch, with nothing done
+static bool snoise8( const int* p, __m256 x, __m256 y, __m256 z,
+		     miScalar* out )
+{
+   if ( !fits8(x) || !fits8(y) || !fits8(z) ) return false;
+
+   const __m256i xf = floor8( x );
+   const __m256i yf = floor8( y );
+   const __m256i zf = floor8( z );
+   const __m256i mask = _mm256_set1_epi32( 255 );
+   const __m256i one  = _mm256_set1_epi32( 1 );
+   const __m256i X = _mm256_and_si256( xf, mask );
+   const __m256i Y = _mm256_and_si256( yf, mask );
+   const __m256i Z = _mm256_and_si256( zf, mask );
+   x = _mm256_sub_ps( x, _mm256_cvtepi32_ps( xf ) );
+   y = _mm256_sub_ps( y, _mm256_cvtepi32_ps( yf ) );
+   z = _mm256_sub_ps( z, _mm256_cvtepi32_ps( zf ) );
+
+#define P(i)  _mm256_i32gather_epi32( p, i, 4 )
+   const __m256i A  = _mm256_add_epi32( P( X ), Y );
+   const __m256i B  = _mm256_add_epi32( P( _mm256_add_epi32( X, one ) ), Y );
+   const __m256i AA = _mm256_add_epi32( P( A ), Z );
+   const __m256i AB = _mm256_add_epi32( P( _mm256_add_epi32( A, one ) ), Z );
+   const __m256i BA = _mm256_add_epi32( P( B ), Z );
+   const __m256i BB = _mm256_add_epi32( P( _mm256_add_epi32( B, one ) ), Z );
+
+   const __m256 u = fade8( x );
+   const __m256 v = fade8( y );
+   const __m256 w = fade8( z );
+   const __m256 fone = _mm256_set1_ps( 1.0f );
+   const __m256 x1 = _mm256_sub_ps( x, fone );
+   const __m256 y1 = _mm256_sub_ps( y, fone );
+   const __m256 z1 = _mm256_sub_ps( z, fone );
+
+   _mm256_storeu_ps( out,
+		     lerp8( w, lerp8( v, lerp8( u, grad8( P( AA ), x , y , z ),
+						grad8( P( BA ), x1, y , z ) ),
+				      lerp8( u, grad8( P( AB ), x , y1, z ),
+					     grad8( P( BB ), x1, y1, z ) ) ),
+			    lerp8( v, lerp8( u, grad8( P( _mm256_add_epi32( AA, one ) ), x , y , z1 ),
+					     grad8( P( _mm256_add_epi32( BA, one ) ), x1, y , z1 ) ),
+				   lerp8( u, grad8( P( _mm256_add_epi32( AB, one ) ), x , y1, z1 ),
+					  grad8( P( _mm256_add_epi32( BB, one ) ), x1, y1, z1 ) ) ) ) );
+#undef P
+   return true;
+}
+
+#endif // MR_AVX2
+
+
+//! Batches that don't fit 16.16 fixed point, and the points left over,
+//! go through the scalar snoise.
+void SPerlin::snoise( const point* P, const vector& offset,
+		      miScalar* out, const int n )
+{
+   int i = 0;
+
+#ifdef MR_AVX2
+   for ( ; i + 8 <= n; i += 8 )
+   {
+      const point* Q = P + i;
+      const __m256 x = _mm256_add_ps( _mm256_setr_ps( Q[0].x, Q[1].x, Q[2].x, Q[3].x,
+						      Q[4].x, Q[5].x, Q[6].x, Q[7].x ),
+				      _mm256_set1_ps( offset.x ) );
+      const __m256 y = _mm256_add_ps( _mm256_setr_ps( Q[0].y, Q[1].y, Q[2].y, Q[3].y,
+						      Q[4].y, Q[5].y, Q[6].y, Q[7].y ),
+				      _mm256_set1_ps( offset.y ) );
+      const __m256 z = _mm256_add_ps( _mm256_setr_ps( Q[0].z, Q[1].z, Q[2].z, Q[3].z,
+						      Q[4].z, Q[5].z, Q[6].z, Q[7].z ),
+				      _mm256_set1_ps( offset.z ) );
+      if ( snoise8( p, x, y, z, out + i ) ) continue;
+
+      for ( int k = 0; k < 8; ++k )
+	 out[i+k] = snoise( Q[k].x + offset.x, Q[k].y + offset.y,
+			    Q[k].z + offset.z );
+   }
+#endif
+
+#ifdef MR_SSE2
+   for ( ; i + 4 <= n; i += 4 )
+   {
+      const point* Q = P + i;
+      const __m128 x = _mm_add_ps( _mm_setr_ps( Q[0].x, Q[1].x, Q[2].x, Q[3].x ),
+				   _mm_set1_ps( offset.x ) );
+      const __m128 y = _mm_add_ps( _mm_setr_ps( Q[0].y, Q[1].y, Q[2].y, Q[3].y ),
+				   _mm_set1_ps( offset.y ) );
+      const __m128 z = _mm_add_ps( _mm_setr_ps( Q[0].z, Q[1].z, Q[2].z, Q[3].z ),
+				   _mm_set1_ps( offset.z ) );
+      if ( snoise4( p, x, y, z, out + i ) ) continue;
+
+      for ( int k = 0; k < 4; ++k )
+	 out[i+k] = snoise( Q[k].x + offset.x, Q[k].y + offset.y,
+			    Q[k].z + offset.z );
+   }
+#endif
+
+   for ( ; i < n; ++i )
+      out[i] = snoise( P[i].x + offset.x, P[i].y + offset.y,
+		       P[i].z + offset.z );
+}
+
+
 END_NAMESPACE( mr )
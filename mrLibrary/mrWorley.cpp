@@ -34,9 +34,14 @@
 // "Texture and Modeling: A Procedural Approach"
 //
 ///////////////////////////////////////////////////////////////////////////
+#include "mrPlatform.h"
 #include "mrWorley.h"
 #include "mrMath.h"
 
+#ifdef MR_SSE2
+#include <emmintrin.h>
+#endif
+
 BEGIN_NAMESPACE( mr )
 
 /* A hardwired lookup table to quickly determine how many feature
@@ -45,7 +50,7 @@ BEGIN_NAMESPACE( mr )
    this array will give an approximate Poisson distribution of mean
    density 2.5. Read the book for the longwinded explanation. */
 
-static int Poisson_count[256]=
+int FWorley::Poisson_count[256]=
 {4,3,1,1,1,2,4,2,2,2,5,1,0,2,1,2,2,0,4,3,2,1,2,1,3,2,2,4,2,2,5,1,2,3,2,2,2,2,2,3,
  2,4,2,5,3,2,2,2,5,3,3,5,2,1,3,3,4,4,2,3,0,4,2,2,2,1,3,2,2,2,3,3,3,1,2,0,2,1,1,2,
  2,2,2,5,3,2,3,2,3,2,2,1,0,2,1,1,2,1,2,2,1,3,4,2,2,2,5,4,2,4,2,2,5,4,3,2,2,5,4,3,
@@ -54,9 +59,297 @@ static int Poisson_count[256]=
  2,3,3,3,2,5,2,3,3,2,0,2,1,1,4,2,1,3,2,1,2,2,3,2,5,5,3,4,5,5,2,4,4,5,3,2,2,2,1,4,
  2,3,3,4,2,5,4,2,4,2,2,2,4,5,3,2};
 
-/* This constant is manipulated to make sure that the mean value of F[0]
-   is 1.0. This makes an easy natural "scale" size of the cellular features. */
-#define DENSITY_ADJUSTMENT  0.398150f
+/* kWorleyDensity (mrWorley.h) is manipulated to make sure that the mean
+   value of F[0] is 1.0. This makes an easy natural "scale" size of the
+   cellular features. */
+#define DENSITY_ADJUSTMENT  kWorleyDensity
+
+
+
+#ifdef MR_SSE2
+
+//
+// SSE2 kernel for the euclidian noise() of up to 4 orders.  All the
+// feature points of a cube are generated and tested at once, one per
+// lane, and the closest ones are kept sorted in registers.  The
+// results are the same as those of AddSamples().
+//
+
+//! Churning a seed k times is seed * A + C.  These are the A and C that
+//! give this_id, f.x, f.y and f.z of the 4 points in a batch.
+static const miUint kChurnA[4][4] = {
+{          1u,   49518929u, 2945969057u, 1186449137u },
+{ 1402024253u, 1850018125u, 2491283037u, 3630139501u },
+{ 1586653321u, 3101160537u,  802717993u, 1956470521u },
+{  796795301u, 2728608309u, 1250467781u, 1857440341u },
+};
+static const miUint kChurnC[4][4] = {
+{          0u, 2381041692u,  662529272u, 3310942868u },
+{  586950981u,  182328305u,  615034973u,  452604553u },
+{ 2081239990u,  868414130u,  882703470u, 2128571626u },
+{ 2233291171u, 4122349487u, 1560501627u, 2963007239u },
+};
+//! ...and the seed of the next batch of 4 points
+static const miUint kChurn16A = 4006542145u;
+static const miUint kChurn16C =  793873648u;
+
+//! Low 32 bits of a * b
+static inline __m128i mullo4( const __m128i a, const __m128i b )
+{
+   const __m128i even = _mm_mul_epu32( a, b );
+   const __m128i odd  = _mm_mul_epu32( _mm_srli_epi64( a, 32 ),
+				       _mm_srli_epi64( b, 32 ) );
+   return _mm_unpacklo_epi32( _mm_shuffle_epi32( even, _MM_SHUFFLE(0,0,2,0) ),
+			      _mm_shuffle_epi32( odd,  _MM_SHUFFLE(0,0,2,0) ) );
+}
+
+//! this_id (m=0), or the seed of f.x, f.y, f.z (m=1,2,3) of the 4 points
+//! that follow seed
+static inline __m128i churn4( const __m128i seed, const int m )
+{
+   return _mm_add_epi32( mullo4( seed,
+				 _mm_loadu_si128( (const __m128i*) kChurnA[m] ) ),
+			 _mm_loadu_si128( (const __m128i*) kChurnC[m] ) );
+}
+
+//! (seed + 0.5f) * (1.0f/4294967296.0f), with seed unsigned
+static inline __m128 unit4( const __m128i seed )
+{
+   // Both halves convert exactly, so their sum is rounded only once
+   const __m128 hi = _mm_cvtepi32_ps( _mm_srli_epi32( seed, 16 ) );
+   const __m128 lo = _mm_cvtepi32_ps( _mm_and_si128( seed,
+						      _mm_set1_epi32( 0xffff ) ) );
+   const __m128 f  = _mm_add_ps( _mm_mul_ps( hi, _mm_set1_ps( 65536.0f ) ), lo );
+   return _mm_mul_ps( _mm_add_ps( f, _mm_set1_ps( 0.5f ) ),
+		      _mm_set1_ps( 1.0f/4294967296.0f ) );
+}
+
+
+static inline __m128 select4( const __m128 mask, const __m128 a,
+			      const __m128 b )
+{
+   return _mm_or_ps( _mm_and_ps( mask, a ), _mm_andnot_ps( mask, b ) );
+}
+
+//! Lane k gets lane k-1, lane 0 gets 0
+static inline __m128 shift4( const __m128 v )
+{
+   return _mm_castsi128_ps( _mm_slli_si128( _mm_castps_si128( v ), 4 ) );
+}
+
+template< int k >
+static inline __m128 splat4( const __m128 v )
+{
+   return _mm_shuffle_ps( v, v, _MM_SHUFFLE(k,k,k,k) );
+}
+
+
+//! The 4 closest feature points found so far, sorted, one per lane
+struct WorleyClosest
+{
+     __m128 F, dx, dy, dz, id;
+
+     WorleyClosest() :
+     F( _mm_set1_ps( 999999.9f ) ),
+     dx( _mm_setzero_ps() ), dy( _mm_setzero_ps() ), dz( _mm_setzero_ps() ),
+     id( _mm_setzero_ps() )
+     {
+     }
+
+     //! Insert a point, given in all lanes.  Lanes past the insertion
+     //! point take the lane before them, without any branches.  A
+     //! point goes after those at the same distance, like in
+     //! AddSamples().
+     inline void insert( const __m128 d2, const __m128 x, const __m128 y,
+			 const __m128 z, const __m128 i )
+     {
+	const __m128 m    = _mm_cmplt_ps( d2, F );
+	const __m128 prev = shift4( m );
+	F  = select4( prev, shift4( F ),  select4( m, d2, F ) );
+	dx = select4( prev, shift4( dx ), select4( m, x, dx ) );
+	dy = select4( prev, shift4( dy ), select4( m, y, dy ) );
+	dz = select4( prev, shift4( dz ), select4( m, z, dz ) );
+	id = select4( prev, shift4( id ), select4( m, i, id ) );
+     }
+
+     template< int k >
+     inline void insert( const __m128 d2, const __m128 x, const __m128 y,
+			 const __m128 z, const __m128 i )
+     {
+	insert( splat4<k>( d2 ), splat4<k>( x ), splat4<k>( y ),
+		splat4<k>( z ), splat4<k>( i ) );
+     }
+};
+
+
+//! AddSamples() of the euclidian noise(), 4 feature points at a time.
+//! The closest N <= 4 points end up in the first N lanes of c.
+//! \return the distance of the Nth closest point
+template< int N >
+static inline miScalar addSamples4( WorleyClosest& c,
+				    const long xi, const long yi, const long zi,
+				    const miVector& at )
+{
+   miUint seed = 702395077*xi + 915488749*yi + 2120969693*zi;
+   const int count = FWorley::Poisson_count[seed>>24];
+   if ( count == 0 ) return _mm_cvtss_f32( splat4< N-1 >( c.F ) );
+   seed = 1402024253*seed+586950981;
+
+   const __m128 cx = _mm_set1_ps( (miScalar) xi );
+   const __m128 cy = _mm_set1_ps( (miScalar) yi );
+   const __m128 cz = _mm_set1_ps( (miScalar) zi );
+   const __m128 ax = _mm_set1_ps( at.x );
+   const __m128 ay = _mm_set1_ps( at.y );
+   const __m128 az = _mm_set1_ps( at.z );
+   const __m128i lane = _mm_setr_epi32( 0, 1, 2, 3 );
+
+   for ( int j = 0; j < count; j += 4 )
+   {
+      const __m128i s  = _mm_set1_epi32( (int) seed );
+      const __m128  id = _mm_castsi128_ps( churn4( s, 0 ) );
+
+      // delta from feature point to sample location
+      const __m128 dx = _mm_sub_ps( _mm_add_ps( cx, unit4( churn4( s, 1 ) ) ),
+				    ax );
+      const __m128 dy = _mm_sub_ps( _mm_add_ps( cy, unit4( churn4( s, 2 ) ) ),
+				    ay );
+      const __m128 dz = _mm_sub_ps( _mm_add_ps( cz, unit4( churn4( s, 3 ) ) ),
+				    az );
+      __m128 d2 = _mm_add_ps( _mm_add_ps( _mm_mul_ps( dx, dx ),
+					  _mm_mul_ps( dy, dy ) ),
+			      _mm_mul_ps( dz, dz ) );
+
+      // Lanes past the points of this cube never get inserted
+      const __m128 valid = _mm_castsi128_ps(
+			   _mm_cmplt_epi32( lane, _mm_set1_epi32( count - j ) ) );
+      d2 = select4( valid, d2, _mm_set1_ps( 1e30f ) );
+
+      seed = kChurn16A * seed + kChurn16C;
+
+      // Is any point close enough to remember?
+      const __m128 far = splat4< N-1 >( c.F );
+      if ( _mm_movemask_ps( _mm_cmplt_ps( d2, far ) ) == 0 ) continue;
+
+      if ( N == 1 )
+      {
+	 // Only the closest point of the batch, the first one on ties
+	 __m128 m = _mm_min_ps( d2, _mm_shuffle_ps( d2, d2,
+						    _MM_SHUFFLE(2,3,0,1) ) );
+	 m = _mm_min_ps( m, _mm_shuffle_ps( m, m, _MM_SHUFFLE(1,0,3,2) ) );
+	 const int bits = _mm_movemask_ps( _mm_cmpeq_ps( d2, m ) );
+	 switch( bits & -bits )
+	 {
+	    case 1: c.insert<0>( d2, dx, dy, dz, id ); break;
+	    case 2: c.insert<1>( d2, dx, dy, dz, id ); break;
+	    case 4: c.insert<2>( d2, dx, dy, dz, id ); break;
+	    default: c.insert<3>( d2, dx, dy, dz, id ); break;
+	 }
+      }
+      else
+      {
+	 c.insert<0>( d2, dx, dy, dz, id );
+	 c.insert<1>( d2, dx, dy, dz, id );
+	 c.insert<2>( d2, dx, dy, dz, id );
+	 c.insert<3>( d2, dx, dy, dz, id );
+      }
+   }
+   return _mm_cvtss_f32( splat4< N-1 >( c.F ) );
+}
+
+
+//! noise() of N <= 4 orders with the SSE2 kernel
+template< int N >
+static void noiseSSE2( const miScalar x, const miScalar y, const miScalar z,
+		       miScalar* const F, miVector* const delta,
+		       miUlong* const ID )
+{
+   WorleyClosest c;
+
+   miVector new_at;
+   new_at.x=DENSITY_ADJUSTMENT*x;
+   new_at.y=DENSITY_ADJUSTMENT*y;
+   new_at.z=DENSITY_ADJUSTMENT*z;
+
+   long int_at[3];
+   int_at[0] = fastmath<float>::floor(new_at.x);
+   int_at[1] = fastmath<float>::floor(new_at.y);
+   int_at[2] = fastmath<float>::floor(new_at.z);
+
+   miScalar far = addSamples4<N>( c, int_at[0], int_at[1], int_at[2],
+				  new_at );
+
+   // Same neighbors, in the same order and culled by the same sums
+   // as in noise()
+   double x2,y2,z2, mx2, my2, mz2;
+   x2=new_at.x-int_at[0];
+   y2=new_at.y-int_at[1];
+   z2=new_at.z-int_at[2];
+   mx2=(1.0-x2)*(1.0-x2);
+   my2=(1.0-y2)*(1.0-y2);
+   mz2=(1.0-z2)*(1.0-z2);
+   x2*=x2;
+   y2*=y2;
+   z2*=z2;
+
+#define MR_WORLEY_CUBE( dx, dy, dz, d2 ) \
+   if ( d2 < far ) \
+      far = addSamples4<N>( c, int_at[0]+dx, int_at[1]+dy, int_at[2]+dz, \
+			    new_at );
+
+   MR_WORLEY_CUBE( -1,  0,  0, x2 );
+   MR_WORLEY_CUBE(  0, -1,  0, y2 );
+   MR_WORLEY_CUBE(  0,  0, -1, z2 );
+   MR_WORLEY_CUBE(  1,  0,  0, mx2 );
+   MR_WORLEY_CUBE(  0,  1,  0, my2 );
+   MR_WORLEY_CUBE(  0,  0,  1, mz2 );
+
+   MR_WORLEY_CUBE( -1, -1,  0,  x2+ y2 );
+   MR_WORLEY_CUBE( -1,  0, -1,  x2+ z2 );
+   MR_WORLEY_CUBE(  0, -1, -1,  y2+ z2 );
+   MR_WORLEY_CUBE(  1,  1,  0, mx2+my2 );
+   MR_WORLEY_CUBE(  1,  0,  1, mx2+mz2 );
+   MR_WORLEY_CUBE(  0,  1,  1, my2+mz2 );
+   MR_WORLEY_CUBE( -1,  1,  0,  x2+my2 );
+   MR_WORLEY_CUBE( -1,  0,  1,  x2+mz2 );
+   MR_WORLEY_CUBE(  0, -1,  1,  y2+mz2 );
+   MR_WORLEY_CUBE(  1, -1,  0, mx2+ y2 );
+   MR_WORLEY_CUBE(  1,  0, -1, mx2+ z2 );
+   MR_WORLEY_CUBE(  0,  1, -1, my2+ z2 );
+
+   MR_WORLEY_CUBE( -1, -1, -1,  x2+ y2+ z2 );
+   MR_WORLEY_CUBE( -1, -1,  1,  x2+ y2+mz2 );
+   MR_WORLEY_CUBE( -1,  1, -1,  x2+my2+ z2 );
+   MR_WORLEY_CUBE( -1,  1,  1,  x2+my2+mz2 );
+   MR_WORLEY_CUBE(  1, -1, -1, mx2+ y2+ z2 );
+   MR_WORLEY_CUBE(  1, -1,  1, mx2+ y2+mz2 );
+   MR_WORLEY_CUBE(  1,  1, -1, mx2+my2+ z2 );
+   MR_WORLEY_CUBE(  1,  1,  1, mx2+my2+mz2 );
+
+#undef MR_WORLEY_CUBE
+
+   miScalar cF[4], cx[4], cy[4], cz[4];
+   miUint   cid[4];
+   _mm_storeu_ps( cF, c.F );
+   _mm_storeu_ps( cx, c.dx );
+   _mm_storeu_ps( cy, c.dy );
+   _mm_storeu_ps( cz, c.dz );
+   _mm_storeu_si128( (__m128i*) cid, _mm_castps_si128( c.id ) );
+
+   for ( int i = 0; i < N; ++i )
+   {
+      F[i]=math<float>::sqrt(cF[i])*(1.0f/DENSITY_ADJUSTMENT);
+      if (delta)
+      {
+	 delta[i].x = cx[i] * (1.0f/DENSITY_ADJUSTMENT);
+	 delta[i].y = cy[i] * (1.0f/DENSITY_ADJUSTMENT);
+	 delta[i].z = cz[i] * (1.0f/DENSITY_ADJUSTMENT);
+      }
+      if (ID) ID[i] = cid[i];
+   }
+}
+
+#endif // MR_SSE2
+
 
 
 
@@ -67,6 +360,16 @@ FWorley::noise(const miScalar x, const miScalar y, const miScalar z,
 	       miVector* const delta, miUlong* const ID)
 {
    mrASSERT( F != NULL );
+
+#ifdef MR_SSE2
+   switch( max_order )
+   {
+      case 1: return noiseSSE2<1>( x, y, z, F, delta, ID );
+      case 2: return noiseSSE2<2>( x, y, z, F, delta, ID );
+      case 3: return noiseSSE2<3>( x, y, z, F, delta, ID );
+      case 4: return noiseSSE2<4>( x, y, z, F, delta, ID );
+   }
+#endif
    
   double x2,y2,z2, mx2, my2, mz2;
   miVector new_at;
@@ -195,140 +498,59 @@ FWorley::noise(const miScalar x, const miScalar y, const miScalar z,
 }
 
 
+//! A distance measure only known at run time
+struct AnyDistance
+{
+     const mr::distances::Type& D;
+
+     AnyDistance( const mr::distances::Type& d ) : D( d ) {}
+
+     miScalar operator()( const vector& d, const vector& s ) const
+     {
+	return D( d, s );
+     }
+};
+
+
 void MR_LIB_EXPORT
-FWorley::noise(const mr::distances::Type& D,
+FWorley::noise(const mr::distances::Metric metric,
 	       const miVector& scale,
 	       const miScalar x, const miScalar y, const miScalar z,
 	       const miUlong max_order, miScalar* const F,
 	       miVector* const delta, miUlong* const ID)
 {
-   mrASSERT( F != NULL );
-   
-  double x2,y2,z2, mx2, my2, mz2;
-  miVector new_at;
-  long int_at[3];
-  miUlong i;
-  
-  /* Initialize the F values to "huge" so they will be replaced by the
-     first real sample tests. Note we'll be storing and comparing the
-     SQUARED distance from the feature points to avoid lots of slow
-     sqrt() calls. We'll use sqrt() only on the final answer. */
-  for (i=0; i<max_order; ++i) F[i]=999999.9f;
-  
-  /* Make our own local copy, multiplying to make mean(F[0])==1.0  */
-  new_at.x=DENSITY_ADJUSTMENT*x;
-  new_at.y=DENSITY_ADJUSTMENT*y;
-  new_at.z=DENSITY_ADJUSTMENT*z;
-
-  /* Find the integer cube holding the hit point */
-  /* A macro could make this slightly faster */
-  int_at[0] = fastmath<float>::floor(new_at.x); 
-  int_at[1] = fastmath<float>::floor(new_at.y);
-  int_at[2] = fastmath<float>::floor(new_at.z);
-
-  /* A simple way to compute the closest neighbors would be to test all
-     boundary cubes exhaustively. This is simple with code like: 
-     {
-       long ii, jj, kk;
-       for (ii=-1; ii<=1; ii++) for (jj=-1; jj<=1; jj++) for (kk=-1; kk<=1; kk++)
-       AddSamples(int_at[0]+ii,int_at[1]+jj,int_at[2]+kk, 
-       max_order, new_at, F, delta, ID);
-     }
-     But this wastes a lot of time working on cubes which are known to be
-     too far away to matter! So we can use a more complex testing method
-     that avoids this needless testing of distant cubes. This doubles the 
-     speed of the algorithm. */
+   const vector s( scale );
+   switch( metric )
+   {
+      case mr::distances::kManhattan:
+	 return noiseWith( mr::distances::Manhattan(), s, x, y, z,
+			   max_order, F, delta, ID );
+      case mr::distances::kChessboard:
+	 return noiseWith( mr::distances::Chessboard(), s, x, y, z,
+			   max_order, F, delta, ID );
+      case mr::distances::kSuperquadratic:
+	 return noiseWith( mr::distances::Superquadratic(), s, x, y, z,
+			   max_order, F, delta, ID );
+      case mr::distances::kEuclidian:
+      default:
+	 // Unscaled, it is the plain noise() and its SSE2 kernel
+	 if ( s.x == 1.0f && s.y == 1.0f && s.z == 1.0f )
+	    return noise( x, y, z, max_order, F, delta, ID );
+	 return noiseWith( mr::distances::Euclidian(), s, x, y, z,
+			   max_order, F, delta, ID );
+   }
+}
 
-  /* Test the central cube for closest point(s). */
-  AddSamples(D, scale, int_at[0], int_at[1], int_at[2],
-	     max_order, new_at, F, delta, ID);
 
-  /* We test if neighbor cubes are even POSSIBLE contributors by examining the
-     combinations of the sum of the squared distances from the cube's lower 
-     or upper corners.*/
-  x2=new_at.x-int_at[0];
-  y2=new_at.y-int_at[1];
-  z2=new_at.z-int_at[2];
-  mx2=(1.0-x2)*(1.0-x2);
-  my2=(1.0-y2)*(1.0-y2);
-  mz2=(1.0-z2)*(1.0-z2);
-  x2*=x2;
-  y2*=y2;
-  z2*=z2;
-  
-  /* Test 6 facing neighbors of center cube. These are closest and most 
-     likely to have a close feature point. */
-  if (x2<F[max_order-1])  AddSamples(D, scale, int_at[0]-1, int_at[1]  , int_at[2]  , 
-				     max_order, new_at, F, delta, ID);
-  if (y2<F[max_order-1])  AddSamples(D, scale, int_at[0]  , int_at[1]-1, int_at[2]  , 
-				     max_order, new_at, F, delta, ID);
-  if (z2<F[max_order-1])  AddSamples(D, scale, int_at[0]  , int_at[1]  , int_at[2]-1, 
-				     max_order, new_at, F, delta, ID);
-  
-  if (mx2<F[max_order-1]) AddSamples(D, scale, int_at[0]+1, int_at[1]  , int_at[2]  , 
-				     max_order, new_at, F, delta, ID);
-  if (my2<F[max_order-1]) AddSamples(D, scale, int_at[0]  , int_at[1]+1, int_at[2]  , 
-				     max_order, new_at, F, delta, ID);
-  if (mz2<F[max_order-1]) AddSamples(D, scale, int_at[0]  , int_at[1]  , int_at[2]+1, 
-				     max_order, new_at, F, delta, ID);
-  
-  /* Test 12 "edge cube" neighbors if necessary. They're next closest. */
-  if ( x2+ y2<F[max_order-1]) AddSamples(D, scale, int_at[0]-1, int_at[1]-1, int_at[2]  , 
-					 max_order, new_at, F, delta, ID);
-  if ( x2+ z2<F[max_order-1]) AddSamples(D, scale, int_at[0]-1, int_at[1]  , int_at[2]-1, 
-					 max_order, new_at, F, delta, ID);
-  if ( y2+ z2<F[max_order-1]) AddSamples(D, scale, int_at[0]  , int_at[1]-1, int_at[2]-1, 
-					 max_order, new_at, F, delta, ID);  
-  if (mx2+my2<F[max_order-1]) AddSamples(D, scale, int_at[0]+1, int_at[1]+1, int_at[2]  , 
-					 max_order, new_at, F, delta, ID);
-  if (mx2+mz2<F[max_order-1]) AddSamples(D, scale, int_at[0]+1, int_at[1]  , int_at[2]+1, 
-					 max_order, new_at, F, delta, ID);
-  if (my2+mz2<F[max_order-1]) AddSamples(D, scale, int_at[0]  , int_at[1]+1, int_at[2]+1, 
-					 max_order, new_at, F, delta, ID);  
-  if ( x2+my2<F[max_order-1]) AddSamples(D, scale, int_at[0]-1, int_at[1]+1, int_at[2]  , 
-					 max_order, new_at, F, delta, ID);
-  if ( x2+mz2<F[max_order-1]) AddSamples(D, scale, int_at[0]-1, int_at[1]  , int_at[2]+1, 
-					 max_order, new_at, F, delta, ID);
-  if ( y2+mz2<F[max_order-1]) AddSamples(D, scale, int_at[0]  , int_at[1]-1, int_at[2]+1, 
-					 max_order, new_at, F, delta, ID);  
-  if (mx2+ y2<F[max_order-1]) AddSamples(D, scale, int_at[0]+1, int_at[1]-1, int_at[2]  , 
-					 max_order, new_at, F, delta, ID);
-  if (mx2+ z2<F[max_order-1]) AddSamples(D, scale, int_at[0]+1, int_at[1]  , int_at[2]-1, 
-					 max_order, new_at, F, delta, ID);
-  if (my2+ z2<F[max_order-1]) AddSamples(D, scale, int_at[0]  , int_at[1]+1, int_at[2]-1, 
-					 max_order, new_at, F, delta, ID);  
-  
-  /* Final 8 "corner" cubes */
-  if ( x2+ y2+ z2<F[max_order-1]) AddSamples(D, scale, int_at[0]-1, int_at[1]-1, int_at[2]-1, 
-					     max_order, new_at, F, delta, ID);
-  if ( x2+ y2+mz2<F[max_order-1]) AddSamples(D, scale, int_at[0]-1, int_at[1]-1, int_at[2]+1, 
-					     max_order, new_at, F, delta, ID);
-  if ( x2+my2+ z2<F[max_order-1]) AddSamples(D, scale, int_at[0]-1, int_at[1]+1, int_at[2]-1, 
-					     max_order, new_at, F, delta, ID);
-  if ( x2+my2+mz2<F[max_order-1]) AddSamples(D, scale, int_at[0]-1, int_at[1]+1, int_at[2]+1, 
-					     max_order, new_at, F, delta, ID);
-  if (mx2+ y2+ z2<F[max_order-1]) AddSamples(D, scale, int_at[0]+1, int_at[1]-1, int_at[2]-1, 
-					     max_order, new_at, F, delta, ID);
-  if (mx2+ y2+mz2<F[max_order-1]) AddSamples(D, scale, int_at[0]+1, int_at[1]-1, int_at[2]+1, 
-					     max_order, new_at, F, delta, ID);
-  if (mx2+my2+ z2<F[max_order-1]) AddSamples(D, scale, int_at[0]+1, int_at[1]+1, int_at[2]-1, 
-					     max_order, new_at, F, delta, ID);
-  if (mx2+my2+mz2<F[max_order-1]) AddSamples(D, scale, int_at[0]+1, int_at[1]+1, int_at[2]+1, 
-					     max_order, new_at, F, delta, ID);
-  
-  /* We're done! Convert everything to right size scale */
-  for (i=0; i<max_order; i++)
-    {
-       F[i]=math<float>::sqrt(F[i])*(1.0f/DENSITY_ADJUSTMENT);
-       if (delta)
-       {
-	  delta[i].x *= (1.0f/DENSITY_ADJUSTMENT);
-	  delta[i].y *= (1.0f/DENSITY_ADJUSTMENT);
-	  delta[i].z *= (1.0f/DENSITY_ADJUSTMENT);
-       }
-    }
-  
-  return;
+void MR_LIB_EXPORT
+FWorley::noise(const mr::distances::Type& D,
+	       const miVector& scale,
+	       const miScalar x, const miScalar y, const miScalar z,
+	       const miUlong max_order, miScalar* const F,
+	       miVector* const delta, miUlong* const ID)
+{
+   noiseWith( AnyDistance( D ), vector( scale ), x, y, z,
+	      max_order, F, delta, ID );
 }
 
 
@@ -340,7 +562,7 @@ void FWorley::AddSamples(const long xi, const long yi, const long zi,
   miScalar d2;
   vector d, f;
   long count, i, j, index;
-  miUlong seed, this_id;
+  miUint seed, this_id;  /* the LCG wraps at 32 bits */
   
   /* Each cube has a random number seed based on the cube's ID number.
      The seed might be better if it were a nonlinear hash like Perlin uses
@@ -421,81 +643,4 @@ void FWorley::AddSamples(const long xi, const long yi, const long zi,
 
 
 
-void FWorley::AddSamples(const mr::distances::Type& D,
-			 const miVector& scale,
-			 const long xi, const long yi, const long zi,
-			 const miUlong max_order,
-			 const miVector& at, miScalar* const F,
-			 miVector* const delta, miUlong* const ID)
-{
-  miScalar d2;
-  vector d, f;
-  long count, i, j, index;
-  miUlong seed, this_id;
-  
-  /* Each cube has a random number seed based on the cube's ID number.
-     The seed might be better if it were a nonlinear hash like Perlin uses
-     for noise but we do very well with this faster simple one.
-     Our LCG uses Knuth-approved constants for maximal periods. */
-  seed=702395077*xi + 915488749*yi + 2120969693*zi;
-  
-  /* How many feature points are in this cube? */
-  count=Poisson_count[seed>>24]; /* 256 element lookup table. Use MSB */
-
-  seed=1402024253*seed+586950981; /* churn the seed with good Knuth LCG */
-
-  for (j=0; j<count; ++j) /* test and insert each point into our solution */
-    {
-      this_id=seed;
-      seed=1402024253*seed+586950981; /* churn */
-
-      /* compute the 0..1 feature point location's XYZ */
-      f.x=(seed+0.5f)*(1.0f/4294967296.0f); 
-      seed=1402024253*seed+586950981; /* churn */
-      f.y=(seed+0.5f)*(1.0f/4294967296.0f);
-      seed=1402024253*seed+586950981; /* churn */
-      f.z=(seed+0.5f)*(1.0f/4294967296.0f);
-      seed=1402024253*seed+586950981; /* churn */
-
-      /* delta from feature point to sample location */
-      d.x = xi + f.x - at.x; 
-      d.y = yi + f.y - at.y;
-      d.z = zi + f.z - at.z;
-
-      d2= D(d,scale); // Arbitrary distance calculation
-
-      if (d2 < F[max_order-1]) /* Is this point close enough to rememember? */
-	{
-	  /* Insert the information into the output arrays if it's close enough.
-	     We use an insertion sort.  No need for a binary search to find
-	     the appropriate index.. usually we're dealing with order 2,3,4 so
-	     we can just go through the list. If you were computing order 50
-	     (wow!!) you could get a speedup with a binary search in the sorted
-	     F[] list. */
-	  
-	  index=max_order;
-	  while (index>0 && d2<F[index-1]) index--;
-
-	  /* We insert this new point into slot # <index> */
-
-	  /* Bump down more distant information to make room for this new point. */
-	  for (i = max_order-1; i-- > index;)
-	    {
-	      F[i+1]=F[i];
-	      if (ID)        ID[i+1] = ID[i];
-	      if (delta)  delta[i+1] = delta[i];
-	    }
-	  /* Insert the new point's information into the list. */
-	  F[index]=d2;
-	  if (ID)       ID[index] = this_id;
-	  if (delta) delta[index] = d;
-	}
-    }
-}
-
-
-
-
-
-
 END_NAMESPACE( mr )
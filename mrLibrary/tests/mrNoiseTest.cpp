@@ -0,0 +1,164 @@
+//
+//  Copyright (c) 2004, Gonzalo Garramuno
+//
+//  All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are
+//  met:
+//  *       Redistributions of source code must retain the above copyright
+//  notice, this list of conditions and the following disclaimer.
+//  *       Redistributions in binary form must reproduce the above
+//  copyright notice, this list of conditions and the following disclaimer
+//  in the documentation and/or other materials provided with the
+//  distribution.
+//  *       Neither the name of Gonzalo Garramuno nor the names of
+//  its other contributors may be used to endorse or promote products derived
+//  from this software without specific prior written permission. 
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+//  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+//  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+//  OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+//  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+//  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+//  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+//  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+//  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+//  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+
+//
+// Checks that the SIMD noise kernels give what the scalar code gives.
+// mrClasses allocates through mental ray, so it links with the
+// stand-in for it of the texture checks.  Build it once per
+// instruction set the library is built for:
+//
+//    g++ -O2 -msse2 -I../../mrClasses -I<mental ray>/include
+//        mrNoiseTest.cpp ../mrPerlin.cpp ../mrWorley.cpp
+//        ../../LPGL/tests/mrTestHost.cpp -lpthread -o mrNoiseTest
+//    g++ -O2 -mavx2 ... -o mrNoiseTestAVX2
+//
+// It returns the number of failed checks.
+//
+
+#include <stdio.h>
+
+#include "mrPerlin.h"
+#include "mrWorley.h"
+
+using namespace mr;
+
+
+static int testFailures = 0;
+
+#define CHECK(x) \
+   do { \
+      if ( !(x) ) \
+      { \
+	 fprintf( stderr, "%s:%d: check failed: %s\n", \
+		  __FILE__, __LINE__, #x ); \
+	 testFailures++; \
+      } \
+   } while (0)
+
+
+//! A number in [-1,1), the same for the same seed on all platforms
+static miScalar	testRandom( miUint& seed )
+{
+   seed = seed * 1103515245u + 12345u;
+   return (miScalar) ( seed >> 8 ) / (miScalar) ( 1 << 23 ) - 1.0f;
+}
+
+
+//! Batches of Perlin noise are bit for bit the scalar noise, also for
+//! the points left over and for batches out of the fixed point range
+static void	testPerlinBatch()
+{
+   static const int kPOINTS = 37;
+   point    P[kPOINTS];
+   miScalar out[kPOINTS];
+   miUint   seed = 1;
+   int      i, j;
+
+   const vector offset( 0.5f, -3.25f, 17.0f );
+
+   for ( j = 0; j < 100; ++j )
+   {
+      for ( i = 0; i < kPOINTS; ++i )
+      {
+	 P[i].x = testRandom( seed ) * 100.0f;
+	 P[i].y = testRandom( seed ) * 100.0f;
+	 P[i].z = testRandom( seed ) * 100.0f;
+      }
+
+      // Lattice points, and a batch that doesn't fit 16.16
+      if ( j == 1 )
+	 for ( i = 0; i < kPOINTS; ++i )
+	    P[i] = point( (miScalar) i, (miScalar) -i, 0.0f );
+      if ( j == 2 )
+	 P[5].x = 1.0e6f;
+
+      SPerlin::snoise( P, out, kPOINTS );
+      for ( i = 0; i < kPOINTS; ++i )
+	 CHECK( out[i] == SPerlin::snoise( P[i] ) );
+
+      SPerlin::snoise( P, offset, out, kPOINTS );
+      for ( i = 0; i < kPOINTS; ++i )
+	 CHECK( out[i] == SPerlin::snoise( P[i].x + offset.x,
+					   P[i].y + offset.y,
+					   P[i].z + offset.z ) );
+   }
+}
+
+
+//! The SSE2 Worley kernel finds the feature points the scalar search
+//! finds.  Orders past 4 always take the scalar search, and their
+//! first 4 feature points are those of the lower orders.
+static void	testWorley()
+{
+   miScalar  F[5], refF[5];
+   miVector  delta[5], refDelta[5];
+   miUlong   ID[5], refID[5];
+   miUint    seed = 7;
+   miUlong   order, i;
+   int       j;
+
+   for ( j = 0; j < 2000; ++j )
+   {
+      const miScalar x = testRandom( seed ) * 50.0f;
+      const miScalar y = testRandom( seed ) * 50.0f;
+      const miScalar z = testRandom( seed ) * 50.0f;
+
+      FWorley::noise( x, y, z, 5, refF, refDelta, refID );
+
+      for ( order = 1; order <= 4; ++order )
+      {
+	 FWorley::noise( x, y, z, order, F, delta, ID );
+	 for ( i = 0; i < order; ++i )
+	 {
+	    CHECK( ID[i] == refID[i] );
+	    CHECK( fabs( F[i] - refF[i] ) <= 1e-5f * refF[i] );
+	    CHECK( fabs( delta[i].x - refDelta[i].x ) <= 1e-5f );
+	    CHECK( fabs( delta[i].y - refDelta[i].y ) <= 1e-5f );
+	    CHECK( fabs( delta[i].z - refDelta[i].z ) <= 1e-5f );
+	 }
+      }
+
+      // No delta or ID asked for
+      FWorley::noise( x, y, z, 2, F, NULL, NULL );
+      CHECK( fabs( F[1] - refF[1] ) <= 1e-5f * refF[1] );
+   }
+}
+
+
+int main()
+{
+   testPerlinBatch();
+   testWorley();
+
+   if ( testFailures > 0 )
+      fprintf( stderr, "%d checks failed\n", testFailures );
+   return testFailures;
+}